@@ -232,21 +232,9 @@ filters_prepare_to_run(GSList * filters)
     return ok;
 }
 
-/* Apply the filter's action to the messages in the list; returns TRUE
- * if message(s) were moved to the trash. */
-gboolean
-libbalsa_filter_mailbox_messages(LibBalsaFilter * filt,
-				 LibBalsaMailbox * mailbox,
-				 GArray * msgnos)
+static void
+lbf_notify(LibBalsaFilter * filt)
 {
-    gboolean result=FALSE;
-    LibBalsaMailbox *mbox;
-    GError *err = NULL;
-    gchar **parts, **p;
-
-    if (msgnos->len == 0)
-	return FALSE;
-
 #if HAVE_CANBERRA
     if (filt->sound) {
         GdkScreen *screen;
@@ -262,72 +250,236 @@ libbalsa_filter_mailbox_messages(LibBalsaFilter * filt,
 	libbalsa_information(LIBBALSA_INFORMATION_MESSAGE,
 			     "%s",
 			     filt->popup_text);
+}
+
+/* Add msgnos to the group of messages of key in groups. A new group
+ * is registered with the mailbox, so that its msgnos follow expunges
+ * until lbf_groups_unregister() is called. */
+static void
+lbf_group_add(LibBalsaMailbox * mailbox, GHashTable * groups,
+              gpointer key, GArray * msgnos)
+{
+    GArray *group;
+
+    group = g_hash_table_lookup(groups, key);
+    if (group == NULL) {
+        group = g_array_new(FALSE, FALSE, sizeof(guint));
+        g_hash_table_insert(groups, key, group);
+        libbalsa_mailbox_register_msgnos(mailbox, group);
+    }
+    g_array_append_vals(group, msgnos->data, msgnos->len);
+}
+
+static void
+lbf_groups_unregister(LibBalsaMailbox * mailbox, GHashTable * groups)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, groups);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+        libbalsa_mailbox_unregister_msgnos(mailbox, value);
+}
+
+static gint
+lbf_msgno_compare(gconstpointer a, gconstpointer b)
+{
+    guint msgno_a = *(const guint *) a;
+    guint msgno_b = *(const guint *) b;
+
+    return msgno_a < msgno_b ? -1 : msgno_a > msgno_b;
+}
+
+/* Sort a group, dropping messages matched by more than one filter. */
+static void
+lbf_group_sort(GArray * group)
+{
+    guint i, j;
+
+    g_array_sort(group, lbf_msgno_compare);
+    for (i = j = 0; i < group->len; i++) {
+        if (j == 0 || g_array_index(group, guint, i) !=
+            g_array_index(group, guint, j - 1))
+            g_array_index(group, guint, j++) =
+                g_array_index(group, guint, i);
+    }
+    g_array_set_size(group, j);
+}
+
+static void
+lbf_set_color(LibBalsaMailbox * mailbox, GArray * msgnos,
+              const gchar * action_string)
+{
+    gchar **parts, **p;
+
+    parts = g_strsplit(action_string, ";", 2);
+    for (p = parts; *p; p++) {
+        if (g_str_has_prefix(*p, "foreground:"))
+            libbalsa_mailbox_set_foreground(mailbox, msgnos, (*p) + 11);
+        if (g_str_has_prefix(*p, "background:"))
+            libbalsa_mailbox_set_background(mailbox, msgnos, (*p) + 11);
+    }
+    g_strfreev(parts);
+}
+
+/* Apply the actions of several filters at once; matches holds, for
+ * each filter in the list, the array of messages it matched. The
+ * actions are grouped: one copy and one move per destination mailbox,
+ * one color change per color, and a single flag change for all moved
+ * messages.
+ * Returns TRUE if message(s) were moved to the trash. */
+gboolean
+libbalsa_filters_mailbox_messages(GSList * filters,
+                                  GPtrArray * matches,
+                                  LibBalsaMailbox * mailbox)
+{
+    gboolean result = FALSE;
+    GHashTable *copies, *moves, *colors;
+    GHashTableIter iter;
+    gpointer key, value;
+    GArray *deleted;
+    GError *err = NULL;
+    guint i;
+
+    copies = g_hash_table_new_full(NULL, NULL, NULL,
+                                   (GDestroyNotify) g_array_unref);
+    moves = g_hash_table_new_full(NULL, NULL, NULL,
+                                  (GDestroyNotify) g_array_unref);
+    colors = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                   (GDestroyNotify) g_array_unref);
+
+    for (i = 0; filters != NULL && i < matches->len;
+         filters = filters->next, i++) {
+        LibBalsaFilter *filt = filters->data;
+        GArray *msgnos = g_ptr_array_index(matches, i);
+        LibBalsaMailbox *mbox;
+
+        if (msgnos->len == 0)
+            continue;
+
+        lbf_notify(filt);
+
+        switch (filt->action) {
+        case FILTER_COPY:
+        case FILTER_MOVE:
+            mbox = url_to_mailbox_mapper(filt->action_string);
+            if (!mbox)
+                libbalsa_information(LIBBALSA_INFORMATION_ERROR,
+                                     _("Bad mailbox name for filter: %s"),
+                                     filt->name);
+            else
+                lbf_group_add(mailbox,
+                              filt->action == FILTER_COPY ? copies : moves,
+                              mbox, msgnos);
+            break;
+        case FILTER_TRASH:
+            if (!filters_trash_mbox)
+                libbalsa_information(LIBBALSA_INFORMATION_ERROR,
+                                     _("Error when trashing messages: %s"),
+                                     "?");
+            else
+                lbf_group_add(mailbox, moves, filters_trash_mbox, msgnos);
+            break;
+        case FILTER_COLOR:
+            lbf_group_add(mailbox, colors, filt->action_string, msgnos);
+            break;
+        case FILTER_PRINT:
+            /* FIXME : to be implemented */
+            break;
+        case FILTER_RUN:
+            /* FIXME : to be implemented */
+            break;
+        case FILTER_NOTHING:
+        case FILTER_N_TYPES:
+            /* Nothing to do */
+            break;
+        }
+    }
 
     libbalsa_lock_mailbox(mailbox);
 
-    switch (filt->action) {
-    case FILTER_COPY:
-	mbox = url_to_mailbox_mapper(filt->action_string);
-	if (!mbox)
-	    libbalsa_information(LIBBALSA_INFORMATION_ERROR,
-				 _("Bad mailbox name for filter: %s"),
-				 filt->name);
-	else if (!libbalsa_mailbox_messages_copy(mailbox, msgnos, mbox, &err))
-	    libbalsa_information(LIBBALSA_INFORMATION_ERROR,
-				 _("Error when copying messages: %s"),
-                                 err ? err->message : "?");
-	else if (mbox == filters_trash_mbox)
-	    result = TRUE;
-	break;
-    case FILTER_TRASH:
-	if (!filters_trash_mbox ||
-	    !libbalsa_mailbox_messages_move(mailbox, msgnos,
-					    filters_trash_mbox, &err))
-	    libbalsa_information(LIBBALSA_INFORMATION_ERROR,
-				 _("Error when trashing messages: %s"),
+    g_hash_table_iter_init(&iter, colors);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        lbf_set_color(mailbox, value, key);
+
+    g_hash_table_iter_init(&iter, copies);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        lbf_group_sort(value);
+        if (!libbalsa_mailbox_messages_copy(mailbox, value, key, &err))
+            libbalsa_information(LIBBALSA_INFORMATION_ERROR,
+                                 _("Error when copying messages: %s"),
                                  err ? err->message : "?");
-	else
-	    result = TRUE;
-	break;
-    case FILTER_MOVE:
-	mbox = url_to_mailbox_mapper(filt->action_string);
-	if (!mbox)
-	    libbalsa_information(LIBBALSA_INFORMATION_ERROR,
-				 _("Bad mailbox name for filter: %s"),
-				 filt->name);
-	else if (!libbalsa_mailbox_messages_move(mailbox, msgnos, mbox, &err))
-	    libbalsa_information(LIBBALSA_INFORMATION_ERROR,
-				 _("Error when moving messages: %s"),
+        else if (key == filters_trash_mbox)
+            result = TRUE;
+        g_clear_error(&err);
+    }
+
+    /* copy the moved messages to each destination, and then remove
+     * them from the source at once */
+    deleted = g_array_new(FALSE, FALSE, sizeof(guint));
+    libbalsa_mailbox_register_msgnos(mailbox, deleted);
+    g_hash_table_iter_init(&iter, moves);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        GArray *msgnos = value;
+
+        lbf_group_sort(msgnos);
+        if (!libbalsa_mailbox_messages_copy(mailbox, msgnos, key, &err)) {
+            libbalsa_information(LIBBALSA_INFORMATION_ERROR,
+                                 key == filters_trash_mbox ?
+                                 _("Error when trashing messages: %s") :
+                                 _("Error when moving messages: %s"),
                                  err ? err->message : "?");
-	else if (mbox == filters_trash_mbox)
-	    result = TRUE;
-	break;
-    case FILTER_COLOR:
-        parts = g_strsplit(filt->action_string, ";", 2);
-        for (p = parts; *p; p++) {
-            if (g_str_has_prefix(*p, "foreground:"))
-                libbalsa_mailbox_set_foreground(mailbox, msgnos,
-                                                (*p) + 11);
-            if (g_str_has_prefix(*p, "background:"))
-                libbalsa_mailbox_set_background(mailbox, msgnos,
-                                                (*p) + 11);
+        } else {
+            g_array_append_vals(deleted, msgnos->data, msgnos->len);
+            if (key == filters_trash_mbox)
+                result = TRUE;
         }
-        g_strfreev(parts);
-        break;
-    case FILTER_PRINT:
-	/* FIXME : to be implemented */
-	break;
-    case FILTER_RUN:
-	/* FIXME : to be implemented */
-	break;
-    case FILTER_NOTHING:
-    case FILTER_N_TYPES:
-	/* Nothing to do */
-	break;
+        g_clear_error(&err);
     }
-    g_clear_error(&err);
+    if (deleted->len > 0 &&
+        !libbalsa_mailbox_messages_change_flags(mailbox, deleted,
+                                                LIBBALSA_MESSAGE_FLAG_DELETED,
+                                                (LibBalsaMessageFlag) 0))
+        libbalsa_information(LIBBALSA_INFORMATION_ERROR,
+                             _("Error when moving messages: %s"),
+                             _("Removing messages from source mailbox failed"));
+    libbalsa_mailbox_unregister_msgnos(mailbox, deleted);
+    g_array_free(deleted, TRUE);
+
+    lbf_groups_unregister(mailbox, colors);
+    lbf_groups_unregister(mailbox, moves);
+    lbf_groups_unregister(mailbox, copies);
+
     libbalsa_unlock_mailbox(mailbox);
 
+    g_hash_table_destroy(colors);
+    g_hash_table_destroy(moves);
+    g_hash_table_destroy(copies);
+
+    return result;
+}
+
+/* Apply the filter's action to the messages in the list; returns TRUE
+ * if message(s) were moved to the trash. */
+gboolean
+libbalsa_filter_mailbox_messages(LibBalsaFilter * filt,
+				 LibBalsaMailbox * mailbox,
+				 GArray * msgnos)
+{
+    GSList *filters;
+    GPtrArray *matches;
+    gboolean result;
+
+    if (msgnos->len == 0)
+	return FALSE;
+
+    filters = g_slist_prepend(NULL, filt);
+    matches = g_ptr_array_new();
+    g_ptr_array_add(matches, msgnos);
+    result = libbalsa_filters_mailbox_messages(filters, matches, mailbox);
+    g_ptr_array_free(matches, TRUE);
+    g_slist_free(filters);
+
     return result;
 }
 
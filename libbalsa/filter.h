@@ -240,6 +240,15 @@ gboolean libbalsa_filter_mailbox_messages(LibBalsaFilter * filt,
 					  LibBalsaMailbox * mailbox,
 					  GArray * msgnos);
 
+/* Apply the actions of several filters at once; matches holds the
+ * array of messages matched by each filter of the list. Copies and
+ * moves are issued once per destination mailbox.
+ */
+
+gboolean libbalsa_filters_mailbox_messages(GSList * filters,
+                                           GPtrArray * matches,
+                                           LibBalsaMailbox * mailbox);
+
 /*
  * libbalsa_filter_get_by_name()
  * search in the filter list the filter of name fname or NULL if unfound
@@ -0,0 +1,714 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2016 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+  The IMAP body cache. Each cached body or part is stored once, in a
+  file named after the SHA-256 hash of its contents; any number of
+  keys (user@host-mailbox-uidvalidity-uid-type[-section]) may refer to
+  it, so a message copied to another folder, or an attachment sent to
+  several folders, is kept only once.
+
+  The keys, sizes and access times are kept in memory and persisted
+  in an append-only index log, a LibBalsaJournal, so that neither
+  lookups nor eviction need to scan the cache directory or rely on
+  file access times. Accesses are logged in batches. The log is
+  rewritten when it is loaded, after the files it does not know have
+  been removed, and whenever it grows much larger than its live
+  contents. Least recently used bodies are evicted as soon as the
+  cache grows beyond its size limit.
+
+  Layout: cache_dir/bodies/index and cache_dir/bodies/xx/<hash>.
+*/
+
+#if defined(HAVE_CONFIG_H) && HAVE_CONFIG_H
+# include "config.h"
+#endif                          /* HAVE_CONFIG_H */
+#include "imap-body-cache.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "journal.h"
+
+#define BODY_CACHE_SUBDIR   "bodies"
+#define BODY_CACHE_INDEX    "index"
+#define BODY_CACHE_MAGIC    "BalsaBC1"
+#define BODY_CACHE_HASH_LEN 64  /* hex SHA-256 */
+/* rewrite the log when it has this many more records than live keys */
+#define BODY_CACHE_LOG_SLACK 4096
+/* log the accesses once this many bodies have been accessed */
+#define BODY_CACHE_TOUCH_BATCH 64
+
+enum {
+    LOG_ADD = 1,                /* key refers to hash */
+    LOG_TOUCH,                  /* hash was accessed */
+    LOG_DEL_KEY,                /* key was removed */
+    LOG_DEL_BLOB                /* hash was evicted */
+};
+
+struct log_record {
+    uint8_t  op;
+    uint8_t  pad[3];
+    uint32_t key_len;           /* followed by key_len bytes of the key */
+    uint64_t size;
+    int64_t  atime;
+    gchar    hash[BODY_CACHE_HASH_LEN];
+};
+
+typedef struct {
+    gchar   *hash;
+    guint64  size;
+    gint64   atime;
+    GSList  *keys;              /* owned by BodyCache::keys */
+    GList    lru;               /* link in BodyCache::lru */
+    gboolean touched;           /* in BodyCache::touched */
+} BodyCacheBlob;
+
+typedef struct {
+    gchar      *dir;            /* cache_dir/bodies */
+    GHashTable *keys;           /* key -> BodyCacheBlob */
+    GHashTable *blobs;          /* hash -> BodyCacheBlob */
+    GQueue      lru;            /* most recently used first */
+    guint64     total;
+    LibBalsaJournal *journal;   /* the index log */
+    GPtrArray  *touched;        /* blobs accessed but not yet logged */
+    gboolean    replaying;
+} BodyCache;
+
+static GMutex body_cache_lock;
+static GHashTable *body_caches; /* cache_dir -> BodyCache */
+static guint64 body_cache_size = 512 * 1024 * 1024;
+
+static void bc_dump(LibBalsaJournal *journal, gpointer data);
+
+static gchar *
+bc_blob_path(BodyCache *cache, const gchar *hash)
+{
+    gchar subdir[3] = { hash[0], hash[1], '\0' };
+
+    return g_build_filename(cache->dir, subdir, hash, NULL);
+}
+
+/* bc_record() adds one record, followed by the key, if any, to buf. */
+static void
+bc_record(GByteArray *buf, guint8 op, const gchar *key, BodyCacheBlob *blob)
+{
+    struct log_record rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.op      = op;
+    rec.key_len = key != NULL ? strlen(key) : 0;
+    rec.size    = blob->size;
+    rec.atime   = blob->atime;
+    memcpy(rec.hash, blob->hash, BODY_CACHE_HASH_LEN);
+
+    g_byte_array_append(buf, (const guint8 *) &rec, sizeof(rec));
+    if (rec.key_len > 0)
+        g_byte_array_append(buf, (const guint8 *) key, rec.key_len);
+}
+
+/* bc_write() appends one record. */
+static void
+bc_write(LibBalsaJournal *journal, guint8 op, const gchar *key,
+         BodyCacheBlob *blob)
+{
+    GByteArray *buf = g_byte_array_new();
+
+    bc_record(buf, op, key, blob);
+    libbalsa_journal_append(journal, buf->data, buf->len);
+    g_byte_array_free(buf, TRUE);
+}
+
+static void
+bc_log(BodyCache *cache, guint8 op, const gchar *key, BodyCacheBlob *blob)
+{
+    if (!cache->replaying)
+        bc_write(cache->journal, op, key, blob);
+}
+
+/* bc_log_touches() logs the pending accesses in a single write. */
+static void
+bc_log_touches(BodyCache *cache)
+{
+    GByteArray *buf;
+    guint i;
+
+    if (cache->touched->len == 0)
+        return;
+
+    buf = g_byte_array_new();
+    for (i = 0; i < cache->touched->len; i++) {
+        BodyCacheBlob *blob = g_ptr_array_index(cache->touched, i);
+
+        bc_record(buf, LOG_TOUCH, NULL, blob);
+        blob->touched = FALSE;
+    }
+    g_ptr_array_set_size(cache->touched, 0);
+    libbalsa_journal_append(cache->journal, buf->data, buf->len);
+    g_byte_array_free(buf, TRUE);
+}
+
+/* bc_done() is called when an operation on the cache is complete. */
+static void
+bc_done(BodyCache *cache)
+{
+    if (cache->touched->len >= BODY_CACHE_TOUCH_BATCH)
+        bc_log_touches(cache);
+    libbalsa_journal_maybe_compact(cache->journal,
+                                   g_hash_table_size(cache->keys),
+                                   bc_dump, cache);
+}
+
+static BodyCacheBlob *
+bc_blob_new(BodyCache *cache, const gchar *hash, guint64 size, gint64 atime)
+{
+    BodyCacheBlob *blob = g_new0(BodyCacheBlob, 1);
+
+    blob->hash     = g_strndup(hash, BODY_CACHE_HASH_LEN);
+    blob->size     = size;
+    blob->atime    = atime;
+    blob->lru.data = blob;
+    g_hash_table_insert(cache->blobs, blob->hash, blob);
+    g_queue_push_head_link(&cache->lru, &blob->lru);
+    cache->total += size;
+
+    return blob;
+}
+
+static void
+bc_blob_touch(BodyCache *cache, BodyCacheBlob *blob, gint64 atime)
+{
+    g_queue_unlink(&cache->lru, &blob->lru);
+    g_queue_push_head_link(&cache->lru, &blob->lru);
+    blob->atime = atime;
+}
+
+/* bc_blob_accessed() marks blob as the most recently used one; the
+   access is logged with the next batch. */
+static void
+bc_blob_accessed(BodyCache *cache, BodyCacheBlob *blob)
+{
+    bc_blob_touch(cache, blob, g_get_real_time() / G_USEC_PER_SEC);
+    if (!blob->touched) {
+        blob->touched = TRUE;
+        g_ptr_array_add(cache->touched, blob);
+    }
+}
+
+/* bc_blob_drop() forgets blob and all the keys referring to it, and
+   removes its file. */
+static void
+bc_blob_drop(BodyCache *cache, BodyCacheBlob *blob)
+{
+    GSList *l;
+
+    bc_log(cache, LOG_DEL_BLOB, NULL, blob);
+    if (blob->touched)
+        g_ptr_array_remove_fast(cache->touched, blob);
+    if (!cache->replaying) {
+        gchar *path = bc_blob_path(cache, blob->hash);
+        unlink(path);
+        g_free(path);
+    }
+
+    for (l = blob->keys; l != NULL; l = l->next)
+        g_hash_table_remove(cache->keys, l->data);
+    g_slist_free(blob->keys);
+
+    g_queue_unlink(&cache->lru, &blob->lru);
+    g_hash_table_remove(cache->blobs, blob->hash);
+    cache->total -= blob->size;
+    g_free(blob->hash);
+    g_free(blob);
+}
+
+static void
+bc_key_unbind(BodyCache *cache, const gchar *key)
+{
+    gpointer orig_key, value;
+    BodyCacheBlob *blob;
+
+    if (!g_hash_table_lookup_extended(cache->keys, key, &orig_key, &value))
+        return;
+
+    blob = value;
+    bc_log(cache, LOG_DEL_KEY, key, blob);
+    blob->keys = g_slist_remove(blob->keys, orig_key);
+    g_hash_table_remove(cache->keys, key);
+    if (blob->keys == NULL)
+        bc_blob_drop(cache, blob);
+}
+
+static void
+bc_key_bind(BodyCache *cache, const gchar *key, BodyCacheBlob *blob)
+{
+    gchar *new_key;
+
+    if (g_hash_table_lookup(cache->keys, key) == blob)
+        return;
+
+    bc_key_unbind(cache, key);
+    new_key = g_strdup(key);
+    g_hash_table_insert(cache->keys, new_key, blob);
+    blob->keys = g_slist_prepend(blob->keys, new_key);
+    bc_log(cache, LOG_ADD, key, blob);
+}
+
+/* bc_trim() evicts the least recently used bodies until the cache
+   fits in cache_size, but never the keep most recently used ones. */
+static void
+bc_trim(BodyCache *cache, guint64 cache_size, guint keep)
+{
+    while (cache->total > cache_size && cache->lru.length > keep) {
+        BodyCacheBlob *blob = g_queue_peek_tail(&cache->lru);
+        g_debug("%s: evicting %s", __func__, blob->hash);
+        bc_blob_drop(cache, blob);
+    }
+}
+
+static void
+bc_replay(BodyCache *cache, const gchar *contents, gsize length)
+{
+    gsize offset = 0;
+
+    cache->replaying = TRUE;
+    while (offset + sizeof(struct log_record) <= length) {
+        struct log_record rec;
+        BodyCacheBlob *blob;
+        gchar hash[BODY_CACHE_HASH_LEN + 1];
+        gchar *key;
+
+        memcpy(&rec, contents + offset, sizeof(rec));
+        memcpy(hash, rec.hash, BODY_CACHE_HASH_LEN);
+        hash[BODY_CACHE_HASH_LEN] = '\0';
+        offset += sizeof(rec);
+        if (rec.key_len > length - offset)
+            break;              /* cut short by a crash */
+        key = g_strndup(contents + offset, rec.key_len);
+        offset += rec.key_len;
+
+        blob = g_hash_table_lookup(cache->blobs, hash);
+        switch (rec.op) {
+        case LOG_ADD:
+            if (blob == NULL)
+                blob = bc_blob_new(cache, hash, rec.size, rec.atime);
+            else
+                bc_blob_touch(cache, blob, rec.atime);
+            bc_key_bind(cache, key, blob);
+            break;
+        case LOG_TOUCH:
+            if (blob != NULL)
+                bc_blob_touch(cache, blob, rec.atime);
+            break;
+        case LOG_DEL_KEY:
+            bc_key_unbind(cache, key);
+            break;
+        case LOG_DEL_BLOB:
+            if (blob != NULL)
+                bc_blob_drop(cache, blob);
+            break;
+        }
+        g_free(key);
+    }
+    cache->replaying = FALSE;
+}
+
+/* bc_dump() writes one record per live key, the least recently used
+   first, which also records the pending accesses. */
+static void
+bc_dump(LibBalsaJournal *journal, gpointer data)
+{
+    BodyCache *cache = data;
+    GList *l;
+    guint i;
+
+    for (i = 0; i < cache->touched->len; i++)
+        ((BodyCacheBlob *) g_ptr_array_index(cache->touched, i))->touched =
+            FALSE;
+    g_ptr_array_set_size(cache->touched, 0);
+
+    for (l = cache->lru.tail; l != NULL; l = l->prev) {
+        BodyCacheBlob *blob = l->data;
+        GSList *k;
+
+        for (k = blob->keys; k != NULL; k = k->next)
+            bc_write(journal, LOG_ADD, k->data, blob);
+    }
+}
+
+/* bc_remove_files() removes the files in dir_name that are left over
+   from interrupted fetches or, if legacy is TRUE, belong to the old
+   one-file-per-key cache layout. */
+static void
+bc_remove_files(const gchar *dir_name, gboolean legacy)
+{
+    GDir *dir = g_dir_open(dir_name, 0U, NULL);
+    const gchar *entry;
+
+    if (dir == NULL)
+        return;
+
+    while ((entry = g_dir_read_name(dir)) != NULL) {
+        if (legacy ? (g_str_has_suffix(entry, "-body") ||
+                      strstr(entry, "-part-") != NULL)
+            : g_str_has_prefix(entry, "tmp-")) {
+            gchar *fname = g_build_filename(dir_name, entry, NULL);
+            unlink(fname);
+            g_free(fname);
+        }
+    }
+    g_dir_close(dir);
+}
+
+static gboolean
+bc_is_hash(const gchar *name)
+{
+    guint i;
+
+    for (i = 0; i < BODY_CACHE_HASH_LEN; i++)
+        if (!g_ascii_isxdigit(name[i]))
+            return FALSE;
+
+    return name[i] == '\0';
+}
+
+/* bc_remove_orphans() removes the bodies the index does not know,
+   e.g. after it was found garbled, so that they do not escape the
+   size limit. */
+static void
+bc_remove_orphans(BodyCache *cache)
+{
+    GDir *dir = g_dir_open(cache->dir, 0U, NULL);
+    const gchar *subdir;
+
+    if (dir == NULL)
+        return;
+
+    while ((subdir = g_dir_read_name(dir)) != NULL) {
+        gchar *sub_path;
+        GDir *sub;
+        const gchar *entry;
+
+        if (strlen(subdir) != 2)
+            continue;
+        sub_path = g_build_filename(cache->dir, subdir, NULL);
+        if ((sub = g_dir_open(sub_path, 0U, NULL)) != NULL) {
+            while ((entry = g_dir_read_name(sub)) != NULL) {
+                if (bc_is_hash(entry) &&
+                    !g_hash_table_contains(cache->blobs, entry)) {
+                    gchar *fname = g_build_filename(sub_path, entry, NULL);
+                    g_debug("%s: removing %s", __func__, entry);
+                    unlink(fname);
+                    g_free(fname);
+                }
+            }
+            g_dir_close(sub);
+        }
+        g_free(sub_path);
+    }
+    g_dir_close(dir);
+}
+
+static BodyCache *
+bc_get(const gchar *cache_dir)
+{
+    BodyCache *cache;
+    gchar *index, *contents;
+    gsize length;
+
+    if (body_caches == NULL)
+        body_caches = g_hash_table_new(g_str_hash, g_str_equal);
+    else if ((cache = g_hash_table_lookup(body_caches, cache_dir)) != NULL)
+        return cache;
+
+    cache = g_new0(BodyCache, 1);
+    cache->dir   = g_build_filename(cache_dir, BODY_CACHE_SUBDIR, NULL);
+    cache->keys  = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    cache->blobs = g_hash_table_new(g_str_hash, g_str_equal);
+    cache->touched = g_ptr_array_new();
+    g_queue_init(&cache->lru);
+    g_hash_table_insert(body_caches, g_strdup(cache_dir), cache);
+
+    g_mkdir_with_parents(cache->dir, S_IRUSR | S_IWUSR | S_IXUSR);
+    index = g_build_filename(cache->dir, BODY_CACHE_INDEX, NULL);
+    cache->journal =
+        libbalsa_journal_new(index, BODY_CACHE_MAGIC,
+                             sizeof(BODY_CACHE_MAGIC) - 1,
+                             LIBBALSA_JOURNAL_FLUSH, BODY_CACHE_LOG_SLACK);
+    if (libbalsa_journal_read(cache->journal, &contents, &length)) {
+        bc_replay(cache, contents, length);
+        g_free(contents);
+    } else if (!g_file_test(index, G_FILE_TEST_EXISTS))
+        bc_remove_files(cache_dir, TRUE);
+    g_free(index);
+    bc_remove_files(cache->dir, FALSE);
+    bc_remove_orphans(cache);
+    libbalsa_journal_compact(cache->journal, bc_dump, cache);
+
+    return cache;
+}
+
+static gchar *
+bc_hash_file(const gchar *path, guint64 *size)
+{
+    GChecksum *checksum;
+    FILE *f;
+    gchar buf[65536];
+    size_t sz;
+    gchar *hash = NULL;
+
+    if ((f = fopen(path, "rb")) == NULL)
+        return NULL;
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    *size = 0;
+    while ((sz = fread(buf, 1, sizeof(buf), f)) > 0) {
+        g_checksum_update(checksum, (const guchar *) buf, sz);
+        *size += sz;
+    }
+    if (!ferror(f))
+        hash = g_strdup(g_checksum_get_string(checksum));
+    g_checksum_free(checksum);
+    fclose(f);
+
+    return hash;
+}
+
+/** Sets the size limit of all body caches. */
+void
+libbalsa_imap_body_cache_set_size(guint64 cache_size)
+{
+    g_mutex_lock(&body_cache_lock);
+    body_cache_size = cache_size;
+    g_mutex_unlock(&body_cache_lock);
+}
+
+/** Returns the path of the file holding the data cached under key,
+    or NULL if there is none. */
+gchar *
+libbalsa_imap_body_cache_lookup(const gchar *cache_dir, const gchar *key)
+{
+    BodyCache *cache;
+    BodyCacheBlob *blob;
+    gchar *path = NULL;
+
+    g_mutex_lock(&body_cache_lock);
+    cache = bc_get(cache_dir);
+    if ((blob = g_hash_table_lookup(cache->keys, key)) != NULL) {
+        path = bc_blob_path(cache, blob->hash);
+        if (g_file_test(path, G_FILE_TEST_IS_REGULAR))
+            bc_blob_accessed(cache, blob);
+        else {
+            bc_blob_drop(cache, blob);
+            g_free(path);
+            path = NULL;
+        }
+    }
+    bc_done(cache);
+    g_mutex_unlock(&body_cache_lock);
+
+    return path;
+}
+
+/** Creates a temporary file in the cache to be filled and passed to
+    libbalsa_imap_body_cache_commit(). */
+FILE *
+libbalsa_imap_body_cache_create(const gchar *cache_dir, gchar **tmp_path)
+{
+    gchar *dir = g_build_filename(cache_dir, BODY_CACHE_SUBDIR, NULL);
+    FILE *f = NULL;
+    int fd;
+
+    g_mkdir_with_parents(dir, S_IRUSR | S_IWUSR | S_IXUSR);
+    *tmp_path = g_build_filename(dir, "tmp-XXXXXX", NULL);
+    g_free(dir);
+
+    if ((fd = g_mkstemp(*tmp_path)) >= 0 && (f = fdopen(fd, "wb+")) == NULL) {
+        close(fd);
+        unlink(*tmp_path);
+    }
+    if (f == NULL) {
+        g_free(*tmp_path);
+        *tmp_path = NULL;
+    }
+
+    return f;
+}
+
+/** Stores the contents of the temporary file tmp_path under key. The
+    temporary file is consumed. Returns the path of the cached file,
+    or NULL on failure. */
+gchar *
+libbalsa_imap_body_cache_commit(const gchar *cache_dir, const gchar *key,
+                                const gchar *tmp_path)
+{
+    BodyCache *cache;
+    BodyCacheBlob *blob;
+    guint64 size;
+    gchar *hash, *path;
+    gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+
+    if ((hash = bc_hash_file(tmp_path, &size)) == NULL) {
+        unlink(tmp_path);
+        return NULL;
+    }
+
+    g_mutex_lock(&body_cache_lock);
+    cache = bc_get(cache_dir);
+    path = bc_blob_path(cache, hash);
+    blob = g_hash_table_lookup(cache->blobs, hash);
+    if (blob != NULL && g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+        unlink(tmp_path);       /* we have it already */
+        bc_blob_touch(cache, blob, now);
+    } else {
+        gchar *subdir = g_path_get_dirname(path);
+
+        g_mkdir_with_parents(subdir, S_IRUSR | S_IWUSR | S_IXUSR);
+        g_free(subdir);
+        if (rename(tmp_path, path) != 0) {
+            unlink(tmp_path);
+            g_free(path);
+            path = NULL;
+        } else if (blob == NULL)
+            blob = bc_blob_new(cache, hash, size, now);
+        else
+            bc_blob_touch(cache, blob, now);
+    }
+    if (path != NULL) {
+        bc_key_bind(cache, key, blob);
+        bc_blob_accessed(cache, blob);
+        bc_trim(cache, body_cache_size, 1);
+        if (!g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+            g_free(path);
+            path = NULL;
+        }
+    }
+    bc_done(cache);
+    g_mutex_unlock(&body_cache_lock);
+    g_free(hash);
+
+    return path;
+}
+
+/** Stores a copy of the file src_path under key. */
+gboolean
+libbalsa_imap_body_cache_add_file(const gchar *cache_dir, const gchar *key,
+                                  const gchar *src_path)
+{
+    FILE *in, *out;
+    gchar *tmp_path, *path;
+    gchar buf[65536];
+    size_t sz;
+    gboolean err;
+
+    if ((in = fopen(src_path, "rb")) == NULL)
+        return FALSE;
+    if ((out = libbalsa_imap_body_cache_create(cache_dir, &tmp_path)) == NULL) {
+        fclose(in);
+        return FALSE;
+    }
+
+    while ((sz = fread(buf, 1, sizeof(buf), in)) > 0)
+        if (fwrite(buf, 1, sz, out) != sz)
+            break;
+    err = ferror(in) || ferror(out);
+    fclose(in);
+    if (fclose(out) != 0)
+        err = TRUE;
+    if (err) {
+        unlink(tmp_path);
+        g_free(tmp_path);
+        return FALSE;
+    }
+
+    path = libbalsa_imap_body_cache_commit(cache_dir, key, tmp_path);
+    g_free(tmp_path);
+    g_free(path);
+
+    return path != NULL;
+}
+
+/** Makes dst_key refer to the data cached under src_key, if any. */
+void
+libbalsa_imap_body_cache_link(const gchar *cache_dir, const gchar *src_key,
+                              const gchar *dst_key)
+{
+    BodyCache *cache;
+    BodyCacheBlob *blob;
+
+    g_mutex_lock(&body_cache_lock);
+    cache = bc_get(cache_dir);
+    if ((blob = g_hash_table_lookup(cache->keys, src_key)) != NULL)
+        bc_key_bind(cache, dst_key, blob);
+    bc_done(cache);
+    g_mutex_unlock(&body_cache_lock);
+}
+
+/** Removes key; the data goes when no other key refers to it. */
+void
+libbalsa_imap_body_cache_remove(const gchar *cache_dir, const gchar *key)
+{
+    BodyCache *cache;
+
+    g_mutex_lock(&body_cache_lock);
+    cache = bc_get(cache_dir);
+    bc_key_unbind(cache, key);
+    bc_done(cache);
+    g_mutex_unlock(&body_cache_lock);
+}
+
+/** Calls func for each key starting with prefix. func may call the
+    other libbalsa_imap_body_cache_* functions. */
+void
+libbalsa_imap_body_cache_foreach(const gchar *cache_dir, const gchar *prefix,
+                                 LibBalsaImapBodyCacheFunc func,
+                                 gpointer data)
+{
+    GPtrArray *keys = g_ptr_array_new_with_free_func(g_free);
+    GHashTableIter iter;
+    gpointer key;
+    guint i;
+
+    g_mutex_lock(&body_cache_lock);
+    g_hash_table_iter_init(&iter, bc_get(cache_dir)->keys);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+        if (g_str_has_prefix(key, prefix))
+            g_ptr_array_add(keys, g_strdup(key));
+    g_mutex_unlock(&body_cache_lock);
+
+    for (i = 0; i < keys->len; i++)
+        func(g_ptr_array_index(keys, i), data);
+    g_ptr_array_unref(keys);
+}
+
+/** Evicts the least recently used data until the cache in cache_dir
+    fits in cache_size. */
+void
+libbalsa_imap_body_cache_trim(const gchar *cache_dir, guint64 cache_size)
+{
+    BodyCache *cache;
+
+    g_mutex_lock(&body_cache_lock);
+    cache = bc_get(cache_dir);
+    bc_trim(cache, cache_size, 0);
+    bc_log_touches(cache);
+    bc_done(cache);
+    g_mutex_unlock(&body_cache_lock);
+}
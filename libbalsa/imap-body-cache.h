@@ -0,0 +1,56 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2016 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef __LIBBALSA_IMAP_BODY_CACHE_H__
+#define __LIBBALSA_IMAP_BODY_CACHE_H__
+
+#include <stdio.h>
+#include <glib.h>
+
+/* The IMAP body cache stores message bodies and parts under a key
+ * (the mailbox, UID and section) in the cache directory cache_dir.
+ * Identical contents are stored only once. */
+
+typedef void (*LibBalsaImapBodyCacheFunc)(const gchar *key, gpointer data);
+
+void   libbalsa_imap_body_cache_set_size(guint64 cache_size);
+
+gchar *libbalsa_imap_body_cache_lookup(const gchar *cache_dir,
+                                       const gchar *key);
+FILE  *libbalsa_imap_body_cache_create(const gchar *cache_dir,
+                                       gchar **tmp_path);
+gchar *libbalsa_imap_body_cache_commit(const gchar *cache_dir,
+                                       const gchar *key,
+                                       const gchar *tmp_path);
+gboolean libbalsa_imap_body_cache_add_file(const gchar *cache_dir,
+                                           const gchar *key,
+                                           const gchar *src_path);
+void   libbalsa_imap_body_cache_link(const gchar *cache_dir,
+                                     const gchar *src_key,
+                                     const gchar *dst_key);
+void   libbalsa_imap_body_cache_remove(const gchar *cache_dir,
+                                       const gchar *key);
+void   libbalsa_imap_body_cache_foreach(const gchar *cache_dir,
+                                        const gchar *prefix,
+                                        LibBalsaImapBodyCacheFunc func,
+                                        gpointer data);
+void   libbalsa_imap_body_cache_trim(const gchar *cache_dir,
+                                     guint64 cache_size);
+
+#endif                          /* __LIBBALSA_IMAP_BODY_CACHE_H__ */
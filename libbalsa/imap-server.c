@@ -49,9 +49,12 @@ struct _LibBalsaImapServer {
     gboolean offline_mode;
 
     GMutex lock; /* protects the following members */
+    GCond handle_released; /* signalled whenever a handle is released */
     guint used_connections;
     GList *used_handles;
     GList *free_handles;
+    GThreadPool *job_pool; /* background jobs, see
+                              libbalsa_imap_server_push_job() */
     gboolean persistent_cache; /* if TRUE, messages will be cached in
                                     $HOME and preserved between
                                     sessions. If FALSE, messages will be
@@ -59,6 +62,7 @@ struct _LibBalsaImapServer {
     gboolean has_fetch_bug;
     gboolean use_status; /**< server has fast STATUS command */
     gboolean use_idle;  /**< IDLE will work: no dummy firewall on the way */
+    gboolean mirror_bodies; /**< copy checked mailboxes to the cache */
 };
 
 static void libbalsa_imap_server_finalize(GObject * object);
@@ -72,6 +76,12 @@ static gboolean connection_cleanup(gpointer ptr);
 #define CONNECTION_CLEANUP_NOOP_TIME    (20*60)
 /* We try to avoid too many connections per server */
 #define MAX_CONNECTIONS_PER_SERVER 20
+/* How long a thread queues for a handle before giving up */
+#define HANDLE_WAIT_TIME (60 * G_TIME_SPAN_SECOND)
+/* A background job finding all connections busy is queued again this
+ * many times, after this many seconds */
+#define JOB_RETRIES     5
+#define JOB_RETRY_DELAY 2
 
 static GMutex imap_servers_lock;
 static GHashTable *imap_servers = NULL;
@@ -80,6 +90,14 @@ struct handle_info {
     ImapMboxHandle *handle;
     time_t last_used;
     void *last_user;
+    GThread *owner;             /* the thread that acquired it */
+};
+
+struct server_job {
+    LibBalsaImapServerJobFunc func;
+    gpointer data;
+    guint retries;
+    LibBalsaImapServer *server; /* while waiting for a retry */
 };
 
 static int by_handle(gconstpointer a, gconstpointer b)
@@ -87,11 +105,6 @@ static int by_handle(gconstpointer a, gconstpointer b)
     return ((struct handle_info*)a)->handle != b;
 }
 
-static int by_last_user(gconstpointer a, gconstpointer b)
-{
-    return ((struct handle_info*)a)->last_user != b;
-}
-
 G_DEFINE_TYPE(LibBalsaImapServer, libbalsa_imap_server, LIBBALSA_TYPE_SERVER)
 
 static void libbalsa_imap_server_set_username(LibBalsaServer * server,
@@ -166,6 +179,7 @@ libbalsa_imap_server_init(LibBalsaImapServer * imap_server)
     libbalsa_server_set_protocol(LIBBALSA_SERVER(imap_server), "imap");
     imap_server->key = NULL;
     g_mutex_init(&imap_server->lock);
+    g_cond_init(&imap_server->handle_released);
     imap_server->max_connections = MAX_CONNECTIONS_PER_SERVER;
     imap_server->used_connections = 0;
     imap_server->used_handles = NULL;
@@ -193,7 +207,11 @@ libbalsa_imap_server_finalize(GObject * object)
 
     g_source_remove(imap_server->connection_cleanup_id);
 
+    /* every queued job holds a reference, so the pool is idle */
+    if (imap_server->job_pool != NULL)
+        g_thread_pool_free(imap_server->job_pool, FALSE, FALSE);
     libbalsa_imap_server_force_disconnect(imap_server);
+    g_cond_clear(&imap_server->handle_released);
     g_mutex_clear(&imap_server->lock);
     g_free(imap_server->key); imap_server->key = NULL;
 
@@ -433,6 +451,7 @@ libbalsa_imap_server_new_from_config(void)
         set_bool_if_defined("PersistentCache", &imap_server->persistent_cache);
         set_bool_if_defined("HasFetchBug", &imap_server->has_fetch_bug);
         set_bool_if_defined("UseStatus", &imap_server->use_status);
+        set_bool_if_defined("MirrorBodies", &imap_server->mirror_bodies);
         set_bool_if_defined("UseIdle", &imap_server->use_idle);
     }
 
@@ -447,6 +466,7 @@ libbalsa_imap_server_save_config(LibBalsaImapServer *server)
     libbalsa_conf_set_bool("PersistentCache", server->persistent_cache);
     libbalsa_conf_set_bool("HasFetchBug", server->has_fetch_bug);
     libbalsa_conf_set_bool("UseStatus",   server->use_status);
+    libbalsa_conf_set_bool("MirrorBodies", server->mirror_bodies);
     libbalsa_conf_set_bool("UseIdle",     server->use_idle);
 }
 
@@ -479,150 +499,114 @@ handle_connection_error(int rc, struct handle_info *info,
     lb_imap_server_info_free(info);
 }
 
-/**
- * libbalsa_imap_server_get_handle:
- * @server: A #LibBalsaImapServer
- *
- * Returns a connected handle to the IMAP server, if needed it
- * connects.  If there is no password set, the user is asked to supply
- * one.  Handle is apriopriate for all commands that work in AUTHENTICATED
- * state (LIST, SUBSCRIBE, CREATE, APPEND) but it MUST not be used for
- * select -- use libbalsa_imap_server_get_handle_with_user for that purpose. 
- *
- * Return value: a handle to the server, or %NULL when there are no
- * free connections.
- **/
-ImapMboxHandle*
-libbalsa_imap_server_get_handle(LibBalsaImapServer *imap_server, GError **err)
+/* Pick the free handle best suited for user: the one last used by
+ * user, otherwise one that is not pinned to a selected mailbox.
+ * Called with the lock held. */
+static GList *
+lb_imap_server_find_free(LibBalsaImapServer *imap_server, gpointer user)
 {
-    LibBalsaServer *server = LIBBALSA_SERVER(imap_server);
-    struct handle_info *info = NULL;
+    GList *list;
+    GList *unpinned = NULL;
 
-    if (!imap_server || imap_server->offline_mode)
-        return NULL;
+    for (list = imap_server->free_handles; list; list = list->next) {
+        struct handle_info *info = list->data;
 
-    g_mutex_lock(&imap_server->lock);
-    /* look for free connection */
-    if (imap_server->free_handles) {
-        GList *conn;
-        conn = g_list_find_custom(imap_server->free_handles, NULL,
-                                  by_last_user);
-        if (!conn)
-            conn = g_list_first(imap_server->free_handles);
-        info = (struct handle_info*)conn->data;
-        imap_server->free_handles =
-            g_list_delete_link(imap_server->free_handles, conn);
+        if (info->last_user == user)
+            return list;
+        if (unpinned == NULL
+            && (info->last_user == NULL
+                || !imap_mbox_is_selected(info->handle)))
+            unpinned = list;
     }
-    /* create if used < max connections */
-    if (!info
-        && imap_server->used_connections < imap_server->max_connections) {
-    	g_mutex_unlock(&imap_server->lock);
-        info = lb_imap_server_info_new(server);
-        g_mutex_lock(&imap_server->lock);
-        /* FIXME: after dropping and reacquiring the lock,
-         * (imap_server->used_connections < imap_server->max_connections)
-         * might no longer be true--do we care?
-        if (imap_server->used_connections >= imap_server->max_connections) {
-            lb_imap_server_info_free(info);
-            g_mutex_unlock(&imap_server->lock);
-            return NULL;
-        }
-         */
-    }
-    if (info) {
-        if(imap_mbox_is_disconnected(info->handle)) {
-            ImapResult rc;
-
-            rc=imap_mbox_handle_connect(info->handle, libbalsa_server_get_host(server));
-            if(rc != IMAP_SUCCESS) {
-                handle_connection_error(rc, info, server, err);
-                g_mutex_unlock(&imap_server->lock);
-                return NULL;
-            }
-        }
-        /* add handle to used list */
-        imap_server->used_handles = g_list_prepend(imap_server->used_handles,
-                                                   info);
-        imap_server->used_connections++;
+
+    return unpinned;
+}
+
+/* The least recently used free handle. Called with the lock held. */
+static GList *
+lb_imap_server_find_lru(LibBalsaImapServer *imap_server)
+{
+    GList *list;
+    GList *lru = imap_server->free_handles;
+
+    for (list = lru; list; list = list->next) {
+        struct handle_info *info = list->data;
+
+        if (info->last_used < ((struct handle_info *) lru->data)->last_used)
+            lru = list;
     }
-    g_mutex_unlock(&imap_server->lock);
 
-    /* cppcheck-suppress nullPointer */
-    return info ? info->handle : NULL;
+    return lru;
 }
 
-/**
- * libbalsa_imap_server_get_handle_with_user:
- * @server: A #LibBalsaImapServer
- * @user: user for handle
- *
- * Returns a connected handle to the IMAP server, if needed it
- * connects.  If there is no password set, the user is asked to supply
- * one.  This function first tries to find a handle last used by
- * @user, then a handle without a user and finally the least recently
- * used. @user is usually a pointer to LibBalsaMailbox.
+/* lb_imap_server_acquire() is the connection scheduler. A free handle
+ * last used by user comes first, so that a mailbox gets its SELECTed
+ * connection back; then a handle not pinned to another mailbox, then
+ * a new connection, and only then the least recently used handle of
+ * another mailbox. reserve connections are kept for other callers.
  *
- * Return value: a handle to the server, or %NULL when there are no free
- * connections.
- **/
-ImapMboxHandle*
-libbalsa_imap_server_get_handle_with_user(LibBalsaImapServer *imap_server,
-                                          gpointer user, GError **err)
+ * When all connections are busy, threads queue until a handle is
+ * released, unless wait is FALSE. The main thread must not block, and
+ * a thread already holding a handle could wait for itself, so they
+ * fail at once. */
+static gboolean
+lb_imap_server_holds_handle(LibBalsaImapServer *imap_server)
+{
+    GThread *self = g_thread_self();
+    GList *list;
+
+    for (list = imap_server->used_handles; list != NULL; list = list->next)
+        if (((struct handle_info *) list->data)->owner == self)
+            return TRUE;
+
+    return FALSE;
+}
+
+static ImapMboxHandle *
+lb_imap_server_acquire(LibBalsaImapServer *imap_server, gpointer user,
+                       guint reserve, gboolean wait, GError **err)
 {
     LibBalsaServer *server = LIBBALSA_SERVER(imap_server);
     struct handle_info *info = NULL;
-
-    if (imap_server->offline_mode)
-        return NULL;
+    gboolean counted = FALSE;
+    gint64 deadline = g_get_monotonic_time() + HANDLE_WAIT_TIME;
 
     g_mutex_lock(&imap_server->lock);
-    /* look for free reusable connection */
-    if (imap_server->free_handles) {
-        GList *conn=NULL;
-        if (user)
-            conn = g_list_find_custom(imap_server->free_handles, user,
-                                      by_last_user);
-        if (!conn)
-            conn = imap_server->free_handles;
-        if (conn) {
-            info = (struct handle_info*)conn->data;
+    while (!imap_server->offline_mode) {
+        GList *conn = lb_imap_server_find_free(imap_server, user);
+
+        if (conn == NULL && imap_server->used_connections + reserve <
+            imap_server->max_connections) {
+            /* Count the connection before dropping the lock, so that
+             * concurrent callers respect max_connections. */
+            imap_server->used_connections++;
+            counted = TRUE;
+            g_mutex_unlock(&imap_server->lock);
+            info = lb_imap_server_info_new(server);
+            g_mutex_lock(&imap_server->lock);
+            break;
+        }
+        if (conn == NULL)
+            conn = lb_imap_server_find_lru(imap_server);
+        if (conn != NULL) {
+            info = conn->data;
             imap_server->free_handles =
                 g_list_delete_link(imap_server->free_handles, conn);
+            break;
         }
+        if (!wait || !libbalsa_am_i_subthread()
+            || lb_imap_server_holds_handle(imap_server)
+            || !g_cond_wait_until(&imap_server->handle_released,
+                                  &imap_server->lock, deadline))
+            break;
     }
-    /* create if used < max connections;
-     * always leave one connection for actions without user, i.e.
-     * those that do not SELECT any mailbox. */
-    if (!info
-        && imap_server->used_connections < imap_server->max_connections-1) {
-    	g_mutex_unlock(&imap_server->lock);
-        info = lb_imap_server_info_new(server);
-        if (!info)
-            return NULL;
-        g_mutex_lock(&imap_server->lock);
-        /* FIXME: after dropping and reacquiring the lock,
-         * (imap_server->used_connections < imap_server->max_connections)
-         * might no longer be true--do we care?
-        if (imap_server->used_connections >= imap_server->max_connections) {
-            lb_imap_server_info_free(info);
-            g_mutex_unlock(&imap_server->lock);
-            return NULL;
-        }
-         */
-    }
-    /* reuse a free connection */
-    if (!info && imap_server->free_handles) {
-        GList *conn;
-        conn = g_list_first(imap_server->free_handles);
-        info = (struct handle_info*)conn->data;
-        imap_server->free_handles =
-            g_list_delete_link(imap_server->free_handles, conn);
-    }
-    if(!info) {
-        g_set_error(err, LIBBALSA_MAILBOX_ERROR,
-                    LIBBALSA_MAILBOX_TOOMANYOPEN_ERROR,
-                    _("Exceeded the number of connections per server %s"),
-                    libbalsa_server_get_host(server));
+
+    if (info == NULL) {
+        if (!imap_server->offline_mode)
+            g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                        LIBBALSA_MAILBOX_TOOMANYOPEN_ERROR,
+                        _("Exceeded the number of connections per server %s"),
+                        libbalsa_server_get_host(server));
         g_mutex_unlock(&imap_server->lock);
         return NULL;
     }
@@ -633,53 +617,192 @@ libbalsa_imap_server_get_handle_with_user(LibBalsaImapServer *imap_server,
         rc=imap_mbox_handle_connect(info->handle, libbalsa_server_get_host(server));
         if(rc != IMAP_SUCCESS) {
             handle_connection_error(rc, info, server, err);
+            if (counted)
+                imap_server->used_connections--;
+            g_cond_broadcast(&imap_server->handle_released);
             g_mutex_unlock(&imap_server->lock);
             return NULL;
         }
     }
     /* add handle to used list */
-    info->last_user = user;
+    if (user != NULL)
+        info->last_user = user;
+    info->last_used = time(NULL);
+    info->owner = g_thread_self();
     imap_server->used_handles = g_list_prepend(imap_server->used_handles,
                                                info);
-    imap_server->used_connections++;
+    if (!counted)
+        imap_server->used_connections++;
     g_mutex_unlock(&imap_server->lock);
 
     return info->handle;
 }
 
+/**
+ * libbalsa_imap_server_get_handle:
+ * @server: A #LibBalsaImapServer
+ *
+ * Returns a connected handle to the IMAP server, if needed it
+ * connects.  If there is no password set, the user is asked to supply
+ * one.  Handle is apriopriate for all commands that work in AUTHENTICATED
+ * state (LIST, SUBSCRIBE, CREATE, APPEND) but it MUST not be used for
+ * select -- use libbalsa_imap_server_get_handle_with_user for that purpose. 
+ * Handles pinned to a selected mailbox are taken only when no other
+ * connection can be had.  A thread other than the main thread waits
+ * for a handle when all connections are busy.
+ *
+ * Return value: a handle to the server, or %NULL when there are no
+ * free connections.
+ **/
+ImapMboxHandle*
+libbalsa_imap_server_get_handle(LibBalsaImapServer *imap_server, GError **err)
+{
+    if (!imap_server)
+        return NULL;
+
+    return lb_imap_server_acquire(imap_server, NULL, 0, TRUE, err);
+}
+
+/**
+ * libbalsa_imap_server_get_handle_with_user:
+ * @server: A #LibBalsaImapServer
+ * @user: user for handle
+ *
+ * Returns a connected handle to the IMAP server, if needed it
+ * connects.  If there is no password set, the user is asked to supply
+ * one.  This function first tries to find a handle last used by
+ * @user, then a handle not pinned to another user, a new connection
+ * and finally the least recently used handle. @user is usually a
+ * pointer to LibBalsaMailbox.  One connection is always left for
+ * actions without user, i.e. those that do not SELECT any mailbox.
+ *
+ * Return value: a handle to the server, or %NULL when there are no free
+ * connections.
+ **/
+ImapMboxHandle*
+libbalsa_imap_server_get_handle_with_user(LibBalsaImapServer *imap_server,
+                                          gpointer user, GError **err)
+{
+    return lb_imap_server_acquire(imap_server, user, 1, TRUE, err);
+}
+
 /**
  * libbalsa_imap_server_release_handle:
  * @server: A #LibBalsaImapServer
  * @handle: The handle to release
  *
- * Releases the @handle to the connection cache.
+ * Releases the @handle to the connection cache, and wakes up threads
+ * waiting for a handle.
  **/
 void libbalsa_imap_server_release_handle(LibBalsaImapServer *imap_server,
                                          ImapMboxHandle* handle)
 {
     struct handle_info *info = NULL;
+    GList *conn;
 
     if (!handle)
         return;
 
     g_mutex_lock(&imap_server->lock);
     /* remove from used list */
-    if (imap_server->used_handles) {
-        GList *conn;
-        conn = g_list_find_custom(imap_server->used_handles, handle, by_handle);
+    conn = g_list_find_custom(imap_server->used_handles, handle, by_handle);
+    if (conn != NULL) {
         info = (struct handle_info*)conn->data;
         imap_server->used_handles =
             g_list_delete_link(imap_server->used_handles, conn);
         imap_server->used_connections--;
+        info->last_used = time(NULL);
+        /* check max_connections */
+        if (imap_server->used_connections >= imap_server->max_connections)
+            lb_imap_server_info_free(info);
+        else
+        /* add to free list */
+            imap_server->free_handles =
+                g_list_append(imap_server->free_handles, info);
     }
-    /* check max_connections */
-    if (imap_server->used_connections >= imap_server->max_connections)
-        lb_imap_server_info_free(info);
-    else
-    /* add to free list */
-        imap_server->free_handles = g_list_append(imap_server->free_handles,
-                                                  info);
+    g_cond_broadcast(&imap_server->handle_released);
+    g_mutex_unlock(&imap_server->lock);
+}
+
+static gboolean
+lb_imap_server_retry_job(gpointer data)
+{
+    struct server_job *job = data;
+
+    g_thread_pool_push(job->server->job_pool, job, NULL);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void
+lb_imap_server_run_job(gpointer data, gpointer user_data)
+{
+    struct server_job *job = data;
+    LibBalsaImapServer *imap_server = user_data;
+    ImapMboxHandle *handle;
+
+    /* leave one connection for the foreground; a job does not hold a
+     * pool thread while the connections are busy, but waits for its
+     * turn again */
+    handle = lb_imap_server_acquire(imap_server, NULL, 1, FALSE, NULL);
+    if (handle == NULL && job->retries < JOB_RETRIES &&
+        !libbalsa_imap_server_is_offline(imap_server)) {
+        job->retries++;
+        job->server = imap_server;
+        g_timeout_add_seconds(JOB_RETRY_DELAY, lb_imap_server_retry_job, job);
+        return;
+    }
+    job->func(imap_server, handle, job->data);
+    libbalsa_imap_server_release_handle(imap_server, handle);
+    g_object_unref(imap_server);
+    g_free(job);
+}
+
+/* Background jobs run in parallel on the spare connections: all but
+ * one for a selected mailbox and one for the foreground. */
+static gint
+lb_imap_server_job_threads(LibBalsaImapServer *imap_server)
+{
+    return MAX((gint) imap_server->max_connections - 2, 1);
+}
+
+/**
+ * libbalsa_imap_server_push_job:
+ * @server: A #LibBalsaImapServer
+ * @func: the job
+ * @data: data passed to @func
+ *
+ * Queues a background job, e.g. a STATUS check or a prefetch, that
+ * needs no particular connection.  Jobs run in parallel in their own
+ * threads, each on a spare connection of @server; @func gets the
+ * handle, or %NULL if no connection could be made, and must not
+ * release it.  A job finding all connections busy does not wait for
+ * one, but is queued again a few times before @func gets %NULL.
+ **/
+void
+libbalsa_imap_server_push_job(LibBalsaImapServer       *imap_server,
+                              LibBalsaImapServerJobFunc func,
+                              gpointer                  data)
+{
+    struct server_job *job;
+
+    g_return_if_fail(LIBBALSA_IS_IMAP_SERVER(imap_server));
+    g_return_if_fail(func != NULL);
+
+    job = g_new0(struct server_job, 1);
+    job->func = func;
+    job->data = data;
+
+    g_mutex_lock(&imap_server->lock);
+    if (imap_server->job_pool == NULL)
+        imap_server->job_pool =
+            g_thread_pool_new(lb_imap_server_run_job, imap_server,
+                              lb_imap_server_job_threads(imap_server),
+                              FALSE, NULL);
     g_mutex_unlock(&imap_server->lock);
+
+    g_object_ref(imap_server);
+    g_thread_pool_push(imap_server->job_pool, job, NULL);
 }
 
 /**
@@ -694,7 +817,13 @@ void
 libbalsa_imap_server_set_max_connections(LibBalsaImapServer *server,
                                          int max)
 {
+    g_mutex_lock(&server->lock);
     server->max_connections = max;
+    if (server->job_pool != NULL)
+        g_thread_pool_set_max_threads(server->job_pool,
+                                      lb_imap_server_job_threads(server),
+                                      NULL);
+    g_mutex_unlock(&server->lock);
     g_debug("set_max_connections: set to %d", max);
 }
 
@@ -836,6 +965,18 @@ libbalsa_imap_server_get_use_status(LibBalsaImapServer *server)
     return server->use_status;
 }
 
+void
+libbalsa_imap_server_set_mirror_bodies(LibBalsaImapServer *server,
+                                       gboolean mirror_bodies)
+{
+    server->mirror_bodies = mirror_bodies;
+}
+gboolean
+libbalsa_imap_server_get_mirror_bodies(LibBalsaImapServer *server)
+{
+    return server->mirror_bodies;
+}
+
 void
 libbalsa_imap_server_set_use_idle(LibBalsaImapServer *server, 
                                   gboolean use_idle)
@@ -42,6 +42,13 @@ struct _ImapMboxHandle* libbalsa_imap_server_get_handle_with_user
                            gpointer user, GError **err);
 void libbalsa_imap_server_release_handle(LibBalsaImapServer *server,
                                          struct _ImapMboxHandle* handle);
+
+typedef void (*LibBalsaImapServerJobFunc)(LibBalsaImapServer *server,
+                                          struct _ImapMboxHandle *handle,
+                                          gpointer data);
+void libbalsa_imap_server_push_job(LibBalsaImapServer *server,
+                                   LibBalsaImapServerJobFunc func,
+                                   gpointer data);
 void libbalsa_imap_server_set_max_connections(LibBalsaImapServer *server,
                                               int max);
 int  libbalsa_imap_server_get_max_connections(LibBalsaImapServer *server);
@@ -70,6 +77,9 @@ gboolean libbalsa_imap_server_has_bug(LibBalsaImapServer *server,
 void libbalsa_imap_server_set_use_status(LibBalsaImapServer *server,
                                          gboolean use_status);
 gboolean libbalsa_imap_server_get_use_status(LibBalsaImapServer *server);
+void libbalsa_imap_server_set_mirror_bodies(LibBalsaImapServer *server,
+                                            gboolean mirror_bodies);
+gboolean libbalsa_imap_server_get_mirror_bodies(LibBalsaImapServer *server);
 
 void libbalsa_imap_server_set_use_idle(LibBalsaImapServer *server,
                                        gboolean use_idle);
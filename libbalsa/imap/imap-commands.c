@@ -134,6 +134,16 @@ imap_mbox_handle_can_do(ImapMboxHandle* handle, ImapCapability cap)
   return (cap<IMCAP_MAX) ? handle->capabilities[cap] : 0;
 }
 
+/** Checks whether a literal of len bytes may be sent without waiting
+    for the continuation request: always with LITERAL+, and up to 4096
+    bytes with LITERAL- (RFC 7888). */
+gboolean
+imap_handle_literal_nonsync(ImapMboxHandle *h, size_t len)
+{
+  return imap_mbox_handle_can_do(h, IMCAP_LITERAL) ||
+    (imap_mbox_handle_can_do(h, IMCAP_LITERAL_MINUS) && len <= 4096);
+}
+
 
 
 /* 6.1.2 NOOP Command */
@@ -518,7 +528,8 @@ imap_mbox_append_multi_real(ImapMboxHandle *handle,
 			    ImapSequence *uid_sequence)
 {
   static const unsigned TRANSACTION_SIZE = 10*1024*1024;
-  int use_literal, use_multiappend, use_uidplus;
+  int use_multiappend, use_uidplus;
+  gboolean nonsync;
   unsigned cmdno;
   ImapResponse rc = IMR_OK;
   char *litstr;
@@ -528,10 +539,8 @@ imap_mbox_append_multi_real(ImapMboxHandle *handle,
   ImapMsgFlags flags;
   gboolean new_append = TRUE;
 
-  use_literal = imap_mbox_handle_can_do(handle, IMCAP_LITERAL);
   use_multiappend = imap_mbox_handle_can_do(handle, IMCAP_MULTIAPPEND);
   use_uidplus = imap_mbox_handle_can_do(handle, IMCAP_UIDPLUS);
-  litstr = use_literal ? "+" : "";
 
   if(uid_sequence)
     uid_sequence->ranges = NULL;
@@ -544,6 +553,9 @@ imap_mbox_append_multi_real(ImapMboxHandle *handle,
 
     if (handle->state == IMHS_DISCONNECTED)
       return IMR_SEVERED;
+
+    nonsync = imap_handle_literal_nonsync(handle, msg_size);
+    litstr = nonsync ? "+" : "";
   
     if(new_append || !use_multiappend) {
       gchar *cmd;
@@ -575,7 +587,7 @@ imap_mbox_append_multi_real(ImapMboxHandle *handle,
 		   (unsigned long)msg_size, litstr);
     }
 
-    if(use_literal)
+    if(nonsync)
       rc = IMR_RESPOND; /* we do it without flushing */
     else {
     	net_client_siobuf_flush(handle->sio, NULL);
@@ -750,6 +762,36 @@ imap_mbox_handle_first_unseen(ImapMboxHandle* handle)
   return handle->unseen;
 }
 
+/** Counts the unseen, undeleted messages with a single ESEARCH (RFC
+    4731) command that returns only their number and the lowest
+    message number instead of the full list. Returns IMR_NO when the
+    server does not support ESEARCH. */
+ImapResponse
+imap_mbox_count_unseen(ImapMboxHandle *handle, unsigned *count,
+                       unsigned *first)
+{
+  ImapResponse rc;
+  ImapSearchCb cb;
+
+  g_mutex_lock(&handle->mutex);
+  IMAP_REQUIRED_STATE1(handle, IMHS_SELECTED, IMR_BAD);
+  if(!imap_mbox_handle_can_do(handle, IMCAP_ESEARCH)) {
+    g_mutex_unlock(&handle->mutex);
+    return IMR_NO;
+  }
+  handle->esearch.min = handle->esearch.count = 0;
+  cb = handle->search_cb; handle->search_cb = NULL;
+  rc = imap_cmd_exec(handle, "SEARCH RETURN (MIN COUNT) UNSEEN UNDELETED");
+  handle->search_cb = cb;
+  if(rc == IMR_OK) {
+    *count = handle->esearch.count;
+    *first = handle->esearch.min;
+  }
+  g_mutex_unlock(&handle->mutex);
+
+  return rc;
+}
+
 struct find_all_data {
   unsigned *seqno;
   unsigned msgcnt, allocated;
@@ -1214,50 +1256,6 @@ imap_mbox_handle_fetch_rfc822(ImapMboxHandle* handle,
   return rc;
 }
 
-/* When peeking into message, we need to assure that we save header
-   first and body later: the order the fields are returned is in
-   principle undefined. */
-struct FetchBodyHeaderText {
-  FILE *out_file;
-  char *body;
-  size_t length;
-  gboolean wrote_header;
-};
-
-static void
-write_header_text_ordered(unsigned seqno, ImapFetchBodyType body_type,
-			  const char *str, size_t len, void *arg)
-{
-  struct FetchBodyHeaderText *fbht = (struct FetchBodyHeaderText*)arg;
-  switch(body_type) {
-  case IMAP_BODY_TYPE_RFC822:
-    g_warning("Server sends unrequested RFC822 response");
-    break; /* This is really unexpected response! */
-  case IMAP_BODY_TYPE_HEADER:
-    if (fwrite(str, 1, len, fbht->out_file) != len)
-      perror("write_nstring");
-    fbht->wrote_header = TRUE;
-    if(fbht->body) {
-      if (fwrite(fbht->body, 1, fbht->length, fbht->out_file) != fbht->length)
-	perror("write_nstring");
-      g_free(fbht->body); fbht->body = NULL;
-    }
-    break;
-  case IMAP_BODY_TYPE_TEXT:
-  case IMAP_BODY_TYPE_BODY:
-    if(fbht->wrote_header) {
-      if (fwrite(str, 1, len, fbht->out_file) != len)
-	perror("write_nstring");
-    } else {
-      fbht->body = g_malloc(len);
-      fbht->length = len;
-      memcpy(fbht->body, str, len);
-    }
-    break;
-  }
-}
-
-/* There is some point to code reuse here. */
 struct PassHeaderTextOrdered {
   ImapFetchBodyCb cb;
   void *arg;
@@ -1304,38 +1302,24 @@ imap_mbox_handle_fetch_rfc822_uid(ImapMboxHandle* handle, unsigned uid,
   char cmd[80];
   ImapFetchBodyInternalCb cb = handle->body_cb;
   void          *arg = handle->body_arg;
+  gboolean chunks = handle->body_chunks;
   ImapResponse rc;
-  char *cmdstr;
-  struct FetchBodyHeaderText separate_arg;
-
 
   g_mutex_lock(&handle->mutex);
   IMAP_REQUIRED_STATE1(handle, IMHS_SELECTED, IMR_BAD);
 
-  /* Consider switching between BODY.PEEK[HEADER] BODY.PEEK[TEXT] and
-     BODY[HEADER] BODY[TEXT] - this would simplify the callback
-     code. */
-  if(peek) {
-    handle->body_cb  = write_header_text_ordered;
-    handle->body_arg = &separate_arg;
-    separate_arg.body = NULL;
-    separate_arg.wrote_header = FALSE;
-    separate_arg.out_file = fl;
-    cmdstr = "UID FETCH %u (BODY.PEEK[HEADER] BODY.PEEK[TEXT])";
-  } else {
-    handle->body_cb  = write_nstring;
-    handle->body_arg = fl;
-    cmdstr = "UID FETCH %u RFC822";
-  }
-
-  snprintf(cmd, sizeof(cmd), cmdstr, uid);
+  /* BODY.PEEK[] returns the whole message in one literal, just like
+     RFC822, so it can be written to the file as it arrives. */
+  handle->body_cb  = write_nstring;
+  handle->body_arg = fl;
+  handle->body_chunks = TRUE;
+  snprintf(cmd, sizeof(cmd),
+           peek ? "UID FETCH %u BODY.PEEK[]" : "UID FETCH %u RFC822", uid);
   rc = imap_cmd_exec(handle, cmd);
-  if(peek) {
-    g_free(separate_arg.body); /* This should never be needed. */
-  }
 
   handle->body_cb  = cb;
   handle->body_arg = arg;
+  handle->body_chunks = chunks;
   g_mutex_unlock(&handle->mutex);
   return rc;
 }
@@ -1377,6 +1361,7 @@ imap_mbox_handle_fetch_body(ImapMboxHandle* handle,
   char cmd[200];
   ImapFetchBodyInternalCb fcb;
   void          *farg;
+  gboolean fchunks;
   ImapResponse rc;
   const gchar *peek_string = peek_only ? ".PEEK" : "";
   struct PassHeaderTextOrdered pass_ordered_data;
@@ -1385,6 +1370,7 @@ imap_mbox_handle_fetch_body(ImapMboxHandle* handle,
   IMAP_REQUIRED_STATE1(handle, IMHS_SELECTED, IMR_BAD);
   fcb = handle->body_cb;
   farg = handle->body_arg;
+  fchunks = handle->body_chunks;
 
   /* Use BINARY extension if possible */
   if(handle->enable_binary && options == IMFB_MIME &&
@@ -1397,19 +1383,23 @@ imap_mbox_handle_fetch_body(ImapMboxHandle* handle,
     ibd.first_run = TRUE;
     handle->body_cb = imap_binary_handler;
     handle->body_arg = &ibd;
+    handle->body_chunks = TRUE;
     snprintf(cmd, sizeof(cmd), "FETCH %u BINARY%s[%s]",
              seqno, peek_string, section);
     rc = imap_cmd_exec(handle, cmd);
     if(rc != IMR_NO) { /* unknown-cte */
       handle->body_cb  = fcb;
       handle->body_arg = farg;
+      handle->body_chunks = fchunks;
       g_mutex_unlock(&handle->mutex);
       return rc;
     }
   }
 
+  /* pass_header_text_ordered() needs each section in one piece */
   handle->body_cb  = pass_header_text_ordered;
   handle->body_arg = &pass_ordered_data;
+  handle->body_chunks = FALSE;
   pass_ordered_data.cb = body_cb;
   pass_ordered_data.arg = arg;
   pass_ordered_data.body = NULL;
@@ -1441,6 +1431,62 @@ imap_mbox_handle_fetch_body(ImapMboxHandle* handle,
   g_free(pass_ordered_data.body);
   handle->body_cb  = fcb;
   handle->body_arg = farg;
+  handle->body_chunks = fchunks;
+
+  g_mutex_unlock(&handle->mutex);
+  return rc;
+}
+
+struct PassBody {
+  ImapFetchBodyCb cb;
+  void *arg;
+};
+
+static void
+pass_body(unsigned seqno, ImapFetchBodyType body_type,
+          const char *str, size_t len, void *arg)
+{
+  struct PassBody *pb = (struct PassBody*)arg;
+  pb->cb(seqno, str, len, pb->arg);
+}
+
+/** imap_mbox_handle_fetch_body_range() fetches length octets of the
+    section, in its transfer encoding, starting at offset. This lets
+    large parts be streamed piecewise. The whole section is fetched
+    if length is zero. */
+ImapResponse
+imap_mbox_handle_fetch_body_range(ImapMboxHandle* handle,
+                                  unsigned uid, const char *section,
+                                  size_t offset, size_t length,
+                                  ImapFetchBodyCb body_cb, void *arg)
+{
+  char cmd[200];
+  ImapFetchBodyInternalCb fcb;
+  void          *farg;
+  gboolean fchunks;
+  ImapResponse rc;
+  struct PassBody pb;
+
+  g_mutex_lock(&handle->mutex);
+  IMAP_REQUIRED_STATE1(handle, IMHS_SELECTED, IMR_BAD);
+  fcb = handle->body_cb;
+  farg = handle->body_arg;
+  fchunks = handle->body_chunks;
+
+  pb.cb  = body_cb;
+  pb.arg = arg;
+  handle->body_cb  = pass_body;
+  handle->body_arg = &pb;
+  handle->body_chunks = TRUE;
+  if(length > 0)
+    snprintf(cmd, sizeof(cmd), "UID FETCH %u BODY.PEEK[%s]<%lu.%lu>",
+             uid, section, (unsigned long)offset, (unsigned long)length);
+  else
+    snprintf(cmd, sizeof(cmd), "UID FETCH %u BODY.PEEK[%s]", uid, section);
+  rc = imap_cmd_exec(handle, cmd);
+  handle->body_cb  = fcb;
+  handle->body_arg = farg;
+  handle->body_chunks = fchunks;
 
   g_mutex_unlock(&handle->mutex);
   return rc;
@@ -1467,20 +1513,14 @@ cf_flag(unsigned idx, struct msg_set *csd)
      else return seqno;
 }
 
-static gchar*
-imap_store_prepare(ImapMboxHandle *h, unsigned msgcnt, unsigned*seqno,
-		   ImapMsgFlag flg, gboolean state)
+/* imap_store_local: records the flag change in the local caches and
+   notifies the flags callback. */
+static void
+imap_store_local(ImapMboxHandle *h, unsigned msgcnt, unsigned*seqno,
+                 ImapMsgFlag flg, gboolean state)
 {
-  gchar* cmd, *seq, *str;
-  struct msg_set csd;
   unsigned i;
 
-  csd.handle = h; csd.msgcnt = msgcnt; csd.seqno = seqno;
-  csd.flag = flg; csd.state = state;
-  if(msgcnt == 0) return NULL;
-  seq = imap_coalesce_seq_range(0, msgcnt-1, (ImapCoalesceFunc)cf_flag, &csd);
-  if(!seq) return NULL;
-  str = enum_flag_to_str(flg);
   for(i=0; i<msgcnt; i++) {
     ImapMessage *msg = imap_mbox_handle_get_msg(h, seqno[i]);
     ImapFlagCache *f =
@@ -1499,6 +1539,22 @@ imap_store_prepare(ImapMboxHandle *h, unsigned msgcnt, unsigned*seqno,
   }
   if(h->flags_cb)
     h->flags_cb(msgcnt, seqno, h->flags_arg);
+}
+
+static gchar*
+imap_store_prepare(ImapMboxHandle *h, unsigned msgcnt, unsigned*seqno,
+		   ImapMsgFlag flg, gboolean state)
+{
+  gchar* cmd, *seq, *str;
+  struct msg_set csd;
+
+  csd.handle = h; csd.msgcnt = msgcnt; csd.seqno = seqno;
+  csd.flag = flg; csd.state = state;
+  if(msgcnt == 0) return NULL;
+  seq = imap_coalesce_seq_range(0, msgcnt-1, (ImapCoalesceFunc)cf_flag, &csd);
+  if(!seq) return NULL;
+  str = enum_flag_to_str(flg);
+  imap_store_local(h, msgcnt, seqno, flg, state);
 
   cmd = g_strdup_printf("Store %s %cFlags.Silent (%s)", seq,
                         state ? '+' : '-', str);
@@ -1548,6 +1604,54 @@ imap_mbox_store_flag_a(ImapMboxHandle *h, unsigned msgcnt, unsigned*seqno,
   return rc;
 }
 
+/** Changes the flags of given messages in the local cache only. The
+    change is to be sent to the server later with
+    imap_mbox_uid_store_flag(). */
+void
+imap_mbox_store_flag_local(ImapMboxHandle *h, unsigned msgcnt,
+                           unsigned *seqno, ImapMsgFlag flg, gboolean state)
+{
+  g_mutex_lock(&h->mutex);
+  if(h->state == IMHS_SELECTED)
+    imap_store_local(h, msgcnt, seqno, flg, state);
+  g_mutex_unlock(&h->mutex);
+}
+
+static int
+cmp_uid(const void *a, const void *b)
+{
+  unsigned x = *(const unsigned*)a, y = *(const unsigned*)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/** Stores the flag for the messages with given UIDs in one UID STORE
+    command. The local cache is not touched. The uid array is sorted
+    in place. */
+ImapResponse
+imap_mbox_uid_store_flag(ImapMboxHandle *h, unsigned uidcnt, unsigned *uid,
+                         ImapMsgFlag flg, gboolean state)
+{
+  ImapResponse res;
+  gchar *cmd, *seq, *str;
+
+  if(uidcnt == 0)
+    return IMR_OK;
+  g_mutex_lock(&h->mutex);
+  IMAP_REQUIRED_STATE1(h, IMHS_SELECTED, IMR_BAD);
+  qsort(uid, uidcnt, sizeof(unsigned), cmp_uid);
+  seq = imap_coalesce_set(uidcnt, uid);
+  str = enum_flag_to_str(flg);
+  cmd = g_strdup_printf("UID Store %s %cFlags.Silent (%s)", seq,
+                        state ? '+' : '-', str);
+  g_free(str);
+  g_free(seq);
+  res = imap_cmd_exec(h, cmd);
+  g_free(cmd);
+  g_mutex_unlock(&h->mutex);
+
+  return res;
+}
+
 
 /* 6.4.7 COPY Command */
 /** imap_mbox_handle_copy() copies given set of seqno from the mailbox
@@ -1591,6 +1695,33 @@ imap_mbox_handle_copy(ImapMboxHandle* handle, unsigned cnt, unsigned *seqno,
   return rc;
 }
 
+/** Copies the messages with given UIDs from the mailbox selected in
+    handle to given mailbox on same server in one UID COPY command.
+    The uid array is sorted in place. */
+ImapResponse
+imap_mbox_uid_copy(ImapMboxHandle *h, unsigned uidcnt, unsigned *uid,
+                   const gchar *dest)
+{
+  ImapResponse res;
+  gchar *cmd, *seq, *mbx7;
+
+  if(uidcnt == 0)
+    return IMR_OK;
+  g_mutex_lock(&h->mutex);
+  IMAP_REQUIRED_STATE1(h, IMHS_SELECTED, IMR_BAD);
+  qsort(uid, uidcnt, sizeof(unsigned), cmp_uid);
+  seq = imap_coalesce_set(uidcnt, uid);
+  mbx7 = imap_utf8_to_mailbox(dest);
+  cmd = g_strdup_printf("UID COPY %s \"%s\"", seq, mbx7);
+  g_free(mbx7);
+  g_free(seq);
+  res = imap_cmd_exec(h, cmd);
+  g_free(cmd);
+  g_mutex_unlock(&h->mutex);
+
+  return res;
+}
+
 /* 6.4.8 UID Command */
 /* FIXME: implement */
 /* implemented as alternatives of the commands */
@@ -1699,6 +1830,21 @@ sort_code_to_string(ImapSortKey key)
   return keystr;
 }
 
+static void
+append_no(ImapMboxHandle *handle, unsigned seqno, void *arg)
+{
+  mbox_view_append_no(&handle->mbox_view, seqno);
+}
+
+/* sort_return_opts: with ESORT (RFC 5267), the sorted message numbers
+   are returned as an ESEARCH ALL sequence set, which is much shorter
+   than a SORT response for large mailboxes. */
+static const char*
+sort_return_opts(ImapMboxHandle *handle)
+{
+  return imap_mbox_handle_can_do(handle, IMCAP_ESORT) ? "RETURN (ALL) " : "";
+}
+
 /** executes server side sort. The @param msgno array contains @param
     cnt message numbers. It is subseqently replaced with a new,
     altered order */
@@ -1709,6 +1855,8 @@ imap_mbox_sort_msgno_srv(ImapMboxHandle *handle, ImapSortKey key,
   ImapResponse rc;
   const char *keystr;
   char *seq, *cmd, *cmd1;
+  ImapSearchCb cb;
+  void *arg;
 
   /* IMAP_REQUIRED_STATE1(handle, IMHS_SELECTED, IMR_BAD); */
   if(!imap_mbox_handle_can_do(handle, IMCAP_SORT)) 
@@ -1718,7 +1866,7 @@ imap_mbox_sort_msgno_srv(ImapMboxHandle *handle, ImapSortKey key,
    * string length so we create the command string in two steps. */
   keystr = sort_code_to_string(key);
   seq = imap_coalesce_set(cnt, msgno);
-  cmd= g_strdup_printf("SORT (%s%s) UTF-8 ", 
+  cmd= g_strdup_printf("SORT %s(%s%s) UTF-8 ", sort_return_opts(handle),
                        ascending ? "" : "REVERSE ",
                        keystr);
   cmd1 = g_strconcat(cmd, seq, NULL);
@@ -1727,7 +1875,11 @@ imap_mbox_sort_msgno_srv(ImapMboxHandle *handle, ImapSortKey key,
   handle->mbox_view.entries = 0; /* FIXME: I do not like this! 
                                   * we should not be doing such 
                                   * low level manipulations here */
+  cb  = handle->search_cb;  handle->search_cb  = append_no;
+  arg = handle->search_arg; handle->search_arg = NULL;
   rc = imap_cmd_exec(handle, cmd1);
+  handle->search_cb  = cb;
+  handle->search_arg = arg;
   g_free(cmd1);
 
   if(rc == IMR_OK) {
@@ -1910,12 +2062,6 @@ imap_mbox_sort_msgno(ImapMboxHandle *handle, ImapSortKey key,
   return rc;
 }
 
-static void
-append_no(ImapMboxHandle *handle, unsigned seqno, void *arg)
-{
-  mbox_view_append_no(&handle->mbox_view, seqno);
-}
-
 /** selects a subset of messages specified by given filter and sorts
     it according to specified order. There are four cases possible,
     depending whether filtering needs to be done and whether the SORT
@@ -1960,6 +2106,8 @@ imap_mbox_sort_filter(ImapMboxHandle *handle, ImapSortKey key, int ascending,
     if(imap_mbox_handle_can_do(handle, IMCAP_SORT)) { /* CASE 2a */
       unsigned cmdno;
       const char *keystr;
+      ImapSearchCb cb;
+      void *arg;
       int can_do_literals =
         imap_mbox_handle_can_do(handle, IMCAP_LITERAL);
       ImapCmdTag tag;
@@ -1967,8 +2115,9 @@ imap_mbox_sort_filter(ImapMboxHandle *handle, ImapSortKey key, int ascending,
       cmdno =  imap_make_tag(tag);
       keystr = sort_code_to_string(key);
       if (!imap_handle_idle_disable(handle)) { rc = IMR_SEVERED; goto cleanup; }
-      sio_printf(handle->sio, "%s SORT (%s%s) UTF-8 ", tag,
-                 ascending ? "" : "REVERSE ", keystr);
+      sio_printf(handle->sio, "%s SORT %s(%s%s) UTF-8 ", tag,
+                 sort_return_opts(handle), ascending ? "" : "REVERSE ",
+                 keystr);
 
       handle->mbox_view.entries = 0; /* FIXME: I do not like this! 
                                       * we should not be doing such 
@@ -1982,7 +2131,11 @@ imap_mbox_sort_filter(ImapMboxHandle *handle, ImapSortKey key, int ascending,
       }
       imap_handle_idle_enable(handle, 30);
       net_client_siobuf_flush(handle->sio, NULL);
+      cb  = handle->search_cb;  handle->search_cb  = append_no;
+      arg = handle->search_arg; handle->search_arg = NULL;
       rc = imap_cmd_process_untagged(handle, cmdno);
+      handle->search_cb  = cb;
+      handle->search_arg = arg;
     } else {                                           /* CASE 2b */
       /* try client-side sorting... */
       if(handle->enable_client_sort) {
@@ -93,11 +93,19 @@ ImapResponse imap_mbox_store_flag(ImapMboxHandle *r, unsigned cnt,
 unsigned imap_mbox_store_flag_a(ImapMboxHandle *r, unsigned cnt,
 				unsigned *seqno, ImapMsgFlag flg,
 				gboolean state);
+void imap_mbox_store_flag_local(ImapMboxHandle *r, unsigned cnt,
+                                unsigned *seqno, ImapMsgFlag flg,
+                                gboolean state);
+ImapResponse imap_mbox_uid_store_flag(ImapMboxHandle *r, unsigned cnt,
+                                      unsigned *uid, ImapMsgFlag flg,
+                                      gboolean state);
 
 ImapResponse imap_mbox_handle_copy(ImapMboxHandle* handle,
 				   unsigned cnt, unsigned *seqno,
 				   const gchar *dest,
 				   ImapSequence *ret_sequence);
+ImapResponse imap_mbox_uid_copy(ImapMboxHandle *r, unsigned cnt,
+                                unsigned *uid, const gchar *dest);
 
 ImapResponse imap_mbox_find_unseen(ImapMboxHandle * h, unsigned *msgcnt,
 				   unsigned **msgs);
@@ -112,6 +120,8 @@ ImapResponse imap_mbox_handle_fetch_set(ImapMboxHandle* handle,
                                         unsigned *set, unsigned cnt,
                                         ImapFetchType ift);
 
+/* Large literals may be passed to the callback in several consecutive
+   chunks, as they are read from the server. */
 typedef void (*ImapFetchBodyCb)(unsigned seqno, const char *buf,
 				size_t buflen, void* arg);
 
@@ -132,6 +142,12 @@ ImapResponse imap_mbox_handle_fetch_body(ImapMboxHandle* handle,
                                          ImapFetchBodyOptions options,
                                          ImapFetchBodyCb body_handler,
                                          void *arg);
+ImapResponse imap_mbox_handle_fetch_body_range(ImapMboxHandle* handle,
+                                               unsigned uid,
+                                               const char *section,
+                                               size_t offset, size_t length,
+                                               ImapFetchBodyCb body_handler,
+                                               void *arg);
 
 /* Experimental/Expansion */
 ImapResponse imap_handle_starttls(ImapMboxHandle *handle, GError **error);
@@ -153,6 +169,8 @@ ImapResponse imap_mbox_sort_filter(ImapMboxHandle *handle, ImapSortKey key,
 ImapResponse imap_mbox_filter_msgnos(ImapMboxHandle * handle,
                                      ImapSearchKey *filter,
                                      GHashTable * msgnos);
+ImapResponse imap_mbox_count_unseen(ImapMboxHandle *handle,
+                                    unsigned *count, unsigned *first);
 
 ImapResponse imap_mbox_complete_msgids(ImapMboxHandle *handle,
 				       GPtrArray *msgids,
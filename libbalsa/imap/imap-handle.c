@@ -304,7 +304,7 @@ async_process_real(ImapMboxHandle *h)
 	g_debug("%s: ENTER", __func__);
 	async_cmd = cmdi_get_pending(h->cmd_info);
 	g_debug("%s: enter loop, cmnd %u", __func__, async_cmd);
-	while (net_client_can_read(NET_CLIENT(h->sio))) {
+	while (net_client_siobuf_can_read(h->sio)) {
 		rc = imap_cmd_step(h, async_cmd);
 		if (h->idle_state == IDLE_RESPONSE_PENDING) {
 			int c;
@@ -428,6 +428,8 @@ imap_cmd_issue(ImapMboxHandle* h, const char* cmd)
   g_return_val_if_fail(h, IMR_BAD);
   if (h->state == IMHS_DISCONNECTED)
     return IMR_SEVERED;
+  if (h->replica)
+    return IMR_NO;
 
   /* create sequence for command */
   if (!imap_handle_idle_disable(h)) return IMR_SEVERED;
@@ -501,6 +503,8 @@ void
 imap_handle_disconnect(ImapMboxHandle *h)
 {
   gboolean G_GNUC_UNUSED dummy;
+  if(h->replica) /* never connected */
+    return;
   dummy = imap_handle_idle_disable(h);
   if(h->sio) {
     g_object_unref(h->sio); h->sio = NULL;
@@ -595,6 +599,42 @@ imap_mbox_handle_reconnect(ImapMboxHandle* h, gboolean *readonly)
   return rc;
 }
 
+/** Creates a handle that has mailbox mbox selected but no connection:
+    a replica that the client builds from its own caches while the
+    server cannot be reached. The client restores the messages with
+    imap_mbox_handle_msg_deserialize() and their flags with
+    imap_mbox_handle_replica_set_flags(); the flags can be changed
+    locally with imap_mbox_store_flag_local(). Every command fails with
+    IMR_NO, and the handle cannot be reconnected. */
+ImapMboxHandle*
+imap_mbox_handle_new_replica(const char *mbox, unsigned exists,
+                             unsigned uidval, unsigned uidnext)
+{
+  ImapMboxHandle *h = imap_mbox_handle_new();
+
+  h->replica = 1;
+  h->mbox    = g_strdup(mbox);
+  h->state   = IMHS_SELECTED;
+  h->uidval  = uidval;
+  h->uidnext = uidnext;
+  /* There is nobody to ask: no extensions, sort on the client. */
+  h->has_capabilities = TRUE;
+  h->capabilities[IMCAP_IMAP4REV1] = 1;
+  h->can_fetch_body = 0;
+  h->enable_client_sort = 1;
+  h->enable_idle = 0;
+  imap_mbox_resize_cache(h, exists);
+  imap_mbox_handle_set_msg(h, _("The mailbox is offline."));
+
+  return h;
+}
+
+gboolean
+imap_mbox_handle_is_replica(ImapMboxHandle *h)
+{
+  return h->replica;
+}
+
 /** Drops the connection without waiting for response.  This can be
     called when eg a signal from NetworkManager arrives. */
 void
@@ -722,45 +762,122 @@ imap_make_tag(ImapCmdTag tag)
   return no;
 }
 
+#define IS_FLAG_CHAR(c) (strchr("(){ %*\"]",(c))==NULL&&(c)>0x1f&&(c)!=0x7f)
+/* we include '+' in TAG_CHAR because we want to treat forced responses
+   in same code. This may be wrong. Reconsider.
+*/
+#define IS_TAG_CHAR(c) (strchr("(){ %\"\\]",(c))==NULL&&(c)>0x1f&&(c)!=0x7f)
+/* see the spec for the definition of astring */
+#define IS_ASTRING_CHAR(c) (strchr("(){ %*\"\\", (c))==0&&(c)>0x1F&&(c)!=0x7F)
+
+/* The tokenizer scans the connection buffer a span at a time, looking
+   up each byte in a table of character classes, instead of calling
+   sio_getc() for every character. */
+enum {
+  IMAP_CC_ATOM    = 1 << 0,
+  IMAP_CC_FLAG    = 1 << 1,
+  IMAP_CC_TAG     = 1 << 2,
+  IMAP_CC_ASTRING = 1 << 3,
+  IMAP_CC_QTEXT   = 1 << 4  /* unescaped chars of a quoted string */
+};
+
+static guint8 imap_char_class[256];
+
+static void
+imap_char_class_init(void)
+{
+  static gsize initialized = 0;
+
+  if(g_once_init_enter(&initialized)) {
+    int c;
+    for(c=0; c<256; c++) {
+      guint8 cc = 0;
+      if(c != 0) {
+        if(IS_ATOM_CHAR(c))    cc |= IMAP_CC_ATOM;
+        if(IS_FLAG_CHAR(c))    cc |= IMAP_CC_FLAG;
+        if(IS_TAG_CHAR(c))     cc |= IMAP_CC_TAG;
+        if(IS_ASTRING_CHAR(c)) cc |= IMAP_CC_ASTRING;
+      }
+      if(c != '"' && c != '\\') cc |= IMAP_CC_QTEXT;
+      imap_char_class[c] = cc;
+    }
+    g_once_init_leave(&initialized, 1);
+  }
+}
+
+/* imap_get_span() reads characters of class cc into dest of size len.
+   Like the sio_getc() loop it replaces, it returns the first
+   character not in the class, which is consumed, or the last
+   character stored when dest is full, or -1 on EOF. */
 static int
-imap_get_atom(NetClientSioBuf *sio, char* atom, size_t len)
+imap_get_span(NetClientSioBuf *sio, guint8 cc, char *dest, size_t len)
 {
-  unsigned i;
+  size_t i = 0;
   int c = 0;
-  for(i=0; i<len-1 && (c=sio_getc(sio)) >=0 && IS_ATOM_CHAR(c); i++)
-    atom[i] = c;
 
-  atom[i] = '\0';
+  imap_char_class_init();
+  while(i < len-1) {
+    gsize avail, n;
+    const gchar *span = sio_peek(sio, &avail);
+
+    if(!span) { c = -1; break; }
+    for(n=0; n<avail && n<len-1-i && (imap_char_class[(guchar)span[n]] & cc);
+        n++)
+      ;
+    memcpy(dest+i, span, n);
+    i += n;
+    if(n<avail && i<len-1) { /* stopped at a delimiter */
+      c = (guchar)span[n];
+      sio_skip(sio, n+1);
+      break;
+    }
+    if(n>0) c = (guchar)span[n-1];
+    sio_skip(sio, n);
+  }
+  dest[i] = '\0';
   return c;
 }
 
-#define IS_FLAG_CHAR(c) (strchr("(){ %*\"]",(c))==NULL&&(c)>0x1f&&(c)!=0x7f)
+/* imap_append_span() appends characters of class cc to dest and
+   returns the first character not in the class, which is consumed,
+   or -1 on EOF. */
+static int
+imap_append_span(NetClientSioBuf *sio, guint8 cc, GString *dest)
+{
+  imap_char_class_init();
+  for(;;) {
+    gsize avail, n;
+    const gchar *span = sio_peek(sio, &avail);
+
+    if(!span) return -1;
+    for(n=0; n<avail && (imap_char_class[(guchar)span[n]] & cc); n++)
+      ;
+    g_string_append_len(dest, span, n);
+    if(n<avail) {
+      int c = (guchar)span[n];
+      sio_skip(sio, n+1);
+      return c;
+    }
+    sio_skip(sio, n);
+  }
+}
+
+static int
+imap_get_atom(NetClientSioBuf *sio, char* atom, size_t len)
+{
+  return imap_get_span(sio, IMAP_CC_ATOM, atom, len);
+}
+
 static int
 imap_get_flag(NetClientSioBuf *sio, char* flag, size_t len)
 {
-  unsigned i;
-  int c = 0;
-  for(i=0; i<len-1 && (c=sio_getc(sio)) >=0 && IS_FLAG_CHAR(c); i++) {
-    flag[i] = c;
-  }
-  flag[i] = '\0';
-  return c;
+  return imap_get_span(sio, IMAP_CC_FLAG, flag, len);
 }
 
-/* we include '+' in TAG_CHAR because we want to treat forced responses
-   in same code. This may be wrong. Reconsider.
-*/
-#define IS_TAG_CHAR(c) (strchr("(){ %\"\\]",(c))==NULL&&(c)>0x1f&&(c)!=0x7f)
 static int
 imap_cmd_get_tag(NetClientSioBuf *sio, char* tag, size_t len)
 {
-  unsigned i;
-  int c = 0;
-  for(i=0; i<len-1 && (c=sio_getc(sio)) >=0 && IS_TAG_CHAR(c); i++) {
-    tag[i] = c;
-  }
-  tag[i] = '\0';
-  return c;
+  return imap_get_span(sio, IMAP_CC_TAG, tag, len);
 }
 
   
@@ -1641,13 +1758,66 @@ imap_message_free(ImapMessage *msg)
   g_free(msg);
 }
 
+/** Restores message msgno from serialized data. A message that is
+    already known but has no envelope yet, typically created by an
+    unsolicited FETCH FLAGS, is completed from the data; the fields
+    obtained from the server in this session take precedence. */
 void
 imap_mbox_handle_msg_deserialize(ImapMboxHandle *h, unsigned msgno,
                                  void *data)
 {
-  if(msgno>=1 && msgno <=h->exists && !h->msg_cache[msgno-1])
-    h->msg_cache[msgno-1] = imap_message_deserialize(data);
+  ImapMessage *imsg, *cached;
+  ImapFlagCache *flags;
+
+  if(msgno<1 || msgno>h->exists)
+    return;
+  imsg = h->msg_cache[msgno-1];
+  flags = &g_array_index(h->flag_cache, ImapFlagCache, msgno-1);
+  if(!imsg) {
+    h->msg_cache[msgno-1] = cached = imap_message_deserialize(data);
+    if(flags->known_flags == (ImapMsgFlag)~0)
+      cached->flags = flags->flag_values;
+    return;
+  }
+  if(imsg->envelope)
+    return;
+
+  cached = imap_message_deserialize(data);
+  if(imsg->uid != 0 && imsg->uid != cached->uid) {
+    imap_message_free(cached);
+    return;
+  }
+  if(flags->known_flags == (ImapMsgFlag)~0)
+    cached->flags = imsg->flags;
+  if(imsg->rfc822size >= 0)
+    cached->rfc822size = imsg->rfc822size;
+  if(imsg->internal_date)
+    cached->internal_date = imsg->internal_date;
+  if(imsg->body && !cached->body) {
+    cached->body = imsg->body;
+    imsg->body = NULL;
+  }
+  imap_message_free(imsg);
+  h->msg_cache[msgno-1] = cached;
+}
+/** Sets the flags of message msgno of a replica, which cannot ask
+    the server for them. */
+void
+imap_mbox_handle_replica_set_flags(ImapMboxHandle *h, unsigned msgno,
+                                   ImapMsgFlags flags)
+{
+  ImapFlagCache *f;
+
+  g_return_if_fail(h->replica);
+  if(msgno<1 || msgno>h->exists)
+    return;
+  f = &g_array_index(h->flag_cache, ImapFlagCache, msgno-1);
+  f->flag_values = flags;
+  f->known_flags = ~0;
+  if(h->msg_cache[msgno-1])
+    h->msg_cache[msgno-1]->flags = flags;
 }
+
 /* Serialize message itself and the envelope, and the body structure
    if available. */
 struct ImapMsgSerialized {
@@ -1735,6 +1905,21 @@ imap_serialized_message_size(void *data)
   return imes->total_size;
 }
 
+/** Updates the flags stored in serialized message data. */
+void
+imap_serialized_message_set_flags(void *data, ImapMsgFlags flags)
+{
+  struct ImapMsgSerialized *imes = (struct ImapMsgSerialized*)data;
+  imes->flags = flags;
+}
+
+ImapMsgFlags
+imap_serialized_message_get_flags(void *data)
+{
+  struct ImapMsgSerialized *imes = (struct ImapMsgSerialized*)data;
+  return imes->flags;
+}
+
 /* =================================================================== */
 /*                Imap command processing routines                     */
 /* =================================================================== */
@@ -1762,7 +1947,7 @@ imap_cmd_start(ImapMboxHandle* handle, const char* cmd, unsigned *cmdno)
   ImapCmdTag tag;
   g_return_val_if_fail(handle, -1);
   
-  if(IMAP_MBOX_IS_DISCONNECTED(handle))
+  if(IMAP_MBOX_IS_DISCONNECTED(handle) || handle->replica)
     return -1;
 
   *cmdno = imap_make_tag(tag);
@@ -1877,6 +2062,8 @@ imap_cmd_exec_cmdno(ImapMboxHandle* handle, const char* cmd,
   g_return_val_if_fail(handle, IMR_BAD);
   if (handle->state == IMHS_DISCONNECTED)
     return IMR_SEVERED;
+  if (handle->replica)
+    return IMR_NO; /* no server to send it to */
 
   /* create sequence for command */
   if (!imap_handle_idle_disable(handle)) return IMR_SEVERED;
@@ -1914,6 +2101,8 @@ imap_cmd_exec_cmds(ImapMboxHandle* handle, const char** cmds,
   g_return_val_if_fail(handle, IMR_BAD);
   if (handle->state == IMHS_DISCONNECTED)
     return IMR_SEVERED;
+  if (handle->replica)
+    return IMR_NO;
 
   if (!imap_handle_idle_disable(handle)) return IMR_SEVERED;
 
@@ -1953,19 +2142,36 @@ imap_cmd_exec_cmds(ImapMboxHandle* handle, const char** cmds,
   return ret_rc;
 }
 
+/* reads the length of a literal, which must follow the opening '{',
+   and the CRLF after it; returns -1 on error. */
+static int
+imap_get_literal_length(NetClientSioBuf *sio)
+{
+  char buf[15];
+  int c, len;
+
+  c = imap_get_atom(sio, buf, sizeof(buf));
+  len = strlen(buf); 
+  if(len==0 || buf[len-1] != '}') return -1;
+  buf[len-1] = '\0';
+  len = strtol(buf, NULL, 10);
+  if( c != 0x0d) { g_debug("lit1:%d",c); return -1;}
+  if( (c=sio_getc(sio)) != 0x0a) { g_debug("lit1:%d",c); return -1;}
+  return len;
+}
+
 static GString*
 imap_get_string_with_lookahead(NetClientSioBuf *sio, int c)
 { /* string */  
   GString *res = NULL;
   if(c=='"') { /* quoted */
     res = g_string_new("");
-    while( (c=sio_getc(sio)) != '"' && c != EOF) {
-      if(c== '\\')
-        c = sio_getc(sio);
+    while( (c=imap_append_span(sio, IMAP_CC_QTEXT, res)) == '\\') {
+      if( (c=sio_getc(sio)) == EOF)
+        break;
       g_string_append_c(res, c);
     }
   } else { /* this MUST be literal */
-    char buf[15];
     int len;
     if(c=='~') /* BINARY extension literal8 indicator */
       c = sio_getc(sio);
@@ -1973,13 +2179,8 @@ imap_get_string_with_lookahead(NetClientSioBuf *sio, int c)
       return NULL; /* ERROR */
     }
 
-    c = imap_get_atom(sio, buf, sizeof(buf));
-    len = strlen(buf); 
-    if(len==0 || buf[len-1] != '}') return NULL;
-    buf[len-1] = '\0';
-    len = strtol(buf, NULL, 10);
-    if( c != 0x0d) { g_debug("lit1:%d",c); return NULL;}
-    if( (c=sio_getc(sio)) != 0x0a) { g_debug("lit1:%d",c); return NULL;}
+    if( (len = imap_get_literal_length(sio)) < 0)
+      return NULL;
     res = g_string_sized_new(len+1);
     if(len>0) sio_read(sio, res->str, len);
     res->len = len;
@@ -2018,21 +2219,17 @@ imap_get_nstring(NetClientSioBuf *sio)
 }
 
 /* see the spec for the definition of astring */
-#define IS_ASTRING_CHAR(c) (strchr("(){ %*\"\\", (c))==0&&(c)>0x1F&&(c)!=0x7F)
 static char*
 imap_get_astring(NetClientSioBuf *sio, int* lookahead)
 {
   char* res;
   int c = sio_getc(sio);
 
-  if(IS_ASTRING_CHAR(c)) {
+  if(c != EOF && IS_ASTRING_CHAR(c)) {
     GString *str = g_string_new("");
-    do {
-      g_string_append_c(str, c);
-      c = sio_getc(sio);
-    } while(IS_ASTRING_CHAR(c));
+    g_string_append_c(str, c);
+    *lookahead = imap_append_span(sio, IMAP_CC_ASTRING, str);
     res = g_string_free(str, FALSE);
-    *lookahead = c;
   } else {
     res = g_string_free(imap_get_string_with_lookahead(sio, c), FALSE);
     *lookahead = sio_getc(sio);
@@ -2041,15 +2238,64 @@ imap_get_astring(NetClientSioBuf *sio, int* lookahead)
 }
 
 /* nstring / literal8 as in the BINARY extension */
-static GString*
-imap_get_binary_string(NetClientSioBuf *sio)
+struct BodyChunkData {
+  unsigned seqno;
+  ImapFetchBodyType body_type;
+  ImapFetchBodyInternalCb body_cb;
+  void *body_arg;
+};
+
+static gboolean
+pass_body_chunk(const gchar *buf, gsize len, gpointer arg)
 {
-  int c = sio_getc(sio);
+  struct BodyChunkData *bcd = (struct BodyChunkData*)arg;
+  bcd->body_cb(bcd->seqno, bcd->body_type, buf, len, bcd->body_arg);
+  return TRUE;
+}
+
+/* reads a body string, nil being the empty string, and passes it to
+   the body callback of the handle, if any. When the handle asks for
+   chunks, literals are passed piecewise straight from the connection
+   buffer and never collected in memory. */
+static ImapResponse
+imap_pass_body_string(ImapMboxHandle *h, unsigned seqno,
+                      ImapFetchBodyType body_type)
+{
+  int c = sio_getc(h->sio);
+  GString *bs;
+
+  if(h->body_chunks && h->body_cb && (c == '{' || c == '~')) {
+    struct BodyChunkData bcd;
+    int len;
+
+    if(c=='~') /* BINARY extension literal8 indicator */
+      c = sio_getc(h->sio);
+    if(c!='{' || (len = imap_get_literal_length(h->sio)) < 0)
+      return IMR_PROTOCOL;
+    if(len == 0) {
+      h->body_cb(seqno, body_type, "", 0, h->body_arg);
+      return IMR_OK;
+    }
+    bcd.seqno = seqno;
+    bcd.body_type = body_type;
+    bcd.body_cb = h->body_cb;
+    bcd.body_arg = h->body_arg;
+    return net_client_siobuf_read_to_sink(h->sio, len, pass_body_chunk,
+                                          &bcd, NULL)
+      ? IMR_OK : IMR_PROTOCOL;
+  }
+
   if(toupper(c)=='N') { /* nil */
-    sio_getc(sio); sio_getc(sio); /* ignore i and l */
-    return g_string_new("");
+    sio_getc(h->sio); sio_getc(h->sio); /* ignore i and l */
+    bs = g_string_new("");
   } else
-    return imap_get_string_with_lookahead(sio, c);
+    bs = imap_get_string_with_lookahead(h->sio, c);
+  if(bs) {
+    if(h->body_cb)
+      h->body_cb(seqno, body_type, bs->str, bs->len, h->body_arg);
+    g_string_free(bs, TRUE);
+  }
+  return IMR_OK;
 }
 
 /* this file contains all the response handlers as defined in
@@ -2094,7 +2340,7 @@ ir_capability_data(ImapMboxHandle *handle)
     "AUTH=ANONYMOUS", "AUTH=CRAM-MD5", "AUTH=GSSAPI", "AUTH=PLAIN",
     "ACL", "RIGHTS=", "BINARY", "CHILDREN",
     "COMPRESS=DEFLATE",
-    "ESEARCH", "IDLE", "LITERAL+",
+    "ESEARCH", "ESORT", "IDLE", "LITERAL+", "LITERAL-",
     "LOGINDISABLED", "MULTIAPPEND", "NAMESPACE", "QUOTA", "SASL-IR",
     "SCAN", "STARTTLS",
     "SORT", "THREAD=ORDEREDSUBJECT", "THREAD=REFERENCES",
@@ -2494,8 +2740,15 @@ esearch_cb(ImapUidRange *iur, void *arg)
 {
   ImapMboxHandle *h = (ImapMboxHandle*)arg;
   unsigned i;
-  for(i=iur->lo; i<= iur->hi; i++)
+
+  if(!h->search_cb)
+    return;
+  /* ESORT results keep the sort order, so ranges may be descending. */
+  for(i=iur->lo; ; i += iur->lo <= iur->hi ? 1 : -1) {
     h->search_cb(h, i, h->search_arg);
+    if(i == iur->hi)
+      break;
+  }
 }
 
 /** Process ESEARCH response. Consult RFC4466 and RFC4731 before
@@ -2537,12 +2790,27 @@ ir_esearch(ImapMboxHandle *h)
   while(c == ' ') { /* search-return-data in rfc4466 speak */
     ImapResponse rc;
     /* atom contains search-modifier-name, time to fetch
-       search-return-value. In ESEARCH, it is always an
+       search-return-value. MIN, MAX and COUNT are numbers, the
+       others are
        tagged-ext-simple=sequence-set/number, which are an atoms, so
        we cut the corners here. We get values in chunks.  The chunk
        size is pretty arbitrary as long as it can fit two largest
        possible 32-bit unsigned numbers and a colon. */
-    if ( (rc=imap_get_sequence(h, esearch_cb, h)) != IMR_OK)
+    if(g_ascii_strcasecmp(atom, "MIN") == 0 ||
+       g_ascii_strcasecmp(atom, "MAX") == 0 ||
+       g_ascii_strcasecmp(atom, "COUNT") == 0) {
+      char num[12];
+      unsigned value;
+      c = imap_get_atom(h->sio, num, sizeof(num));
+      if(c == EOF) return IMR_SEVERED;
+      value = strtoul(num, NULL, 10);
+      switch(g_ascii_toupper(atom[1])) {
+      case 'I': h->esearch.min   = value; break;
+      case 'A': h->esearch.max   = value; break;
+      default:  h->esearch.count = value; break;
+      }
+      sio_ungetc(h->sio);
+    } else if ( (rc=imap_get_sequence(h, esearch_cb, h)) != IMR_OK)
       return rc;
 
     if( (c=sio_getc(h->sio)) == ' ')
@@ -3137,11 +3405,7 @@ ir_msg_att_internaldate(ImapMboxHandle *h, int c, unsigned seqno)
 static ImapResponse
 ir_msg_att_rfc822(ImapMboxHandle *h, int c, unsigned seqno)
 {
-  gchar *str = imap_get_nstring(h->sio);
-  if(str && h->body_cb)
-    h->body_cb(seqno, IMAP_BODY_TYPE_RFC822, str, strlen(str), h->body_arg);
-  g_free(str);
-  return IMR_OK;
+  return imap_pass_body_string(h, seqno, IMAP_BODY_TYPE_RFC822);
 }
 
 static ImapResponse
@@ -3822,12 +4086,11 @@ ir_body (NetClientSioBuf *sio, int c, ImapBody * body,
 
 /* read [section] and following string. FIXME: other kinds of body. */ 
 static ImapResponse
-ir_body_section(NetClientSioBuf *sio, unsigned seqno,
-		ImapFetchBodyType body_type,
-		ImapFetchBodyInternalCb body_cb, void *arg)
+ir_body_section(ImapMboxHandle *h, unsigned seqno,
+		ImapFetchBodyType body_type)
 {
+  NetClientSioBuf *sio = h->sio;
   char buf[80];
-  GString *bs;
   int i, c = imap_get_atom(sio, buf, sizeof(buf));
 
   for(i=0; buf[i] && (isdigit((int)buf[i]) || buf[i] == '.'); i++)
@@ -3836,14 +4099,15 @@ ir_body_section(NetClientSioBuf *sio, unsigned seqno,
     body_type = IMAP_BODY_TYPE_HEADER;
 
   if(c != ']') { g_debug("] expected"); return IMR_PROTOCOL; }
-  if(sio_getc(sio) != ' ') { g_debug("space expected"); return IMR_PROTOCOL;}
-  bs = imap_get_binary_string(sio);
-  if(bs) {
-    if(bs->str && body_cb)
-      body_cb(seqno, body_type, bs->str, bs->len, arg);
-    g_string_free(bs, TRUE);
+  c = sio_getc(sio);
+  if(c == '<') { /* partial fetch: skip the <origin> */
+    while((c = sio_getc(sio)) != EOF && isdigit(c))
+      ;
+    if(c != '>') { g_debug("> expected"); return IMR_PROTOCOL; }
+    c = sio_getc(sio);
   }
-  return IMR_OK;
+  if(c != ' ') { g_debug("space expected"); return IMR_PROTOCOL;}
+  return imap_pass_body_string(h, seqno, body_type);
 }
 
 static ImapResponse
@@ -3891,19 +4155,21 @@ ir_msg_att_body(ImapMboxHandle *h, int c, unsigned seqno)
     c = sio_getc (h->sio);
     sio_ungetc (h->sio);
     if(isdigit (c)) {
-      rc = ir_body_section(h->sio, seqno, IMAP_BODY_TYPE_BODY,
-			   h->body_cb, h->body_arg);
+      rc = ir_body_section(h, seqno, IMAP_BODY_TYPE_BODY);
       break;
     }
     c = imap_get_atom(h->sio, buf, sizeof buf);
-    if (c == ']' &&
+    if (c == ']' && buf[0] == '\0') { /* BODY[]: the whole message */
+      sio_ungetc (h->sio); /* put the ']' back */
+      rc = ir_body_section(h, seqno, IMAP_BODY_TYPE_RFC822);
+    } else if (c == ']' &&
         (g_ascii_strcasecmp(buf, "HEADER") == 0 ||
          g_ascii_strcasecmp(buf, "TEXT") == 0)) {
       ImapFetchBodyType body_type = 
 	(g_ascii_strcasecmp(buf, "TEXT") == 0)
 	? IMAP_BODY_TYPE_TEXT : IMAP_BODY_TYPE_HEADER;
       sio_ungetc (h->sio); /* put the ']' back */
-      rc = ir_body_section(h->sio, seqno, body_type, h->body_cb, h->body_arg);
+      rc = ir_body_section(h, seqno, body_type);
     } else {
       if (c == ' ' && 
           (g_ascii_strcasecmp(buf, "HEADER.FIELDS") == 0 ||
@@ -67,8 +67,10 @@ typedef enum
   IMCAP_CHILDREN,               /* RFC 3348 */
   IMCAP_COMPRESS_DEFLATE,       /* RFC 4978 */
   IMCAP_ESEARCH,                /* RFC 4731 */
+  IMCAP_ESORT,                  /* RFC 5267 */
   IMCAP_IDLE,                   /* RFC 2177 */
   IMCAP_LITERAL,                /* RFC 2088 */
+  IMCAP_LITERAL_MINUS,          /* RFC 7888 */
   IMCAP_LOGINDISABLED,		/* RFC 2595 */
   IMCAP_MULTIAPPEND,            /* RFC 3502 */
   IMCAP_NAMESPACE,              /* RFC 2342: IMAP4 Namespace */
@@ -133,6 +135,11 @@ ImapResult imap_mbox_handle_connect(ImapMboxHandle* r, const char *hst);
 ImapResult imap_mbox_handle_reconnect(ImapMboxHandle* r,
                                       gboolean *readonly);
 void imap_handle_force_disconnect(ImapMboxHandle *h);
+ImapMboxHandle *imap_mbox_handle_new_replica(const char *mbox,
+                                             unsigned exists,
+                                             unsigned uidval,
+                                             unsigned uidnext);
+gboolean imap_mbox_handle_is_replica(ImapMboxHandle *h);
 
 NetClientCryptMode imap_handle_set_tls_mode(ImapMboxHandle *h, NetClientCryptMode option);
 
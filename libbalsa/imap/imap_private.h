@@ -104,9 +104,14 @@ struct _ImapMboxHandle {
   void *flags_arg;
   ImapFetchBodyInternalCb body_cb;
   void *body_arg;
+  gboolean body_chunks; /* pass literals to body_cb in chunks, as they
+                         * are read, instead of collecting them first */
 
   ImapSearchCb search_cb;
   void *search_arg;
+  struct {
+    unsigned min, max, count; /* ESEARCH MIN, MAX and COUNT results */
+  } esearch;
 
   GHashTable *status_resps; /* A hash of STATUS responses that we wait for */
 
@@ -128,6 +133,8 @@ struct _ImapMboxHandle {
   unsigned enable_compress:1; /**< enable compress extension */
   unsigned enable_idle:1;     /**< use IDLE - no problem with firewalls */
   unsigned has_rights:1;      /**< whether rights are up-to-date. */
+  unsigned replica:1;         /**< no connection, see
+                               * imap_mbox_handle_new_replica() */
 
   ImapAclType rights;         /**< my rights (RFC 4314) */
   GList *acls;                /**< acl's (RFC 4314) */
@@ -183,6 +190,7 @@ ImapResponse imap_cmd_exec_cmds(ImapMboxHandle* handle, const char** cmds,
 
 ImapResponse imap_cmd_issue(ImapMboxHandle* handle, const char* cmd);
 
+gboolean imap_handle_literal_nonsync(ImapMboxHandle *h, size_t len);
 ImapResponse imap_write_key(ImapMboxHandle *handle, ImapSearchKey *s,
                             unsigned cmdno, int use_literal);
 ImapResponse imap_search_exec_unlocked(ImapMboxHandle *h, gboolean uid, 
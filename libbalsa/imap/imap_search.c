@@ -306,10 +306,11 @@ imap_write_key_string(ImapMboxHandle *handle, ImapSearchKey *k,
     sio_write(handle->sio, " ", 1);
   }
   /* Here comes the difficult part: writing the string. If the server
-     does not support LITERAL+, we have to either use quoting or use
-     synchronizing literals which are somewhat painful. That's the
-     life! */
-  if(use_literal)
+     does not support LITERAL+ (or LITERAL- for short strings), we have
+     to either use quoting or use synchronizing literals which are
+     somewhat painful. That's the life! */
+  if(use_literal ||
+     imap_handle_literal_nonsync(handle, strlen(k->d.string.s)))
     sio_printf(handle->sio, "{%u+}\r\n%s",
                (unsigned)strlen(k->d.string.s), k->d.string.s);
   else { /* No literal+ suppport, do it the old way */
@@ -266,9 +266,13 @@ ImapMessage *imap_message_new(void);
 void imap_message_free(ImapMessage *);
 void imap_mbox_handle_msg_deserialize(ImapMboxHandle *h, unsigned msgno,
                                       void *data);
+void imap_mbox_handle_replica_set_flags(ImapMboxHandle *h, unsigned msgno,
+                                        ImapMsgFlags flags);
 void*        imap_message_serialize(ImapMessage *);
 ImapMessage* imap_message_deserialize(void *data);
 size_t imap_serialized_message_size(void *data);
+void imap_serialized_message_set_flags(void *data, ImapMsgFlags flags);
+ImapMsgFlags imap_serialized_message_get_flags(void *data);
 
 /* RFC 4314: IMAP ACL's */
 typedef enum {
@@ -27,6 +27,8 @@
 #define sio_getc(sio)						net_client_siobuf_getc(sio, NULL)
 #define sio_ungetc(sio)						net_client_siobuf_ungetc(sio)
 #define sio_gets(sio, buf, buflen)			net_client_siobuf_gets(sio, buf, buflen, NULL)
+#define sio_peek(sio, countp)				net_client_siobuf_peek(sio, countp, NULL)
+#define sio_skip(sio, count)				net_client_siobuf_skip(sio, count)
 #define sio_write(sio, buf, buflen)			net_client_siobuf_write(sio, buf, buflen)
 #define sio_printf(sio, format, ...)		net_client_siobuf_printf(sio, format, ##__VA_ARGS__)
 
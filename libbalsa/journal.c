@@ -0,0 +1,325 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2016 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+  The journal behind the append-only logs of Balsa: each record is
+  appended as it is made, the owner replays the records when it loads
+  the log, and the log is compacted when it has grown much larger
+  than the live records.
+
+  The file is opened for appending when the first record is written;
+  a new file gets the header first. After a failed write, nothing more
+  is written, as a record missing in the middle of the log would
+  change the meaning of the following ones; the error is reported by
+  libbalsa_journal_sync(). A log cut short by a crash is the owner's
+  to handle: it must ignore an incomplete last record when replaying.
+
+  Compaction writes the live contents to a temporary file, which then
+  replaces the log. If that fails, the old log is kept and appended to.
+*/
+
+#if defined(HAVE_CONFIG_H) && HAVE_CONFIG_H
+# include "config.h"
+#endif                          /* HAVE_CONFIG_H */
+#include "journal.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+struct _LibBalsaJournal {
+    gchar *path;
+    gchar *header;
+    gsize header_len;
+    LibBalsaJournalSync sync;
+    guint slack;
+
+    FILE *log;
+    guint records;
+    gboolean broken;            /* a write failed, the log is closed */
+    gint error;                 /* errno of the first failure */
+
+    FILE *tmp;                  /* the new log while compacting */
+    gboolean tmp_failed;
+};
+
+static void
+lbj_set_error(LibBalsaJournal *journal, gint error)
+{
+    if (journal->error == 0)
+        journal->error = error != 0 ? error : EIO;
+}
+
+static gboolean
+lbj_open(LibBalsaJournal *journal)
+{
+    if (journal->log != NULL)
+        return TRUE;
+    if (journal->broken)
+        return FALSE;
+
+    journal->log = fopen(journal->path, "ab");
+    if (journal->log != NULL &&
+        fseek(journal->log, 0, SEEK_END) == 0 &&
+        (ftell(journal->log) > 0 || journal->header_len == 0 ||
+         fwrite(journal->header, 1, journal->header_len, journal->log)
+         == journal->header_len))
+        return TRUE;
+
+    lbj_set_error(journal, errno);
+    if (journal->log != NULL)
+        fclose(journal->log);
+    journal->log = NULL;
+    journal->broken = TRUE;
+    g_debug("%s: cannot write %s", __func__, journal->path);
+
+    return FALSE;
+}
+
+static gboolean
+lbj_sync_file(FILE *f)
+{
+    return fflush(f) == 0 && fsync(fileno(f)) == 0;
+}
+
+/* Public methods */
+
+/* libbalsa_journal_new() sets up the journal in path, whose records
+   follow the header of header_len bytes. The log is to be compacted
+   when it holds more than twice the live records plus slack. */
+LibBalsaJournal *
+libbalsa_journal_new(const gchar *path, gconstpointer header,
+                     gsize header_len, LibBalsaJournalSync sync,
+                     guint slack)
+{
+    LibBalsaJournal *journal;
+
+    g_return_val_if_fail(path != NULL, NULL);
+
+    journal = g_new0(LibBalsaJournal, 1);
+    journal->path = g_strdup(path);
+    journal->header = g_malloc(header_len + 1);
+    if (header_len > 0)
+        memcpy(journal->header, header, header_len);
+    journal->header_len = header_len;
+    journal->sync = sync;
+    journal->slack = slack;
+
+    return journal;
+}
+
+/* libbalsa_journal_read() returns the records in the log, i.e. its
+   contents after the header, nul-terminated. Returns FALSE if there is
+   no log or if it does not start with the header. */
+gboolean
+libbalsa_journal_read(LibBalsaJournal *journal, gchar **contents,
+                      gsize *length)
+{
+    gchar *data;
+    gsize len;
+
+    g_return_val_if_fail(journal != NULL && contents != NULL, FALSE);
+
+    if (!g_file_get_contents(journal->path, &data, &len, NULL))
+        return FALSE;
+    if (len < journal->header_len ||
+        memcmp(data, journal->header, journal->header_len) != 0) {
+        g_free(data);
+        return FALSE;
+    }
+
+    len -= journal->header_len;
+    memmove(data, data + journal->header_len, len + 1);
+    *contents = data;
+    if (length != NULL)
+        *length = len;
+
+    return TRUE;
+}
+
+/* libbalsa_journal_replayed() tells the journal how many records the
+   owner has read from the log. */
+void
+libbalsa_journal_replayed(LibBalsaJournal *journal, guint records)
+{
+    g_return_if_fail(journal != NULL);
+
+    journal->records = records;
+}
+
+/* libbalsa_journal_append() writes one record. Returns FALSE if it
+   could not be written. */
+gboolean
+libbalsa_journal_append(LibBalsaJournal *journal, gconstpointer data,
+                        gsize len)
+{
+    gboolean ok;
+
+    g_return_val_if_fail(journal != NULL, FALSE);
+
+    if (journal->tmp != NULL) {
+        if (journal->tmp_failed)
+            return FALSE;
+        /* synced once when the compaction is complete */
+        if (fwrite(data, 1, len, journal->tmp) != len) {
+            lbj_set_error(journal, errno);
+            journal->tmp_failed = TRUE;
+            return FALSE;
+        }
+        ++journal->records;
+        return TRUE;
+    }
+
+    if (!lbj_open(journal))
+        return FALSE;
+
+    ok = fwrite(data, 1, len, journal->log) == len &&
+        fflush(journal->log) == 0;
+    if (ok && journal->sync == LIBBALSA_JOURNAL_FSYNC)
+        ok = fsync(fileno(journal->log)) == 0;
+    if (!ok) {
+        lbj_set_error(journal, errno);
+        g_debug("%s: cannot write %s", __func__, journal->path);
+        fclose(journal->log);
+        journal->log = NULL;
+        journal->broken = TRUE;
+        return FALSE;
+    }
+    ++journal->records;
+
+    return TRUE;
+}
+
+gboolean
+libbalsa_journal_printf(LibBalsaJournal *journal, const gchar *format, ...)
+{
+    va_list args;
+    gchar *record;
+    gboolean ok;
+
+    va_start(args, format);
+    record = g_strdup_vprintf(format, args);
+    va_end(args);
+    ok = libbalsa_journal_append(journal, record, strlen(record));
+    g_free(record);
+
+    return ok;
+}
+
+/* libbalsa_journal_compact() replaces the log by the records which
+   dump writes. */
+void
+libbalsa_journal_compact(LibBalsaJournal *journal,
+                         LibBalsaJournalDumpFunc dump, gpointer data)
+{
+    gchar *tmp_path;
+    guint records;
+    gboolean ok;
+
+    g_return_if_fail(journal != NULL && dump != NULL);
+
+    records = journal->records;
+    if (journal->log != NULL) {
+        fclose(journal->log);
+        journal->log = NULL;
+    }
+
+    tmp_path = g_strconcat(journal->path, ".tmp", NULL);
+    journal->tmp = fopen(tmp_path, "wb");
+    ok = journal->tmp != NULL &&
+        (journal->header_len == 0 ||
+         fwrite(journal->header, 1, journal->header_len, journal->tmp)
+         == journal->header_len);
+    if (ok) {
+        journal->records = 0;
+        journal->tmp_failed = FALSE;
+        dump(journal, data);
+        ok = !journal->tmp_failed && lbj_sync_file(journal->tmp);
+    }
+    if (!ok)
+        lbj_set_error(journal, errno);
+    if (journal->tmp != NULL && fclose(journal->tmp) != 0 && ok) {
+        lbj_set_error(journal, errno);
+        ok = FALSE;
+    }
+    journal->tmp = NULL;
+    if (ok && g_rename(tmp_path, journal->path) != 0) {
+        lbj_set_error(journal, errno);
+        ok = FALSE;
+    }
+
+    if (ok) {
+        /* a fresh start after an earlier failure */
+        journal->broken = FALSE;
+    } else {
+        g_debug("%s: cannot write %s", __func__, tmp_path);
+        g_unlink(tmp_path);
+        journal->records = records;
+    }
+    g_free(tmp_path);
+}
+
+/* libbalsa_journal_maybe_compact() compacts the log if it has grown
+   much larger than the live records, whose number is live. */
+void
+libbalsa_journal_maybe_compact(LibBalsaJournal *journal, guint live,
+                               LibBalsaJournalDumpFunc dump, gpointer data)
+{
+    g_return_if_fail(journal != NULL);
+
+    if (journal->records > live * 2 + journal->slack)
+        libbalsa_journal_compact(journal, dump, data);
+}
+
+/* libbalsa_journal_sync() syncs the log to disk. Returns FALSE, and
+   sets error, if any record could not be written since the last
+   call. */
+gboolean
+libbalsa_journal_sync(LibBalsaJournal *journal, GError **error)
+{
+    g_return_val_if_fail(journal != NULL, FALSE);
+
+    if (journal->log != NULL && !lbj_sync_file(journal->log))
+        lbj_set_error(journal, errno);
+    if (journal->error == 0)
+        return TRUE;
+
+    g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(journal->error),
+                "%s", g_strerror(journal->error));
+    /* report a failure only once */
+    journal->error = 0;
+
+    return FALSE;
+}
+
+void
+libbalsa_journal_free(LibBalsaJournal *journal)
+{
+    if (journal == NULL)
+        return;
+
+    if (journal->log != NULL)
+        fclose(journal->log);
+    g_free(journal->header);
+    g_free(journal->path);
+    g_free(journal);
+}
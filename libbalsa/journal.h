@@ -0,0 +1,63 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2016 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef __LIBBALSA_JOURNAL_H__
+#define __LIBBALSA_JOURNAL_H__
+
+#include <glib.h>
+
+/* LibBalsaJournal: an append-only log of records, which starts with a
+ * fixed header. The owner replays the log into its own data on load
+ * and rewrites it from that data when it has grown too large; the
+ * journal takes care of the file, of syncing and of write errors. */
+
+typedef struct _LibBalsaJournal LibBalsaJournal;
+
+typedef enum {
+    LIBBALSA_JOURNAL_FLUSH,     /* flush each record */
+    LIBBALSA_JOURNAL_FSYNC      /* sync each record to disk */
+} LibBalsaJournalSync;
+
+/* LibBalsaJournalDumpFunc: writes the live contents of the owner's
+ * data with libbalsa_journal_append() or libbalsa_journal_printf(). */
+typedef void (*LibBalsaJournalDumpFunc)(LibBalsaJournal *journal,
+                                        gpointer data);
+
+LibBalsaJournal *libbalsa_journal_new(const gchar *path,
+                                      gconstpointer header,
+                                      gsize header_len,
+                                      LibBalsaJournalSync sync,
+                                      guint slack);
+gboolean libbalsa_journal_read(LibBalsaJournal *journal, gchar **contents,
+                               gsize *length);
+void libbalsa_journal_replayed(LibBalsaJournal *journal, guint records);
+gboolean libbalsa_journal_append(LibBalsaJournal *journal,
+                                 gconstpointer data, gsize len);
+gboolean libbalsa_journal_printf(LibBalsaJournal *journal,
+                                 const gchar *format, ...)
+    G_GNUC_PRINTF(2, 3);
+void libbalsa_journal_compact(LibBalsaJournal *journal,
+                              LibBalsaJournalDumpFunc dump, gpointer data);
+void libbalsa_journal_maybe_compact(LibBalsaJournal *journal, guint live,
+                                    LibBalsaJournalDumpFunc dump,
+                                    gpointer data);
+gboolean libbalsa_journal_sync(LibBalsaJournal *journal, GError **error);
+void libbalsa_journal_free(LibBalsaJournal *journal);
+
+#endif                          /* __LIBBALSA_JOURNAL_H__ */
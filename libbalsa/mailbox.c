@@ -69,6 +69,17 @@ static void libbalsa_mailbox_real_lock_store(LibBalsaMailbox * mailbox,
 static void libbalsa_mailbox_real_cache_message(LibBalsaMailbox * mailbox,
                                                 guint msgno,
                                                 LibBalsaMessage * message);
+static GMimeStream *libbalsa_mailbox_real_delivery_new(LibBalsaMailbox *
+                                                       mailbox,
+                                                       GError ** err);
+static gboolean libbalsa_mailbox_real_delivery_commit(LibBalsaMailbox *
+                                                      mailbox,
+                                                      GMimeStream * stream,
+                                                      LibBalsaMessageFlag
+                                                      flags,
+                                                      GError ** err);
+static void libbalsa_mailbox_real_delivery_abort(LibBalsaMailbox * mailbox,
+                                                 GMimeStream * stream);
 
 /* SIGNALS MEANINGS :
    - CHANGED: notification signal sent by the mailbox to allow the
@@ -266,6 +277,9 @@ libbalsa_mailbox_class_init(LibBalsaMailboxClass * klass)
     klass->lock_store  = libbalsa_mailbox_real_lock_store;
     klass->test_can_reach = NULL;
     klass->cache_message = libbalsa_mailbox_real_cache_message;
+    klass->delivery_new    = libbalsa_mailbox_real_delivery_new;
+    klass->delivery_commit = libbalsa_mailbox_real_delivery_commit;
+    klass->delivery_abort  = libbalsa_mailbox_real_delivery_abort;
 }
 
 static void
@@ -869,6 +883,11 @@ lbm_run_filters_on_reception_idle_cb(LibBalsaMailbox * mailbox)
     guint total;
     guint progress_total;
     LibBalsaProgress progress;
+    GArray *arrived;
+    GHashTable *moved;
+    GPtrArray *matches;
+    guint msgno;
+    guint n;
 
     libbalsa_lock_mailbox(mailbox);
 
@@ -919,21 +938,37 @@ lbm_run_filters_on_reception_idle_cb(LibBalsaMailbox * mailbox)
                                             (TRUE,
                                              LIBBALSA_MESSAGE_FLAG_DELETED));
 
-    text = g_strdup_printf(_("Applying filter rules to %s"), priv->name);
+    /* the newly arrived messages, found in one pass */
     total = libbalsa_mailbox_total_messages(mailbox);
-    progress_total = progress_count * total;
+    arrived = g_array_new(FALSE, FALSE, sizeof(guint));
+    for (msgno = 1; msgno <= total; msgno++) {
+        if (libbalsa_mailbox_msgno_has_flags(mailbox, msgno,
+                                             LIBBALSA_MESSAGE_FLAG_RECENT,
+                                             LIBBALSA_MESSAGE_FLAG_DELETED))
+            g_array_append_val(arrived, msgno);
+    }
+
+    text = g_strdup_printf(_("Applying filter rules to %s"), priv->name);
+    progress_total = progress_count * arrived->len;
     libbalsa_progress_set_text(&progress, text, progress_total);
     g_free(text);
 
+    /* match the whole batch against each filter; a message which a
+     * filter moves away is not offered to the following ones */
+    moved = g_hash_table_new(NULL, NULL);
+    matches = g_ptr_array_new_with_free_func((GDestroyNotify) g_array_unref);
     progress_count = 0;
     for (lst = filters; lst; lst = lst->next) {
         LibBalsaFilter *filter = lst->data;
         gboolean use_progress;
         LibBalsaCondition *cond;
         LibBalsaMailboxSearchIter *search_iter;
-        guint msgno;
         GArray *msgnos;
+        guint i;
 
+        msgnos = g_array_new(FALSE, FALSE, sizeof(guint));
+        g_ptr_array_add(matches, msgnos);
+        libbalsa_mailbox_register_msgnos(mailbox, msgnos);
         if (!filter->condition)
             continue;
 
@@ -946,11 +981,15 @@ lbm_run_filters_on_reception_idle_cb(LibBalsaMailbox * mailbox)
         search_iter = libbalsa_mailbox_search_iter_new(cond);
         libbalsa_condition_unref(cond);
 
-        msgnos = g_array_new(FALSE, FALSE, sizeof(guint));
-
-        for (msgno = 1; msgno <= total; msgno++) {
-            if (libbalsa_mailbox_message_match(mailbox, msgno, search_iter))
+        for (i = 0; i < arrived->len; i++) {
+            msgno = g_array_index(arrived, guint, i);
+            if (!g_hash_table_contains(moved, GUINT_TO_POINTER(msgno)) &&
+                libbalsa_mailbox_message_match(mailbox, msgno, search_iter)) {
                 g_array_append_val(msgnos, msgno);
+                if (filter->action == FILTER_MOVE ||
+                    filter->action == FILTER_TRASH)
+                    g_hash_table_add(moved, GUINT_TO_POINTER(msgno));
+            }
             if (use_progress) {
                 libbalsa_progress_set_fraction(&progress,
                                                ((gdouble) ++progress_count)
@@ -959,15 +998,19 @@ lbm_run_filters_on_reception_idle_cb(LibBalsaMailbox * mailbox)
             }
         }
 
-        libbalsa_mailbox_register_msgnos(mailbox, msgnos);
-        libbalsa_filter_mailbox_messages(filter, mailbox, msgnos);
-        libbalsa_mailbox_unregister_msgnos(mailbox, msgnos);
-
-        g_array_free(msgnos, TRUE);
-
         libbalsa_mailbox_search_iter_unref(search_iter);
     }
 
+    /* apply the actions, grouped by destination */
+    libbalsa_filters_mailbox_messages(filters, matches, mailbox);
+    for (n = 0; n < matches->len; n++)
+        libbalsa_mailbox_unregister_msgnos(mailbox,
+                                           g_ptr_array_index(matches, n));
+
+    g_ptr_array_free(matches, TRUE);
+    g_hash_table_destroy(moved);
+    g_array_free(arrived, TRUE);
+
     libbalsa_progress_set_text(&progress, NULL, 0);
 
     g_slist_free(filters);
@@ -1956,6 +1999,100 @@ libbalsa_mailbox_add_messages(LibBalsaMailbox * mailbox,
     return retval;
 }
 
+/* By default, a message being delivered is spooled to an unlinked
+ * temporary file, so that its size does not matter, and added to the
+ * mailbox when it is complete. */
+static GMimeStream *
+libbalsa_mailbox_real_delivery_new(LibBalsaMailbox * mailbox,
+                                   GError ** err)
+{
+    gchar *path;
+    gint fd;
+
+    fd = g_file_open_tmp("balsa-delivery-XXXXXX", &path, err);
+    if (fd < 0)
+        return NULL;
+    unlink(path);
+    g_free(path);
+
+    return g_mime_stream_fs_new(fd);
+}
+
+/* Called with mailbox locked. */
+static gboolean
+libbalsa_mailbox_real_delivery_commit(LibBalsaMailbox * mailbox,
+                                      GMimeStream * stream,
+                                      LibBalsaMessageFlag flags,
+                                      GError ** err)
+{
+    struct AddMessageData amd;
+    guint retval;
+
+    g_mime_stream_reset(stream);
+    amd.stream = stream;
+    amd.flags  = flags;
+    amd.processed = FALSE;
+    retval =
+        LIBBALSA_MAILBOX_GET_CLASS(mailbox)->add_messages(mailbox,
+                                                          msg_iterator,
+                                                          &amd, err);
+    g_object_unref(stream);
+
+    return retval > 0;
+}
+
+static void
+libbalsa_mailbox_real_delivery_abort(LibBalsaMailbox * mailbox,
+                                     GMimeStream * stream)
+{
+    g_object_unref(stream);
+}
+
+GMimeStream *
+libbalsa_mailbox_delivery_new(LibBalsaMailbox * mailbox, GError ** err)
+{
+    g_return_val_if_fail(LIBBALSA_IS_MAILBOX(mailbox), NULL);
+
+    return LIBBALSA_MAILBOX_GET_CLASS(mailbox)->delivery_new(mailbox, err);
+}
+
+gboolean
+libbalsa_mailbox_delivery_commit(LibBalsaMailbox * mailbox,
+                                 GMimeStream * stream,
+                                 LibBalsaMessageFlag flags, GError ** err)
+{
+    gboolean retval;
+
+    g_return_val_if_fail(LIBBALSA_IS_MAILBOX(mailbox), FALSE);
+    g_return_val_if_fail(GMIME_IS_STREAM(stream), FALSE);
+
+    libbalsa_lock_mailbox(mailbox);
+
+    retval =
+        LIBBALSA_MAILBOX_GET_CLASS(mailbox)->delivery_commit(mailbox, stream,
+                                                             flags, err);
+    if (retval) {
+        if (!(flags & LIBBALSA_MESSAGE_FLAG_DELETED)
+            && (flags & LIBBALSA_MESSAGE_FLAG_NEW))
+            libbalsa_mailbox_set_unread_messages_flag(mailbox, TRUE);
+        lbm_queue_check(mailbox);
+    }
+
+    libbalsa_unlock_mailbox(mailbox);
+
+    return retval;
+}
+
+void
+libbalsa_mailbox_delivery_abort(LibBalsaMailbox * mailbox,
+                                GMimeStream * stream)
+{
+    g_return_if_fail(LIBBALSA_IS_MAILBOX(mailbox));
+    g_return_if_fail(GMIME_IS_STREAM(stream));
+
+    LIBBALSA_MAILBOX_GET_CLASS(mailbox)->delivery_abort(mailbox, stream);
+}
+
 gboolean
 libbalsa_mailbox_close_backend(LibBalsaMailbox * mailbox)
 {
@@ -261,6 +261,11 @@ struct _LibBalsaMailboxClass {
     void (*cache_message) (LibBalsaMailbox *mailbox,
                            guint            msgno,
                            LibBalsaMessage *message);
+    GMimeStream *(*delivery_new) (LibBalsaMailbox * mailbox, GError ** err);
+    gboolean (*delivery_commit) (LibBalsaMailbox * mailbox,
+                                 GMimeStream * stream,
+                                 LibBalsaMessageFlag flags, GError ** err);
+    void (*delivery_abort) (LibBalsaMailbox * mailbox, GMimeStream * stream);
 };
 
 LibBalsaMailbox *libbalsa_mailbox_new_from_config(const gchar *prefix,
@@ -395,6 +400,18 @@ guint libbalsa_mailbox_add_messages(LibBalsaMailbox * mailbox,
 				    void *arg,
 				    GError ** err);
 
+/* Delivery of a message which arrives in pieces: the data are written
+ * to the stream returned by libbalsa_mailbox_delivery_new(), which is
+ * then either committed to the mailbox or aborted; both unref it. */
+GMimeStream *libbalsa_mailbox_delivery_new(LibBalsaMailbox * mailbox,
+                                           GError ** err);
+gboolean libbalsa_mailbox_delivery_commit(LibBalsaMailbox * mailbox,
+                                          GMimeStream * stream,
+                                          LibBalsaMessageFlag flags,
+                                          GError ** err);
+void libbalsa_mailbox_delivery_abort(LibBalsaMailbox * mailbox,
+                                     GMimeStream * stream);
+
 gboolean libbalsa_mailbox_close_backend(LibBalsaMailbox * mailbox);
 
 /* Message number-list methods */
@@ -31,6 +31,7 @@
 #endif                          /* HAVE_CONFIG_H */
 
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -44,13 +45,16 @@
 #include "filter-funcs.h"
 #include "filter.h"
 #include "imap-commands.h"
+#include "imap-body-cache.h"
 #include "imap-handle.h"
 #include "imap-server.h"
+#include "journal.h"
 #include "libbalsa-conf.h"
 #include "libbalsa_private.h"
 #include "libimap.h"
 #include "mailbox-filter.h"
 #include "message.h"
+#include "mime-stream-imap.h"
 #include "mime-stream-shared.h"
 #include "misc.h"
 #include "server.h"
@@ -77,6 +81,7 @@ struct _LibBalsaMailboxImap {
     GPtrArray *msgids; /* message-ids */
 
     GArray *sort_ranks;
+    GArray *sort_order;         /* msgnos by rank, inverse of sort_ranks */
     guint unread_update_id;
     LibBalsaMailboxSortFields sort_field;
     unsigned opened:1;
@@ -89,6 +94,27 @@ struct _LibBalsaMailboxImap {
 
     GArray *expunged_seqnos;
     guint expunged_idle_id;
+
+    guint prefetch_chunk;       /* current envelope prefetch length */
+    gint64 prefetch_time;       /* monotonic time of last prefetch */
+
+    gint mirror_pending;        /* a mirror job is queued */
+    ImapUID mirror_uid_validity; /* the mirror job has seen all messages */
+    ImapUID mirror_uidnext;     /* below mirror_uidnext */
+    gint prefetch_pending;      /* a body prefetch job is queued */
+
+    GMutex replica_lock;        /* the offline replica, see
+                                   lbm_imap_replica_load() */
+    LibBalsaJournal *replica_log;
+    gboolean replica_loaded;
+    gboolean replica_replaying;
+    ImapUID replica_uid_validity; /* of the last session */
+    GPtrArray *replica_changes; /* records of the queued changes */
+
+    GMutex pending_flags_lock;
+    GPtrArray *pending_flags;   /* queued flag changes, see
+                                   lbm_imap_queue_flags() */
+    guint flush_flags_id;
 };
 
 struct message_info {
@@ -96,10 +122,12 @@ struct message_info {
     LibBalsaMessageFlag user_flags;
 };
 
-static off_t ImapCacheSize = 30*1024*1024; /* 30MB */
+static off_t ImapCacheSize = 512*1024*1024; /* 512MB */
 
  /* issue message if downloaded part has more than this size */
 static unsigned SizeMsgThreshold = 50*1024;
+/* messages up to this size are mirrored to the body cache */
+#define MIRROR_SIZE_LIMIT (1024*1024)
 static void libbalsa_mailbox_imap_dispose(GObject * object);
 static void libbalsa_mailbox_imap_finalize(GObject * object);
 static gboolean libbalsa_mailbox_imap_open(LibBalsaMailbox * mailbox,
@@ -184,6 +212,14 @@ static gboolean libbalsa_mailbox_imap_messages_copy(LibBalsaMailbox *
 static void server_host_settings_changed_cb(LibBalsaServer * server,
 					    LibBalsaMailbox * mailbox);
 static void imap_cache_manager_free(struct ImapCacheManager *icm);
+static uint32_t lbm_imap_msgno_to_uid(LibBalsaMailboxImap *mimap,
+                                      unsigned msgno);
+static void lbm_imap_flush_flags(LibBalsaMailboxImap *mimap);
+static void lbm_imap_flag_op_free(gpointer data);
+static GNode *lbm_imap_thread_cache_restore(LibBalsaMailboxImap *mimap,
+                                            gboolean *changed);
+static void lbm_imap_thread_cache_save(LibBalsaMailboxImap *mimap,
+                                       GNode *tree);
 
 
 static struct message_info *message_info_from_msgno(
@@ -276,11 +312,19 @@ libbalsa_mailbox_imap_init(LibBalsaMailboxImap * mailbox)
     mailbox->handle = NULL;
     mailbox->handle_refs = 0;
     mailbox->sort_ranks = g_array_new(FALSE, FALSE, sizeof(guint));
+    mailbox->sort_order = g_array_new(FALSE, FALSE, sizeof(guint));
     mailbox->sort_field = -1;	/* Initially invalid. */
     mailbox->disconnected = FALSE;
 
     mailbox->expunged_seqnos = g_array_new(FALSE, FALSE, sizeof(guint));
     mailbox->expunged_idle_id = 0;
+
+    g_mutex_init(&mailbox->pending_flags_lock);
+    mailbox->pending_flags =
+        g_ptr_array_new_with_free_func(lbm_imap_flag_op_free);
+
+    g_mutex_init(&mailbox->replica_lock);
+    mailbox->replica_changes = g_ptr_array_new_with_free_func(g_free);
 }
 
 static void
@@ -310,6 +354,8 @@ libbalsa_mailbox_imap_dispose(GObject * object)
         mimap->expunged_idle_id = 0;
     }
 
+    lbm_imap_flush_flags(mimap);
+
     G_OBJECT_CLASS(libbalsa_mailbox_imap_parent_class)->dispose(object);
 }
 
@@ -320,10 +366,16 @@ libbalsa_mailbox_imap_finalize(GObject * object)
 
     g_free(mimap->path);
     g_array_free(mimap->sort_ranks, TRUE);
+    g_array_free(mimap->sort_order, TRUE);
     g_array_free(mimap->expunged_seqnos, TRUE);
     g_list_free_full(mimap->acls, (GDestroyNotify) imap_user_acl_free);
     if (mimap->icm != NULL)
         imap_cache_manager_free(mimap->icm);
+    g_ptr_array_unref(mimap->pending_flags);
+    g_mutex_clear(&mimap->pending_flags_lock);
+    libbalsa_journal_free(mimap->replica_log);
+    g_ptr_array_unref(mimap->replica_changes);
+    g_mutex_clear(&mimap->replica_lock);
 
     G_OBJECT_CLASS(libbalsa_mailbox_imap_parent_class)->finalize(object);
 }
@@ -448,7 +500,7 @@ get_cache_dir(gboolean is_persistent)
 }
 
 static gchar*
-get_header_cache_path(LibBalsaMailboxImap *mimap)
+get_header_cache_path_full(LibBalsaMailboxImap *mimap, ImapUID uid_validity)
 {
     LibBalsaMailboxRemote *remote = LIBBALSA_MAILBOX_REMOTE(mimap);
     LibBalsaServer *server = libbalsa_mailbox_remote_get_server(remote);
@@ -456,11 +508,11 @@ get_header_cache_path(LibBalsaMailboxImap *mimap)
     gchar *header_file;
     gchar *encoded_path;
 
-    header_file = g_strdup_printf("%s@%s-%s-%u-headers2",
+    header_file = g_strdup_printf("%s@%s-%s-%u-headers3",
                                   libbalsa_server_get_user(server),
                                   libbalsa_server_get_host(server),
                                   (mimap->path != NULL ? mimap->path : "INBOX"),
-                                  mimap->uid_validity);
+                                  uid_validity);
     encoded_path = libbalsa_urlencode(header_file);
     g_free(header_file);
 
@@ -472,16 +524,21 @@ get_header_cache_path(LibBalsaMailboxImap *mimap)
     return header_file;
 }
 
+static gchar*
+get_header_cache_path(LibBalsaMailboxImap *mimap)
+{
+    return get_header_cache_path_full(mimap, mimap->uid_validity);
+}
+
 static gchar**
-get_cache_name_pair(LibBalsaMailboxImap *mimap, const gchar *type,
-                    ImapUID uid)
+get_cache_name_pair_full(LibBalsaMailboxImap *mimap, const gchar *type,
+                         ImapUID uid_validity, ImapUID uid)
 {
     LibBalsaMailboxRemote *remote = LIBBALSA_MAILBOX_REMOTE(mimap);
     LibBalsaServer *server = libbalsa_mailbox_remote_get_server(remote);
     LibBalsaImapServer *imap_server = LIBBALSA_IMAP_SERVER(server);
     gboolean is_persistent = libbalsa_imap_server_has_persistent_cache(imap_server);
     gchar **res = g_malloc(3*sizeof(gchar*));
-    ImapUID uid_validity = mimap->uid_validity;
     gchar *fname;
 
     res[0] = get_cache_dir(is_persistent);
@@ -497,66 +554,16 @@ get_cache_name_pair(LibBalsaMailboxImap *mimap, const gchar *type,
     return res;
 }
 
-/* clean_cache:
-   removes unused entries from the cache file.
-*/
-struct file_info {
-    char  *name;
-    off_t  size;
-    time_t time;
-};
-static gint
-cmp_by_time (gconstpointer  a, gconstpointer  b)
-{
-    return ((const struct file_info*)b)->time
-        -((const struct file_info*)a)->time;
-}
-
-static void
-clean_dir(const char *dir_name, off_t cache_size)
+static gchar**
+get_cache_name_pair(LibBalsaMailboxImap *mimap, const gchar *type,
+                    ImapUID uid)
 {
-    GDir* dir;
-    const gchar *entry;
-    GList *list, *lst;
-    off_t sz;
-
-    dir = g_dir_open(dir_name, 0U, NULL);	/* do not notify the user about errors */
-    if (!dir)
-        return;
-
-    list = NULL;
-    while ((entry = g_dir_read_name(dir)) != NULL) {
-        struct stat st;
-        struct file_info *fi;
-        gchar *fname = g_build_filename(dir_name, entry, NULL);
-
-        if(stat(fname, &st) == -1 || !S_ISREG(st.st_mode)) {
-	    g_free(fname);
-            continue;
-	}
-        fi = g_new(struct file_info,1);
-        fi->name = fname;
-        fi->size = st.st_size;
-        fi->time = st.st_atime;
-        list = g_list_prepend(list, fi);
-    }
-    g_dir_close(dir);
-
-    list = g_list_sort(list, cmp_by_time);
-    sz = 0;
-    for(lst = list; lst; lst = lst->next) {
-        struct file_info *fi = (struct file_info*)(lst->data);
-        sz += fi->size;
-        if(sz>cache_size) {
-            g_debug("removing %s", fi->name);
-            unlink(fi->name);
-        }
-        g_free(fi->name);
-        g_free(fi);
-    }
-    g_list_free(list);
+    return get_cache_name_pair_full(mimap, type, mimap->uid_validity, uid);
 }
 
+/* clean_cache:
+   evicts the least recently used entries from the body cache.
+*/
 static gboolean
 clean_cache(LibBalsaMailbox* mailbox)
 {
@@ -566,23 +573,53 @@ clean_cache(LibBalsaMailbox* mailbox)
     gchar* dir;
 
     dir = get_cache_dir(is_persistent);
-    clean_dir(dir, ImapCacheSize);
+    libbalsa_imap_body_cache_trim(dir, ImapCacheSize);
     g_free(dir);
  
     return TRUE;
 }
 
 static struct ImapCacheManager*imap_cache_manager_new_from_file(const char *header_cache_path);
-static struct ImapCacheManager *icm_store_cached_data(ImapMboxHandle *h);
+static struct ImapCacheManager *icm_store_cached_data(ImapMboxHandle *h,
+                                                      struct ImapCacheManager *old_icm);
+static gboolean icm_sync_uidmap(ImapMboxHandle *h,
+                                struct ImapCacheManager *icm);
 static void icm_restore_from_cache(ImapMboxHandle *h,
                                    struct ImapCacheManager *icm);
+static gboolean icm_has_msg(struct ImapCacheManager *icm, unsigned msgno);
+static gboolean icm_load_msg(struct ImapCacheManager *icm, ImapMboxHandle *h,
+                             unsigned msgno);
+static void icm_msgno_expunged(struct ImapCacheManager *icm, unsigned msgno);
+static struct ImapCacheManager *icm_update_from_handle(struct ImapCacheManager *icm,
+                                                       ImapMboxHandle *h);
+static gboolean icm_matches_handle(struct ImapCacheManager *icm,
+                                   ImapMboxHandle *h);
 static gboolean icm_save_to_file(struct ImapCacheManager *icm,
 				 const gchar *path);
+static struct ImapCacheManager *icm_new_from_disk(const gchar *header_cache_path,
+                                                  ImapUID uidvalidity);
+static void icm_set_journal(struct ImapCacheManager *icm,
+                            const gchar *header_cache_path);
+static void icm_cache_msgs(struct ImapCacheManager *icm, ImapMboxHandle *h,
+                           const unsigned *msgnos, unsigned cnt);
+static void icm_cache_flags(struct ImapCacheManager *icm, ImapMboxHandle *h,
+                            const unsigned *msgnos, unsigned cnt);
+static void icm_change_flags(struct ImapCacheManager *icm,
+                             const unsigned *uids, unsigned cnt,
+                             ImapMsgFlag flag, gboolean state);
+static GBytes *icm_message_record(uint32_t uid, gconstpointer ptr);
+static void icm_append_in_background(const gchar *header_cache_path,
+                                     GPtrArray *records, ImapUID uidvalidity);
+static ImapMboxHandle *icm_new_replica(struct ImapCacheManager *icm,
+                                       const gchar *mbox, ImapUID uidnext);
+static void icm_save_in_background(struct ImapCacheManager *icm,
+                                   const gchar *header_cache_path);
+static void set_uid(ImapMboxHandle *handle, unsigned seqno, void *arg);
 
 static ImapResult
 mi_reconnect(ImapMboxHandle *h)
 {
-    struct ImapCacheManager *icm = icm_store_cached_data(h);
+    struct ImapCacheManager *icm = icm_store_cached_data(h, NULL);
     ImapResult r;
     unsigned old_cnt = imap_mbox_handle_get_exists(h);
     unsigned old_next = imap_mbox_handle_get_uidnext(h);
@@ -675,31 +712,96 @@ lbimap_update_flags(LibBalsaMessage *message, ImapMessage *imsg)
 /* mi_get_imsg is a thin wrapper around imap_mbox_handle_get_msg().
    We wrap around imap_mbox_handle_get_msg() in case the libimap data
    was invalidated by eg. disconnect.
+
+   We prefetch envelopes in chunks to save on RTTs. The chunk length
+   adapts to the access pattern: a miss that follows the previous
+   prefetch within PREFETCH_GROW_INTERVAL doubles it (the user is
+   scrolling through the index), a miss after a pause resets it.
+   Neighbours are picked in view order - straight from the msgno or
+   the cached sort ranks when the view is flat; the message tree is
+   walked only for threaded or filtered views.
 */
+#define PREFETCH_MIN_CHUNK     20U
+#define PREFETCH_MAX_CHUNK     4096U
+#define PREFETCH_GROW_INTERVAL (2 * G_USEC_PER_SEC)
+
+/* Tells whether the envelope of msgno is known, either to the handle
+ * or to the header cache - the latter is restored when first needed. */
+static gboolean
+mi_has_envelope(LibBalsaMailboxImap *mimap, unsigned msgno)
+{
+    ImapMessage *imsg = imap_mbox_handle_get_msg(mimap->handle, msgno);
+
+    return (imsg != NULL && imsg->envelope != NULL) ||
+        icm_has_msg(mimap->icm, msgno);
+}
+
 struct collect_seq_data {
+    LibBalsaMailboxImap *mimap;
     unsigned *msgno_arr;
+    unsigned chunk;
     unsigned cnt;
     unsigned needed_msgno;
     unsigned has_it;
 };
 
-static const unsigned MAX_CHUNK_LENGTH = 20; 
 static gboolean
 collect_seq_cb(GNode *node, gpointer data)
 {
-    /* We prefetch envelopes in chunks to save on RTTs.
-     * Try to get the messages both before and after the message. */
+    /* Try to get the messages both before and after the message. */
     struct collect_seq_data *csd = (struct collect_seq_data*)data;
     unsigned msgno = GPOINTER_TO_UINT(node->data);
     if(msgno==0) /* root node */
         return FALSE;
-    csd->msgno_arr[(csd->cnt++) % MAX_CHUNK_LENGTH] = msgno;
+    if(msgno != csd->needed_msgno && mi_has_envelope(csd->mimap, msgno))
+        return FALSE;
+    csd->msgno_arr[(csd->cnt++) % csd->chunk] = msgno;
     if(csd->has_it>0) csd->has_it++;
     if(csd->needed_msgno == msgno)
         csd->has_it = 1;
     /* quit if we have enough messages and at least half of them are
      * after message in question. */
-    return csd->cnt >= MAX_CHUNK_LENGTH && csd->has_it*2>MAX_CHUNK_LENGTH;
+    return csd->cnt >= csd->chunk && csd->has_it*2>csd->chunk;
+}
+
+/* Collects up to csd->chunk messages around csd->needed_msgno from a
+ * flat view without traversing the message tree. Returns FALSE if the
+ * view order is not known. */
+static gboolean
+collect_seq_flat(LibBalsaMailboxImap *mimap, struct collect_seq_data *csd)
+{
+    LibBalsaMailbox *mailbox = LIBBALSA_MAILBOX(mimap);
+    LibBalsaMailboxSortFields sort_field;
+    unsigned total_msgs = mimap->messages_info->len;
+    unsigned pos, lo, hi;
+    gboolean by_msgno;
+
+    if (libbalsa_mailbox_get_threading_type(mailbox) !=
+        LB_MAILBOX_THREADING_FLAT ||
+        libbalsa_mailbox_get_view_filter(mailbox, FALSE) != NULL)
+        return FALSE;
+
+    sort_field = libbalsa_mailbox_get_view(mailbox)->sort_field;
+    by_msgno = sort_field == LB_MAILBOX_SORT_NO;
+    if (!by_msgno &&
+        (mimap->sort_field != sort_field ||
+         mimap->sort_order->len != total_msgs ||
+         csd->needed_msgno > mimap->sort_ranks->len))
+        return FALSE;
+
+    pos = by_msgno ? csd->needed_msgno - 1
+        : g_array_index(mimap->sort_ranks, guint, csd->needed_msgno - 1);
+    lo = pos > csd->chunk / 2 ? pos - csd->chunk / 2 : 0;
+    hi = MIN(lo + csd->chunk, total_msgs);
+    for (; lo < hi; lo++) {
+        unsigned msgno = by_msgno ? lo + 1
+            : g_array_index(mimap->sort_order, guint, lo);
+        if (msgno == csd->needed_msgno ||
+            !mi_has_envelope(mimap, msgno))
+            csd->msgno_arr[csd->cnt++] = msgno;
+    }
+
+    return TRUE;
 }
 
 static int
@@ -715,23 +817,38 @@ mi_get_imsg(LibBalsaMailboxImap *mimap, unsigned msgno)
     struct collect_seq_data csd;
     ImapResponse rc;
     GNode *msg_tree;
+    gint64 now;
 
     /* This test too weak: I can imagine unsolicited ENVELOPE
      * responses sent from server that wil create the ImapMessage
      * structure but message size or UID etc will not be available. */
     if( (imsg = imap_mbox_handle_get_msg(mimap->handle, msgno)) 
         != NULL && imsg->envelope) return imsg;
+    if (icm_load_msg(mimap->icm, mimap->handle, msgno))
+        return imap_mbox_handle_get_msg(mimap->handle, msgno);
+
+    now = g_get_monotonic_time();
+    if (mimap->prefetch_chunk == 0 ||
+        now - mimap->prefetch_time > PREFETCH_GROW_INTERVAL)
+        mimap->prefetch_chunk = PREFETCH_MIN_CHUNK;
+    else if (mimap->prefetch_chunk < PREFETCH_MAX_CHUNK)
+        mimap->prefetch_chunk *= 2;
+
+    csd.mimap        = mimap;
+    csd.chunk        = mimap->prefetch_chunk;
     csd.needed_msgno = msgno;
-    csd.msgno_arr    = g_malloc(MAX_CHUNK_LENGTH*sizeof(csd.msgno_arr[0]));
+    csd.msgno_arr    = g_new(unsigned, csd.chunk);
     csd.cnt          = 0;
     csd.has_it       = 0;
 
     msg_tree = libbalsa_mailbox_get_msg_tree(LIBBALSA_MAILBOX(mimap));
     if (msg_tree != NULL) {
-        g_node_traverse(msg_tree,
-                        G_PRE_ORDER, G_TRAVERSE_ALL, -1, collect_seq_cb,
-                        &csd);
-        if(csd.cnt>MAX_CHUNK_LENGTH) csd.cnt = MAX_CHUNK_LENGTH;
+        if (!collect_seq_flat(mimap, &csd)) {
+            g_node_traverse(msg_tree,
+                            G_PRE_ORDER, G_TRAVERSE_ALL, -1, collect_seq_cb,
+                            &csd);
+            if(csd.cnt>csd.chunk) csd.cnt = csd.chunk;
+        }
         qsort(csd.msgno_arr, csd.cnt, sizeof(csd.msgno_arr[0]), cmp_msgno);
     } else {
         /* It may happen that we want to perform an automatic
@@ -741,10 +858,14 @@ mi_get_imsg(LibBalsaMailboxImap *mimap, unsigned msgno)
            LibBalsaMessage object are present, and these require that
            some basic information is fetched from the server.  */
         unsigned i, total_msgs = mimap->messages_info->len;
-        csd.cnt = msgno+MAX_CHUNK_LENGTH>total_msgs
-            ? total_msgs-msgno+1 : MAX_CHUNK_LENGTH;
-        for(i=0; i<csd.cnt; i++) csd.msgno_arr[i] = msgno+i;
+        unsigned last = msgno+csd.chunk>total_msgs
+            ? total_msgs : msgno+csd.chunk-1;
+        for(i=msgno; i<=last; i++)
+            if(i == msgno || !mi_has_envelope(mimap, i))
+                csd.msgno_arr[csd.cnt++] = i;
     }
+    /* imap_mbox_handle_fetch_set() skips the messages already known
+     * and coalesces the rest into sequence ranges. */
     II(rc,mimap->handle,
        imap_mbox_handle_fetch_set(mimap->handle, csd.msgno_arr,
                                   csd.cnt,
@@ -753,14 +874,26 @@ mi_get_imsg(LibBalsaMailboxImap *mimap, unsigned msgno)
                                   IMFETCH_ENV |
                                   IMFETCH_RFC822SIZE |
                                   IMFETCH_CONTENT_TYPE));
+    if (rc == IMR_OK)
+        icm_cache_msgs(mimap->icm, mimap->handle, csd.msgno_arr, csd.cnt);
     g_free(csd.msgno_arr);
+    mimap->prefetch_time = g_get_monotonic_time();
     if (rc != IMR_OK)
         return FALSE;
     return imap_mbox_handle_get_msg(mimap->handle, msgno);
 }
 
 /* Forward reference. */
-static void lbm_imap_get_unseen(LibBalsaMailboxImap * mimap);
+static void lbm_imap_get_unseen(LibBalsaMailboxImap * mimap,
+                                gboolean ask_server);
+static gboolean lbm_imap_replica_usable(LibBalsaMailboxImap *mimap);
+static gboolean lbm_imap_replica_wanted(LibBalsaMailboxImap *mimap,
+                                        const GError *error);
+static gboolean lbm_imap_replica_open(LibBalsaMailboxImap *mimap);
+static void lbm_imap_replica_set_validity(LibBalsaMailboxImap *mimap,
+                                          ImapUID uid_validity);
+static void lbm_imap_replay(LibBalsaMailboxImap *mimap,
+                            ImapMboxHandle *handle);
 
 /** imap_flags_cb() is called by the imap backend when flags are
    fetched. Note that we may not have yet the preprocessed data in
@@ -775,7 +908,7 @@ idle_unread_update_cb(LibBalsaMailbox *mailbox)
     libbalsa_lock_mailbox(mailbox);
     unread = libbalsa_mailbox_get_unread_messages(mailbox);
     
-    lbm_imap_get_unseen(LIBBALSA_MAILBOX_IMAP(mailbox));
+    lbm_imap_get_unseen(LIBBALSA_MAILBOX_IMAP(mailbox), FALSE);
     if(unread != libbalsa_mailbox_get_unread_messages(mailbox))
         libbalsa_mailbox_set_unread_messages_flag(mailbox,
                                                   libbalsa_mailbox_get_unread_messages(mailbox)>0);
@@ -813,6 +946,10 @@ imap_flags_cb(unsigned cnt, const unsigned seqno[], LibBalsaMailboxImap *mimap)
 
 	    libbalsa_mailbox_index_set_flags(mailbox, seqno[i], new_flags);
 	    ++mimap->search_stamp;
+            /* A replica journals its changes itself, see
+             * lbm_imap_replica_change_flags(). */
+            if (!imap_mbox_handle_is_replica(mimap->handle))
+                icm_cache_flags(mimap->icm, mimap->handle, &seqno[i], 1);
         }
     }
     if (mimap->unread_update_id == 0)
@@ -883,7 +1020,8 @@ imap_exists_idle(gpointer data)
         ++mimap->search_stamp;
         
 	libbalsa_mailbox_run_filters_on_reception(mailbox);
-	lbm_imap_get_unseen(LIBBALSA_MAILBOX_IMAP(mailbox));    
+	/* this runs in the main loop, which must not wait for the server */
+	lbm_imap_get_unseen(LIBBALSA_MAILBOX_IMAP(mailbox), FALSE);
     }
 
     libbalsa_unlock_mailbox(mailbox);
@@ -895,6 +1033,11 @@ imap_exists_idle(gpointer data)
 static void
 imap_exists_cb(ImapMboxHandle *handle, LibBalsaMailboxImap *mimap)
 {
+    libbalsa_lock_mailbox(LIBBALSA_MAILBOX(mimap));
+    if (mimap->icm != NULL && !icm_matches_handle(mimap->icm, handle))
+        mimap->icm = icm_update_from_handle(mimap->icm, handle);
+    libbalsa_unlock_mailbox(LIBBALSA_MAILBOX(mimap));
+
     g_idle_add(imap_exists_idle, g_object_ref(mimap));
 }
 
@@ -964,12 +1107,11 @@ imap_expunge_cb(ImapMboxHandle *handle, unsigned seqno,
      * fetch the message from the server. */
     if ((imsg = imap_mbox_handle_get_msg(mimap->handle, seqno))) {
 	gchar **pair = get_cache_name_pair(mimap, "body", imsg->uid);
-        gchar *fn = g_build_filename(pair[0], pair[1], NULL);
-        unlink(fn); /* ignore error; perhaps the message 
-                     * was not in the cache.  */
-        g_free(fn);
+        /* perhaps the message was not in the cache. */
+        libbalsa_imap_body_cache_remove(pair[0], pair[1]);
         g_strfreev(pair);
     }
+    icm_msgno_expunged(mimap->icm, seqno);
 
     g_array_append_val(mimap->expunged_seqnos, seqno);
     if (mimap->expunged_idle_id == 0)
@@ -991,7 +1133,10 @@ libbalsa_mailbox_imap_release_handle(LibBalsaMailboxImap * mimap)
 					     G_SIGNAL_MATCH_DATA,
 					     0, 0, NULL, NULL, mimap);
         imap_handle_set_flagscb(mimap->handle, NULL, NULL);
-	RELEASE_HANDLE(mimap, mimap->handle);
+        if (imap_mbox_handle_is_replica(mimap->handle))
+            g_object_unref(mimap->handle);
+        else
+            RELEASE_HANDLE(mimap, mimap->handle);
 	mimap->handle = NULL;
     }
 }
@@ -1046,6 +1191,14 @@ libbalsa_mailbox_imap_get_selected_handle(LibBalsaMailboxImap *mimap,
 	/* FIXME: update/remove msg uids */
     }
 
+    /* Send the changes made offline, before anything is fetched. */
+    if (libbalsa_imap_server_has_persistent_cache(imap_server)) {
+        if (lbm_imap_replica_usable(mimap))
+            lbm_imap_replica_set_validity(mimap, uidval);
+        if (!libbalsa_mailbox_get_readonly(LIBBALSA_MAILBOX(mimap)))
+            lbm_imap_replay(mimap, mimap->handle);
+    }
+
     imap_handle_set_flagscb(mimap->handle, (ImapFlagsCb)imap_flags_cb, mimap);
     g_signal_connect(mimap->handle,
                      "exists-notify", G_CALLBACK(imap_exists_cb),
@@ -1057,10 +1210,12 @@ libbalsa_mailbox_imap_get_selected_handle(LibBalsaMailboxImap *mimap,
     return mimap->handle;
 }
 
-/* Get the list of unseen messages from the server and set
- * the unread-messages count. */
+/* Set the unread-messages count from the flags known locally. When
+ * ask_server is TRUE, i.e. on select, the server is asked instead if
+ * it can count with ESEARCH, which avoids transferring the list of all
+ * unseen messages. */
 static void
-lbm_imap_get_unseen(LibBalsaMailboxImap * mimap)
+lbm_imap_get_unseen(LibBalsaMailboxImap * mimap, gboolean ask_server)
 {
     LibBalsaMailbox *mailbox;
     guint i, count, total;
@@ -1070,19 +1225,25 @@ lbm_imap_get_unseen(LibBalsaMailboxImap * mimap)
 	return;
 
     mailbox = LIBBALSA_MAILBOX(mimap);
-    total = imap_mbox_handle_get_exists(mimap->handle);
-    first_unread = total;
-    for(i=count=0; i<total; i++) {
-        if(imap_mbox_handle_msgno_has_flags(mimap->handle,
-                                            i+1,
-                                            0, IMSGF_SEEN|IMSGF_DELETED)) {
-            count++;
-            if (first_unread > i)
-                first_unread = i + 1;
+    if (ask_server)
+        lbm_imap_flush_flags(mimap);
+    if (!ask_server ||
+        imap_mbox_count_unseen(mimap->handle, &count, &first_unread)
+        != IMR_OK) {
+        total = imap_mbox_handle_get_exists(mimap->handle);
+        first_unread = total;
+        for(i=count=0; i<total; i++) {
+            if(imap_mbox_handle_msgno_has_flags(mimap->handle,
+                                                i+1,
+                                                0, IMSGF_SEEN|IMSGF_DELETED)) {
+                count++;
+                if (first_unread > i)
+                    first_unread = i + 1;
+            }
         }
+        if (count == 0)
+            first_unread = 0;
     }
-    if (count == 0)
-        first_unread = 0;
 
     libbalsa_mailbox_set_first_unread(mailbox, first_unread);
     libbalsa_mailbox_clear_unread_messages(mailbox);
@@ -1097,15 +1258,29 @@ static gboolean
 libbalsa_mailbox_imap_open(LibBalsaMailbox * mailbox, GError **err)
 {
     LibBalsaMailboxImap *mimap;
+    LibBalsaServer *server;
     unsigned i;
     guint total_messages;
+    gchar *header_cache_path;
+    gboolean replica;
+    GError *error = NULL;
 
     g_return_val_if_fail(LIBBALSA_IS_MAILBOX_IMAP(mailbox), FALSE);
 
     mimap = LIBBALSA_MAILBOX_IMAP(mailbox);
 
-    mimap->handle = libbalsa_mailbox_imap_get_selected_handle(mimap, err);
+    mimap->handle = libbalsa_mailbox_imap_get_selected_handle(mimap, &error);
+    replica = mimap->handle == NULL &&
+        lbm_imap_replica_wanted(mimap, error) && lbm_imap_replica_open(mimap);
+    if (replica) {
+        g_clear_error(&error);
+        libbalsa_information(LIBBALSA_INFORMATION_MESSAGE,
+                             _("Mailbox %s is offline; showing the "
+                               "messages kept locally."),
+                             libbalsa_mailbox_get_name(mailbox));
+    }
     if (!mimap->handle) {
+        g_propagate_error(err, error);
         mimap->opened       = FALSE;
         mimap->disconnected = TRUE;
 	return FALSE;
@@ -1123,21 +1298,36 @@ libbalsa_mailbox_imap_open(LibBalsaMailbox * mailbox, GError **err)
 	g_array_append_val(mimap->messages_info, a);
 	g_ptr_array_add(mimap->msgids, NULL);
     }
-    if (mimap->icm == NULL) { /* Try restoring from file... */
-	gchar *header_cache_path = get_header_cache_path(mimap);
-	mimap->icm = imap_cache_manager_new_from_file(header_cache_path);
-	g_free(header_cache_path);
-    }
-    if (mimap->icm != NULL) {
-        icm_restore_from_cache(mimap->handle, mimap->icm);
-        imap_cache_manager_free(mimap->icm);
-        mimap->icm = NULL;
+    if (replica) {
+        /* lbm_imap_replica_open() has set up the cache; there is
+         * nobody to ask for the unseen messages, and no new ones. */
+        lbm_imap_get_unseen(mimap, FALSE);
+    } else {
+        header_cache_path = get_header_cache_path(mimap);
+        if (mimap->icm == NULL) /* Try restoring from file... */
+            mimap->icm =
+                icm_new_from_disk(header_cache_path,
+                                  imap_mbox_handle_get_validity(mimap->handle));
+        /* The cached messages are restored lazily by mi_get_imsg(). */
+        if (mimap->icm != NULL &&
+            !icm_sync_uidmap(mimap->handle, mimap->icm)) {
+            imap_cache_manager_free(mimap->icm);
+            mimap->icm = NULL;
+        }
+        if (mimap->icm == NULL)
+            mimap->icm = icm_store_cached_data(mimap->handle, NULL);
+        /* Fetched headers are journaled as they arrive. */
+        server = libbalsa_mailbox_remote_get_server(LIBBALSA_MAILBOX_REMOTE(mailbox));
+        icm_set_journal(mimap->icm,
+                        libbalsa_imap_server_has_persistent_cache
+                        (LIBBALSA_IMAP_SERVER(server)) ? header_cache_path : NULL);
+        g_free(header_cache_path);
+
+        libbalsa_mailbox_set_first_unread(mailbox,
+                                          imap_mbox_handle_first_unseen(mimap->handle));
+        libbalsa_mailbox_run_filters_on_reception(mailbox);
+        lbm_imap_get_unseen(mimap, TRUE);
     }
-
-    libbalsa_mailbox_set_first_unread(mailbox,
-                                      imap_mbox_handle_first_unseen(mimap->handle));
-    libbalsa_mailbox_run_filters_on_reception(mailbox);
-    lbm_imap_get_unseen(mimap);
     if (mimap->search_stamp)
 	++mimap->search_stamp;
     else
@@ -1183,25 +1373,40 @@ libbalsa_mailbox_imap_close(LibBalsaMailbox * mailbox, gboolean expunge)
     gboolean is_persistent = libbalsa_imap_server_has_persistent_cache(imap_server);
     LibBalsaMailboxImap *mimap = LIBBALSA_MAILBOX_IMAP(mailbox);
 
+    lbm_imap_flush_flags(mimap);
     mimap->opened = FALSE;
-    mimap->icm = icm_store_cached_data(mimap->handle);
 
-    /* we do not attempt to reconnect here */
-    if (expunge) {
-	if (is_persistent) { /* We appreciate expunge info to simplify
-				next resync. */
-	    imap_mbox_expunge_a(mimap->handle);
-	}
-	imap_mbox_close(mimap->handle);
-    } else
-	imap_mbox_unselect(mimap->handle);
+    if (imap_mbox_handle_is_replica(mimap->handle)) {
+        /* There is no server to talk to. The changes are in the
+         * journal of the header cache, which the next session
+         * compacts; the replica does not know the mailbox well enough
+         * to replace the cache. */
+        imap_cache_manager_free(mimap->icm);
+        mimap->icm = NULL;
+    } else {
+        mimap->icm = icm_store_cached_data(mimap->handle, mimap->icm);
 
-    /* We have received last notificiations, we can save the cache now. */
-    if(is_persistent) {
+        /* we do not attempt to reconnect here */
+        if (expunge) {
+            if (is_persistent) { /* We appreciate expunge info to simplify
+                                    next resync. */
+                imap_mbox_expunge_a(mimap->handle);
+            }
+            imap_mbox_close(mimap->handle);
+        } else
+            imap_mbox_unselect(mimap->handle);
+    }
+
+    /* We have received last notificiations, we can save the cache now.
+       The writer thread takes the cache over; it is read back from disk
+       on next open. */
+    if(is_persistent && mimap->icm != NULL) {
 	/* Implement only for persistent. Cache dir is shared for all
 	   non-persistent caches. */
 	gchar *header_file = get_header_cache_path(mimap);
-	icm_save_to_file(mimap->icm, header_file);
+	icm_set_journal(mimap->icm, NULL);
+	icm_save_in_background(mimap->icm, header_file);
+	mimap->icm = NULL;
 	g_free(header_file);
     }
     clean_cache(mailbox);
@@ -1218,41 +1423,58 @@ libbalsa_mailbox_imap_close(LibBalsaMailbox * mailbox, gboolean expunge)
     libbalsa_mailbox_set_view_filter(mailbox, NULL, FALSE);
 }
 
+/* fetch_to_body_cache:
+   fetches message uid into the body cache entry pair; path is set to
+   the cached copy on success.
+*/
+static ImapResponse
+fetch_to_body_cache(ImapMboxHandle *handle, gchar **pair, guint uid,
+                    gboolean peek, gchar **path)
+{
+    FILE *cache;
+    gchar *tmp_path;
+    ImapResponse rc;
+    int ferr;
+
+    *path = NULL;
+    cache = libbalsa_imap_body_cache_create(pair[0], &tmp_path);
+    if(!cache)
+        return IMR_NO;
+    rc = imap_mbox_handle_fetch_rfc822_uid(handle, uid, peek, cache);
+    ferr = ferror(cache);
+    if(fclose(cache) != 0) ferr = 1;
+    if(ferr || rc != IMR_OK) {
+        g_debug("Error fetching RFC822 message, removing cache.");
+        unlink(tmp_path);
+    } else
+        *path = libbalsa_imap_body_cache_commit(pair[0], pair[1], tmp_path);
+    g_free(tmp_path);
+
+    return rc;
+}
+
 static FILE*
 get_cache_stream(LibBalsaMailboxImap *mimap, guint uid, gboolean peek)
 {
-    FILE *stream;
+    FILE *stream = NULL;
     gchar **pair, *path;
 
     pair = get_cache_name_pair(mimap, "body", uid);
-    path = g_build_filename(pair[0], pair[1], NULL);
-    stream = fopen(path, "rb");
-    if(!stream) {
-        FILE *cache;
+    path = libbalsa_imap_body_cache_lookup(pair[0], pair[1]);
+    if(!path) {
 	ImapResponse rc;
 
-        g_mkdir_with_parents(pair[0], S_IRUSR|S_IWUSR|S_IXUSR);
 #if 0
         if(msg->length>(signed)SizeMsgThreshold)
             libbalsa_information(LIBBALSA_INFORMATION_MESSAGE, 
                                  _("Downloading %ld kB"),
                                  msg->length/1024);
 #endif
-        cache = fopen(path, "wb");
-        if(cache) {
-	    int ferr;
-            II(rc,mimap->handle,
-               imap_mbox_handle_fetch_rfc822_uid(mimap->handle, uid, peek,
-						 cache));
-	    ferr = ferror(cache);
-            fclose(cache);
-	    if(ferr || rc != IMR_OK) {
-		g_debug("Error fetching RFC822 message, removing cache.");
-		unlink(path);
-	    }
-        }
-	stream = fopen(path,"rb");
+        II(rc,mimap->handle,
+           fetch_to_body_cache(mimap->handle, pair, uid, peek, &path));
     }
+    if(path)
+        stream = fopen(path,"rb");
     g_free(path); 
     g_strfreev(pair);
     return stream;
@@ -1327,8 +1549,10 @@ lbm_imap_check(LibBalsaMailbox * mailbox)
             { IMSTAT_UNSEEN, 0 }, { IMSTAT_NONE, 0 } };
         /* cannot do status on an open mailbox */
         g_return_val_if_fail(!mimap->opened, FALSE);
-        if(imap_mbox_status(handle, mimap->path, info) != IMR_OK)
+        if(imap_mbox_status(handle, mimap->path, info) != IMR_OK) {
+            libbalsa_mailbox_imap_release_handle(mimap);
             return FALSE;
+        }
         libbalsa_mailbox_imap_release_handle(mimap);
         return info[0].result > 0;
     } else {
@@ -1351,124 +1575,842 @@ lbm_imap_check(LibBalsaMailbox * mailbox)
     }
 }
 
+/* Offline replica
+ *
+ * When the server cannot be reached, a mailbox of a server with a
+ * persistent cache and mirroring enabled is opened from the caches:
+ * the header cache of the last session, extended by the headers that
+ * the mirror job has journaled since, provides the index and the
+ * flags, and the body cache the messages. The handle of such a
+ * mailbox is a replica, see imap_mbox_handle_new_replica().
+ *
+ * Changes made meanwhile are queued in the replica log of the mailbox
+ * and replayed in order when the mailbox is next selected, or by the
+ * mirror job: flag changes, copies to other mailboxes of the server -
+ * a move is a copy and a flag change - and messages appended to the
+ * mailbox, which are spooled next to the log. Flag changes and copies
+ * are kept by UID; those made under another UIDVALIDITY are dropped.
+ * Expunging is not queued, and the flags of the messages are those
+ * known at the end of the last session.
+ *
+ * The log is a text journal, one record per line:
+ *   V uidvalidity                  UIDVALIDITY of the last session
+ *   M uidvalidity uidnext          progress of the mirror job
+ *   F uidvalidity flag state uids  flag change
+ *   C uidvalidity uids mailbox     copy
+ *   A flags spool-file             append
+ * where uids is a comma-separated list. The last V and M records
+ * count; the log is compacted to them and the queued changes.
+ */
+#define REPLICA_LOG_MAGIC "BalsaIR1\n"
+#define REPLICA_LOG_SLACK 16
+
+/* Tells whether the mailbox may be opened from the caches and changed
+ * offline. Queued changes are replayed in any case. */
+static gboolean
+lbm_imap_replica_usable(LibBalsaMailboxImap *mimap)
+{
+    LibBalsaImapServer *imap_server =
+        LIBBALSA_IMAP_SERVER(LIBBALSA_MAILBOX_REMOTE_GET_SERVER(mimap));
+
+    return libbalsa_imap_server_has_persistent_cache(imap_server) &&
+        libbalsa_imap_server_get_mirror_bodies(imap_server);
+}
+
+/* Tells whether to fall back to the replica after error: the server
+ * is offline or cannot be reached. */
+static gboolean
+lbm_imap_replica_wanted(LibBalsaMailboxImap *mimap, const GError *error)
+{
+    LibBalsaImapServer *imap_server =
+        LIBBALSA_IMAP_SERVER(LIBBALSA_MAILBOX_REMOTE_GET_SERVER(mimap));
+
+    return lbm_imap_replica_usable(mimap) &&
+        (libbalsa_imap_server_is_offline(imap_server) ||
+         g_error_matches(error, LIBBALSA_MAILBOX_ERROR,
+                         LIBBALSA_MAILBOX_NETWORK_ERROR));
+}
+
+static gchar *
+lbm_imap_replica_log_path(LibBalsaMailboxImap *mimap)
+{
+    LibBalsaServer *server = LIBBALSA_MAILBOX_REMOTE_GET_SERVER(mimap);
+    gchar *name, *encoded_name, *cache_dir, *path;
+
+    name = g_strdup_printf("%s@%s-%s-replica",
+                           libbalsa_server_get_user(server),
+                           libbalsa_server_get_host(server),
+                           (mimap->path != NULL ? mimap->path : "INBOX"));
+    encoded_name = libbalsa_urlencode(name);
+    g_free(name);
+
+    cache_dir = get_cache_dir(TRUE);
+    g_mkdir_with_parents(cache_dir, S_IRUSR | S_IWUSR | S_IXUSR);
+    path = g_build_filename(cache_dir, encoded_name, NULL);
+    g_free(encoded_name);
+    g_free(cache_dir);
+
+    return path;
+}
+
+/* lbm_imap_replica_load() reads the replica log on first use. Called
+ * with replica_lock held, like the other functions that use the log
+ * and the replica fields. */
 static void
-libbalsa_mailbox_imap_check(LibBalsaMailbox * mailbox)
+lbm_imap_replica_load(LibBalsaMailboxImap *mimap)
 {
-    g_assert(LIBBALSA_IS_MAILBOX_IMAP(mailbox));
+    gchar *path, *contents;
+    guint records = 0;
 
-    if (!MAILBOX_OPEN(mailbox)) {
-        libbalsa_mailbox_set_unread_messages_flag(mailbox,
-                                                  lbm_imap_check(mailbox));
-	return;
+    if (mimap->replica_loaded)
+        return;
+    mimap->replica_loaded = TRUE;
+
+    path = lbm_imap_replica_log_path(mimap);
+    mimap->replica_log =
+        libbalsa_journal_new(path, REPLICA_LOG_MAGIC,
+                             strlen(REPLICA_LOG_MAGIC),
+                             LIBBALSA_JOURNAL_FSYNC, REPLICA_LOG_SLACK);
+    if (libbalsa_journal_read(mimap->replica_log, &contents, NULL)) {
+        gchar *line = contents, *end;
+
+        /* An incomplete last line was cut short by a crash. */
+        while ((end = strchr(line, '\n')) != NULL) {
+            ImapUID uid_validity, uidnext;
+
+            *end = '\0';
+            if (sscanf(line, "V %u", &uid_validity) == 1)
+                mimap->replica_uid_validity = uid_validity;
+            else if (sscanf(line, "M %u %u", &uid_validity, &uidnext) == 2) {
+                mimap->mirror_uid_validity = uid_validity;
+                mimap->mirror_uidnext = uidnext;
+            } else if ((line[0] == 'F' || line[0] == 'C' || line[0] == 'A')
+                       && line[1] == ' ')
+                g_ptr_array_add(mimap->replica_changes, g_strdup(line));
+            records++;
+            line = end + 1;
+        }
+        g_free(contents);
+    } else
+        unlink(path); /* garbled */
+    libbalsa_journal_replayed(mimap->replica_log, records);
+    g_free(path);
+}
+
+static void
+lbm_imap_replica_dump(LibBalsaJournal *journal, gpointer data)
+{
+    LibBalsaMailboxImap *mimap = data;
+    guint i;
+
+    if (mimap->replica_uid_validity != 0)
+        libbalsa_journal_printf(journal, "V %u\n",
+                                mimap->replica_uid_validity);
+    if (mimap->mirror_uid_validity != 0)
+        libbalsa_journal_printf(journal, "M %u %u\n",
+                                mimap->mirror_uid_validity,
+                                mimap->mirror_uidnext);
+    for (i = 0; i < mimap->replica_changes->len; i++)
+        libbalsa_journal_printf(journal, "%s\n",
+                                (gchar *) g_ptr_array_index(mimap->
+                                                            replica_changes,
+                                                            i));
+}
 
+static void
+lbm_imap_replica_record(LibBalsaMailboxImap *mimap, const gchar *record)
+{
+    GError *error = NULL;
+
+    libbalsa_journal_printf(mimap->replica_log, "%s\n", record);
+    if (!libbalsa_journal_sync(mimap->replica_log, &error)) {
+        libbalsa_information(LIBBALSA_INFORMATION_WARNING,
+                             _("Cannot save the offline changes of "
+                               "mailbox %s: %s"),
+                             libbalsa_mailbox_get_name(LIBBALSA_MAILBOX
+                                                       (mimap)),
+                             error->message);
+        g_error_free(error);
     }
+    libbalsa_journal_maybe_compact(mimap->replica_log,
+                                   mimap->replica_changes->len + 2,
+                                   lbm_imap_replica_dump, mimap);
+}
 
-    if (LIBBALSA_MAILBOX_IMAP(mailbox)->handle)
-	libbalsa_mailbox_imap_noop(LIBBALSA_MAILBOX_IMAP(mailbox));
-    else
-	g_warning("mailbox has open_ref>0 but no handle!");
+/* lbm_imap_replica_queue() takes over record and queues it. */
+static void
+lbm_imap_replica_queue(LibBalsaMailboxImap *mimap, gchar *record)
+{
+    g_mutex_lock(&mimap->replica_lock);
+    lbm_imap_replica_load(mimap);
+    g_ptr_array_add(mimap->replica_changes, record);
+    lbm_imap_replica_record(mimap, record);
+    g_mutex_unlock(&mimap->replica_lock);
 }
 
-/* Search iters */
+static void
+lbm_imap_replica_set_validity(LibBalsaMailboxImap *mimap,
+                              ImapUID uid_validity)
+{
+    g_mutex_lock(&mimap->replica_lock);
+    lbm_imap_replica_load(mimap);
+    if (mimap->replica_uid_validity != uid_validity) {
+        gchar *record = g_strdup_printf("V %u", uid_validity);
+
+        mimap->replica_uid_validity = uid_validity;
+        lbm_imap_replica_record(mimap, record);
+        g_free(record);
+    }
+    g_mutex_unlock(&mimap->replica_lock);
+}
 
-static ImapSearchKey *lbmi_build_imap_query(const LibBalsaCondition * cond,
-					    ImapSearchKey * last);
+static void
+lbm_imap_replica_set_mirror(LibBalsaMailboxImap *mimap,
+                            ImapUID uid_validity, ImapUID uidnext)
+{
+    gchar *record;
+
+    g_mutex_lock(&mimap->replica_lock);
+    lbm_imap_replica_load(mimap);
+    mimap->mirror_uid_validity = uid_validity;
+    mimap->mirror_uidnext = uidnext;
+    record = g_strdup_printf("M %u %u", uid_validity, uidnext);
+    lbm_imap_replica_record(mimap, record);
+    g_free(record);
+    g_mutex_unlock(&mimap->replica_lock);
+}
+
+/* Tells whether changes wait to be replayed; loads the mirror
+ * progress, too. */
 static gboolean
-libbalsa_mailbox_imap_message_match(LibBalsaMailbox* mailbox, guint msgno,
-				    LibBalsaMailboxSearchIter * search_iter)
+lbm_imap_replica_pending(LibBalsaMailboxImap *mimap)
 {
-    LibBalsaMailboxImap *mimap;
-    struct message_info *msg_info;
-    GHashTable *matchings;
+    gboolean pending;
 
-    mimap = LIBBALSA_MAILBOX_IMAP(mailbox);
-    msg_info = message_info_from_msgno(mimap, msgno);
-    if (!msg_info)
-        return FALSE;
+    g_mutex_lock(&mimap->replica_lock);
+    lbm_imap_replica_load(mimap);
+    pending = mimap->replica_changes->len > 0;
+    g_mutex_unlock(&mimap->replica_lock);
 
-    if (msg_info->message)
-        g_object_ref(msg_info->message);
-    else if (imap_mbox_handle_get_msg(mimap->handle, msgno)
-             && imap_mbox_handle_get_msg(mimap->handle, msgno)->envelope)
-        /* The backend has already downloaded the data, we can just
-        * convert it to LibBalsaMessage. */
-        libbalsa_mailbox_imap_get_message(mailbox, msgno);
-    if (msg_info->message) {
-        if (libbalsa_condition_can_match(search_iter->condition,
-                                         msg_info->message)) {
-            gboolean retval =
-                libbalsa_condition_matches(search_iter->condition,
-                                           msg_info->message);
-            g_object_unref(msg_info->message);
-            return retval;
-        }
-        g_object_unref(msg_info->message);
-    }
+    return pending;
+}
 
-    if (search_iter->stamp != mimap->search_stamp && search_iter->mailbox
-	&& LIBBALSA_MAILBOX_GET_CLASS(search_iter->mailbox)->
-	search_iter_free)
-	LIBBALSA_MAILBOX_GET_CLASS(search_iter->mailbox)->
-	    search_iter_free(search_iter);
+static gchar *
+lbm_imap_replica_format_uids(const unsigned *uids, guint cnt)
+{
+    GString *str = g_string_new(NULL);
+    guint i;
 
-    matchings = search_iter->user_data;
-    if (!matchings) {
-	ImapSearchKey* query;
-	ImapResponse rc;
+    for (i = 0; i < cnt; i++)
+        g_string_append_printf(str, i > 0 ? ",%u" : "%u", uids[i]);
 
-	matchings = g_hash_table_new(NULL, NULL);
-	query = lbmi_build_imap_query(search_iter->condition, NULL);
-	II(rc,mimap->handle,
-           imap_mbox_filter_msgnos(mimap->handle, query, matchings));
-	imap_search_key_free(query);
-	if (rc != IMR_OK) {
-	    g_hash_table_destroy(matchings);
-	    return FALSE;
-	}
-	search_iter->user_data = matchings;
-	search_iter->mailbox = mailbox;
-	search_iter->stamp = mimap->search_stamp;
+    return g_string_free(str, FALSE);
+}
+
+/* lbm_imap_replica_parse_uids() appends the comma-separated UIDs at
+ * str to uids. Returns the rest of the record, or NULL if it is
+ * garbled. */
+static const gchar *
+lbm_imap_replica_parse_uids(const gchar *str, GArray *uids)
+{
+    gchar *end;
+
+    for (;;) {
+        unsigned uid = strtoul(str, &end, 10);
+
+        if (end == str || uid == 0)
+            return NULL;
+        g_array_append_val(uids, uid);
+        if (*end != ',')
+            break;
+        str = end + 1;
     }
 
-    return g_hash_table_lookup(matchings, GUINT_TO_POINTER(msgno)) != NULL;
+    if (*end == '\0')
+        return end;
+    return *end == ' ' ? end + 1 : NULL;
 }
 
-static void
-libbalsa_mailbox_imap_search_iter_free(LibBalsaMailboxSearchIter * iter)
+/* lbm_imap_replica_change_flags() changes flag of messages seqno on a
+ * replica and queues the change. */
+static gboolean
+lbm_imap_replica_change_flags(LibBalsaMailboxImap *mimap, GArray *seqno,
+                              ImapMsgFlag flag, gboolean state)
 {
-    GHashTable *matchings = iter->user_data;
+    GArray *uids;
+    gchar *uid_list;
+    guint i;
 
-    if (matchings) {
-	g_hash_table_destroy(matchings);
-	iter->user_data = NULL;
+    uids = g_array_sized_new(FALSE, FALSE, sizeof(unsigned), seqno->len);
+    for (i = 0; i < seqno->len; i++) {
+        unsigned uid =
+            lbm_imap_msgno_to_uid(mimap, g_array_index(seqno, guint, i));
+        if (uid != 0)
+            g_array_append_val(uids, uid);
     }
-    /* iter->condition and iter are freed in the LibBalsaMailbox method. */
+    if (uids->len != seqno->len) {
+        g_array_free(uids, TRUE);
+        return FALSE;
+    }
+
+    imap_mbox_store_flag_local(mimap->handle, seqno->len,
+                               (guint *) seqno->data, flag, state);
+    icm_change_flags(mimap->icm, (unsigned *) uids->data, uids->len,
+                     flag, state);
+    uid_list = lbm_imap_replica_format_uids((unsigned *) uids->data,
+                                            uids->len);
+    lbm_imap_replica_queue(mimap,
+                           g_strdup_printf("F %u %u %d %s",
+                                           mimap->uid_validity, flag,
+                                           state ? 1 : 0, uid_list));
+    g_free(uid_list);
+    g_array_free(uids, TRUE);
+
+    return TRUE;
 }
 
-/* add_or_query() adds a new term to an set of eqs. that can be or-ed.
-   There are at least two ways to do it:
-   a). transform a and b to NOT (NOT a NOT b)
-   b). transform a and b to OR a b
-   We keep it simple.
-*/
-static ImapSearchKey*
-add_or_query(ImapSearchKey *or_query, gboolean neg, ImapSearchKey *new_term)
+/* lbm_imap_replica_copy() queues the copy of messages msgnos of a
+ * replica to dest, on the same server. */
+static gboolean
+lbm_imap_replica_copy(LibBalsaMailboxImap *mimap, GArray *msgnos,
+                      LibBalsaMailboxImap *dest, GError **err)
 {
-    if(!or_query) return new_term;
-    if(neg) {
-        imap_search_key_set_next(new_term, or_query);
-        return new_term;
-    } else return imap_search_key_new_or(FALSE, new_term, or_query);
+    unsigned *uids = g_new(unsigned, msgnos->len);
+    gchar *uid_list;
+    guint i;
+
+    for (i = 0; i < msgnos->len; i++) {
+        uids[i] = lbm_imap_msgno_to_uid(mimap,
+                                        g_array_index(msgnos, guint, i));
+        if (uids[i] == 0) {
+            g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                        LIBBALSA_MAILBOX_COPY_ERROR,
+                        _("Mailbox %s is offline."),
+                        libbalsa_mailbox_get_name(LIBBALSA_MAILBOX(mimap)));
+            g_free(uids);
+            return FALSE;
+        }
+    }
+    uid_list = lbm_imap_replica_format_uids(uids, msgnos->len);
+    lbm_imap_replica_queue(mimap,
+                           g_strdup_printf("C %u %s %s", mimap->uid_validity,
+                                           uid_list,
+                                           dest->path != NULL ?
+                                           dest->path : "INBOX"));
+    g_free(uid_list);
+    g_free(uids);
+
+    return TRUE;
 }
 
-static ImapSearchKey*
-lbmi_build_imap_query(const LibBalsaCondition* cond,
-                      ImapSearchKey *next)
+/* lbm_imap_replica_spool() spools the messages to be appended to the
+ * mailbox while it is offline. Returns the number of messages. */
+static guint
+lbm_imap_replica_spool(LibBalsaMailboxImap *mimap,
+                       LibBalsaAddMessageIterator msg_iterator,
+                       void *arg, GError **err)
 {
-    gboolean neg;
-    ImapSearchKey *query = NULL;
-    int cnt=0;
-
+    LibBalsaMessageFlag flags;
+    GMimeStream *stream;
+    gchar *log_path = lbm_imap_replica_log_path(mimap);
+    guint spooled = 0;
+
+    while (msg_iterator(&flags, &stream, arg)) {
+        ImapMsgFlags imap_flags = IMAP_FLAGS_EMPTY;
+        GMimeStream *tmpstream, *outstream;
+        GMimeFilter *crlffilter;
+        gchar *spool_path;
+        gboolean ok;
+        gint fd;
+
+        if (stream == NULL)
+            continue;
+
+        if (!(flags & LIBBALSA_MESSAGE_FLAG_NEW))
+            IMSG_FLAG_SET(imap_flags, IMSGF_SEEN);
+        if (flags & LIBBALSA_MESSAGE_FLAG_DELETED)
+            IMSG_FLAG_SET(imap_flags, IMSGF_DELETED);
+        if (flags & LIBBALSA_MESSAGE_FLAG_FLAGGED)
+            IMSG_FLAG_SET(imap_flags, IMSGF_FLAGGED);
+        if (flags & LIBBALSA_MESSAGE_FLAG_REPLIED)
+            IMSG_FLAG_SET(imap_flags, IMSGF_ANSWERED);
+
+        spool_path = g_strconcat(log_path, "-XXXXXX", NULL);
+        fd = g_mkstemp(spool_path);
+        if (fd < 0) {
+            g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                        LIBBALSA_MAILBOX_APPEND_ERROR,
+                        _("Cannot keep the message for mailbox %s: %s"),
+                        libbalsa_mailbox_get_name(LIBBALSA_MAILBOX(mimap)),
+                        g_strerror(errno));
+            g_object_unref(stream);
+            g_free(spool_path);
+            break;
+        }
+
+        tmpstream = g_mime_stream_filter_new(stream);
+        crlffilter = g_mime_filter_unix2dos_new(FALSE);
+        g_mime_stream_filter_add(GMIME_STREAM_FILTER(tmpstream), crlffilter);
+        g_object_unref(crlffilter);
+
+        outstream = g_mime_stream_fs_new(fd);
+        libbalsa_mime_stream_shared_lock(stream);
+        ok = g_mime_stream_write_to_stream(tmpstream, outstream) >= 0;
+        libbalsa_mime_stream_shared_unlock(stream);
+        /* the record must not get to disk before the message */
+        ok = g_mime_stream_flush(outstream) == 0 && ok;
+        g_object_unref(tmpstream);
+        g_object_unref(stream);
+        g_object_unref(outstream);
+
+        if (!ok) {
+            g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                        LIBBALSA_MAILBOX_APPEND_ERROR,
+                        _("Cannot keep the message for mailbox %s: %s"),
+                        libbalsa_mailbox_get_name(LIBBALSA_MAILBOX(mimap)),
+                        g_strerror(errno));
+            unlink(spool_path);
+            g_free(spool_path);
+            break;
+        }
+        lbm_imap_replica_queue(mimap, g_strdup_printf("A %u %s", imap_flags,
+                                                      spool_path));
+        g_free(spool_path);
+        spooled++;
+    }
+    g_free(log_path);
+
+    return spooled;
+}
+
+/* lbm_imap_replay_change() sends one queued change to the server, on
+ * handle which has the mailbox selected. */
+static ImapResponse
+lbm_imap_replay_change(LibBalsaMailboxImap *mimap, ImapMboxHandle *handle,
+                       const gchar *record)
+{
+    LibBalsaMailbox *mailbox = LIBBALSA_MAILBOX(mimap);
+    ImapUID uid_validity;
+    unsigned flag;
+    int state, n = 0;
+    GArray *uids;
+    const gchar *rest = NULL;
+    ImapResponse rc;
+
+    if (record[0] == 'A') {
+        GMimeStream *stream;
+        int fd;
+
+        if (sscanf(record, "A %u %n", &flag, &n) != 1 || n == 0 ||
+            (fd = open(record + n, O_RDONLY)) < 0) {
+            g_debug("%s: cannot replay \"%s\"", __func__, record);
+            return IMR_BAD;
+        }
+        stream = g_mime_stream_fs_new(fd);
+        rc = imap_mbox_append_stream(handle, mimap->path, flag, stream, -1);
+        g_object_unref(stream);
+        if (rc == IMR_OK)
+            unlink(record + n);
+        else if (rc != IMR_SEVERED && rc != IMR_BYE)
+            libbalsa_information(LIBBALSA_INFORMATION_WARNING,
+                                 _("A message added to mailbox %s while "
+                                   "offline could not be uploaded; it is "
+                                   "kept in %s."),
+                                 libbalsa_mailbox_get_name(mailbox),
+                                 record + n);
+        return rc;
+    }
+
+    uids = g_array_new(FALSE, FALSE, sizeof(unsigned));
+    if (record[0] == 'F' ?
+        sscanf(record, "F %u %u %d %n", &uid_validity, &flag, &state, &n)
+        == 3 :
+        sscanf(record, "C %u %n", &uid_validity, &n) == 1)
+        rest = n > 0 ? lbm_imap_replica_parse_uids(record + n, uids) : NULL;
+
+    if (rest == NULL) {
+        g_debug("%s: cannot replay \"%s\"", __func__, record);
+        rc = IMR_BAD;
+    } else if (uid_validity != imap_mbox_handle_get_validity(handle))
+        rc = IMR_NO; /* the UIDs are meaningless now */
+    else if (record[0] == 'F')
+        rc = imap_mbox_uid_store_flag(handle, uids->len,
+                                      (unsigned *) uids->data, flag,
+                                      state != 0);
+    else
+        rc = imap_mbox_uid_copy(handle, uids->len, (unsigned *) uids->data,
+                                rest);
+    g_array_free(uids, TRUE);
+
+    return rc;
+}
+
+/* lbm_imap_replay() replays the queued changes on handle, which has
+ * the mailbox selected. A change that the server refuses is dropped;
+ * when the connection is lost, the rest is replayed next time. */
+static void
+lbm_imap_replay(LibBalsaMailboxImap *mimap, ImapMboxHandle *handle)
+{
+    GPtrArray *changes;
+    guint i, failed = 0;
+
+    g_mutex_lock(&mimap->replica_lock);
+    lbm_imap_replica_load(mimap);
+    if (mimap->replica_changes->len == 0 || mimap->replica_replaying) {
+        g_mutex_unlock(&mimap->replica_lock);
+        return;
+    }
+    mimap->replica_replaying = TRUE;
+    changes = g_ptr_array_new_with_free_func(g_free);
+    for (i = 0; i < mimap->replica_changes->len; i++)
+        g_ptr_array_add(changes,
+                        g_strdup(g_ptr_array_index(mimap->replica_changes,
+                                                   i)));
+    g_mutex_unlock(&mimap->replica_lock);
+
+    for (i = 0; i < changes->len; i++) {
+        ImapResponse rc =
+            lbm_imap_replay_change(mimap, handle,
+                                   g_ptr_array_index(changes, i));
+
+        if (rc == IMR_SEVERED || rc == IMR_BYE)
+            break;
+        if (rc != IMR_OK)
+            failed++;
+    }
+
+    /* Changes queued meanwhile follow the replayed ones. */
+    g_mutex_lock(&mimap->replica_lock);
+    g_ptr_array_remove_range(mimap->replica_changes, 0, i);
+    libbalsa_journal_compact(mimap->replica_log, lbm_imap_replica_dump,
+                             mimap);
+    mimap->replica_replaying = FALSE;
+    g_mutex_unlock(&mimap->replica_lock);
+    g_ptr_array_unref(changes);
+
+    if (failed > 0)
+        libbalsa_information(LIBBALSA_INFORMATION_WARNING,
+                             ngettext("%u change made to mailbox %s while "
+                                      "offline could not be applied.",
+                                      "%u changes made to mailbox %s while "
+                                      "offline could not be applied.",
+                                      failed),
+                             failed,
+                             libbalsa_mailbox_get_name(LIBBALSA_MAILBOX
+                                                       (mimap)));
+}
+
+/* lbm_imap_replica_open() opens the mailbox from the caches. */
+static gboolean
+lbm_imap_replica_open(LibBalsaMailboxImap *mimap)
+{
+    struct ImapCacheManager *icm;
+    ImapUID uid_validity, uidnext;
+    gchar *header_cache_path;
+
+    g_mutex_lock(&mimap->replica_lock);
+    lbm_imap_replica_load(mimap);
+    uid_validity = mimap->replica_uid_validity;
+    uidnext = mimap->mirror_uid_validity == uid_validity ?
+        mimap->mirror_uidnext : 0;
+    g_mutex_unlock(&mimap->replica_lock);
+    if (uid_validity == 0)
+        return FALSE; /* never selected */
+
+    header_cache_path = get_header_cache_path_full(mimap, uid_validity);
+    icm = icm_new_from_disk(header_cache_path, uid_validity);
+    if (icm == NULL) {
+        g_free(header_cache_path);
+        return FALSE;
+    }
+    /* The flag changes are journaled; the cache is not saved on close,
+     * so that the next session compacts it against the server. */
+    icm_set_journal(icm, header_cache_path);
+    g_free(header_cache_path);
+
+    if (mimap->icm != NULL)
+        imap_cache_manager_free(mimap->icm);
+    mimap->icm = icm;
+    mimap->uid_validity = uid_validity;
+    mimap->handle =
+        icm_new_replica(icm, mimap->path != NULL ? mimap->path : "INBOX",
+                        uidnext);
+    mimap->handle_refs = 1;
+    imap_handle_set_flagscb(mimap->handle, (ImapFlagsCb) imap_flags_cb,
+                            mimap);
+
+    return TRUE;
+}
+
+/* Mirroring:
+   mailboxes of servers with mirroring enabled are copied to the
+   caches whenever they are checked, so that their messages can be
+   read at local-disk speed and, with a persistent cache, the mailbox
+   can be opened while the server cannot be reached (see "Offline
+   replica" above). The job runs in the background on a spare
+   connection of the server and looks only at the messages that
+   arrived since its last complete run: their headers are journaled
+   to the header cache and their bodies go to the body cache. It also
+   replays the changes made offline. While the mailbox is open, its
+   session caches the headers and compacts the journal when closed;
+   the job then leaves the headers to it and does not record its
+   progress, so that the messages are looked at again later.
+*/
+static void
+lbm_imap_mirror_job(LibBalsaImapServer *imap_server,
+                    ImapMboxHandle *handle, gpointer data)
+{
+    LibBalsaMailboxImap *mimap = data;
+    gboolean is_persistent =
+        libbalsa_imap_server_has_persistent_cache(imap_server);
+    ImapUID uid_validity, uidnext, first_uid;
+    GArray *msgnos;
+    GPtrArray *records = NULL;
+    gboolean complete, pending, readonly = FALSE;
+    ImapResponse rc;
+    guint i;
+
+    if(!handle)
+        goto out;
+
+    /* Loads the progress, too. The changes need a selected mailbox. */
+    pending = is_persistent && lbm_imap_replica_pending(mimap);
+    rc = pending ? imap_mbox_select(handle, mimap->path, &readonly) :
+        imap_mbox_examine(handle, mimap->path);
+    if(rc != IMR_OK)
+        goto out;
+
+    uid_validity = imap_mbox_handle_get_validity(handle);
+    if(is_persistent) {
+        if(lbm_imap_replica_usable(mimap))
+            lbm_imap_replica_set_validity(mimap, uid_validity);
+        if(pending && !readonly)
+            lbm_imap_replay(mimap, handle);
+        if(!mimap->opened)
+            records = g_ptr_array_new_with_free_func((GDestroyNotify)
+                                                     g_bytes_unref);
+    }
+
+    uidnext = imap_mbox_handle_get_uidnext(handle);
+    first_uid = uid_validity == mimap->mirror_uid_validity ?
+        MAX(mimap->mirror_uidnext, 1) : 1;
+    if(uidnext == 0 || first_uid >= uidnext)
+        goto out; /* no UIDNEXT, or nothing new */
+
+    msgnos = g_array_new(FALSE, FALSE, sizeof(unsigned));
+    if(imap_mbox_handle_get_exists(handle) > 0) {
+        ImapSearchKey *k =
+            imap_search_key_new_range(FALSE, TRUE, first_uid, uidnext - 1);
+        complete = imap_search_exec(handle, FALSE, k, set_uid, msgnos)
+            == IMR_OK;
+        imap_search_key_free(k);
+    } else
+        complete = TRUE;
+    if(complete && msgnos->len > 0)
+        complete =
+            imap_mbox_handle_fetch_set(handle, (unsigned *) msgnos->data,
+                                       msgnos->len,
+                                       records != NULL ?
+                                       IMFETCH_FLAGS | IMFETCH_UID |
+                                       IMFETCH_ENV | IMFETCH_RFC822SIZE |
+                                       IMFETCH_CONTENT_TYPE :
+                                       IMFETCH_UID | IMFETCH_RFC822SIZE)
+            == IMR_OK;
+
+    for(i = 0; complete && i < msgnos->len; i++) {
+        ImapMessage *imsg =
+            imap_mbox_handle_get_msg(handle,
+                                     g_array_index(msgnos, unsigned, i));
+        gchar **pair, *path;
+
+        if(libbalsa_imap_server_is_offline(imap_server)) {
+            complete = FALSE;
+            break;
+        }
+        if(!imsg || imsg->uid == 0)
+            continue;
+        if(records != NULL && imsg->envelope != NULL) {
+            void *ptr = imap_message_serialize(imsg);
+
+            if(ptr != NULL) {
+                g_ptr_array_add(records, icm_message_record(imsg->uid, ptr));
+                g_free(ptr);
+            }
+        }
+        if(imsg->rfc822size > MIRROR_SIZE_LIMIT)
+            continue;
+        pair = get_cache_name_pair_full(mimap, "body", uid_validity,
+                                        imsg->uid);
+        path = libbalsa_imap_body_cache_lookup(pair[0], pair[1]);
+        if(!path) {
+            rc = fetch_to_body_cache(handle, pair, imsg->uid, TRUE, &path);
+            if(rc != IMR_OK)
+                complete = FALSE;
+            if(rc == IMR_SEVERED)
+                i = msgnos->len;
+        }
+        g_free(path);
+        g_strfreev(pair);
+    }
+    g_array_free(msgnos, TRUE);
+
+    if(records != NULL && records->len > 0) {
+        gchar *header_cache_path =
+            get_header_cache_path_full(mimap, uid_validity);
+        icm_append_in_background(header_cache_path, records, uid_validity);
+        records = NULL;
+        g_free(header_cache_path);
+    }
+
+    /* Start from here next time, unless a message is still missing. */
+    if(complete && !(is_persistent && mimap->opened)) {
+        if(is_persistent)
+            lbm_imap_replica_set_mirror(mimap, uid_validity, uidnext);
+        else {
+            mimap->mirror_uid_validity = uid_validity;
+            mimap->mirror_uidnext = uidnext;
+        }
+    }
+
+ out:
+    if(records != NULL)
+        g_ptr_array_unref(records);
+    g_atomic_int_set(&mimap->mirror_pending, 0);
+    g_object_unref(mimap);
+}
+
+static void
+lbm_imap_schedule_mirror(LibBalsaMailboxImap *mimap)
+{
+    LibBalsaImapServer *imap_server =
+        LIBBALSA_IMAP_SERVER(LIBBALSA_MAILBOX_REMOTE_GET_SERVER(mimap));
+
+    if(!libbalsa_imap_server_get_mirror_bodies(imap_server) ||
+       libbalsa_imap_server_is_offline(imap_server))
+        return;
+    if(!g_atomic_int_compare_and_exchange(&mimap->mirror_pending, 0, 1))
+        return;
+    libbalsa_imap_server_push_job(imap_server, lbm_imap_mirror_job,
+                                  g_object_ref(mimap));
+}
+
+static void
+libbalsa_mailbox_imap_check(LibBalsaMailbox * mailbox)
+{
+    g_assert(LIBBALSA_IS_MAILBOX_IMAP(mailbox));
+
+    if (!MAILBOX_OPEN(mailbox)) {
+        libbalsa_mailbox_set_unread_messages_flag(mailbox,
+                                                  lbm_imap_check(mailbox));
+    } else if (LIBBALSA_MAILBOX_IMAP(mailbox)->handle)
+	libbalsa_mailbox_imap_noop(LIBBALSA_MAILBOX_IMAP(mailbox));
+    else
+	g_warning("mailbox has open_ref>0 but no handle!");
+
+    lbm_imap_schedule_mirror(LIBBALSA_MAILBOX_IMAP(mailbox));
+}
+
+/* Search iters */
+
+static ImapSearchKey *lbmi_build_imap_query(const LibBalsaCondition * cond,
+					    ImapSearchKey * last);
+static gboolean
+libbalsa_mailbox_imap_message_match(LibBalsaMailbox* mailbox, guint msgno,
+				    LibBalsaMailboxSearchIter * search_iter)
+{
+    LibBalsaMailboxImap *mimap;
+    struct message_info *msg_info;
+    GHashTable *matchings;
+
+    mimap = LIBBALSA_MAILBOX_IMAP(mailbox);
+    msg_info = message_info_from_msgno(mimap, msgno);
+    if (!msg_info)
+        return FALSE;
+
+    if (msg_info->message)
+        g_object_ref(msg_info->message);
+    else if (imap_mbox_handle_get_msg(mimap->handle, msgno)
+             && imap_mbox_handle_get_msg(mimap->handle, msgno)->envelope)
+        /* The backend has already downloaded the data, we can just
+        * convert it to LibBalsaMessage. */
+        libbalsa_mailbox_imap_get_message(mailbox, msgno);
+    if (msg_info->message) {
+        if (libbalsa_condition_can_match(search_iter->condition,
+                                         msg_info->message)) {
+            gboolean retval =
+                libbalsa_condition_matches(search_iter->condition,
+                                           msg_info->message);
+            g_object_unref(msg_info->message);
+            return retval;
+        }
+        g_object_unref(msg_info->message);
+    }
+
+    if (search_iter->stamp != mimap->search_stamp && search_iter->mailbox
+	&& LIBBALSA_MAILBOX_GET_CLASS(search_iter->mailbox)->
+	search_iter_free)
+	LIBBALSA_MAILBOX_GET_CLASS(search_iter->mailbox)->
+	    search_iter_free(search_iter);
+
+    matchings = search_iter->user_data;
+    if (!matchings) {
+	ImapSearchKey* query;
+	ImapResponse rc;
+
+	matchings = g_hash_table_new(NULL, NULL);
+	query = lbmi_build_imap_query(search_iter->condition, NULL);
+	lbm_imap_flush_flags(mimap);
+	II(rc,mimap->handle,
+           imap_mbox_filter_msgnos(mimap->handle, query, matchings));
+	imap_search_key_free(query);
+	if (rc != IMR_OK) {
+	    g_hash_table_destroy(matchings);
+	    return FALSE;
+	}
+	search_iter->user_data = matchings;
+	search_iter->mailbox = mailbox;
+	search_iter->stamp = mimap->search_stamp;
+    }
+
+    return g_hash_table_lookup(matchings, GUINT_TO_POINTER(msgno)) != NULL;
+}
+
+static void
+libbalsa_mailbox_imap_search_iter_free(LibBalsaMailboxSearchIter * iter)
+{
+    GHashTable *matchings = iter->user_data;
+
+    if (matchings) {
+	g_hash_table_destroy(matchings);
+	iter->user_data = NULL;
+    }
+    /* iter->condition and iter are freed in the LibBalsaMailbox method. */
+}
+
+/* add_or_query() adds a new term to an set of eqs. that can be or-ed.
+   There are at least two ways to do it:
+   a). transform a and b to NOT (NOT a NOT b)
+   b). transform a and b to OR a b
+   We keep it simple.
+*/
+static ImapSearchKey*
+add_or_query(ImapSearchKey *or_query, gboolean neg, ImapSearchKey *new_term)
+{
+    if(!or_query) return new_term;
+    if(neg) {
+        imap_search_key_set_next(new_term, or_query);
+        return new_term;
+    } else return imap_search_key_new_or(FALSE, new_term, or_query);
+}
+
+static ImapSearchKey*
+lbmi_build_imap_query(const LibBalsaCondition* cond,
+                      ImapSearchKey *next)
+{
+    gboolean neg;
+    ImapSearchKey *query = NULL;
+    int cnt=0;
+
     if(!cond) return NULL;
     neg = cond->negate;
     switch (cond->type) {
@@ -1624,6 +2566,7 @@ GHashTable * libbalsa_mailbox_imap_get_matchings(LibBalsaMailboxImap* mbox,
 #else	
         g_warning("Search results ignored. Fixme!");
 #endif
+        lbm_imap_flush_flags(mbox);
         II(rc,mbox->handle,
            imap_mbox_uid_search(mbox->handle, query,
                                 (void(*)(unsigned,void*))imap_matched,
@@ -1734,10 +2677,12 @@ libbalsa_mailbox_imap_noop(LibBalsaMailboxImap* mimap)
 {
     g_return_if_fail(mimap != NULL);
 
-    if (mimap->handle) /* we do not attempt to reconnect here */
+    if (mimap->handle) { /* we do not attempt to reconnect here */
+	lbm_imap_flush_flags(mimap);
 	if (imap_mbox_handle_noop(mimap->handle) != IMR_OK) {
 	    /* FIXME: report error... */
 	}
+    }
 }
 
 void
@@ -1777,7 +2722,8 @@ libbalsa_mailbox_imap_reconnect(LibBalsaMailboxImap* mimap)
 gboolean
 libbalsa_mailbox_imap_is_connected(LibBalsaMailboxImap* mimap)
 {
-    return mimap->handle && !imap_mbox_is_disconnected(mimap->handle);
+    return mimap->handle && !imap_mbox_is_disconnected(mimap->handle) &&
+        !imap_mbox_handle_is_replica(mimap->handle);
 }
 
 /* imap_close_all_connections:
@@ -1931,6 +2877,7 @@ libbalsa_mailbox_imap_sync(LibBalsaMailbox * mailbox, gboolean expunge)
 
     g_return_val_if_fail(mimap->opened, FALSE);
     /* we are always in sync, we need only to do expunge now and then */
+    lbm_imap_flush_flags(mimap);
     if(expunge) {
         ImapResponse rc;
         II(rc,mimap->handle,
@@ -2201,8 +3148,10 @@ get_struct_from_cache(LibBalsaMailbox *mailbox, LibBalsaMessage *message,
 
         pair = get_cache_name_pair(mimap, "body", imsg->uid);
 
-        filename = g_build_filename(pair[0], pair[1], NULL);
+        filename = libbalsa_imap_body_cache_lookup(pair[0], pair[1]);
         g_strfreev(pair);
+        if (filename == NULL)
+            return FALSE;
         fd = open(filename, O_RDONLY);
         g_free(filename);
         if (fd == -1)
@@ -2247,6 +3196,139 @@ get_struct_from_cache(LibBalsaMailbox *mailbox, LibBalsaMessage *message,
     return TRUE;
 }
 
+/* Body prefetch
+ *
+ * After a message is displayed, the messages that follow it in view
+ * order and the next unread one are fetched into the body cache on a
+ * spare connection, so that displaying them needs no server round
+ * trip. Only messages up to PREFETCH_SIZE_LIMIT are prefetched.
+ *
+ * The view order is approximated by the sequence order, reversed when
+ * the view is sorted by arrival or date in descending order: finding
+ * the message in the view tree would walk the whole tree each time a
+ * message is displayed.
+ */
+#define PREFETCH_COUNT      3
+#define PREFETCH_SCAN_LIMIT 200
+#define PREFETCH_SIZE_LIMIT (256*1024)
+
+struct lbm_imap_prefetch {
+    LibBalsaMailboxImap *mimap;
+    ImapUID uid_validity;
+    GArray *uids;
+};
+
+static void
+lbm_imap_prefetch_job(LibBalsaImapServer *imap_server,
+                      ImapMboxHandle *handle, gpointer data)
+{
+    struct lbm_imap_prefetch *pf = data;
+    guint i;
+
+    if (handle != NULL &&
+        imap_mbox_examine(handle, pf->mimap->path) == IMR_OK &&
+        imap_mbox_handle_get_validity(handle) == pf->uid_validity) {
+        for (i = 0; i < pf->uids->len; i++) {
+            ImapUID uid = g_array_index(pf->uids, ImapUID, i);
+            gchar **pair, *path;
+
+            pair = get_cache_name_pair_full(pf->mimap, "body",
+                                            pf->uid_validity, uid);
+            path = libbalsa_imap_body_cache_lookup(pair[0], pair[1]);
+            if (path == NULL &&
+                fetch_to_body_cache(handle, pair, uid, TRUE, &path)
+                == IMR_SEVERED) {
+                g_strfreev(pair);
+                break;
+            }
+            g_free(path);
+            g_strfreev(pair);
+        }
+    }
+
+    g_atomic_int_set(&pf->mimap->prefetch_pending, 0);
+    g_object_unref(pf->mimap);
+    g_array_free(pf->uids, TRUE);
+    g_free(pf);
+}
+
+/* Returns the step from a message to the next one in view order. */
+static gint
+lbm_imap_view_step(LibBalsaMailbox *mailbox)
+{
+    LibBalsaMailboxSortFields field =
+        libbalsa_mailbox_get_sort_field(mailbox);
+
+    return (field == LB_MAILBOX_SORT_NO || field == LB_MAILBOX_SORT_DATE) &&
+        libbalsa_mailbox_get_sort_type(mailbox) == LB_MAILBOX_SORT_TYPE_DESC
+        ? -1 : 1;
+}
+
+/* Adds the UID of msgno to uids if the message is worth prefetching. */
+static gboolean
+lbm_imap_prefetch_add(LibBalsaMailboxImap *mimap, unsigned msgno,
+                      GArray *uids)
+{
+    ImapMessage *imsg = imap_mbox_handle_get_msg(mimap->handle, msgno);
+    ImapUID uid;
+
+    if (imsg == NULL || imsg->rfc822size <= 0 ||
+        imsg->rfc822size > PREFETCH_SIZE_LIMIT ||
+        (uid = lbm_imap_msgno_to_uid(mimap, msgno)) == 0)
+        return FALSE;
+    g_array_append_val(uids, uid);
+
+    return TRUE;
+}
+
+static void
+lbm_imap_schedule_prefetch(LibBalsaMailboxImap *mimap, unsigned msgno)
+{
+    LibBalsaImapServer *imap_server =
+        LIBBALSA_IMAP_SERVER(LIBBALSA_MAILBOX_REMOTE_GET_SERVER(mimap));
+    struct lbm_imap_prefetch *pf;
+    GArray *uids;
+    guint scanned, next = 0;
+    gint64 n, total;
+    gint step;
+    gboolean unread_found = FALSE;
+
+    if (mimap->handle == NULL ||
+        imap_mbox_handle_is_replica(mimap->handle) ||
+        libbalsa_imap_server_is_offline(imap_server) ||
+        g_atomic_int_get(&mimap->prefetch_pending))
+        return;
+    total = libbalsa_mailbox_total_messages(LIBBALSA_MAILBOX(mimap));
+    step = lbm_imap_view_step(LIBBALSA_MAILBOX(mimap));
+
+    uids = g_array_new(FALSE, FALSE, sizeof(ImapUID));
+    for (scanned = 0, n = (gint64) msgno + step;
+         n >= 1 && n <= total && scanned < PREFETCH_SCAN_LIMIT &&
+             (next < PREFETCH_COUNT || !unread_found);
+         scanned++, n += step) {
+        ImapMessage *imsg = imap_mbox_handle_get_msg(mimap->handle, n);
+        gboolean unread = imsg != NULL && !(imsg->flags & IMSGF_SEEN);
+
+        if (next < PREFETCH_COUNT) {
+            next++;
+            if (lbm_imap_prefetch_add(mimap, n, uids) && unread)
+                unread_found = TRUE;
+        } else if (unread && lbm_imap_prefetch_add(mimap, n, uids))
+            unread_found = TRUE;
+    }
+
+    if (uids->len == 0 ||
+        !g_atomic_int_compare_and_exchange(&mimap->prefetch_pending, 0, 1)) {
+        g_array_free(uids, TRUE);
+        return;
+    }
+    pf = g_new(struct lbm_imap_prefetch, 1);
+    pf->mimap = g_object_ref(mimap);
+    pf->uid_validity = mimap->uid_validity;
+    pf->uids = uids;
+    libbalsa_imap_server_push_job(imap_server, lbm_imap_prefetch_job, pf);
+}
+
 static gboolean
 libbalsa_mailbox_imap_fetch_structure(LibBalsaMailbox *mailbox,
                                       LibBalsaMessage *message,
@@ -2272,6 +3354,8 @@ libbalsa_mailbox_imap_fetch_structure(LibBalsaMailbox *mailbox,
     server = LIBBALSA_MAILBOX_REMOTE_GET_SERVER(mailbox);
     headers = libbalsa_message_get_headers(message);
     msgno = libbalsa_message_get_msgno(message);
+    if(flags & LB_FETCH_STRUCTURE)
+        lbm_imap_schedule_prefetch(mimap, msgno);
     if(!imap_mbox_handle_can_do(mimap->handle, IMCAP_FETCHBODY) ||
        libbalsa_imap_server_has_bug(LIBBALSA_IMAP_SERVER(server),
                                     ISBUG_FETCH) ||
@@ -2462,16 +3546,212 @@ get_parent(LibBalsaMessageBody *root, LibBalsaMessageBody *part,
     }
     return NULL;
 }
-static gboolean
-lbm_imap_get_msg_part_from_cache(LibBalsaMessage * message,
+
+/* Parts larger than this are not fetched in one go but streamed. */
+#define STREAM_PART_THRESHOLD (1024*1024)
+
+struct part_stream_data {
+    LibBalsaMailboxImap *mimap; /* weak pointer */
+    ImapUID uid;
+    gchar *section;
+    gint64 length;
+    /* Data read sequentially is spooled to the body cache. */
+    gchar *cache_dir, *key;
+    gchar *spool_path;
+    FILE *spool;
+    gint64 spooled;
+};
+
+static void
+part_stream_data_free(struct part_stream_data *psd)
+{
+    if (psd->spool != NULL) { /* incomplete */
+        fclose(psd->spool);
+        unlink(psd->spool_path);
+    }
+    if (psd->mimap != NULL)
+        g_object_remove_weak_pointer(G_OBJECT(psd->mimap),
+                                     (gpointer *) &psd->mimap);
+    g_free(psd->spool_path);
+    g_free(psd->cache_dir);
+    g_free(psd->key);
+    g_free(psd->section);
+    g_free(psd);
+}
+
+struct range_data { gchar *buf; gsize len, pos; };
+static void
+append_range(unsigned seqno, const char *buf, size_t buflen, void *arg)
+{
+    struct range_data *rd = (struct range_data*)arg;
+
+    if (buflen > rd->len - rd->pos)
+        buflen = rd->len - rd->pos;
+    memcpy(rd->buf + rd->pos, buf, buflen);
+    rd->pos += buflen;
+}
+
+static void
+append_gstring(unsigned seqno, const char *buf, size_t buflen, void *arg)
+{
+    g_string_append_len((GString*)arg, buf, buflen);
+}
+
+/* part_stream_fetch() is the LibBalsaMimeStreamImapFetch of streamed
+   parts. */
+static gssize
+part_stream_fetch(gint64 offset, gchar *buf, gsize len, gpointer data)
+{
+    struct part_stream_data *psd = data;
+    LibBalsaMailboxImap *mimap = psd->mimap;
+    struct range_data rd = { buf, len, 0 };
+    ImapResponse rc = IMR_NO;
+
+    if (mimap == NULL)
+        return -1;
+
+    libbalsa_lock_mailbox(LIBBALSA_MAILBOX(mimap));
+    if (mimap->handle != NULL) {
+        II(rc, mimap->handle,
+           imap_mbox_handle_fetch_body_range(mimap->handle, psd->uid,
+                                             psd->section, offset, len,
+                                             append_range, &rd));
+    }
+    libbalsa_unlock_mailbox(LIBBALSA_MAILBOX(mimap));
+    if (rc != IMR_OK) {
+        g_debug("%s: cannot fetch section %s of UID %u at %" G_GINT64_FORMAT,
+                __func__, psd->section, psd->uid, offset);
+        return -1;
+    }
+
+    /* The part may be shorter than its announced size; an empty
+       range marks its end. */
+    if (psd->spool != NULL && offset == psd->spooled) {
+        if (fwrite(buf, 1, rd.pos, psd->spool) != rd.pos) {
+            fclose(psd->spool);
+            psd->spool = NULL;
+            unlink(psd->spool_path);
+        } else if ((psd->spooled += rd.pos) >= psd->length || rd.pos == 0) {
+            if (fclose(psd->spool) == 0)
+                g_free(libbalsa_imap_body_cache_commit(psd->cache_dir,
+                                                       psd->key,
+                                                       psd->spool_path));
+            else
+                unlink(psd->spool_path);
+            psd->spool = NULL;
+        }
+    }
+
+    return rd.pos;
+}
+
+/* lbm_imap_get_msg_part_streamed() sets up a large leaf part so that
+   its content is fetched piecewise while it is read, rather than
+   entirely before it can be displayed or saved. Returns FALSE if the
+   part should be fetched the usual way. */
+static gboolean
+lbm_imap_get_msg_part_streamed(LibBalsaMessage * message,
+                               LibBalsaMessageBody * part,
+                               ImapMessage *imsg, const gchar *section,
+                               const gchar *cache_dir, const gchar *key)
+{
+    LibBalsaMailbox *mailbox = libbalsa_message_get_mailbox(message);
+    LibBalsaMailboxImap *mimap = LIBBALSA_MAILBOX_IMAP(mailbox);
+    LibBalsaServer *server = LIBBALSA_MAILBOX_REMOTE_GET_SERVER(mailbox);
+    ImapBody *body = imap_message_get_body_from_section(imsg, section);
+    LibBalsaMessageBody *parent;
+    struct part_stream_data *psd;
+    GString *header;
+    GMimeStream *stream;
+    GMimeParser *parser;
+    GMimeObject *mime_part;
+    GMimeDataWrapper *wrapper;
+
+    if (body == NULL || body->octets < STREAM_PART_THRESHOLD ||
+        libbalsa_imap_server_has_bug(LIBBALSA_IMAP_SERVER(server),
+                                     ISBUG_FETCH))
+        return FALSE;
+
+    parent = get_parent(libbalsa_message_get_body_list(message), part, NULL);
+    header = g_string_new(NULL);
+    if (parent == NULL) {
+        g_string_printf(header, "MIME-version: 1.0\r\ncontent-type: %s\r\n"
+                        "Content-Transfer-Encoding: %s\r\n\r\n",
+                        part->content_type ? part->content_type : "text/plain",
+                        encoding_names(body->encoding));
+    } else if (parent->body_type != LIBBALSA_MESSAGE_BODY_TYPE_MESSAGE) {
+        gchar *mime_section = g_strconcat(section, ".MIME", NULL);
+        ImapResponse rc;
+
+        libbalsa_lock_mailbox(mailbox);
+        II(rc, mimap->handle,
+           imap_mbox_handle_fetch_body_range(mimap->handle, imsg->uid,
+                                             mime_section, 0, 0,
+                                             append_gstring, header));
+        libbalsa_unlock_mailbox(mailbox);
+        g_free(mime_section);
+        if (rc != IMR_OK)
+            g_string_truncate(header, 0);
+    }
+    if (header->len == 0) { /* e.g. the header of a message/rfc822 part */
+        g_string_free(header, TRUE);
+        return FALSE;
+    }
+
+    stream = g_mime_stream_mem_new_with_buffer(header->str, header->len);
+    parser = g_mime_parser_new_with_stream(stream);
+    g_object_unref(stream);
+    g_mime_parser_set_format(parser, GMIME_FORMAT_MESSAGE);
+    mime_part = g_mime_parser_construct_part(parser, libbalsa_parser_options());
+    g_object_unref(parser);
+    if (!GMIME_IS_PART(mime_part)) {
+        if (mime_part != NULL)
+            g_object_unref(mime_part);
+        g_string_free(header, TRUE);
+        return FALSE;
+    }
+
+    psd = g_new0(struct part_stream_data, 1);
+    psd->mimap     = mimap;
+    g_object_add_weak_pointer(G_OBJECT(mimap), (gpointer *) &psd->mimap);
+    psd->uid       = imsg->uid;
+    psd->section   = g_strdup(section);
+    psd->length    = body->octets;
+    psd->cache_dir = g_strdup(cache_dir);
+    psd->key       = g_strdup(key);
+    psd->spool     = libbalsa_imap_body_cache_create(cache_dir,
+                                                     &psd->spool_path);
+    if (psd->spool != NULL &&
+        fwrite(header->str, 1, header->len, psd->spool) != header->len) {
+        fclose(psd->spool);
+        psd->spool = NULL;
+        unlink(psd->spool_path);
+    }
+    g_string_free(header, TRUE);
+
+    stream = libbalsa_mime_stream_imap_new(body->octets, part_stream_fetch,
+                                           psd,
+                                           (GDestroyNotify) part_stream_data_free);
+    wrapper = g_mime_data_wrapper_new_with_stream
+        (stream, g_mime_part_get_content_encoding(GMIME_PART(mime_part)));
+    g_object_unref(stream);
+    g_mime_part_set_content(GMIME_PART(mime_part), wrapper);
+    g_object_unref(wrapper);
+    part->mime_part = mime_part;
+
+    return TRUE;
+}
+
+static gboolean
+lbm_imap_get_msg_part_from_cache(LibBalsaMessage * message,
                                  LibBalsaMessageBody * part,
                                  GError **err)
 {
     GMimeStream *partstream = NULL;
-    gchar **pair, *part_name;
+    gchar **pair, *part_name, *path;
     LibBalsaMailbox *mailbox = libbalsa_message_get_mailbox(message);
     LibBalsaMailboxImap *mimap = LIBBALSA_MAILBOX_IMAP(mailbox);
-    FILE *fp;
+    FILE *fp = NULL;
     gchar *section;
     glong msgno = libbalsa_message_get_msgno(message);
     ImapMessage *imsg = mi_get_imsg(mimap, msgno);
@@ -2487,12 +3767,21 @@ lbm_imap_get_msg_part_from_cache(LibBalsaMessage * message,
    /* look for a part cache */
     section = get_section_for(message, part);
     pair = get_cache_name_pair(mimap, "part", imsg->uid);
-    part_name   = g_strconcat(pair[0], G_DIR_SEPARATOR_S,
-                              pair[1], "-", section, NULL);
-    fp = fopen(part_name,"rb+");
+    part_name   = g_strconcat(pair[1], "-", section, NULL);
+    path = libbalsa_imap_body_cache_lookup(pair[0], part_name);
+    if(path)
+        fp = fopen(path, "rb");
+    else if(lbm_imap_get_msg_part_streamed(message, part, imsg, section,
+                                           pair[0], part_name)) {
+        g_free(section);
+        g_free(part_name);
+        g_strfreev(pair);
+        return TRUE;
+    }
     
     if(!fp) { /* no cache element */
         struct part_data dt;
+        gchar *tmp_path;
         ImapFetchBodyOptions ifbo;
         ImapResponse rc;
         LibBalsaMessageBody *parent;
@@ -2507,6 +3796,7 @@ lbm_imap_get_msg_part_from_cache(LibBalsaMessage * message,
                message. This can be simulated by randomly
                disconnecting from the IMAP server. */
             g_debug("Cannot find data for section %s", section);
+            g_free(path);
             g_strfreev(pair);
             return FALSE;
         }
@@ -2547,11 +3837,11 @@ lbm_imap_get_msg_part_from_cache(LibBalsaMessage * message,
             g_free(dt.block);
             g_free(section);
             g_free(part_name);
+            g_free(path);
             g_strfreev(pair);
             return FALSE;
         }
-        g_mkdir_with_parents(pair[0], S_IRUSR|S_IWUSR|S_IXUSR);
-        fp = fopen(part_name, "wb+");
+        fp = libbalsa_imap_body_cache_create(pair[0], &tmp_path);
         if(!fp) {
             g_set_error(err,
                         LIBBALSA_MAILBOX_ERROR, LIBBALSA_MAILBOX_ACCESS_ERROR,
@@ -2559,6 +3849,7 @@ lbm_imap_get_msg_part_from_cache(LibBalsaMessage * message,
             g_free(dt.block);
             g_free(section);
             g_free(part_name);
+            g_free(path);
             g_strfreev(pair);
             return FALSE;
         }
@@ -2576,19 +3867,42 @@ lbm_imap_get_msg_part_from_cache(LibBalsaMessage * message,
             /* we do not want to have an incomplete part in the cache
                so that the user still can try again later when the
                problem with writing (disk space?) is removed */
-            unlink(part_name);
+            unlink(tmp_path);
             g_set_error(err,
                         LIBBALSA_MAILBOX_ERROR, LIBBALSA_MAILBOX_ACCESS_ERROR,
-                        _("Cannot write to temporary file %s"), part_name);
+                        _("Cannot write to temporary file %s"), tmp_path);
+            g_free(tmp_path);
             g_free(dt.block);
             g_free(section);
             g_free(part_name);
+            g_free(path);
             g_strfreev(pair);
             return FALSE; /* something better ? */
             }
         }
         g_free(dt.block);
-	fseek(fp, 0, SEEK_SET);
+        /* Store the part in the cache; if that fails, use the
+           temporary file just this once. */
+        g_free(path);
+        fflush(fp);
+        path = libbalsa_imap_body_cache_commit(pair[0], part_name, tmp_path);
+        if(path) {
+            fclose(fp);
+            fp = fopen(path, "rb");
+        }
+        if(!fp) {
+            g_set_error(err,
+                        LIBBALSA_MAILBOX_ERROR, LIBBALSA_MAILBOX_ACCESS_ERROR,
+                        _("Cannot create temporary file"));
+            g_free(tmp_path);
+            g_free(section);
+            g_free(part_name);
+            g_free(path);
+            g_strfreev(pair);
+            return FALSE;
+        }
+        fseek(fp, 0, SEEK_SET);
+        g_free(tmp_path);
     }
     partstream = g_mime_stream_file_new (fp);
 
@@ -2602,6 +3916,7 @@ lbm_imap_get_msg_part_from_cache(LibBalsaMessage * message,
     g_object_unref (partstream);
     g_free(section);
     g_free(part_name);
+    g_free(path);
     g_strfreev(pair);
 
     return TRUE;
@@ -2944,37 +4259,6 @@ struct append_to_cache_data {
     unsigned uid_validity;
 };
 
-static void
-create_cache_copy(const gchar *src, const gchar *cache_dir, const gchar *name)
-{
-    gchar *fname = libbalsa_urlencode(name);
-    gchar *dst = g_build_filename(cache_dir, fname, NULL);
-    if(link(src, dst) != 0) {
-	/* Link failed possibly because the two caches reside on
-	   different file systems. We attempt to copy the cache instead. */
-	FILE *in  = fopen(src, "r");
-
-	if(in) {
-	    FILE *out = fopen(dst, "w");
-	    if(out) {
-	        size_t sz;
-	        char buf[65536];
-		gboolean err;
-		while( (sz=fread(buf, 1, sizeof(buf), in)) > 0)
-		    if(fwrite(buf, 1, sz, out) != sz)
-			break;
-		err = ferror(in) || ferror(out);
-		fclose(out);
-		if(err)
-		    unlink(dst);
-	    }
-	    fclose(in);
-	}
-    }
-    g_free(fname);
-    g_free(dst);
-}
-
 static void
 append_to_cache(unsigned uid, void *arg)
 {
@@ -2984,12 +4268,15 @@ append_to_cache(unsigned uid, void *arg)
 				  atcd->uid_validity,
 				  uid, "body");
     gchar *msg = atcd->curr_name->data;
+    gchar *key;
 
     atcd->curr_name = g_list_next(atcd->curr_name);
 
     g_return_if_fail(msg);
 
-    create_cache_copy(msg, atcd->cache_dir, name);
+    key = libbalsa_urlencode(name);
+    libbalsa_imap_body_cache_add_file(atcd->cache_dir, key, msg);
+    g_free(key);
     g_free(name);
 }
 
@@ -2999,15 +4286,26 @@ libbalsa_mailbox_imap_add_messages(LibBalsaMailbox * mailbox,
 				   void *arg, GError ** err)
 {
     LibBalsaMailboxImap *mimap = LIBBALSA_MAILBOX_IMAP(mailbox);
-    ImapMboxHandle *handle = libbalsa_mailbox_imap_get_handle(mimap, err);
+    GError *error = NULL;
+    ImapMboxHandle *handle = libbalsa_mailbox_imap_get_handle(mimap, &error);
     struct MultiAppendCbData macd;
     ImapResponse rc;
     ImapSequence uid_sequence;
 
+    if (handle != NULL && imap_mbox_handle_is_replica(handle)) {
+        libbalsa_mailbox_imap_release_handle(mimap);
+        return lbm_imap_replica_spool(mimap, msg_iterator, arg, err);
+    }
     if (!handle) {
+        /* The messages are kept until the server can be reached. */
+        if (lbm_imap_replica_wanted(mimap, error)) {
+            g_clear_error(&error);
+            return lbm_imap_replica_spool(mimap, msg_iterator, arg, err);
+        }
 	/* Perhaps the mailbox was closed and the authentication
 	   failed or was cancelled? err is set already, we just
 	   return. */
+        g_propagate_error(err, error);
 	return 0;
     }
 
@@ -3098,14 +4396,209 @@ lbm_imap_change_user_flags(LibBalsaMailbox * mailbox, GArray * seqno,
     }
 }
 
+/* Flag write-behind
+ *
+ * Flag changes are applied to the local flag cache at once, while the
+ * STOREs are queued by UID and sent FLAG_FLUSH_DELAY ms later, in a
+ * thread on the connection of the mailbox, or before any command that
+ * depends on the flags on the server. Consecutive changes of the same
+ * flags are merged into one UID STORE. A STORE that fails stays in the
+ * queue and is retried; after FLAG_FLUSH_RETRIES failures the user is
+ * told, and it is sent again only with the next flush.
+ */
+#define FLAG_FLUSH_DELAY   300
+#define FLAG_FLUSH_RETRIES 3
+
+static GThreadPool *flush_flags_pool;
+static GMutex flush_flags_pool_lock;
+
+struct lbm_imap_flag_op {
+    ImapMsgFlag flag;
+    gboolean state;
+    GArray *uids;
+    guint failures;
+};
+
+static void
+lbm_imap_flag_op_free(gpointer data)
+{
+    struct lbm_imap_flag_op *op = data;
+
+    if (op == NULL) /* moved to another queue */
+        return;
+    g_array_free(op->uids, TRUE);
+    g_free(op);
+}
+
+static gboolean lbm_imap_flush_flags_cb(gpointer data);
+
+/* lbm_imap_requeue_flags:
+   moves the operations ops[from..] back to the queue, in front of
+   those queued meanwhile, so that the order of the changes is kept,
+   and, if retry is TRUE, schedules another flush. */
+static void
+lbm_imap_requeue_flags(LibBalsaMailboxImap *mimap, GPtrArray *ops,
+                       guint from, gboolean retry)
+{
+    GPtrArray *pending;
+    guint i;
+
+    g_mutex_lock(&mimap->pending_flags_lock);
+    pending = mimap->pending_flags;
+    mimap->pending_flags =
+        g_ptr_array_new_with_free_func(lbm_imap_flag_op_free);
+    for (i = from; i < ops->len; i++) {
+        g_ptr_array_add(mimap->pending_flags, g_ptr_array_index(ops, i));
+        g_ptr_array_index(ops, i) = NULL;
+    }
+    for (i = 0; i < pending->len; i++) {
+        g_ptr_array_add(mimap->pending_flags,
+                        g_ptr_array_index(pending, i));
+        g_ptr_array_index(pending, i) = NULL;
+    }
+    g_ptr_array_unref(pending);
+    if (retry && mimap->flush_flags_id == 0)
+        mimap->flush_flags_id =
+            g_timeout_add(FLAG_FLUSH_DELAY, lbm_imap_flush_flags_cb, mimap);
+    g_mutex_unlock(&mimap->pending_flags_lock);
+}
+
+/* lbm_imap_flush_flags:
+   sends the queued flag changes. The queue is taken over under
+   pending_flags_lock, but the STOREs are sent under the mailbox lock
+   only, which also keeps concurrent flushes in order. */
+static void
+lbm_imap_flush_flags(LibBalsaMailboxImap *mimap)
+{
+    LibBalsaMailbox *mailbox = LIBBALSA_MAILBOX(mimap);
+    GPtrArray *ops;
+    guint i;
+
+    libbalsa_lock_mailbox(mailbox);
+    g_mutex_lock(&mimap->pending_flags_lock);
+    if (mimap->flush_flags_id != 0) {
+        g_source_remove(mimap->flush_flags_id);
+        mimap->flush_flags_id = 0;
+    }
+    ops = mimap->pending_flags;
+    mimap->pending_flags =
+        g_ptr_array_new_with_free_func(lbm_imap_flag_op_free);
+    g_mutex_unlock(&mimap->pending_flags_lock);
+
+    /* Without a handle, the mailbox is closed and the changes are
+       dropped. */
+    for (i = 0; i < ops->len && mimap->handle; i++) {
+        struct lbm_imap_flag_op *op = g_ptr_array_index(ops, i);
+        ImapResponse rc;
+
+        II(rc, mimap->handle,
+           imap_mbox_uid_store_flag(mimap->handle, op->uids->len,
+                                    (unsigned *) op->uids->data,
+                                    op->flag, op->state));
+        if (rc == IMR_OK)
+            continue;
+        if (++op->failures == FLAG_FLUSH_RETRIES)
+            libbalsa_information(LIBBALSA_INFORMATION_WARNING,
+                                 _("Storing the flags of %u messages in "
+                                   "mailbox %s failed; the changes are "
+                                   "kept and will be sent again."),
+                                 op->uids->len,
+                                 libbalsa_mailbox_get_name(mailbox));
+        lbm_imap_requeue_flags(mimap, ops, i,
+                               op->failures < FLAG_FLUSH_RETRIES);
+        break;
+    }
+    g_ptr_array_unref(ops);
+    libbalsa_unlock_mailbox(mailbox);
+}
+
+/* The STOREs go to the connection of the mailbox, so that they stay
+   in order with its commands; no other connection is needed. */
+static void
+lbm_imap_flush_flags_thread(gpointer data, gpointer user_data)
+{
+    LibBalsaMailboxImap *mimap = data;
+
+    lbm_imap_flush_flags(mimap);
+    g_object_unref(mimap);
+}
+
+static gboolean
+lbm_imap_flush_flags_cb(gpointer data)
+{
+    LibBalsaMailboxImap *mimap = data;
+
+    g_mutex_lock(&mimap->pending_flags_lock);
+    mimap->flush_flags_id = 0;
+    g_mutex_unlock(&mimap->pending_flags_lock);
+
+    g_mutex_lock(&flush_flags_pool_lock);
+    if (flush_flags_pool == NULL)
+        flush_flags_pool =
+            g_thread_pool_new(lbm_imap_flush_flags_thread, NULL, 2, FALSE,
+                              NULL);
+    g_mutex_unlock(&flush_flags_pool_lock);
+    g_thread_pool_push(flush_flags_pool, g_object_ref(mimap), NULL);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* lbm_imap_queue_flags:
+   queues the change of flag for messages seqno. Returns FALSE, without
+   changing anything, if the UID of some message is not known. */
+static gboolean
+lbm_imap_queue_flags(LibBalsaMailboxImap *mimap, GArray *seqno,
+                     ImapMsgFlag flag, gboolean state)
+{
+    struct lbm_imap_flag_op *op = NULL;
+    GArray *uids;
+    guint i;
+
+    uids = g_array_sized_new(FALSE, FALSE, sizeof(unsigned), seqno->len);
+    for (i = 0; i < seqno->len; i++) {
+        unsigned uid =
+            lbm_imap_msgno_to_uid(mimap, g_array_index(seqno, guint, i));
+        if (uid == 0) {
+            g_array_free(uids, TRUE);
+            return FALSE;
+        }
+        g_array_append_val(uids, uid);
+    }
+    imap_mbox_store_flag_local(mimap->handle, seqno->len,
+                               (guint *) seqno->data, flag, state);
+
+    g_mutex_lock(&mimap->pending_flags_lock);
+    if (mimap->pending_flags->len > 0)
+        op = g_ptr_array_index(mimap->pending_flags,
+                               mimap->pending_flags->len - 1);
+    if (op != NULL && op->flag == flag && op->state == state) {
+        g_array_append_vals(op->uids, uids->data, uids->len);
+        g_array_free(uids, TRUE);
+    } else {
+        op = g_new(struct lbm_imap_flag_op, 1);
+        op->flag  = flag;
+        op->state = state;
+        op->uids  = uids;
+        op->failures = 0;
+        g_ptr_array_add(mimap->pending_flags, op);
+    }
+    if (mimap->flush_flags_id == 0)
+        mimap->flush_flags_id =
+            g_timeout_add(FLAG_FLUSH_DELAY, lbm_imap_flush_flags_cb, mimap);
+    g_mutex_unlock(&mimap->pending_flags_lock);
+
+    return TRUE;
+}
+
 static gboolean
 lbm_imap_messages_change_flags(LibBalsaMailbox * mailbox, GArray * seqno,
 			       LibBalsaMessageFlag set,
 			       LibBalsaMessageFlag clear)
 {
+    LibBalsaMailboxImap *mimap = LIBBALSA_MAILBOX_IMAP(mailbox);
     ImapMsgFlag flag_set, flag_clr;
     ImapResponse rc = IMR_OK;
-    ImapMboxHandle *handle = LIBBALSA_MAILBOX_IMAP(mailbox)->handle;
+    ImapMboxHandle *handle = mimap->handle;
 
     if(seqno->len == 0) return TRUE;
     lbm_imap_change_user_flags(mailbox, seqno, set, clear);
@@ -3116,6 +4609,19 @@ lbm_imap_messages_change_flags(LibBalsaMailbox * mailbox, GArray * seqno,
 
     g_array_sort(seqno, cmp_msgno);
     transform_flags(set, clear, &flag_set, &flag_clr);
+    if (handle != NULL && imap_mbox_handle_is_replica(handle))
+        return
+            (!flag_set ||
+             lbm_imap_replica_change_flags(mimap, seqno, flag_set, TRUE)) &&
+            (!flag_clr ||
+             lbm_imap_replica_change_flags(mimap, seqno, flag_clr, FALSE));
+    /* The queued changes are kept by UID, so unsolicited EXPUNGE
+       responses cannot make them hit other messages. */
+    if (handle != NULL &&
+        (!flag_set || lbm_imap_queue_flags(mimap, seqno, flag_set, TRUE)) &&
+        (!flag_clr || lbm_imap_queue_flags(mimap, seqno, flag_clr, FALSE)))
+        return TRUE;
+    lbm_imap_flush_flags(mimap); /* keep the order of the changes */
     /* Do not use the asynchronous versions until the issues related
        to unsolicited EXPUNGE responses are resolved. The issues are
        pretty much of a theoretical character but we do not want to
@@ -3213,18 +4719,29 @@ libbalsa_mailbox_imap_set_threading(LibBalsaMailbox *mailbox,
     ImapSearchKey *filter =
         lbmi_build_imap_query(libbalsa_mailbox_get_view_filter(mailbox, FALSE), NULL);
     ImapResponse rc;
+    gboolean changed = FALSE;
     
     libbalsa_mailbox_get_view(mailbox)->threading_type = thread_type;
+    if(filter)
+        lbm_imap_flush_flags(mimap);
     switch(thread_type) {
     case LB_MAILBOX_THREADING_SIMPLE:
     case LB_MAILBOX_THREADING_JWZ:
+        if(!filter &&
+           (new_tree = lbm_imap_thread_cache_restore(mimap, &changed))) {
+            if(changed)
+                lbm_imap_thread_cache_save(mimap, new_tree);
+            break;
+        }
         II(rc,mimap->handle,
            imap_mbox_thread(mimap->handle, "REFERENCES", filter));
         if(rc == IMR_OK) {
             new_tree =
                 g_node_copy(imap_mbox_handle_get_thread_root(mimap->handle));
+            if(!filter)
+                lbm_imap_thread_cache_save(mimap, new_tree);
             break;
-        } else 
+        } else if (!imap_mbox_handle_is_replica(mimap->handle))
             libbalsa_information(LIBBALSA_INFORMATION_WARNING,
 			     _("Server-side threading not supported."));
         /* fall through */
@@ -3305,11 +4822,21 @@ libbalsa_mailbox_imap_sort(LibBalsaMailbox *mbox, GArray *array)
         guint i, len;
 
         len = mimap->messages_info->len;
-        msgno_arr = g_malloc(len * sizeof(unsigned));
+        g_array_set_size(mimap->sort_order, len);
+        msgno_arr = (unsigned *) mimap->sort_order->data;
         for (i = 0; i < len; i++)
             msgno_arr[i] = i + 1;
         if (libbalsa_mailbox_get_view(mbox)->sort_field != LB_MAILBOX_SORT_NO) {
             ImapResponse rc;
+            /* A replica sorts on the client, which cannot fetch the
+             * envelopes. */
+            if (imap_mbox_handle_is_replica(mimap->handle))
+                for (i = 0; i < len; i++) {
+                    ImapMessage *imsg =
+                        imap_mbox_handle_get_msg(mimap->handle, i + 1);
+                    if (imsg == NULL || imsg->envelope == NULL)
+                        icm_load_msg(mimap->icm, mimap->handle, i + 1);
+                }
 	    /* Server-side sort of the whole mailbox. */
             II(rc, LIBBALSA_MAILBOX_IMAP(mbox)->handle,
                imap_mbox_sort_msgno(LIBBALSA_MAILBOX_IMAP(mbox)->handle,
@@ -3319,7 +4846,6 @@ libbalsa_mailbox_imap_sort(LibBalsaMailbox *mbox, GArray *array)
         g_array_set_size(mimap->sort_ranks, len);
         for (i = 0; i < len; i++)
 	    g_array_index(mimap->sort_ranks, guint, msgno_arr[i] - 1) = i;
-	g_free(msgno_arr);
 	/* Validate the cache. */
         mimap->sort_field = libbalsa_mailbox_get_view(mbox)->sort_field;
     }
@@ -3337,6 +4863,48 @@ libbalsa_mailbox_imap_total_messages(LibBalsaMailbox * mailbox)
     return cnt;
 }
 
+struct copy_cache_data {
+    LibBalsaServer *server;
+    LibBalsaMailboxImap *dest;
+    gchar *cache_dir;
+    size_t prefix_length;
+    const unsigned *uids;       /* sorted UIDs of the copied messages */
+    unsigned cnt;
+    ImapSequence *uid_sequence; /* their UIDs in dest */
+};
+
+/* copy_cache_entry() makes the cache entry key of a copied message
+   available under the message UID in the destination mailbox. */
+static void
+copy_cache_entry(const gchar *key, gpointer data)
+{
+    struct copy_cache_data *ccd = data;
+    unsigned msg_uid, im, nth;
+    gchar *tail;
+
+    msg_uid = strtol(key + ccd->prefix_length, &tail, 10);
+    for(im = 0; im<ccd->cnt; im++) {
+        if(ccd->uids[im]>msg_uid) break;
+        else if(ccd->uids[im]==msg_uid &&
+                (nth = imap_sequence_nth(ccd->uid_sequence, im))) {
+            gchar *dst_prefix =
+                g_strdup_printf("%s@%s-%s-%u-%u%s",
+                                libbalsa_server_get_user(ccd->server),
+                                libbalsa_server_get_host(ccd->server),
+                                (ccd->dest->path != NULL ?
+                                 ccd->dest->path : "INBOX"),
+                                ccd->uid_sequence->uid_validity,
+                                nth, tail);
+            gchar *dst_key = libbalsa_urlencode(dst_prefix);
+
+            libbalsa_imap_body_cache_link(ccd->cache_dir, key, dst_key);
+            g_free(dst_key);
+            g_free(dst_prefix);
+            break;
+        }
+    }
+}
+
 /* Copy messages in the list to dest; use server-side copy if mailbox
  * and dest are on the same server, fall back to parent method
  * otherwise.
@@ -3358,6 +4926,9 @@ libbalsa_mailbox_imap_messages_copy(LibBalsaMailbox * mailbox,
 	unsigned im;
 	g_return_val_if_fail(handle, FALSE);
 
+        if (imap_mbox_handle_is_replica(handle))
+            return lbm_imap_replica_copy(mimap, msgnos, mimap_dest, err);
+	lbm_imap_flush_flags(mimap);
 	imap_sequence_init(&uid_sequence);
 	/* User server-side copy. */
 	g_array_sort(msgnos, cmp_msgno);
@@ -3379,12 +4950,11 @@ libbalsa_mailbox_imap_messages_copy(LibBalsaMailbox * mailbox,
                         "%s", msg);
             g_free(msg);
         } else if(!imap_sequence_empty(&uid_sequence)) {
-	    /* Copy cache files. */
-	    GDir *dir;
+	    /* Copy cache entries. */
 	    LibBalsaImapServer *imap_server = LIBBALSA_IMAP_SERVER(server);
 	    gboolean is_persistent =
 		libbalsa_imap_server_has_persistent_cache(imap_server);
-	    gchar *dir_name = get_cache_dir(is_persistent);
+	    struct copy_cache_data ccd;
 	    gchar *src_prefix = g_strdup_printf("%s@%s-%s-%u-",
 						libbalsa_server_get_user(server),
                                                 libbalsa_server_get_host(server),
@@ -3393,42 +4963,18 @@ libbalsa_mailbox_imap_messages_copy(LibBalsaMailbox * mailbox,
 						mimap->uid_validity);
 	    gchar *encoded_path = libbalsa_urlencode(src_prefix);
 	    g_free(src_prefix);
-	    dir = g_dir_open(dir_name, 0, NULL);
-	    if (dir != NULL) {
-		const gchar *filename;
-		size_t prefix_length = strlen(encoded_path);
-		unsigned nth;
-		while ((filename = g_dir_read_name(dir)) != NULL) {
-		    unsigned msg_uid;
-		    gchar *tail;
-		    if(strncmp(encoded_path, filename, prefix_length))
-			continue;
-		    msg_uid = strtol(filename + prefix_length, &tail, 10);
-		    for(im = 0; im<msgnos->len; im++) {
-			if(uids[im]>msg_uid) break;
-			else if(uids[im]==msg_uid &&
-				(nth = imap_sequence_nth(&uid_sequence, im))
-				 ) {
-			    gchar *src =
-				g_build_filename(dir_name, filename, NULL);
-			    gchar *dst_prefix =
-				g_strdup_printf("%s@%s-%s-%u-%u%s",
-						libbalsa_server_get_user(server),
-                                                libbalsa_server_get_host(server),
-						(mimap_dest->path != NULL ?
-						 mimap_dest->path : "INBOX"),
-						uid_sequence.uid_validity,
-						nth, tail);
-
-			    create_cache_copy(src, dir_name, dst_prefix);
-			    g_free(dst_prefix);
-			    break;
-			}
-		    }
-		}
-		g_dir_close(dir);
-	    }
-	    g_free(dir_name);
+
+	    ccd.server        = server;
+	    ccd.dest          = mimap_dest;
+	    ccd.cache_dir     = get_cache_dir(is_persistent);
+	    ccd.prefix_length = strlen(encoded_path);
+	    ccd.uids          = uids;
+	    ccd.cnt           = msgnos->len;
+	    ccd.uid_sequence  = &uid_sequence;
+	    libbalsa_imap_body_cache_foreach(ccd.cache_dir, encoded_path,
+					     copy_cache_entry, &ccd);
+	    g_free(ccd.cache_dir);
+	    g_free(encoded_path);
 	}
 	g_free(uids);
 	imap_sequence_release(&uid_sequence);
@@ -3444,6 +4990,7 @@ void
 libbalsa_imap_set_cache_size(off_t cache_size)
 {
     ImapCacheSize = cache_size;
+    libbalsa_imap_body_cache_set_size(cache_size);
 }
 
 /** Purges the temporary directory used for non-persistent message
@@ -3452,7 +4999,7 @@ void
 libbalsa_imap_purge_temp_dir(off_t cache_size)
 {
     gchar *dir_name = get_cache_dir(FALSE);
-    clean_dir(dir_name, cache_size);
+    libbalsa_imap_body_cache_trim(dir_name, cache_size);
     g_free(dir_name);
 }
 
@@ -3479,16 +5026,60 @@ libbalsa_imap_purge_temp_dir(off_t cache_size)
      ImapMboxHandle and can be potentially used in future sessions -
      mostly all ImapMessage and ImapEnvelope structures.
 
-     Current implementation stores the information in memory but an
-     implementation storing data on disk is possible, too.
-
+     The data of the session is kept in memory. Data from earlier
+     sessions is kept in a file which is mapped, not read: its messages
+     are deserialized only when they are first needed, so the memory
+     footprint is proportional to what is actually viewed.
+
+   On-disk layout of the header cache, integers in host byte order:
+     struct icm_file_header;
+     uint32_t uidmap[exists];                 UID of each msgno, or 0;
+     struct icm_record records[n_records];    sorted by UID;
+     serialized messages, each aligned to ICM_ALIGNMENT bytes.
+
+   Persistence is write-behind. Messages are serialized as they are
+   fetched and appended to a journal next to the cache file; when the
+   mailbox is closed, the cache manager is handed over to a background
+   thread that merges the old file and the session data into a new
+   file and removes the journal. A journal left behind by a crash is
+   replayed on the next open. A flag change only journals the new
+   flags, so that flag churn does not rewrite whole messages. Journal
+   layout:
+     ICM_JOURNAL_MAGIC; uint32_t uidvalidity;
+     { uint32_t uid; uint32_t size; serialized message[size]; } or
+     { uint32_t uid; ICM_JOURNAL_FLAGS; uint32_t flags; } ...
  */
+#define ICM_MAGIC "BalsaHC3"
+#define ICM_ALIGNMENT 8
+#define ICM_ALIGN(off) (((off) + ICM_ALIGNMENT - 1) & ~(gsize) (ICM_ALIGNMENT - 1))
+#define ICM_JOURNAL_MAGIC "BalsaHJ3"
+#define ICM_JOURNAL_FLAGS ((uint32_t) ~0)
+
+struct icm_file_header {
+    gchar    magic[8];
+    uint32_t uidvalidity;
+    uint32_t uidnext;
+    uint32_t exists;
+    uint32_t n_records;
+};
+
+struct icm_record {
+    uint32_t uid;
+    uint32_t size;
+    uint64_t offset;
+};
+
 struct ImapCacheManager {
-    GHashTable *headers;
+    GHashTable *headers;        /* UID -> serialized data of this session */
     GArray     *uidmap;
     uint32_t    uidvalidity;
     uint32_t    uidnext;
     uint32_t    exists;
+    GMappedFile *mapped;        /* data of earlier sessions, if any */
+    const struct icm_record *records;
+    uint32_t    n_records;
+    gchar      *journal_path;   /* NULL unless the cache is persistent */
+    gboolean    extend_map;     /* journal knows messages beyond uidmap */
 };
 
 static struct ImapCacheManager*
@@ -3505,48 +5096,43 @@ imap_cache_manager_new(guint cnt)
 static struct ImapCacheManager*
 imap_cache_manager_new_from_file(const char *header_cache_path)
 {
-    /* The cache data should be transferable between 32- and 64-bit
-       systems. */
-    uint32_t i;
-    ImapUID uid;
+    GMappedFile *mapped;
+    const gchar *contents;
+    const struct icm_file_header *hdr;
+    gsize length, records_offset;
     struct ImapCacheManager *icm;
-    FILE *f = fopen(header_cache_path, "rb");
-    if(!f) {
-	return NULL;
-    }
-    if(fread(&i, sizeof(i), 1, f) != 1) {
-	g_debug("Could not read cache table size.");
-        fclose(f);
-	return NULL;
-    }
-    
-    icm = imap_cache_manager_new(i);
-    if(fread(&icm->uidvalidity, sizeof(uint32_t), 1, f) != 1 ||
-       fread(&icm->uidnext,     sizeof(uint32_t), 1, f) != 1 ||
-       fread(&icm->exists,      sizeof(uint32_t), 1, f) != 1) {
-	imap_cache_manager_free(icm);
-	g_debug("Couldn't read cache - aborting…");
-        fclose(f);
-	return NULL;
+
+    mapped = g_mapped_file_new(header_cache_path, FALSE, NULL);
+    if (mapped == NULL)
+        return NULL;
+
+    contents = g_mapped_file_get_contents(mapped);
+    length = g_mapped_file_get_length(mapped);
+    hdr = (const struct icm_file_header *) contents;
+    if (length < sizeof(*hdr) ||
+        memcmp(hdr->magic, ICM_MAGIC, sizeof(hdr->magic)) != 0) {
+        g_debug("%s: no valid header cache in %s", __func__,
+                header_cache_path);
+        g_mapped_file_unref(mapped);
+        return NULL;
     }
 
-    i = 0;
-    while(fread(&uid, sizeof(uid), 1, f) == 1) {
-	if(uid) {
-	    uint32_t slen; /* Architecture-independent size */
-	    gchar *s;
-	    if(fread(&slen, sizeof(slen), 1, f) != 1)
-		break;
-	    s = g_malloc(slen+1); /* slen would be sufficient? */
-	    if(fread(s, 1, slen, f) != slen)
-                break;
-	    s[slen] = '\0'; /* Unneeded? */
-	    g_hash_table_insert(icm->headers, GUINT_TO_POINTER(uid), s);
-	}
-        g_array_append_val(icm->uidmap, uid);
-	i++;
+    records_offset =
+        ICM_ALIGN(sizeof(*hdr) + (gsize) hdr->exists * sizeof(uint32_t));
+    if (records_offset +
+        (gsize) hdr->n_records * sizeof(struct icm_record) > length) {
+        g_debug("Couldn't read cache - aborting…");
+        g_mapped_file_unref(mapped);
+        return NULL;
     }
-    fclose(f);
+
+    icm = imap_cache_manager_new(hdr->exists);
+    icm->uidvalidity = hdr->uidvalidity;
+    icm->uidnext     = hdr->uidnext;
+    g_array_append_vals(icm->uidmap, contents + sizeof(*hdr), hdr->exists);
+    icm->mapped    = mapped;
+    icm->records   = (const struct icm_record *) (contents + records_offset);
+    icm->n_records = hdr->n_records;
 
     return icm;
 }
@@ -3556,15 +5142,83 @@ imap_cache_manager_free(struct ImapCacheManager *icm)
 {
     g_hash_table_destroy(icm->headers);
     g_array_free(icm->uidmap, TRUE);
+    if (icm->mapped != NULL)
+        g_mapped_file_unref(icm->mapped);
+    g_free(icm->journal_path);
     g_free(icm);
 }
 
-/* icm_init_on_select_() preloads header cache of the ImapMboxHandle object.
-   It currently handles following cases:
+static int
+icm_cmp_record(const void *a, const void *b)
+{
+    uint32_t uid_a = ((const struct icm_record *) a)->uid;
+    uint32_t uid_b = ((const struct icm_record *) b)->uid;
+
+    return uid_a < uid_b ? -1 : (uid_a > uid_b ? 1 : 0);
+}
+
+/* Returns the serialized data of message uid, or NULL if it is not
+   in the cache. */
+static gpointer
+icm_lookup_mapped(struct ImapCacheManager *icm, uint32_t uid)
+{
+    const struct icm_record *rec;
+    struct icm_record key;
+
+    if (icm->mapped == NULL)
+        return NULL;
+
+    key.uid = uid;
+    rec = bsearch(&key, icm->records, icm->n_records, sizeof(*rec),
+                  icm_cmp_record);
+    if (rec == NULL || rec->size == 0 ||
+        rec->offset + rec->size > g_mapped_file_get_length(icm->mapped))
+        return NULL;
+
+    return g_mapped_file_get_contents(icm->mapped) + rec->offset;
+}
+
+static gpointer
+icm_lookup(struct ImapCacheManager *icm, uint32_t uid)
+{
+    gpointer data = g_hash_table_lookup(icm->headers, GUINT_TO_POINTER(uid));
+
+    return data != NULL ? data : icm_lookup_mapped(icm, uid);
+}
+
+/* icm_set_flags() sets the flags of a cached message; data of earlier
+   sessions is copied to the session data first. Returns FALSE if uid
+   is not in the cache. */
+static gboolean
+icm_set_flags(struct ImapCacheManager *icm, uint32_t uid, ImapMsgFlags flags)
+{
+    gpointer data = g_hash_table_lookup(icm->headers, GUINT_TO_POINTER(uid));
+
+    if (data == NULL) {
+        gpointer mapped = icm_lookup_mapped(icm, uid);
+
+        if (mapped == NULL)
+            return FALSE;
+#if GLIB_CHECK_VERSION(2, 68, 0)
+        data = g_memdup2(mapped, imap_serialized_message_size(mapped));
+#else
+        data = g_memdup(mapped, imap_serialized_message_size(mapped));
+#endif
+        g_hash_table_insert(icm->headers, GUINT_TO_POINTER(uid), data);
+    }
+    imap_serialized_message_set_flags(data, flags);
+
+    return TRUE;
+}
+
+/* icm_sync_uidmap() brings the msgno->UID map of the cache up to date
+   with the freshly selected mailbox. It currently handles following
+   cases:
    a). uidvalidity different - entire cache has to be invalidated.
    b). cache->exists == h->exists && cache->uidnext == h->uidnext:
-   nothing has changed - feed entire cache.
+   nothing has changed - the map is valid.
    else fetch the message numbers for the UIDs in cache.
+   Returns FALSE if the cache cannot be used.
 */
 static void
 set_uid(ImapMboxHandle *handle, unsigned seqno, void *arg)
@@ -3573,21 +5227,21 @@ set_uid(ImapMboxHandle *handle, unsigned seqno, void *arg)
     g_array_append_val(a, seqno);
 }
 
-static void
-icm_restore_from_cache(ImapMboxHandle *h, struct ImapCacheManager *icm)
+static gboolean
+icm_sync_uidmap(ImapMboxHandle *h, struct ImapCacheManager *icm)
 {
     unsigned exists, uidvalidity, uidnext;
     unsigned i;
 
     if(!icm || ! h)
-        return;
+        return FALSE;
     uidvalidity = imap_mbox_handle_get_validity(h);
     exists  = imap_mbox_handle_get_exists(h);
     uidnext = imap_mbox_handle_get_uidnext(h);
     if(icm->uidvalidity != uidvalidity) {
     	g_debug("Different validities old: %u new: %u - cache invalidated",
                icm->uidvalidity, uidvalidity);
-        return;
+        return FALSE;
     }
 
     /* There were some modifications to the mailbox but the situation
@@ -3613,97 +5267,1029 @@ icm_restore_from_cache(ImapMboxHandle *h, struct ImapCacheManager *icm)
             uidmap->len = lo-1;
             rc = imap_search_exec(h, TRUE, k, set_uid, uidmap);
             imap_search_key_free(k);
-        } else rc = IMR_NO;
+        } else rc = IMR_OK; /* no UID known, nothing to sync */
         if(rc != IMR_OK) {
             g_array_free(uidmap, TRUE);
-            return;
+            return FALSE;
         }
         g_array_free(icm->uidmap, TRUE); icm->uidmap = uidmap;
         g_debug("New uidmap has length: %u", icm->uidmap->len);
     }
-    /* One way or another, we have a valid uid->seqno map now;
-     * The mailbox data can be resynced easily. */
+    /* The journal may know messages that arrived after the cache file
+     * was written; learn their UIDs, too. */
+    if(icm->extend_map && icm->uidmap->len < exists) {
+        guint len = icm->uidmap->len;
+        ImapSearchKey *k =
+            imap_search_key_new_range(FALSE, FALSE, len + 1, exists);
+        if(imap_search_exec(h, TRUE, k, set_uid, icm->uidmap) != IMR_OK ||
+           icm->uidmap->len != exists)
+            g_array_set_size(icm->uidmap, len);
+        imap_search_key_free(k);
+    }
+    icm->extend_map = FALSE;
+
+    /* One way or another, we have a valid uid->seqno map now. */
+    if(icm->uidmap->len > exists)
+        g_array_set_size(icm->uidmap, exists);
+    icm->exists  = exists;
+    icm->uidnext = uidnext;
+
+    return TRUE;
+}
 
-    for(i=1; i<=icm->exists; i++) {
+/* icm_restore_from_cache() preloads the header cache of the
+   ImapMboxHandle object with all the data of the cache manager. */
+static void
+icm_restore_from_cache(ImapMboxHandle *h, struct ImapCacheManager *icm)
+{
+    unsigned i;
+
+    if(!icm_sync_uidmap(h, icm))
+        return;
+
+    for(i=1; i<=icm->uidmap->len; i++) {
         uint32_t uid = g_array_index(icm->uidmap, uint32_t, i-1);
-        void *data = g_hash_table_lookup(icm->headers,
-                                         GUINT_TO_POINTER(uid));
+        void *data = uid ? icm_lookup(icm, uid) : NULL;
         if(data) /* if uid known */
             imap_mbox_handle_msg_deserialize(h, i, data);
     }
 }
 
-/** Stores (possibly persistently) data associated with given handle.
-    This allows for quick restore between IMAP sessions and reduces
-    synchronization overhead. */
-static struct ImapCacheManager*
-icm_store_cached_data(ImapMboxHandle *handle)
+static gboolean
+icm_has_msg(struct ImapCacheManager *icm, unsigned msgno)
 {
-    struct ImapCacheManager *icm;
-    unsigned cnt, i;
+    uint32_t uid;
 
-    if(!handle)
-        return NULL;
+    if (icm == NULL || msgno == 0 || msgno > icm->uidmap->len)
+        return FALSE;
+    uid = g_array_index(icm->uidmap, uint32_t, msgno - 1);
 
-    cnt = imap_mbox_handle_get_exists(handle);
-    icm = imap_cache_manager_new(cnt);
-    icm->uidvalidity = imap_mbox_handle_get_validity(handle);
-    icm->uidnext     = imap_mbox_handle_get_uidnext(handle);
+    return uid != 0 && icm_lookup(icm, uid) != NULL;
+}
 
-    for(i=0; i<cnt; i++) {
-        void *ptr;
-        ImapMessage *imsg = imap_mbox_handle_get_msg(handle, i+1);
-        unsigned uid;
-        if(imsg && (ptr = imap_message_serialize(imsg)) != NULL) {
-            g_hash_table_insert(icm->headers,
-                                GUINT_TO_POINTER(imsg->uid), ptr);
-            uid = imsg->uid;
-        } else uid = 0;
-        g_array_append_val(icm->uidmap, uid);
+/* icm_load_msg() restores a single message from the cache on first
+   access. Returns TRUE if the message was found. */
+static gboolean
+icm_load_msg(struct ImapCacheManager *icm, ImapMboxHandle *h,
+             unsigned msgno)
+{
+    uint32_t uid;
+    void *data;
+    ImapMessage *imsg;
+
+    if (icm == NULL || msgno == 0 || msgno > icm->uidmap->len)
+        return FALSE;
+    uid = g_array_index(icm->uidmap, uint32_t, msgno - 1);
+    if (uid == 0 || (data = icm_lookup(icm, uid)) == NULL)
+        return FALSE;
+
+    imap_mbox_handle_msg_deserialize(h, msgno, data);
+    imsg = imap_mbox_handle_get_msg(h, msgno);
+
+    return imsg != NULL && imsg->envelope != NULL;
+}
+
+static int
+icm_cmp_uid(gconstpointer a, gconstpointer b)
+{
+    guint uid_a = GPOINTER_TO_UINT(a), uid_b = GPOINTER_TO_UINT(b);
+
+    return uid_a < uid_b ? -1 : (uid_a > uid_b ? 1 : 0);
+}
+
+/* icm_new_replica() returns a replica of mailbox mbox, see
+   imap_mbox_handle_new_replica(), made from the cache. Its messages
+   are those of the msgno->UID map of the last session, less those
+   whose headers were never fetched, followed by the messages that are
+   known only to the journal, which have arrived since. */
+static ImapMboxHandle *
+icm_new_replica(struct ImapCacheManager *icm, const gchar *mbox,
+                ImapUID uidnext)
+{
+    ImapMboxHandle *handle;
+    GArray *uidmap;
+    GList *uids, *list;
+    uint32_t max_uid = 0;
+    guint i;
+
+    uidmap = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+    for (i = 0; i < icm->uidmap->len; i++) {
+        uint32_t uid = g_array_index(icm->uidmap, uint32_t, i);
+
+        if (uid != 0 && icm_lookup(icm, uid) != NULL) {
+            g_array_append_val(uidmap, uid);
+            max_uid = MAX(max_uid, uid);
+        }
     }
-    return icm;
+    uids = g_list_sort(g_hash_table_get_keys(icm->headers), icm_cmp_uid);
+    for (list = uids; list != NULL; list = list->next) {
+        uint32_t uid = GPOINTER_TO_UINT(list->data);
+
+        if (uid > max_uid) {
+            g_array_append_val(uidmap, uid);
+            max_uid = uid;
+        }
+    }
+    g_list_free(uids);
+
+    g_array_free(icm->uidmap, TRUE);
+    icm->uidmap     = uidmap;
+    icm->exists     = uidmap->len;
+    icm->uidnext    = MAX(uidnext, max_uid + 1);
+    icm->extend_map = FALSE;
+
+    handle = imap_mbox_handle_new_replica(mbox, icm->exists,
+                                          icm->uidvalidity, icm->uidnext);
+    for (i = 0; i < uidmap->len; i++) {
+        gpointer data = icm_lookup(icm, g_array_index(uidmap, uint32_t, i));
+
+        imap_mbox_handle_replica_set_flags(handle, i + 1,
+                                           imap_serialized_message_get_flags
+                                           (data));
+    }
+
+    return handle;
 }
 
+/* icm_msgno_expunged() keeps the msgno->UID map in step with the
+   mailbox. */
+static void
+icm_msgno_expunged(struct ImapCacheManager *icm, unsigned msgno)
+{
+    if (icm != NULL && msgno >= 1 && msgno <= icm->uidmap->len) {
+        g_array_remove_index(icm->uidmap, msgno - 1);
+        icm->exists--;
+    }
+}
+
+/* icm_matches_handle() checks whether the msgno->UID map can still be
+   trusted. New messages are fine, but a changed UIDNEXT or a shrunk
+   mailbox means that the mailbox was selected again behind our back. */
 static gboolean
-icm_save_header(uint32_t uid, gpointer value, FILE *f)
+icm_matches_handle(struct ImapCacheManager *icm, ImapMboxHandle *h)
 {
-    if(fwrite(&uid, sizeof(uid), 1, f) != 1) return FALSE;
-    if(uid) {
-	uint32_t slen = imap_serialized_message_size(value);
-	if(fwrite(&slen, sizeof(slen), 1, f) != 1 ||
-           fwrite(value, 1, slen, f) != slen)
-            return FALSE;
+    return imap_mbox_handle_get_uidnext(h) == icm->uidnext &&
+        imap_mbox_handle_get_exists(h) >= icm->exists;
+}
+
+/* icm_message_record() returns the journal record of message uid,
+   whose serialized form is ptr. */
+static GBytes *
+icm_message_record(uint32_t uid, gconstpointer ptr)
+{
+    uint32_t hdr[2];
+    gchar *rec;
+
+    hdr[0] = uid;
+    hdr[1] = imap_serialized_message_size((void *) ptr);
+    rec = g_malloc(sizeof(hdr) + hdr[1]);
+    memcpy(rec, hdr, sizeof(hdr));
+    memcpy(rec + sizeof(hdr), ptr, hdr[1]);
+
+    return g_bytes_new_take(rec, sizeof(hdr) + hdr[1]);
+}
+
+/* icm_insert_msg() stores the serialized form of imsg in the cache
+   and, if journal is not NULL, appends a journal record for it. */
+static void
+icm_insert_msg(struct ImapCacheManager *icm, ImapMessage *imsg,
+               GPtrArray *journal)
+{
+    void *ptr = imap_message_serialize(imsg);
+
+    if (ptr == NULL)
+        return;
+    g_hash_table_insert(icm->headers, GUINT_TO_POINTER(imsg->uid), ptr);
+    if (journal != NULL)
+        g_ptr_array_add(journal, icm_message_record(imsg->uid, ptr));
+}
+
+/* icm_update_from_handle() brings the cache in step with the mailbox
+   after new messages were announced. They only extend the msgno->UID
+   map, and their UIDs are learnt as they are fetched. If the mailbox
+   shrank, the map is rebuilt from the handle, keeping the cached
+   headers; a new UIDVALIDITY invalidates them, and the new cache is
+   not journaled: the journal on disk belongs to the old one. */
+static struct ImapCacheManager*
+icm_update_from_handle(struct ImapCacheManager *icm, ImapMboxHandle *h)
+{
+    unsigned exists = imap_mbox_handle_get_exists(h);
+
+    if (icm->uidvalidity != imap_mbox_handle_get_validity(h))
+        return icm_store_cached_data(h, icm);
+
+    if (exists >= icm->exists) {
+        icm->exists  = exists;
+        icm->uidnext = imap_mbox_handle_get_uidnext(h);
+        return icm;
     }
-    return TRUE;
+
+    g_array_set_size(icm->uidmap, 0);
+    return icm_store_cached_data(h, icm);
 }
 
+/** Stores (possibly persistently) data associated with given handle.
+    This allows for quick restore between IMAP sessions and reduces
+    synchronization overhead. The session data in old_icm, if any, is
+    reused: only the msgno->UID map is rebuilt and only the messages
+    that are not cached yet are serialized. */
+static struct ImapCacheManager*
+icm_store_cached_data(ImapMboxHandle *handle,
+                      struct ImapCacheManager *old_icm)
+{
+    struct ImapCacheManager *icm;
+    GArray *uidmap;
+    unsigned cnt, i;
+
+    if(!handle)
+        return old_icm;
+
+    if(old_icm &&
+       old_icm->uidvalidity == imap_mbox_handle_get_validity(handle))
+        icm = old_icm;
+    else {
+        if(old_icm)
+            imap_cache_manager_free(old_icm);
+        icm = imap_cache_manager_new(0);
+    }
+
+    cnt = imap_mbox_handle_get_exists(handle);
+    icm->exists      = cnt;
+    icm->uidvalidity = imap_mbox_handle_get_validity(handle);
+    icm->uidnext     = imap_mbox_handle_get_uidnext(handle);
 
+    uidmap = g_array_sized_new(FALSE, TRUE, sizeof(uint32_t), cnt);
+    for(i=0; i<cnt; i++) {
+        ImapMessage *imsg = imap_mbox_handle_get_msg(handle, i+1);
+        uint32_t uid;
+        if(imsg && imsg->envelope) {
+            uid = imsg->uid;
+            if(!icm_lookup(icm, uid))
+                icm_insert_msg(icm, imsg, NULL);
+        } else if(i < icm->uidmap->len &&
+                  (uid = g_array_index(icm->uidmap, uint32_t, i)) != 0 &&
+                  icm_lookup(icm, uid) != NULL) {
+            /* Not looked at in this session - keep the old record. */
+        } else uid = 0;
+        g_array_append_val(uidmap, uid);
+    }
+    g_array_free(icm->uidmap, TRUE);
+    icm->uidmap = uidmap;
+
+    return icm;
+}
+
+static gboolean
+icm_write_padding(FILE *f, gsize *offset)
+{
+    static const gchar zeros[ICM_ALIGNMENT];
+    gsize pad = ICM_ALIGN(*offset) - *offset;
+
+    *offset += pad;
+    return pad == 0 || fwrite(zeros, 1, pad, f) == pad;
+}
+
+/* icm_save_to_file() writes the cache to a temporary file which then
+   replaces file_name. The old file may still be mapped, so it must
+   never be truncated in place. */
 static gboolean
 icm_save_to_file(struct ImapCacheManager *icm, const gchar *file_name)
 {
+    struct icm_file_header hdr;
+    GArray *records;
+    gchar *tmp_name;
+    gsize offset;
     gboolean success;
-    FILE *f = fopen(file_name, "wb");
+    guint i;
+    FILE *f;
+
+    records = g_array_new(FALSE, FALSE, sizeof(struct icm_record));
+    for (i = 0; i < icm->uidmap->len; i++) {
+        struct icm_record rec;
+        gpointer value;
 
+        rec.uid = g_array_index(icm->uidmap, uint32_t, i);
+        if (rec.uid == 0 || (value = icm_lookup(icm, rec.uid)) == NULL)
+            continue;
+        rec.size = imap_serialized_message_size(value);
+        rec.offset = 0;
+        g_array_append_val(records, rec);
+    }
+    g_array_sort(records, icm_cmp_record);
+
+    memcpy(hdr.magic, ICM_MAGIC, sizeof(hdr.magic));
+    hdr.uidvalidity = icm->uidvalidity;
+    hdr.uidnext     = icm->uidnext;
+    hdr.exists      = icm->uidmap->len;
+    hdr.n_records   = records->len;
+
+    offset = ICM_ALIGN(sizeof(hdr) + (gsize) hdr.exists * sizeof(uint32_t)) +
+        (gsize) records->len * sizeof(struct icm_record);
+    for (i = 0; i < records->len; i++) {
+        struct icm_record *rec =
+            &g_array_index(records, struct icm_record, i);
+        offset = ICM_ALIGN(offset);
+        rec->offset = offset;
+        offset += rec->size;
+    }
+
+    tmp_name = g_strconcat(file_name, ".tmp", NULL);
+    f = fopen(tmp_name, "wb");
     success = f != NULL;
-    if(success) {
-	uint32_t i = icm->uidmap->len;
-	if(fwrite(&i, sizeof(i), 1, f) != 1                       ||
-           fwrite(&icm->uidvalidity, sizeof(uint32_t), 1, f) != 1 ||
-           fwrite(&icm->uidnext,     sizeof(uint32_t), 1, f) != 1 ||
-           fwrite(&icm->exists,      sizeof(uint32_t), 1, f) != 1) {
+    if (success) {
+        offset = sizeof(hdr) + (gsize) hdr.exists * sizeof(uint32_t);
+        success =
+            fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+            fwrite(icm->uidmap->data, sizeof(uint32_t), hdr.exists, f)
+            == hdr.exists &&
+            icm_write_padding(f, &offset) &&
+            fwrite(records->data, sizeof(struct icm_record), records->len, f)
+            == records->len;
+        offset += (gsize) records->len * sizeof(struct icm_record);
+        for (i = 0; success && i < records->len; i++) {
+            struct icm_record *rec =
+                &g_array_index(records, struct icm_record, i);
+            success = icm_write_padding(f, &offset) &&
+                fwrite(icm_lookup(icm, rec->uid), 1, rec->size, f)
+                == rec->size;
+            offset += rec->size;
+        }
+        if (fclose(f) != 0)
             success = FALSE;
-        } else {
-            for(i = 0; i<icm->uidmap->len; i++) {
-                uint32_t uid = g_array_index(icm->uidmap, uint32_t, i);
-                gpointer value = g_hash_table_lookup(icm->headers,
-                                                     GUINT_TO_POINTER(uid));
-                if(!icm_save_header(uid, value, f)) {
-                    success = FALSE;
+        if (success)
+            success = rename(tmp_name, file_name) == 0;
+        if (!success)
+            unlink(tmp_name);
+    }
+    g_free(tmp_name);
+    g_array_free(records, TRUE);
+
+    return success;
+}
+
+/* The background writer. A single thread executes the jobs in the
+   order they were pushed, so the journal records of a session are
+   always written before the cache is compacted. Loading a cache from
+   disk waits until no job for its files is pending. */
+typedef enum {
+    ICM_JOB_APPEND,             /* append records to a journal */
+    ICM_JOB_COMPACT             /* write the cache, remove the journal */
+} IcmJobType;
+
+struct icm_job {
+    IcmJobType type;
+    gchar *path;                /* journal or cache file */
+    GPtrArray *records;         /* ICM_JOB_APPEND: GBytes */
+    ImapUID uidvalidity;        /* ICM_JOB_APPEND */
+    struct ImapCacheManager *icm; /* ICM_JOB_COMPACT */
+};
+
+static GThreadPool *icm_writer_pool;
+static GMutex icm_writer_pool_lock;
+static GCond icm_writer_idle;
+static GHashTable *icm_writer_pending; /* path -> number of jobs */
+
+static gchar *
+icm_journal_path(const gchar *header_cache_path)
+{
+    return g_strconcat(header_cache_path, ".journal", NULL);
+}
+
+/* icm_journal_new() returns the journal for the given UIDVALIDITY;
+   it is not compacted, the cache file replaces it instead. */
+static LibBalsaJournal *
+icm_journal_new(const gchar *journal_path, ImapUID uidvalidity)
+{
+    gchar header[8 + sizeof(uint32_t)];
+    uint32_t validity = uidvalidity;
+
+    memcpy(header, ICM_JOURNAL_MAGIC, 8);
+    memcpy(header + 8, &validity, sizeof(validity));
+
+    return libbalsa_journal_new(journal_path, header, sizeof(header),
+                                LIBBALSA_JOURNAL_FLUSH, 0);
+}
+
+static gboolean
+icm_journal_append(const gchar *journal_path, ImapUID uidvalidity,
+                   GPtrArray *records)
+{
+    LibBalsaJournal *journal = icm_journal_new(journal_path, uidvalidity);
+    GByteArray *batch = g_byte_array_new();
+    gboolean success;
+    guint i;
+
+    /* one write and one flush for the whole batch */
+    for (i = 0; i < records->len; i++) {
+        gsize len;
+        gconstpointer data = g_bytes_get_data(g_ptr_array_index(records, i),
+                                              &len);
+        g_byte_array_append(batch, data, len);
+    }
+    success = libbalsa_journal_append(journal, batch->data, batch->len);
+    g_byte_array_free(batch, TRUE);
+    libbalsa_journal_free(journal);
+
+    return success;
+}
+
+static void
+icm_journal_replay(struct ImapCacheManager *icm, const gchar *journal_path)
+{
+    LibBalsaJournal *journal =
+        icm_journal_new(journal_path, icm->uidvalidity);
+    gchar *contents;
+    gsize length, offset;
+
+    if (libbalsa_journal_read(journal, &contents, &length)) {
+        offset = 0;
+        while (offset + 2 * sizeof(uint32_t) <= length) {
+            uint32_t hdr[2];
+            gpointer data;
+
+            memcpy(hdr, contents + offset, sizeof(hdr));
+            offset += sizeof(hdr);
+            if (hdr[1] == ICM_JOURNAL_FLAGS) {
+                uint32_t flags;
+
+                if (sizeof(flags) > length - offset)
                     break;
-                }
+                memcpy(&flags, contents + offset, sizeof(flags));
+                icm_set_flags(icm, hdr[0], flags);
+                offset += sizeof(flags);
+                continue;
             }
+            if (hdr[1] > length - offset)
+                break; /* the last record was cut short by a crash */
+#if GLIB_CHECK_VERSION(2, 68, 0)
+            data = g_memdup2(contents + offset, hdr[1]);
+#else
+            data = g_memdup(contents + offset, hdr[1]);
+#endif
+            g_hash_table_insert(icm->headers, GUINT_TO_POINTER(hdr[0]), data);
+            if (hdr[0] >= icm->uidnext)
+                icm->extend_map = TRUE;
+            offset += hdr[1];
         }
-	fclose(f);
+        g_debug("%s: replayed %s", __func__, journal_path);
+        g_free(contents);
+    } else
+        unlink(journal_path); /* stale or garbled */
+    libbalsa_journal_free(journal);
+}
+
+static void
+icm_writer_thread(struct icm_job *job, gpointer user_data)
+{
+    guint pending;
+
+    switch (job->type) {
+    case ICM_JOB_APPEND:
+        if (!icm_journal_append(job->path, job->uidvalidity, job->records))
+            g_debug("%s: cannot append to %s", __func__, job->path);
+        g_ptr_array_unref(job->records);
+        break;
+    case ICM_JOB_COMPACT:
+        if (icm_save_to_file(job->icm, job->path)) {
+            gchar *journal_path = icm_journal_path(job->path);
+            unlink(journal_path);
+            g_free(journal_path);
+        } else
+            g_debug("%s: cannot write %s", __func__, job->path);
+        imap_cache_manager_free(job->icm);
+        break;
     }
-    return success;
+
+    g_mutex_lock(&icm_writer_pool_lock);
+    pending = GPOINTER_TO_UINT(g_hash_table_lookup(icm_writer_pending,
+                                                   job->path));
+    if (pending > 1)
+        g_hash_table_insert(icm_writer_pending, g_strdup(job->path),
+                            GUINT_TO_POINTER(pending - 1));
+    else
+        g_hash_table_remove(icm_writer_pending, job->path);
+    g_cond_broadcast(&icm_writer_idle);
+    g_mutex_unlock(&icm_writer_pool_lock);
+
+    g_free(job->path);
+    g_free(job);
+}
+
+static void
+icm_writer_push(IcmJobType type, const gchar *path, GPtrArray *records,
+                ImapUID uidvalidity, struct ImapCacheManager *icm)
+{
+    struct icm_job *job = g_new(struct icm_job, 1);
+    guint pending;
+
+    job->type        = type;
+    job->path        = g_strdup(path);
+    job->records     = records;
+    job->uidvalidity = uidvalidity;
+    job->icm         = icm;
+
+    g_mutex_lock(&icm_writer_pool_lock);
+    if (icm_writer_pool == NULL) {
+        icm_writer_pool =
+            g_thread_pool_new((GFunc) icm_writer_thread, NULL, 1, FALSE,
+                              NULL);
+        icm_writer_pending =
+            g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+    pending = GPOINTER_TO_UINT(g_hash_table_lookup(icm_writer_pending, path));
+    g_hash_table_insert(icm_writer_pending, g_strdup(path),
+                        GUINT_TO_POINTER(pending + 1));
+    g_thread_pool_push(icm_writer_pool, job, NULL);
+    g_mutex_unlock(&icm_writer_pool_lock);
+}
+
+/* icm_writer_wait() waits until no job for path, or no job at all if
+   path is NULL, is pending. */
+static void
+icm_writer_wait(const gchar *path)
+{
+    g_mutex_lock(&icm_writer_pool_lock);
+    while (icm_writer_pending != NULL &&
+           (path != NULL ?
+            g_hash_table_contains(icm_writer_pending, path) :
+            g_hash_table_size(icm_writer_pending) > 0))
+        g_cond_wait(&icm_writer_idle, &icm_writer_pool_lock);
+    g_mutex_unlock(&icm_writer_pool_lock);
+}
+
+/* icm_new_from_disk() loads the cache file and replays the journal of
+   a session that did not finish cleanly. */
+static struct ImapCacheManager*
+icm_new_from_disk(const gchar *header_cache_path, ImapUID uidvalidity)
+{
+    struct ImapCacheManager *icm;
+    gchar *journal_path = icm_journal_path(header_cache_path);
+
+    icm_writer_wait(header_cache_path);
+    icm_writer_wait(journal_path);
+
+    icm = imap_cache_manager_new_from_file(header_cache_path);
+    if (g_file_test(journal_path, G_FILE_TEST_EXISTS)) {
+        if (icm == NULL) {
+            icm = imap_cache_manager_new(0);
+            icm->uidvalidity = uidvalidity;
+        }
+        icm_journal_replay(icm, journal_path);
+    }
+    g_free(journal_path);
+
+    return icm;
+}
+
+static void
+icm_set_journal(struct ImapCacheManager *icm, const gchar *header_cache_path)
+{
+    g_free(icm->journal_path);
+    icm->journal_path = header_cache_path != NULL ?
+        icm_journal_path(header_cache_path) : NULL;
+}
+
+/* icm_cache_msgs() serializes freshly fetched messages and queues them
+   for the journal. */
+static void
+icm_cache_msgs(struct ImapCacheManager *icm, ImapMboxHandle *h,
+               const unsigned *msgnos, unsigned cnt)
+{
+    GPtrArray *journal;
+    unsigned i;
+
+    if (icm == NULL)
+        return;
+
+    journal = icm->journal_path != NULL ?
+        g_ptr_array_new_with_free_func((GDestroyNotify) g_bytes_unref) : NULL;
+    for (i = 0; i < cnt; i++) {
+        ImapMessage *imsg = imap_mbox_handle_get_msg(h, msgnos[i]);
+
+        if (imsg == NULL || imsg->envelope == NULL || imsg->uid == 0)
+            continue;
+        icm_insert_msg(icm, imsg, journal);
+        if (msgnos[i] > icm->uidmap->len)
+            g_array_set_size(icm->uidmap, msgnos[i]);
+        g_array_index(icm->uidmap, uint32_t, msgnos[i] - 1) = imsg->uid;
+    }
+
+    if (journal != NULL && journal->len > 0)
+        icm_writer_push(ICM_JOB_APPEND, icm->journal_path, journal,
+                        icm->uidvalidity, NULL);
+    else if (journal != NULL)
+        g_ptr_array_unref(journal);
+}
+
+/* icm_cache_flags() updates the cached flags of messages whose flags
+   have changed and journals only the new flags. */
+static void
+icm_cache_flags(struct ImapCacheManager *icm, ImapMboxHandle *h,
+                const unsigned *msgnos, unsigned cnt)
+{
+    GPtrArray *journal;
+    unsigned i;
+
+    if (icm == NULL)
+        return;
+
+    journal = icm->journal_path != NULL ?
+        g_ptr_array_new_with_free_func((GDestroyNotify) g_bytes_unref) : NULL;
+    for (i = 0; i < cnt; i++) {
+        ImapMessage *imsg = imap_mbox_handle_get_msg(h, msgnos[i]);
+        uint32_t rec[3];
+
+        if (imsg == NULL || imsg->uid == 0)
+            continue;
+        if (!icm_set_flags(icm, imsg->uid, imsg->flags)) {
+            /* not cached yet */
+            icm_cache_msgs(icm, h, &msgnos[i], 1);
+            continue;
+        }
+        if (journal == NULL)
+            continue;
+        rec[0] = imsg->uid;
+        rec[1] = ICM_JOURNAL_FLAGS;
+        rec[2] = imsg->flags;
+        g_ptr_array_add(journal, g_bytes_new(rec, sizeof(rec)));
+    }
+
+    if (journal != NULL && journal->len > 0)
+        icm_writer_push(ICM_JOB_APPEND, icm->journal_path, journal,
+                        icm->uidvalidity, NULL);
+    else if (journal != NULL)
+        g_ptr_array_unref(journal);
+}
+
+/* icm_change_flags() sets or clears flag of the cached messages uids,
+   which need not be loaded into a handle, and journals their new
+   flags. */
+static void
+icm_change_flags(struct ImapCacheManager *icm, const unsigned *uids,
+                 unsigned cnt, ImapMsgFlag flag, gboolean state)
+{
+    GPtrArray *journal;
+    unsigned i;
+
+    if (icm == NULL)
+        return;
+
+    journal = icm->journal_path != NULL ?
+        g_ptr_array_new_with_free_func((GDestroyNotify) g_bytes_unref) : NULL;
+    for (i = 0; i < cnt; i++) {
+        gpointer data = icm_lookup(icm, uids[i]);
+        ImapMsgFlags flags;
+        uint32_t rec[3];
+
+        if (data == NULL)
+            continue;
+        flags = imap_serialized_message_get_flags(data);
+        flags = state ? flags | flag : flags & ~flag;
+        icm_set_flags(icm, uids[i], flags);
+        if (journal == NULL)
+            continue;
+        rec[0] = uids[i];
+        rec[1] = ICM_JOURNAL_FLAGS;
+        rec[2] = flags;
+        g_ptr_array_add(journal, g_bytes_new(rec, sizeof(rec)));
+    }
+
+    if (journal != NULL && journal->len > 0)
+        icm_writer_push(ICM_JOB_APPEND, icm->journal_path, journal,
+                        icm->uidvalidity, NULL);
+    else if (journal != NULL)
+        g_ptr_array_unref(journal);
+}
+
+/* icm_save_in_background() takes over icm and writes it to
+   header_cache_path in the background thread. */
+static void
+icm_save_in_background(struct ImapCacheManager *icm,
+                       const gchar *header_cache_path)
+{
+    icm_writer_push(ICM_JOB_COMPACT, header_cache_path, NULL, 0, icm);
+}
+
+/* icm_append_in_background() takes over records and appends them to
+   the journal of the cache for uidvalidity in the background thread;
+   the cache need not be loaded. */
+static void
+icm_append_in_background(const gchar *header_cache_path, GPtrArray *records,
+                         ImapUID uidvalidity)
+{
+    gchar *journal_path = icm_journal_path(header_cache_path);
+
+    icm_writer_push(ICM_JOB_APPEND, journal_path, records, uidvalidity, NULL);
+    g_free(journal_path);
+}
+
+/** Waits until all pending header cache writes are finished. To be
+    called before the application exits; the writer stays available
+    for any cache written later. */
+void
+libbalsa_imap_flush_header_caches(void)
+{
+    icm_writer_wait(NULL);
+}
+
+/* Thread cache
+ *
+ * The result of server-side threading of the whole mailbox is saved
+ * next to the persistent header cache, keyed by UIDVALIDITY and
+ * UIDNEXT. Each line holds the depth, the UID and, when known, the
+ * Message-ID of one message, in pre-order. When the mailbox is
+ * threaded again, the cached tree is restored, expunged messages are
+ * dropped and messages that arrived since are attached by their
+ * In-Reply-To, so that the server need not thread the mailbox again.
+ */
+#define THREAD_CACHE_MAX_NEW 1000
+
+static gchar*
+get_thread_cache_path(LibBalsaMailboxImap *mimap)
+{
+    gchar *header_cache_path = get_header_cache_path(mimap);
+    gchar *path = g_strconcat(header_cache_path, "-threads", NULL);
+
+    g_free(header_cache_path);
+    return path;
+}
+
+static gboolean
+lbm_imap_thread_cache_usable(LibBalsaMailboxImap *mimap)
+{
+    LibBalsaServer *server =
+        libbalsa_mailbox_remote_get_server(LIBBALSA_MAILBOX_REMOTE(mimap));
+
+    return mimap->handle != NULL && mimap->icm != NULL &&
+        !imap_mbox_handle_is_replica(mimap->handle) &&
+        libbalsa_imap_server_has_persistent_cache
+        (LIBBALSA_IMAP_SERVER(server)) &&
+        icm_matches_handle(mimap->icm, mimap->handle);
+}
+
+/* Returns the UID of msgno, or 0 if it is not known locally. */
+static uint32_t
+lbm_imap_msgno_to_uid(LibBalsaMailboxImap *mimap, unsigned msgno)
+{
+    ImapMessage *imsg;
+
+    if (mimap->icm != NULL && msgno <= mimap->icm->uidmap->len &&
+        g_array_index(mimap->icm->uidmap, uint32_t, msgno - 1) != 0)
+        return g_array_index(mimap->icm->uidmap, uint32_t, msgno - 1);
+    imsg = imap_mbox_handle_get_msg(mimap->handle, msgno);
+
+    return imsg != NULL ? imsg->uid : 0;
+}
+
+/* Replaces node with its children. */
+static void
+lbm_imap_thread_cache_unlink(GNode *node)
+{
+    while (node->children != NULL) {
+        GNode *child = node->children;
+
+        g_node_unlink(child);
+        g_node_insert_before(node->parent, node, child);
+    }
+    g_node_destroy(node);
+}
+
+static gboolean
+lbm_imap_thread_cache_collect_gone(GNode *node, gpointer data)
+{
+    if (!G_NODE_IS_ROOT(node) && node->data == NULL)
+        g_ptr_array_add(data, node);
+
+    return FALSE;
+}
+
+/* Parses the cached tree. nodes is indexed by msgno. */
+static GNode*
+lbm_imap_thread_cache_parse(LibBalsaMailboxImap *mimap, gchar **lines,
+                            GPtrArray *nodes, gboolean *changed)
+{
+    GHashTable *msgnos;
+    GPtrArray *parents, *gone;
+    GNode *root;
+    gboolean ok = TRUE;
+    unsigned i;
+
+    msgnos = g_hash_table_new(NULL, NULL);
+    for (i = 1; i < nodes->len; i++) {
+        uint32_t uid = lbm_imap_msgno_to_uid(mimap, i);
+        if (uid != 0)
+            g_hash_table_insert(msgnos, GUINT_TO_POINTER(uid),
+                                GUINT_TO_POINTER(i));
+    }
+
+    root = g_node_new(NULL);
+    parents = g_ptr_array_new();
+    g_ptr_array_add(parents, root);
+    for (i = 1; ok && lines[i] != NULL && *lines[i] != '\0'; i++) {
+        gchar *p, *end;
+        unsigned depth, msgno;
+        gulong uid;
+        GNode *node;
+
+        depth = strtoul(lines[i], &end, 10);
+        if (end == lines[i] || *end != ' ' || depth >= parents->len) {
+            ok = FALSE;
+            break;
+        }
+        uid = strtoul(end + 1, &p, 10);
+        if (*p != ' ') {
+            ok = FALSE;
+            break;
+        }
+        p++;
+        msgno = GPOINTER_TO_UINT(g_hash_table_lookup(msgnos,
+                                                     GUINT_TO_POINTER(uid)));
+        if (msgno != 0 && g_ptr_array_index(nodes, msgno) != NULL)
+            msgno = 0;          /* duplicate, drop it */
+        node = g_node_append_data(g_ptr_array_index(parents, depth),
+                                  GUINT_TO_POINTER(msgno));
+        g_ptr_array_set_size(parents, depth + 1);
+        g_ptr_array_add(parents, node);
+        if (msgno == 0)
+            continue;
+        g_ptr_array_index(nodes, msgno) = node;
+        if (strcmp(p, "-") != 0 && msgno <= mimap->msgids->len &&
+            g_ptr_array_index(mimap->msgids, msgno - 1) == NULL)
+            g_ptr_array_index(mimap->msgids, msgno - 1) = g_strdup(p);
+    }
+    g_ptr_array_free(parents, TRUE);
+    g_hash_table_destroy(msgnos);
+
+    if (!ok) {
+        g_node_destroy(root);
+        return NULL;
+    }
+
+    /* Drop the expunged messages; their replies move up. */
+    gone = g_ptr_array_new();
+    g_node_traverse(root, G_POST_ORDER, G_TRAVERSE_ALL, -1,
+                    lbm_imap_thread_cache_collect_gone, gone);
+    if (gone->len > 0)
+        *changed = TRUE;
+    for (i = 0; i < gone->len; i++)
+        lbm_imap_thread_cache_unlink(g_ptr_array_index(gone, i));
+    g_ptr_array_free(gone, TRUE);
+
+    return root;
+}
+
+/* lbm_imap_thread_cache_restore:
+   returns the cached thread tree brought up to date with the mailbox,
+   or NULL if there is no usable cache. changed is set when the tree
+   differs from the cached one.
+*/
+static GNode*
+lbm_imap_thread_cache_restore(LibBalsaMailboxImap *mimap,
+                              gboolean *changed)
+{
+    gchar *path, *contents, **lines;
+    unsigned validity, uidnext, exists, msgno, new_msgs = 0;
+    GPtrArray *nodes;
+    GHashTable *by_msgid;
+    GNode *root;
+
+    if (!lbm_imap_thread_cache_usable(mimap))
+        return NULL;
+
+    path = get_thread_cache_path(mimap);
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        g_free(path);
+        return NULL;
+    }
+    g_free(path);
+    lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+
+    exists = imap_mbox_handle_get_exists(mimap->handle);
+    if (lines[0] == NULL ||
+        sscanf(lines[0], "%u %u", &validity, &uidnext) != 2 ||
+        validity != mimap->uid_validity ||
+        uidnext > imap_mbox_handle_get_uidnext(mimap->handle)) {
+        g_strfreev(lines);
+        return NULL;
+    }
+    *changed = uidnext != imap_mbox_handle_get_uidnext(mimap->handle);
+
+    nodes = g_ptr_array_new();
+    g_ptr_array_set_size(nodes, exists + 1);
+    root = lbm_imap_thread_cache_parse(mimap, lines, nodes, changed);
+    g_strfreev(lines);
+    if (root == NULL) {
+        g_ptr_array_free(nodes, TRUE);
+        return NULL;
+    }
+
+    by_msgid = g_hash_table_new(g_str_hash, g_str_equal);
+    for (msgno = 1; msgno <= exists && msgno <= mimap->msgids->len; msgno++) {
+        gchar *msgid = g_ptr_array_index(mimap->msgids, msgno - 1);
+        if (msgid != NULL && g_ptr_array_index(nodes, msgno) != NULL)
+            g_hash_table_insert(by_msgid, msgid,
+                                g_ptr_array_index(nodes, msgno));
+    }
+
+    /* Attach the messages that are not in the cached tree. */
+    for (msgno = 1; msgno <= exists; msgno++) {
+        ImapMessage *imsg;
+        GNode *parent = root, *node;
+
+        if (g_ptr_array_index(nodes, msgno) != NULL)
+            continue;
+        if (++new_msgs > THREAD_CACHE_MAX_NEW) {
+            g_node_destroy(root);
+            root = NULL;
+            break;
+        }
+        *changed = TRUE;
+        imsg = mi_get_imsg(mimap, msgno);
+        if (imsg != NULL && imsg->envelope != NULL) {
+            ImapEnvelope *env = imsg->envelope;
+
+            if (env->in_reply_to != NULL &&
+                (node = g_hash_table_lookup(by_msgid, env->in_reply_to))
+                != NULL)
+                parent = node;
+            if (env->message_id != NULL && msgno <= mimap->msgids->len &&
+                g_ptr_array_index(mimap->msgids, msgno - 1) == NULL)
+                g_ptr_array_index(mimap->msgids, msgno - 1) =
+                    g_strdup(env->message_id);
+        }
+        node = g_node_append_data(parent, GUINT_TO_POINTER(msgno));
+        g_ptr_array_index(nodes, msgno) = node;
+        if (msgno <= mimap->msgids->len &&
+            g_ptr_array_index(mimap->msgids, msgno - 1) != NULL)
+            g_hash_table_insert(by_msgid,
+                                g_ptr_array_index(mimap->msgids, msgno - 1),
+                                node);
+    }
+    g_hash_table_destroy(by_msgid);
+    g_ptr_array_free(nodes, TRUE);
+
+    return root;
+}
+
+struct thread_cache_save_data {
+    LibBalsaMailboxImap *mimap;
+    GString *buf;
+    gboolean ok;
+};
+
+static gboolean
+lbm_imap_thread_cache_write_node(GNode *node, gpointer data)
+{
+    struct thread_cache_save_data *tcsd = data;
+    unsigned msgno = GPOINTER_TO_UINT(node->data);
+    const gchar *msgid = NULL;
+    uint32_t uid;
+
+    if (G_NODE_IS_ROOT(node))
+        return FALSE;
+    if (msgno == 0 || (uid = lbm_imap_msgno_to_uid(tcsd->mimap, msgno))
+        == 0) {
+        tcsd->ok = FALSE;
+        return TRUE;
+    }
+    if (msgno <= tcsd->mimap->msgids->len)
+        msgid = g_ptr_array_index(tcsd->mimap->msgids, msgno - 1);
+    if (msgid == NULL) {
+        ImapMessage *imsg =
+            imap_mbox_handle_get_msg(tcsd->mimap->handle, msgno);
+        if (imsg != NULL && imsg->envelope != NULL)
+            msgid = imsg->envelope->message_id;
+    }
+    if (msgid == NULL || *msgid == '\0' || strpbrk(msgid, " \r\n") != NULL)
+        msgid = "-";
+    g_string_append_printf(tcsd->buf, "%u %u %s\n",
+                           g_node_depth(node) - 2, uid, msgid);
+
+    return FALSE;
+}
+
+static void
+lbm_imap_thread_cache_save(LibBalsaMailboxImap *mimap, GNode *tree)
+{
+    struct thread_cache_save_data tcsd;
+    gchar *path;
+
+    if (!lbm_imap_thread_cache_usable(mimap))
+        return;
+
+    tcsd.mimap = mimap;
+    tcsd.buf = g_string_new(NULL);
+    tcsd.ok = TRUE;
+    g_string_append_printf(tcsd.buf, "%u %u\n", mimap->uid_validity,
+                           imap_mbox_handle_get_uidnext(mimap->handle));
+    g_node_traverse(tree, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+                    lbm_imap_thread_cache_write_node, &tcsd);
+
+    path = get_thread_cache_path(mimap);
+    if (!tcsd.ok ||
+        !g_file_set_contents(path, tcsd.buf->str, tcsd.buf->len, NULL))
+        unlink(path);
+    g_free(path);
+    g_string_free(tcsd.buf, TRUE);
 }
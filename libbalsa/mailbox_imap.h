@@ -72,4 +72,5 @@ gchar *libbalsa_imap_url(LibBalsaServer * server, const gchar * path);
 
 void libbalsa_imap_set_cache_size(off_t cache_size);
 void libbalsa_imap_purge_temp_dir(off_t cache_size);
+void libbalsa_imap_flush_header_caches(void);
 #endif				/* __LIBBALSA_MAILBOX_IMAP_H__ */
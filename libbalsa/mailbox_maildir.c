@@ -96,6 +96,14 @@ static guint lbm_maildir_fileno(LibBalsaMailboxLocal * local, guint msgno);
 static LibBalsaMailboxLocalMessageInfo
     *lbm_maildir_get_info(LibBalsaMailboxLocal * local, guint msgno);
 static LibBalsaMailboxLocalAddMessageFunc lbm_maildir_add_message;
+static GMimeStream *lbm_maildir_delivery_new(LibBalsaMailbox * mailbox,
+                                             GError ** err);
+static gboolean lbm_maildir_delivery_commit(LibBalsaMailbox * mailbox,
+                                            GMimeStream * stream,
+                                            LibBalsaMessageFlag flags,
+                                            GError ** err);
+static void lbm_maildir_delivery_abort(LibBalsaMailbox * mailbox,
+                                       GMimeStream * stream);
 
 /* util functions */
 static struct message_info *message_info_from_msgno(LibBalsaMailboxMaildir
@@ -148,6 +156,9 @@ libbalsa_mailbox_maildir_class_init(LibBalsaMailboxMaildirClass * klass)
 	libbalsa_mailbox_maildir_fetch_message_structure;
     libbalsa_mailbox_class->total_messages =
 	libbalsa_mailbox_maildir_total_messages;
+    libbalsa_mailbox_class->delivery_new    = lbm_maildir_delivery_new;
+    libbalsa_mailbox_class->delivery_commit = lbm_maildir_delivery_commit;
+    libbalsa_mailbox_class->delivery_abort  = lbm_maildir_delivery_abort;
 
     libbalsa_mailbox_local_class->check_files  = lbm_maildir_check_files;
     libbalsa_mailbox_local_class->set_path     = lbm_maildir_set_path;
@@ -863,6 +874,40 @@ lbm_maildir_get_info(LibBalsaMailboxLocal * local, guint msgno)
     return &msg_info->local_info;
 }
 
+/* Move the complete message file tmp, which is in tmp/, into the
+ * mailbox. Called with mailbox locked. */
+static gboolean
+lbm_maildir_add_tmp(LibBalsaMailboxLocal * local, const gchar * tmp,
+                    LibBalsaMessageFlag flags)
+{
+    LibBalsaMailbox *mailbox = (LibBalsaMailbox *) local;
+    const gchar *new_filename;
+    struct message_info *msg_info;
+    gboolean retval;
+    time_t mtime;
+
+    new_filename = strrchr(tmp, '/');
+    if (new_filename)
+	new_filename++;
+    else
+	new_filename = tmp;
+    msg_info = g_new0(struct message_info, 1);
+    msg_info->subdir = "tmp";
+    msg_info->key = g_strdup(new_filename);
+    msg_info->filename = g_strdup(new_filename);
+    msg_info->local_info.flags = flags | LIBBALSA_MESSAGE_FLAG_RECENT;
+    retval = maildir_sync_add(msg_info, libbalsa_mailbox_local_get_path(local));
+    free_message_info(msg_info);
+
+    if ((mtime = libbalsa_mailbox_get_mtime(mailbox)) != 0)
+	/* If we checked or synced the mailbox less than 1 second ago,
+	 * the cached modification time could be the same as the new
+	 * modification time, so we'll invalidate the cached time. */
+	libbalsa_mailbox_set_mtime(mailbox, --mtime);
+
+    return retval;
+}
+
 /* Called with mailbox locked. */
 static gboolean
 lbm_maildir_add_message(LibBalsaMailboxLocal * local,
@@ -870,17 +915,13 @@ lbm_maildir_add_message(LibBalsaMailboxLocal * local,
                         LibBalsaMessageFlag    flags,
                         GError              ** err)
 {
-    LibBalsaMailbox *mailbox = (LibBalsaMailbox *) local;
     const char *path;
     char *tmp;
     int fd;
     GMimeStream *out_stream;
     GMimeStream *in_stream;
     GMimeFilter *crlffilter;
-    char *new_filename;
-    struct message_info *msg_info;
     gint retval;
-    time_t mtime;
 
     /* open tempfile */
     path = libbalsa_mailbox_local_get_path(local);
@@ -909,29 +950,77 @@ lbm_maildir_add_message(LibBalsaMailboxLocal * local,
 	return FALSE;
     }
 
-    new_filename = strrchr(tmp, '/');
-    if (new_filename)
-	new_filename++;
-    else
-	new_filename = tmp;
-    msg_info = g_new0(struct message_info, 1);
-    msg_info->subdir = "tmp";
-    msg_info->key = g_strdup(new_filename);
-    msg_info->filename = g_strdup(new_filename);
-    msg_info->local_info.flags = flags | LIBBALSA_MESSAGE_FLAG_RECENT;
-    retval = maildir_sync_add(msg_info, path);
-    free_message_info(msg_info);
+    retval = lbm_maildir_add_tmp(local, tmp, flags);
     g_free(tmp);
 
-    if ((mtime = libbalsa_mailbox_get_mtime(mailbox)) != 0)
-	/* If we checked or synced the mailbox less than 1 second ago,
-	 * the cached modification time could be the same as the new
-	 * modification time, so we'll invalidate the cached time. */
-	libbalsa_mailbox_set_mtime(mailbox, --mtime);
+    return retval;
+}
+
+/* A message delivered in pieces is written straight into a file in
+ * tmp/, which is moved into the mailbox on commit. */
+static const gchar maildir_tmp_key[] = "libbalsa-maildir-tmp";
+
+static GMimeStream *
+lbm_maildir_delivery_new(LibBalsaMailbox * mailbox, GError ** err)
+{
+    GMimeStream *stream;
+    char *tmp;
+    int fd;
+
+    fd = libbalsa_mailbox_maildir_open_temp(libbalsa_mailbox_local_get_path
+                                            (LIBBALSA_MAILBOX_LOCAL(mailbox)),
+                                            &tmp);
+    if (fd == -1) {
+        g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                    LIBBALSA_MAILBOX_APPEND_ERROR,
+                    _("Cannot create message"));
+        return NULL;
+    }
+
+    stream = g_mime_stream_fs_new(fd);
+    g_object_set_data_full(G_OBJECT(stream), maildir_tmp_key, tmp, g_free);
+
+    return stream;
+}
+
+/* Called with mailbox locked. */
+static gboolean
+lbm_maildir_delivery_commit(LibBalsaMailbox * mailbox,
+                            GMimeStream * stream,
+                            LibBalsaMessageFlag flags, GError ** err)
+{
+    gchar *tmp;
+    gboolean retval;
+
+    tmp = g_strdup(g_object_get_data(G_OBJECT(stream), maildir_tmp_key));
+    retval = g_mime_stream_flush(stream) == 0;
+    /* closes the file */
+    g_object_unref(stream);
+
+    if (!retval) {
+        unlink(tmp);
+        g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                    LIBBALSA_MAILBOX_COPY_ERROR,
+                    _("Data copy error"));
+    } else
+        retval = lbm_maildir_add_tmp(LIBBALSA_MAILBOX_LOCAL(mailbox), tmp,
+                                     flags);
+    g_free(tmp);
 
     return retval;
 }
 
+static void
+lbm_maildir_delivery_abort(LibBalsaMailbox * mailbox, GMimeStream * stream)
+{
+    gchar *tmp;
+
+    tmp = g_strdup(g_object_get_data(G_OBJECT(stream), maildir_tmp_key));
+    g_object_unref(stream);
+    unlink(tmp);
+    g_free(tmp);
+}
+
 static guint
 libbalsa_mailbox_maildir_total_messages(LibBalsaMailbox * mailbox)
 {
@@ -34,6 +34,7 @@
 #include "misc.h"
 #include "mailbox.h"
 #include "mailbox_pop3.h"
+#include "pop3-uid-store.h"
 #include <glib/gi18n.h>
 #include <glib/gstdio.h>
 
@@ -147,106 +148,6 @@ libbalsa_mailbox_pop3_open(LibBalsaMailbox * mailbox, GError **err)
 }
 
 
-#define POP_UID_FILE	"/.balsa/pop-uids"
-static GMutex uid_mutex;
-
-
-static GHashTable *
-mp_load_uids(const gchar *prefix)
-{
-	GHashTable *res;
-	gboolean read_res;
-	gchar *fname;
-	gchar *contents;
-
-	res = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
-
-	fname = g_strconcat(g_get_home_dir(), POP_UID_FILE, NULL);
-	g_mutex_lock(&uid_mutex);
-	read_res = g_file_get_contents(fname, &contents, NULL, NULL);
-	g_mutex_unlock(&uid_mutex);
-	g_free(fname);
-
-	if (read_res) {
-		gchar **lines;
-		size_t prefix_len;
-		guint n;
-
-		lines = g_strsplit(contents, "\n", -1);
-		g_free(contents);
-		prefix_len = strlen(prefix);
-		for (n = 0; lines[n] != NULL; n++) {
-			if (strncmp(lines[n], prefix, prefix_len) == 0) {
-				g_hash_table_insert(res, g_strdup(lines[n]), GINT_TO_POINTER(1));
-			}
-		}
-
-		g_strfreev(lines);
-	}
-
-	return res;
-}
-
-
-static void
-mp_save_uid(gpointer key, gpointer G_GNUC_UNUSED value, gpointer user_data)
-{
-	FILE *out = (FILE *) user_data;
-
-	fputs((const gchar *) key, out);
-	fputc('\n', out);
-}
-
-
-static gboolean
-mp_save_uids(GHashTable *uids, const gchar *prefix, GError **error)
-{
-	gchar *fname;
-	gboolean read_res;
-	gchar *contents = NULL;
-	FILE *out;
-	gboolean result;
-
-	fname = g_strconcat(g_get_home_dir(), POP_UID_FILE, NULL);
-
-	g_mutex_lock(&uid_mutex);
-	read_res = g_file_get_contents(fname, &contents, NULL, NULL);
-	out = fopen(fname, "w");
-	g_free(fname);
-	if (out != NULL) {
-		if (read_res) {
-			gchar **lines;
-			size_t prefix_len;
-			guint n;
-
-			lines = g_strsplit(contents, "\n", -1);
-			g_free(contents);
-			prefix_len = strlen(prefix);
-			for (n = 0; lines[n] != NULL; n++) {
-				if ((lines[n][0] != '\0') && (strncmp(lines[n], prefix, prefix_len) != 0)) {
-					fputs(lines[n], out);
-					fputc('\n', out);
-				}
-			}
-
-			g_strfreev(lines);
-		}
-
-		if (uids != NULL) {
-			g_hash_table_foreach(uids, mp_save_uid, out);
-		}
-		fclose(out);
-		result = TRUE;
-	} else {
-		g_set_error(error, MBOX_POP3_ERROR, errno, _("Saving the POP3 message UID list failed: %s"), g_strerror(errno));
-		result = FALSE;
-	}
-
-	g_mutex_unlock(&uid_mutex);
-	return result;
-}
-
-
 #ifdef POP_SYNC
 static int
 dump_cb(unsigned len, char *buf, void *arg)
@@ -259,15 +160,19 @@ dump_cb(unsigned len, char *buf, void *arg)
 
 typedef struct {
 	gboolean filter;
-	GMimeStream *mbx_stream;	/* used if we store directly to a mailbox only */
+	LibBalsaMailbox *inbox;		/* used if we store directly to a mailbox only */
+	GMimeStream *mbx_stream;	/* delivery stream of the inbox, NULL when committed */
 	FILE *filter_pipe;			/* used of we write to a filter pipe only */
 	gchar *path;				/* needed for error reporting only */
 } pop_handler_t;
 
 
+/* note: when storing to the inbox, the message data is written to its delivery stream as it arrives, so the message is never
+ * held in memory */
 static pop_handler_t *
-pop_handler_new(const gchar *filter_path,
-				GError     **error)
+pop_handler_new(const gchar     *filter_path,
+				LibBalsaMailbox *inbox,
+				GError         **error)
 {
 	pop_handler_t *res;
 
@@ -283,7 +188,13 @@ pop_handler_new(const gchar *filter_path,
 			res->path = g_strdup(filter_path);
 		}
 	} else {
-		res->mbx_stream = g_mime_stream_mem_new();
+		res->mbx_stream = libbalsa_mailbox_delivery_new(inbox, error);
+		if (res->mbx_stream == NULL) {
+			g_free(res);
+			res = NULL;
+		} else {
+			res->inbox = inbox;
+		}
 	}
 
 	return res;
@@ -328,8 +239,10 @@ pop_handler_close(pop_handler_t *handler,
 				g_strerror(errno));
 			result = FALSE;
 		}
+	} else if (handler->mbx_stream != NULL) {
+		libbalsa_mailbox_delivery_abort(handler->inbox, handler->mbx_stream);
 	} else {
-		g_object_unref(handler->mbx_stream);
+		/* nothing to do, the message has been committed */
 	}
 	g_free(handler->path);
 	g_free(handler);
@@ -350,6 +263,7 @@ struct fetch_data {
     gsize received;
     pop_handler_t *handler;
     gint64 next_notify;
+    LibBalsaPop3UidStore *uid_store;	/* NULL if messages are deleted from the server */
 };
 
 static void
@@ -379,7 +293,7 @@ message_cb(const gchar                    *buffer,
 	if (count > 0) {
 		/* message data chunk - initialise for a new message if the output does not exist */
 		if (fd->handler == NULL) {
-			fd->handler = pop_handler_new(fd->filter_path, error);
+			fd->handler = pop_handler_new(fd->filter_path, LIBBALSA_MAILBOX_POP3(fd->mailbox)->inbox, error);
 
 			if (fd->handler == NULL) {
 				result = FALSE;
@@ -416,12 +330,12 @@ message_cb(const gchar                    *buffer,
                     mailbox = fd->mailbox;
                     inbox = LIBBALSA_MAILBOX_POP3(mailbox)->inbox;
 
-		    g_mime_stream_reset(fd->handler->mbx_stream);
 		    result =
-                        libbalsa_mailbox_add_message(inbox, fd->handler->mbx_stream,
-                                                     LIBBALSA_MESSAGE_FLAG_NEW |
-                                                     LIBBALSA_MESSAGE_FLAG_RECENT,
-                                                     &add_err);
+                        libbalsa_mailbox_delivery_commit(inbox, fd->handler->mbx_stream,
+                                                         LIBBALSA_MESSAGE_FLAG_NEW |
+                                                         LIBBALSA_MESSAGE_FLAG_RECENT,
+                                                         &add_err);
+		    fd->handler->mbx_stream = NULL;
 		    if (!result) {
 		        libbalsa_information(LIBBALSA_INFORMATION_WARNING, _("Error appending message %d from %s to %s: %s"),
 		        	info->id,
@@ -436,6 +350,11 @@ message_cb(const gchar                    *buffer,
 		close_res = pop_handler_close(fd->handler, error);
 		fd->handler = NULL;
 		result = close_res & result;
+
+		/* remember it at once, so it is not retrieved again even if a later one fails */
+		if (result && (fd->uid_store != NULL)) {
+			libbalsa_pop3_uid_store_add(fd->uid_store, info->uid);
+		}
 	} else {
 		/* count < 0: error; note that the handler may already be NULL if the error occurred for count == 0 */
 		if (fd->handler != NULL) {
@@ -538,25 +457,27 @@ libbalsa_mailbox_pop3_startup(LibBalsaServer      *server,
 static GList *
 update_msg_list(struct fetch_data         *fd,
                 const LibBalsaMailboxPOP3 *mailbox_pop3,
-                GHashTable               **current_uids,
-                LibBalsaServer            *server,
                 GList                     *msg_list)
 {
-	GHashTable *uids = NULL;
-	gchar *uid_prefix = NULL;
-	size_t prefix_len = 0U;
 	GList *p;
 
-	/* load uid's if messages shall be left on the server */
-	if (!mailbox_pop3->delete_from_server) {
-		uid_prefix = g_strconcat(libbalsa_server_get_user(server), "@",
-                                         libbalsa_server_get_host(server), NULL);
-		prefix_len = strlen(uid_prefix);
-		uids = mp_load_uids(uid_prefix);
-		*current_uids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	/* forget the uid's of messages which have been removed from the server */
+	if (fd->uid_store != NULL) {
+		GHashTable *present;
+
+		present = g_hash_table_new(g_str_hash, g_str_equal);
+		for (p = msg_list; p != NULL; p = p->next) {
+			const NetClientPopMessageInfo *msg_info = (const NetClientPopMessageInfo *) p->data;
+
+			if (msg_info->uid != NULL) {
+				g_hash_table_add(present, msg_info->uid);
+			}
+		}
+		libbalsa_pop3_uid_store_expire(fd->uid_store, present);
+		g_hash_table_destroy(present);
 	}
 
-	/* calculate totals, remove oversized messages, remember in the hash if required */
+	/* calculate totals, remove oversized and known messages */
 	fd->total_messages = 0U;
 	fd->total_size = 0U;
 	p = msg_list;
@@ -578,13 +499,9 @@ update_msg_list(struct fetch_data         *fd,
 		}
 
 		/* check if we already know this message */
-		if (!skip && !mailbox_pop3->delete_from_server) {
-			gchar *full_uid = g_strconcat(uid_prefix, " ", msg_info->uid, NULL);
-
-			g_hash_table_insert(*current_uids, full_uid, GINT_TO_POINTER(1));
-			if (g_hash_table_lookup(uids, full_uid) != NULL) {
-				skip = TRUE;
-			}
+		if (!skip && (fd->uid_store != NULL) &&
+			libbalsa_pop3_uid_store_contains(fd->uid_store, msg_info->uid)) {
+			skip = TRUE;
 		}
 
 		/* delete from list if we want to skip the message, update totals otherwise */
@@ -598,24 +515,6 @@ update_msg_list(struct fetch_data         *fd,
 		p = next;
 	}
 
-	/* copy all keys /not/ starting with the prefix from the old to the current hash table, and drop the old table */
-	if (!mailbox_pop3->delete_from_server && (msg_list != NULL)) {
-		GHashTableIter iter;
-		gpointer key;
-
-		g_hash_table_iter_init(&iter, uids);
-		while (g_hash_table_iter_next(&iter, &key, NULL)) {
-			if (strncmp((const char *) key, uid_prefix, prefix_len) != 0) {
-				g_hash_table_insert(*current_uids, key, GINT_TO_POINTER(1));
-			}
-		}
-	}
-
-	g_free(uid_prefix);
-	if (uids != NULL) {
-		g_hash_table_destroy(uids);
-	}
-
 	return msg_list;
 }
 
@@ -641,7 +540,6 @@ libbalsa_mailbox_pop3_check(LibBalsaMailbox * mailbox)
 	/* proceed on success only */
 	if (pop != NULL) {
 		struct fetch_data fd;
-		GHashTable *current_uids = NULL;
 		gboolean result = TRUE;
 		GError *err = NULL;
 
@@ -649,12 +547,16 @@ libbalsa_mailbox_pop3_check(LibBalsaMailbox * mailbox)
 			_("Connected to %s"), net_client_get_host(NET_CLIENT(pop)));
 		memset(&fd, 0, sizeof(fd));
 
-		/* nothing to do if no messages are on the server */
-		if (msg_list != NULL) {
-			/* load uid's if messages shall be left on the server */
-			msg_list = update_msg_list(&fd, mailbox_pop3, &current_uids,
-                                                   server, msg_list);
+		/* load uid's if messages shall be left on the server */
+		if (!mailbox_pop3->delete_from_server) {
+			gchar *account =
+                            g_strconcat(libbalsa_server_get_user(server), "@",
+                                        libbalsa_server_get_host(server), NULL);
+
+			fd.uid_store = libbalsa_pop3_uid_store_open(account);
+			g_free(account);
 		}
+		msg_list = update_msg_list(&fd, mailbox_pop3, msg_list);
 
 		/* download messages unless the list is empty */
 		if (fd.total_messages > 0U) {
@@ -683,16 +585,13 @@ libbalsa_mailbox_pop3_check(LibBalsaMailbox * mailbox)
 			g_list_free_full(msg_list, (GDestroyNotify) net_client_pop_msg_info_free);
 		}
 
-		/* store uid list */
-		if (result && !mailbox_pop3->delete_from_server) {
-			gchar *uid_prefix =
-                            g_strconcat(libbalsa_server_get_user(server), "@",
-                                        libbalsa_server_get_host(server), NULL);
+		/* the uid's of the retrieved messages have already been stored */
+		if (fd.uid_store != NULL) {
+			GError *uid_err = NULL;
 
-			mp_save_uids(current_uids, uid_prefix, &err);
-			g_free(uid_prefix);
-			if (current_uids != NULL) {
-				g_hash_table_destroy(current_uids);
+			if (!libbalsa_pop3_uid_store_close(fd.uid_store, &uid_err)) {
+				libbalsa_information(LIBBALSA_INFORMATION_WARNING, "%s", uid_err->message);
+				g_error_free(uid_err);
 			}
 		}
 
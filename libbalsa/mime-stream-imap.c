@@ -0,0 +1,338 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2016 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option) 
+ * any later version.
+ *  
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * LibBalsaMimeStreamImap: a read-only GMimeStream whose data is
+ * fetched on demand, a window at a time, typically by partial IMAP
+ * FETCHes of a message part.
+ *
+ * The window grows while the stream is read sequentially, so that a
+ * large attachment is streamed in few round trips, while a reader
+ * jumping around fetches only what it needs. The window is shared by
+ * the stream and all substreams derived from it.
+ */
+
+#if defined(HAVE_CONFIG_H) && HAVE_CONFIG_H
+# include "config.h"
+#endif                          /* HAVE_CONFIG_H */
+
+#include "mime-stream-imap.h"
+
+#include <string.h>
+
+#define LBMSI_MIN_WINDOW (64 * 1024)
+#define LBMSI_MAX_WINDOW (4 * 1024 * 1024)
+
+typedef struct {
+    gint refcount;
+    GMutex lock;
+    gint64 length;
+    LibBalsaMimeStreamImapFetch fetch;
+    gpointer data;
+    GDestroyNotify destroy;
+    GByteArray *window;         /* data at window_offset */
+    gint64 window_offset;
+} LbmsiSource;
+
+struct _LibBalsaMimeStreamImap {
+    GMimeStream parent_object;
+
+    LbmsiSource *source;
+};
+
+static void lbmsi_finalize(GObject *object);
+
+static ssize_t lbmsi_stream_read(GMimeStream * stream, char *buf,
+                                 size_t len);
+static ssize_t lbmsi_stream_write(GMimeStream * stream, const char *buf,
+                                  size_t len);
+static int lbmsi_stream_flush(GMimeStream * stream);
+static int lbmsi_stream_close(GMimeStream * stream);
+static gboolean lbmsi_stream_eos(GMimeStream * stream);
+static int lbmsi_stream_reset(GMimeStream * stream);
+static gint64 lbmsi_stream_seek(GMimeStream * stream, gint64 offset,
+                                GMimeSeekWhence whence);
+static gint64 lbmsi_stream_tell(GMimeStream * stream);
+static gint64 lbmsi_stream_length(GMimeStream * stream);
+static GMimeStream *lbmsi_stream_substream(GMimeStream * stream,
+                                           gint64 start, gint64 end);
+
+G_DEFINE_TYPE(LibBalsaMimeStreamImap, libbalsa_mime_stream_imap, GMIME_TYPE_STREAM)
+
+static void
+libbalsa_mime_stream_imap_class_init(LibBalsaMimeStreamImapClass * klass)
+{
+    GMimeStreamClass *stream_class = GMIME_STREAM_CLASS(klass);
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+    object_class->finalize  = lbmsi_finalize;
+
+    stream_class->read      = lbmsi_stream_read;
+    stream_class->write     = lbmsi_stream_write;
+    stream_class->flush     = lbmsi_stream_flush;
+    stream_class->close     = lbmsi_stream_close;
+    stream_class->eos       = lbmsi_stream_eos;
+    stream_class->reset     = lbmsi_stream_reset;
+    stream_class->seek      = lbmsi_stream_seek;
+    stream_class->tell      = lbmsi_stream_tell;
+    stream_class->length    = lbmsi_stream_length;
+    stream_class->substream = lbmsi_stream_substream;
+}
+
+static void
+libbalsa_mime_stream_imap_init(LibBalsaMimeStreamImap * stream)
+{
+}
+
+/* The shared source. */
+
+static LbmsiSource *
+lbmsi_source_ref(LbmsiSource * source)
+{
+    g_atomic_int_inc(&source->refcount);
+
+    return source;
+}
+
+static void
+lbmsi_source_unref(LbmsiSource * source)
+{
+    if (!g_atomic_int_dec_and_test(&source->refcount))
+        return;
+
+    if (source->destroy != NULL)
+        source->destroy(source->data);
+    g_byte_array_unref(source->window);
+    g_mutex_clear(&source->lock);
+    g_free(source);
+}
+
+/* lbmsi_source_fill() makes the window start at offset. The length
+ * is only the size announced by the server, so an empty fetch means
+ * that the data ends at offset. Returns the size of the window, 0 at
+ * the end of the data, or -1 on error. Called with the source lock
+ * held. */
+static gssize
+lbmsi_source_fill(LbmsiSource * source, gint64 offset)
+{
+    gsize size = source->window->len;
+    gssize n;
+
+    if (offset >= source->length)
+        return 0; /* another reader found the end */
+
+    /* Grow the window for sequential reads, start small otherwise. */
+    if (offset == source->window_offset + (gint64) size && size > 0)
+        size = MIN(2 * size, LBMSI_MAX_WINDOW);
+    else
+        size = LBMSI_MIN_WINDOW;
+    size = MIN((gint64) size, source->length - offset);
+
+    g_byte_array_set_size(source->window, size);
+    n = source->fetch(offset, (gchar *) source->window->data, size,
+                      source->data);
+    if (n <= 0) {
+        g_byte_array_set_size(source->window, 0);
+        source->window_offset = 0;
+        if (n == 0)
+            source->length = offset;
+        return n < 0 ? -1 : 0;
+    }
+    g_byte_array_set_size(source->window, n);
+    source->window_offset = offset;
+
+    return n;
+}
+
+/* Object class method. */
+
+static void
+lbmsi_finalize(GObject *object)
+{
+    LibBalsaMimeStreamImap *imap_stream = (LibBalsaMimeStreamImap *) object;
+
+    lbmsi_source_unref(imap_stream->source);
+
+    G_OBJECT_CLASS(libbalsa_mime_stream_imap_parent_class)->finalize(object);
+}
+
+/* Stream class methods. */
+
+static gint64
+lbmsi_bound_end(GMimeStream * stream)
+{
+    LbmsiSource *source = LIBBALSA_MIME_STREAM_IMAP(stream)->source;
+
+    return stream->bound_end != -1 ?
+        MIN(stream->bound_end, source->length) : source->length;
+}
+
+static ssize_t
+lbmsi_stream_read(GMimeStream * stream, char *buf, size_t len)
+{
+    LbmsiSource *source = LIBBALSA_MIME_STREAM_IMAP(stream)->source;
+    gint64 end = lbmsi_bound_end(stream);
+    gint64 position = stream->position;
+    ssize_t n;
+
+    if (position >= end)
+        return 0;
+    len = MIN((gint64) len, end - position);
+
+    g_mutex_lock(&source->lock);
+    if (position < source->window_offset ||
+        position >= source->window_offset + (gint64) source->window->len) {
+        n = lbmsi_source_fill(source, position);
+    } else
+        n = source->window->len;
+    if (n > 0) {
+        n = MIN((gint64) len,
+                source->window_offset + (gint64) source->window->len - position);
+        memcpy(buf, source->window->data + (position - source->window_offset),
+               n);
+        stream->position += n;
+    }
+    g_mutex_unlock(&source->lock);
+
+    return n;
+}
+
+static ssize_t
+lbmsi_stream_write(GMimeStream * stream, const char *buf, size_t len)
+{
+    return -1;                  /* read-only */
+}
+
+static int
+lbmsi_stream_flush(GMimeStream * stream)
+{
+    return 0;
+}
+
+static int
+lbmsi_stream_close(GMimeStream * stream)
+{
+    return 0;
+}
+
+static gboolean
+lbmsi_stream_eos(GMimeStream * stream)
+{
+    return stream->position >= lbmsi_bound_end(stream);
+}
+
+static int
+lbmsi_stream_reset(GMimeStream * stream)
+{
+    stream->position = stream->bound_start;
+
+    return 0;
+}
+
+static gint64
+lbmsi_stream_seek(GMimeStream * stream, gint64 offset,
+                  GMimeSeekWhence whence)
+{
+    gint64 end = lbmsi_bound_end(stream);
+    gint64 position;
+
+    switch (whence) {
+    case GMIME_STREAM_SEEK_SET:
+        position = stream->bound_start + offset;
+        break;
+    case GMIME_STREAM_SEEK_CUR:
+        position = stream->position + offset;
+        break;
+    case GMIME_STREAM_SEEK_END:
+        position = end + offset;
+        break;
+    default:
+        return -1;
+    }
+    if (position < stream->bound_start || position > end)
+        return -1;
+
+    stream->position = position;
+
+    return position;
+}
+
+static gint64
+lbmsi_stream_tell(GMimeStream * stream)
+{
+    return stream->position;
+}
+
+static gint64
+lbmsi_stream_length(GMimeStream * stream)
+{
+    return lbmsi_bound_end(stream) - stream->bound_start;
+}
+
+static GMimeStream *
+lbmsi_stream_substream(GMimeStream * stream, gint64 start, gint64 end)
+{
+    LibBalsaMimeStreamImap *imap_stream;
+
+    imap_stream = g_object_new(LIBBALSA_TYPE_MIME_STREAM_IMAP, NULL);
+    imap_stream->source =
+        lbmsi_source_ref(LIBBALSA_MIME_STREAM_IMAP(stream)->source);
+    g_mime_stream_construct(GMIME_STREAM(imap_stream), start, end);
+
+    return GMIME_STREAM(imap_stream);
+}
+
+/* Public methods. */
+
+/**
+ * libbalsa_mime_stream_imap_new:
+ * @length: length of the data
+ * @fetch: function fetching the data
+ * @data: user data for @fetch
+ * @destroy: function to free @data, or NULL
+ *
+ * Create a stream whose data is read on demand with @fetch.
+ *
+ * Returns the new stream.
+ **/
+GMimeStream *
+libbalsa_mime_stream_imap_new(gint64 length,
+                              LibBalsaMimeStreamImapFetch fetch,
+                              gpointer data, GDestroyNotify destroy)
+{
+    LibBalsaMimeStreamImap *imap_stream;
+    LbmsiSource *source;
+
+    g_return_val_if_fail(fetch != NULL, NULL);
+
+    source = g_new0(LbmsiSource, 1);
+    source->refcount = 1;
+    g_mutex_init(&source->lock);
+    source->length  = length;
+    source->fetch   = fetch;
+    source->data    = data;
+    source->destroy = destroy;
+    source->window  = g_byte_array_new();
+
+    imap_stream = g_object_new(LIBBALSA_TYPE_MIME_STREAM_IMAP, NULL);
+    imap_stream->source = source;
+    g_mime_stream_construct(GMIME_STREAM(imap_stream), 0, length);
+
+    return GMIME_STREAM(imap_stream);
+}
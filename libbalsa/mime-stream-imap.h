@@ -0,0 +1,49 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2016 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option) 
+ * any later version.
+ *  
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the  
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LIBBALSA_MIME_STREAM_IMAP_H__
+#define __LIBBALSA_MIME_STREAM_IMAP_H__
+
+#ifndef BALSA_VERSION
+# error "Include config.h before this file."
+#endif
+
+#include <gmime/gmime-stream.h>
+
+#define LIBBALSA_TYPE_MIME_STREAM_IMAP libbalsa_mime_stream_imap_get_type()
+
+G_DECLARE_FINAL_TYPE(LibBalsaMimeStreamImap,
+                     libbalsa_mime_stream_imap,
+                     LIBBALSA,
+                     MIME_STREAM_IMAP,
+                     GMimeStream);
+
+/* LibBalsaMimeStreamImapFetch: reads up to len bytes at offset into
+ * buf; returns the number of bytes read, 0 if the data ends before
+ * offset, or -1 on error. */
+typedef gssize (*LibBalsaMimeStreamImapFetch)(gint64 offset, gchar *buf,
+                                              gsize len, gpointer data);
+
+GMimeStream *libbalsa_mime_stream_imap_new(gint64 length,
+                                           LibBalsaMimeStreamImapFetch fetch,
+                                           gpointer data,
+                                           GDestroyNotify destroy);
+
+#endif                          /* __LIBBALSA_MIME_STREAM_IMAP_H__ */
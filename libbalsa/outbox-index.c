@@ -0,0 +1,460 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2016 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+  The outbox index. The outbox mailbox remains the queue itself; the
+  index only records, for each queued message, the SMTP server it is
+  to be sent through, its state and when it may next be tried. The
+  send code can thus skip messages for other servers, or messages
+  waiting for a retry, without loading them.
+
+  Every state change is appended to a journal, one line per record,
+  and synced to disk before the change takes effect, so that a crash
+  in the middle of a send is noticed on the next start: messages
+  which were being sent are reported as interrupted. The journal is
+  rewritten when it is loaded and whenever it grows much larger than
+  its live contents.
+
+  Records: "Q id server", "S id server", "R id retries next",
+  "F id" and "D id", with the fields separated by tabs.
+
+  The send queue is driven by the index, and only falls back to a scan
+  of the whole outbox while the index may lack some of its messages:
+  when there was no journal to load, or a record could not be written.
+  A complete scan makes the index complete again.
+*/
+
+#if defined(HAVE_CONFIG_H) && HAVE_CONFIG_H
+# include "config.h"
+#endif                          /* HAVE_CONFIG_H */
+#include "outbox-index.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "journal.h"
+
+#define OUTBOX_INDEX_FILE   "outbox-index"
+/* rewrite the journal when it has this many more records than entries */
+#define OUTBOX_INDEX_SLACK  256
+/* retry delays: 1 minute, doubled for each retry, at most 1 hour */
+#define OUTBOX_RETRY_BASE   60
+#define OUTBOX_RETRY_MAX    3600
+
+typedef enum {
+    OI_QUEUED,
+    OI_SENDING,
+    OI_INTERRUPTED,
+    OI_FAILED
+} OutboxIndexState;
+
+typedef struct {
+    gchar *message_id;
+    gchar *smtp_server;
+    guint retries;
+    gint64 next_attempt;        /* seconds since the epoch */
+    OutboxIndexState state;
+} OutboxIndexEntry;
+
+static GMutex outbox_index_lock;
+static GHashTable *outbox_entries;   /* message_id -> OutboxIndexEntry */
+static LibBalsaJournal *outbox_journal;
+static guint outbox_interrupted;
+static gboolean outbox_complete;     /* every queued message is indexed */
+
+static void
+oi_entry_free(OutboxIndexEntry *entry)
+{
+    g_free(entry->message_id);
+    g_free(entry->smtp_server);
+    g_free(entry);
+}
+
+static OutboxIndexEntry *
+oi_entry_new(const gchar *message_id, const gchar *smtp_server)
+{
+    OutboxIndexEntry *entry = g_new0(OutboxIndexEntry, 1);
+
+    entry->message_id = g_strdup(message_id);
+    entry->smtp_server = g_strdup(smtp_server);
+    g_hash_table_replace(outbox_entries, entry->message_id, entry);
+
+    return entry;
+}
+
+/* Message-IDs and server names with tabs or newlines would break the
+   journal; such messages are simply not indexed. */
+static gboolean
+oi_valid(const gchar *str)
+{
+    return str != NULL && str[strcspn(str, "\t\n")] == '\0';
+}
+
+static void
+oi_set_state(OutboxIndexEntry *entry, OutboxIndexState state)
+{
+    if (entry->state == OI_INTERRUPTED)
+        --outbox_interrupted;
+    if (state == OI_INTERRUPTED)
+        ++outbox_interrupted;
+    entry->state = state;
+}
+
+/* oi_write_entry() writes the records of one entry; the journal
+   syncs each record to disk, except while compacting. */
+static void
+oi_write_entry(LibBalsaJournal *journal, OutboxIndexEntry *entry)
+{
+    libbalsa_journal_printf(journal, "Q\t%s\t%s\n",
+                            entry->message_id, entry->smtp_server);
+    if (entry->retries > 0)
+        libbalsa_journal_printf(journal, "R\t%s\t%u\t%" G_GINT64_FORMAT "\n",
+                                entry->message_id, entry->retries,
+                                entry->next_attempt);
+    if (entry->state == OI_SENDING || entry->state == OI_INTERRUPTED)
+        libbalsa_journal_printf(journal, "S\t%s\t%s\n",
+                                entry->message_id, entry->smtp_server);
+    else if (entry->state == OI_FAILED)
+        libbalsa_journal_printf(journal, "F\t%s\n", entry->message_id);
+}
+
+static void
+oi_replay(gchar *contents)
+{
+    gchar *line = contents;
+    gchar *eol;
+
+    /* an incomplete last line was cut short by a crash */
+    while ((eol = strchr(line, '\n')) != NULL) {
+        gchar **fields;
+        guint n_fields;
+        OutboxIndexEntry *entry;
+
+        *eol = '\0';
+        fields = g_strsplit(line, "\t", -1);
+        n_fields = g_strv_length(fields);
+        entry = n_fields >= 2 ?
+            g_hash_table_lookup(outbox_entries, fields[1]) : NULL;
+
+        switch (n_fields >= 2 ? fields[0][0] : '\0') {
+        case 'Q':
+            if (n_fields == 3)
+                oi_entry_new(fields[1], fields[2]);
+            break;
+        case 'S':
+            if (n_fields == 3) {
+                if (entry == NULL)
+                    entry = oi_entry_new(fields[1], fields[2]);
+                entry->state = OI_SENDING;
+            }
+            break;
+        case 'R':
+            if (entry != NULL && n_fields == 4) {
+                entry->retries = strtoul(fields[2], NULL, 10);
+                entry->next_attempt = g_ascii_strtoll(fields[3], NULL, 10);
+                entry->state = OI_QUEUED;
+            }
+            break;
+        case 'F':
+            if (entry != NULL)
+                entry->state = OI_FAILED;
+            break;
+        case 'D':
+            g_hash_table_remove(outbox_entries, fields[1]);
+            break;
+        default:
+            break;
+        }
+        g_strfreev(fields);
+        line = eol + 1;
+    }
+}
+
+/* oi_dump() writes the records of the live entries. */
+static void
+oi_dump(LibBalsaJournal *journal, gpointer data)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, outbox_entries);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+        oi_write_entry(journal, value);
+}
+
+/* oi_init() loads the index when it is first used; messages which
+   were being sent when Balsa stopped are marked as interrupted. */
+static void
+oi_init(void)
+{
+    gchar *path;
+    gchar *contents;
+    GHashTableIter iter;
+    gpointer value;
+
+    if (outbox_entries != NULL)
+        return;
+
+    outbox_entries =
+        g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                              (GDestroyNotify) oi_entry_free);
+    path = g_build_filename(g_get_home_dir(), ".balsa",
+                            OUTBOX_INDEX_FILE, NULL);
+    outbox_journal =
+        libbalsa_journal_new(path, NULL, 0, LIBBALSA_JOURNAL_FSYNC,
+                             OUTBOX_INDEX_SLACK);
+    if (libbalsa_journal_read(outbox_journal, &contents, NULL)) {
+        oi_replay(contents);
+        g_free(contents);
+        outbox_complete = TRUE;
+    }
+    g_free(path);
+
+    g_hash_table_iter_init(&iter, outbox_entries);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        OutboxIndexEntry *entry = value;
+
+        if (entry->state == OI_SENDING)
+            oi_set_state(entry, OI_INTERRUPTED);
+    }
+
+    libbalsa_journal_compact(outbox_journal, oi_dump, NULL);
+}
+
+static void
+oi_done(void)
+{
+    /* a lost record may have been the only trace of a message */
+    if (!libbalsa_journal_sync(outbox_journal, NULL))
+        outbox_complete = FALSE;
+    libbalsa_journal_maybe_compact(outbox_journal,
+                                   g_hash_table_size(outbox_entries),
+                                   oi_dump, NULL);
+    g_mutex_unlock(&outbox_index_lock);
+}
+
+static OutboxIndexEntry *
+oi_lookup(const gchar *message_id)
+{
+    g_mutex_lock(&outbox_index_lock);
+    oi_init();
+
+    return message_id != NULL ?
+        g_hash_table_lookup(outbox_entries, message_id) : NULL;
+}
+
+/* Public methods */
+
+void
+libbalsa_outbox_index_enqueue(const gchar *message_id,
+                              const gchar *smtp_server)
+{
+    OutboxIndexEntry *entry;
+
+    if (!oi_valid(message_id) || !oi_valid(smtp_server)) {
+        /* only a scan of the outbox finds this message */
+        oi_lookup(NULL);
+        outbox_complete = FALSE;
+        g_mutex_unlock(&outbox_index_lock);
+        return;
+    }
+
+    entry = oi_lookup(message_id);
+    if (entry != NULL)
+        oi_set_state(entry, OI_QUEUED);
+    entry = oi_entry_new(message_id, smtp_server);
+    oi_write_entry(outbox_journal, entry);
+    oi_done();
+}
+
+LibBalsaOutboxState
+libbalsa_outbox_index_check(const gchar *message_id,
+                            const gchar *smtp_server)
+{
+    OutboxIndexEntry *entry;
+    LibBalsaOutboxState state;
+
+    entry = oi_lookup(message_id);
+    if (entry == NULL)
+        state = LIBBALSA_OUTBOX_UNKNOWN;
+    else if (entry->state == OI_INTERRUPTED)
+        state = LIBBALSA_OUTBOX_INTERRUPTED;
+    else if (g_strcmp0(entry->smtp_server, smtp_server) != 0)
+        state = LIBBALSA_OUTBOX_DEFERRED;
+    else if (entry->state == OI_QUEUED &&
+             entry->next_attempt > g_get_real_time() / G_USEC_PER_SEC)
+        state = LIBBALSA_OUTBOX_DEFERRED;
+    else
+        state = LIBBALSA_OUTBOX_READY;
+    g_mutex_unlock(&outbox_index_lock);
+
+    return state;
+}
+
+/* libbalsa_outbox_index_due() returns the Message-IDs of the messages
+   which may be sent through smtp_server now, i.e. those for which
+   libbalsa_outbox_index_check() does not return DEFERRED, and of the
+   failed ones, which the user may have released since. */
+GPtrArray *
+libbalsa_outbox_index_due(const gchar *smtp_server)
+{
+    GPtrArray *due;
+    gint64 now;
+    GHashTableIter iter;
+    gpointer value;
+
+    due = g_ptr_array_new_with_free_func(g_free);
+    now = g_get_real_time() / G_USEC_PER_SEC;
+    oi_lookup(NULL);
+    g_hash_table_iter_init(&iter, outbox_entries);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        OutboxIndexEntry *entry = value;
+
+        if (entry->state == OI_INTERRUPTED ||
+            (g_strcmp0(entry->smtp_server, smtp_server) == 0 &&
+             (entry->state != OI_QUEUED || entry->next_attempt <= now)))
+            g_ptr_array_add(due, g_strdup(entry->message_id));
+    }
+    g_mutex_unlock(&outbox_index_lock);
+
+    return due;
+}
+
+/* libbalsa_outbox_index_is_complete() returns FALSE if the outbox may
+   hold messages which are not in the index, so that it must be
+   scanned. */
+gboolean
+libbalsa_outbox_index_is_complete(void)
+{
+    gboolean result;
+
+    oi_lookup(NULL);
+    result = outbox_complete;
+    g_mutex_unlock(&outbox_index_lock);
+
+    return result;
+}
+
+gboolean
+libbalsa_outbox_index_has_interrupted(void)
+{
+    gboolean result;
+
+    oi_lookup(NULL);
+    result = outbox_interrupted > 0;
+    g_mutex_unlock(&outbox_index_lock);
+
+    return result;
+}
+
+void
+libbalsa_outbox_index_sending(const gchar *message_id,
+                              const gchar *smtp_server)
+{
+    OutboxIndexEntry *entry;
+
+    if (!oi_valid(message_id) || !oi_valid(smtp_server))
+        return;
+
+    entry = oi_lookup(message_id);
+    if (entry == NULL)
+        entry = oi_entry_new(message_id, smtp_server);
+    oi_set_state(entry, OI_SENDING);
+    libbalsa_journal_printf(outbox_journal, "S\t%s\t%s\n",
+                            message_id, smtp_server);
+    oi_done();
+}
+
+void
+libbalsa_outbox_index_done(const gchar *message_id)
+{
+    OutboxIndexEntry *entry;
+
+    entry = oi_lookup(message_id);
+    if (entry != NULL) {
+        libbalsa_journal_printf(outbox_journal, "D\t%s\n", message_id);
+        oi_set_state(entry, OI_QUEUED);
+        g_hash_table_remove(outbox_entries, message_id);
+    }
+    oi_done();
+}
+
+void
+libbalsa_outbox_index_retry(const gchar *message_id)
+{
+    OutboxIndexEntry *entry;
+
+    entry = oi_lookup(message_id);
+    if (entry != NULL) {
+        gint64 delay;
+
+        entry->retries++;
+        delay = (gint64) OUTBOX_RETRY_BASE << MIN(entry->retries - 1, 6U);
+        entry->next_attempt = g_get_real_time() / G_USEC_PER_SEC +
+            MIN(delay, OUTBOX_RETRY_MAX);
+        oi_set_state(entry, OI_QUEUED);
+        libbalsa_journal_printf(outbox_journal,
+                                "R\t%s\t%u\t%" G_GINT64_FORMAT "\n",
+                                message_id, entry->retries,
+                                entry->next_attempt);
+    }
+    oi_done();
+}
+
+void
+libbalsa_outbox_index_failed(const gchar *message_id)
+{
+    OutboxIndexEntry *entry;
+
+    entry = oi_lookup(message_id);
+    if (entry != NULL) {
+        oi_set_state(entry, OI_FAILED);
+        libbalsa_journal_printf(outbox_journal, "F\t%s\n", message_id);
+    }
+    oi_done();
+}
+
+/* libbalsa_outbox_index_prune() forgets the messages whose Message-ID
+   is not a key of present, i.e. which have been removed from the
+   outbox by other means. If complete is FALSE, present lacks the
+   flagged messages, which were skipped unseen, so only queued ones
+   are forgotten; otherwise entries in any state are. As present is
+   the result of a scan of the whole outbox, which has indexed every
+   message that may be sent, the index is complete afterwards. */
+void
+libbalsa_outbox_index_prune(GHashTable *present, gboolean complete)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    oi_lookup(NULL);
+    g_hash_table_iter_init(&iter, outbox_entries);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        OutboxIndexEntry *entry = value;
+
+        if ((complete || entry->state == OI_QUEUED) &&
+            !g_hash_table_contains(present, entry->message_id)) {
+            libbalsa_journal_printf(outbox_journal, "D\t%s\n",
+                                    entry->message_id);
+            oi_set_state(entry, OI_QUEUED);
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+    outbox_complete = TRUE;
+    oi_done();
+}
@@ -0,0 +1,50 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2016 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef __LIBBALSA_OUTBOX_INDEX_H__
+#define __LIBBALSA_OUTBOX_INDEX_H__
+
+#include <glib.h>
+
+/* The outbox index records, by Message-ID, the SMTP server, the state
+ * and the retry schedule of each queued message, so that the send
+ * queue need not load every message of the outbox on each flush. */
+
+typedef enum {
+    LIBBALSA_OUTBOX_UNKNOWN,    /* not in the index */
+    LIBBALSA_OUTBOX_READY,      /* may be sent now */
+    LIBBALSA_OUTBOX_DEFERRED,   /* other server, or next attempt later */
+    LIBBALSA_OUTBOX_INTERRUPTED /* was being sent when Balsa stopped */
+} LibBalsaOutboxState;
+
+void libbalsa_outbox_index_enqueue(const gchar *message_id,
+                                   const gchar *smtp_server);
+LibBalsaOutboxState libbalsa_outbox_index_check(const gchar *message_id,
+                                                const gchar *smtp_server);
+GPtrArray *libbalsa_outbox_index_due(const gchar *smtp_server);
+gboolean libbalsa_outbox_index_is_complete(void);
+gboolean libbalsa_outbox_index_has_interrupted(void);
+void libbalsa_outbox_index_sending(const gchar *message_id,
+                                   const gchar *smtp_server);
+void libbalsa_outbox_index_done(const gchar *message_id);
+void libbalsa_outbox_index_retry(const gchar *message_id);
+void libbalsa_outbox_index_failed(const gchar *message_id);
+void libbalsa_outbox_index_prune(GHashTable *present, gboolean complete);
+
+#endif                          /* __LIBBALSA_OUTBOX_INDEX_H__ */
@@ -0,0 +1,170 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2016 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+  Benchmark of the POP3 UID store with a large mailbox left on the
+  server: retrieving 100000 messages, checking them all on the next
+  connection, the server expiring half of them, and loading the store
+  again. The store is kept in a temporary home directory.
+
+  Usage: pop3-uid-store-bench [number of UIDs]
+*/
+
+#if defined(HAVE_CONFIG_H) && HAVE_CONFIG_H
+# include "config.h"
+#endif                          /* HAVE_CONFIG_H */
+#include "pop3-uid-store.h"
+
+#include <stdlib.h>
+#include <glib/gstdio.h>
+
+#define BENCH_ACCOUNT "user@pop.example.com"
+#define BENCH_UIDS    100000
+
+static gint64 bench_start;
+
+static void
+bench_begin(void)
+{
+    bench_start = g_get_monotonic_time();
+}
+
+static void
+bench_end(const gchar *what, guint n)
+{
+    gint64 elapsed = g_get_monotonic_time() - bench_start;
+
+    g_print("%-28s %8u UIDs %10.3f ms %8.3f us/UID\n", what, n,
+            elapsed / 1000.0, n > 0 ? (gdouble) elapsed / n : 0.0);
+}
+
+static gchar *
+bench_uid(guint n)
+{
+    /* looks like the UIDs of common servers */
+    return g_strdup_printf("%08x%08x", n, g_str_hash(BENCH_ACCOUNT) ^ n);
+}
+
+static void
+bench_close(LibBalsaPop3UidStore *store)
+{
+    GError *error = NULL;
+
+    if (!libbalsa_pop3_uid_store_close(store, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        exit(1);
+    }
+}
+
+static void
+bench_remove_dir(const gchar *path)
+{
+    GDir *dir = g_dir_open(path, 0U, NULL);
+    const gchar *name;
+
+    if (dir != NULL) {
+        while ((name = g_dir_read_name(dir)) != NULL) {
+            gchar *child = g_build_filename(path, name, NULL);
+
+            if (g_file_test(child, G_FILE_TEST_IS_DIR))
+                bench_remove_dir(child);
+            else
+                g_unlink(child);
+            g_free(child);
+        }
+        g_dir_close(dir);
+    }
+    g_rmdir(path);
+}
+
+int
+main(int argc, char *argv[])
+{
+    guint n_uids = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_UIDS;
+    gchar **uids;
+    gchar *home;
+    GHashTable *present;
+    LibBalsaPop3UidStore *store;
+    guint i, found;
+
+    home = g_dir_make_tmp("balsa-bench-XXXXXX", NULL);
+    if (home == NULL || n_uids == 0) {
+        g_printerr("usage: %s [number of UIDs]\n", argv[0]);
+        return 1;
+    }
+    /* g_get_home_dir() honours $HOME since GLib 2.36 */
+    g_setenv("HOME", home, TRUE);
+
+    uids = g_new(gchar *, n_uids + 1);
+    for (i = 0; i < n_uids; i++)
+        uids[i] = bench_uid(i);
+    uids[n_uids] = NULL;
+
+    /* first check: every message is new */
+    bench_begin();
+    store = libbalsa_pop3_uid_store_open(BENCH_ACCOUNT);
+    for (i = 0; i < n_uids; i++) {
+        if (!libbalsa_pop3_uid_store_contains(store, uids[i]))
+            libbalsa_pop3_uid_store_add(store, uids[i]);
+    }
+    bench_close(store);
+    bench_end("add", n_uids);
+
+    /* next check: load the log, nothing is new */
+    bench_begin();
+    store = libbalsa_pop3_uid_store_open(BENCH_ACCOUNT);
+    bench_end("open (replay)", n_uids);
+
+    bench_begin();
+    for (i = found = 0; i < n_uids; i++)
+        found += libbalsa_pop3_uid_store_contains(store, uids[i]);
+    bench_end("lookup", n_uids);
+    if (found != n_uids) {
+        g_printerr("lost %u UIDs\n", n_uids - found);
+        return 1;
+    }
+
+    /* the server has deleted every other message */
+    present = g_hash_table_new(g_str_hash, g_str_equal);
+    for (i = 0; i < n_uids; i += 2)
+        g_hash_table_add(present, uids[i]);
+    bench_begin();
+    libbalsa_pop3_uid_store_expire(store, present);
+    bench_close(store);
+    bench_end("expire half (compaction)", n_uids);
+    g_hash_table_destroy(present);
+
+    bench_begin();
+    store = libbalsa_pop3_uid_store_open(BENCH_ACCOUNT);
+    bench_end("open after expire", (n_uids + 1) / 2);
+    for (i = found = 0; i < n_uids; i++)
+        found += libbalsa_pop3_uid_store_contains(store, uids[i]);
+    bench_close(store);
+    if (found != (n_uids + 1) / 2) {
+        g_printerr("expected %u UIDs, found %u\n", (n_uids + 1) / 2, found);
+        return 1;
+    }
+
+    g_strfreev(uids);
+    bench_remove_dir(home);
+    g_free(home);
+
+    return 0;
+}
@@ -0,0 +1,299 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2016 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+  The POP3 UID store. Each account has its own file in
+  ~/.balsa/pop-uids.d, so that checking one account neither reads nor
+  locks the UIDs of the others. The file is a log: "+uid" records a
+  retrieved message as soon as it has been stored, "-uid" forgets a
+  message which is no longer on the server. It is replayed into a
+  hash table when the account is opened, and rewritten only when it
+  has grown much larger than its live contents.
+
+  The UIDs of an account without a file of its own are taken over
+  from the single ~/.balsa/pop-uids file of older versions.
+
+  The file itself is handled by LibBalsaJournal.
+*/
+
+#if defined(HAVE_CONFIG_H) && HAVE_CONFIG_H
+# include "config.h"
+#endif                          /* HAVE_CONFIG_H */
+#include "pop3-uid-store.h"
+
+#include <string.h>
+#include <glib/gi18n.h>
+#include "journal.h"
+
+#define POP3_UID_STORE_DIR     "pop-uids.d"
+#define POP3_UID_STORE_LEGACY  "pop-uids"
+/* rewrite the log when it has this many more records than UIDs */
+#define POP3_UID_STORE_SLACK   1024
+
+struct _LibBalsaPop3UidStore {
+    gchar *account;
+    gchar *path;
+    GMutex lock;
+    GHashTable *uids;           /* the set of known UIDs */
+    LibBalsaJournal *journal;
+    guint refs;
+};
+
+static GMutex uid_stores_lock;
+static GHashTable *uid_stores;  /* account -> LibBalsaPop3UidStore */
+
+/* UIDs consist of printable characters (RFC 1939, sect. 7); anything
+   else would break the log, and is simply not stored. */
+static gboolean
+pus_valid(const gchar *uid)
+{
+    return uid != NULL && uid[0] != '\0' && uid[strcspn(uid, "\r\n")] == '\0';
+}
+
+static guint
+pus_replay(LibBalsaPop3UidStore *store, gchar *contents)
+{
+    gchar *line = contents;
+    gchar *eol;
+    guint records = 0;
+
+    /* an incomplete last line was cut short by a crash */
+    while ((eol = strchr(line, '\n')) != NULL) {
+        *eol = '\0';
+        if (line[0] == '+' && line[1] != '\0')
+            g_hash_table_add(store->uids, g_strdup(line + 1));
+        else if (line[0] == '-')
+            g_hash_table_remove(store->uids, line + 1);
+        ++records;
+        line = eol + 1;
+    }
+
+    return records;
+}
+
+/* pus_migrate() takes the UIDs of the account from the old pop-uids
+   file, whose lines read "user@host uid". */
+static void
+pus_migrate(LibBalsaPop3UidStore *store)
+{
+    gchar *path = g_build_filename(g_get_home_dir(), ".balsa",
+                                   POP3_UID_STORE_LEGACY, NULL);
+    gchar *contents;
+
+    if (g_file_get_contents(path, &contents, NULL, NULL)) {
+        gchar *prefix = g_strconcat(store->account, " ", NULL);
+        size_t prefix_len = strlen(prefix);
+        gchar **lines = g_strsplit(contents, "\n", -1);
+        guint n;
+
+        for (n = 0; lines[n] != NULL; n++) {
+            if (strncmp(lines[n], prefix, prefix_len) == 0 &&
+                pus_valid(lines[n] + prefix_len))
+                g_hash_table_add(store->uids,
+                                 g_strdup(lines[n] + prefix_len));
+        }
+        g_strfreev(lines);
+        g_free(prefix);
+        g_free(contents);
+    }
+    g_free(path);
+}
+
+/* pus_dump() writes one record per known UID. */
+static void
+pus_dump(LibBalsaJournal *journal, gpointer data)
+{
+    LibBalsaPop3UidStore *store = data;
+    GHashTableIter iter;
+    gpointer key;
+
+    g_hash_table_iter_init(&iter, store->uids);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (!libbalsa_journal_printf(journal, "+%s\n", (const gchar *) key))
+            break;
+    }
+}
+
+static void
+pus_maybe_compact(LibBalsaPop3UidStore *store)
+{
+    libbalsa_journal_maybe_compact(store->journal,
+                                   g_hash_table_size(store->uids),
+                                   pus_dump, store);
+}
+
+static void
+pus_free(LibBalsaPop3UidStore *store)
+{
+    libbalsa_journal_free(store->journal);
+    g_hash_table_destroy(store->uids);
+    g_mutex_clear(&store->lock);
+    g_free(store->path);
+    g_free(store->account);
+    g_free(store);
+}
+
+/* Public methods */
+
+/* libbalsa_pop3_uid_store_open() returns the store of the account
+   "user@host", loading it if no other check of the same account
+   holds it; it must be released with
+   libbalsa_pop3_uid_store_close(). */
+LibBalsaPop3UidStore *
+libbalsa_pop3_uid_store_open(const gchar *account)
+{
+    LibBalsaPop3UidStore *store;
+
+    g_return_val_if_fail(account != NULL, NULL);
+
+    g_mutex_lock(&uid_stores_lock);
+    if (uid_stores == NULL)
+        uid_stores = g_hash_table_new(g_str_hash, g_str_equal);
+
+    store = g_hash_table_lookup(uid_stores, account);
+    if (store == NULL) {
+        gchar *dir = g_build_filename(g_get_home_dir(), ".balsa",
+                                      POP3_UID_STORE_DIR, NULL);
+        gchar *name = g_uri_escape_string(account, "@", FALSE);
+        gchar *contents;
+
+        store = g_new0(LibBalsaPop3UidStore, 1);
+        store->account = g_strdup(account);
+        store->path = g_build_filename(dir, name, NULL);
+        g_mutex_init(&store->lock);
+        store->uids =
+            g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        store->journal =
+            libbalsa_journal_new(store->path, NULL, 0,
+                                 LIBBALSA_JOURNAL_FLUSH,
+                                 POP3_UID_STORE_SLACK);
+
+        if (libbalsa_journal_read(store->journal, &contents, NULL)) {
+            libbalsa_journal_replayed(store->journal,
+                                      pus_replay(store, contents));
+            g_free(contents);
+            pus_maybe_compact(store);
+        } else {
+            pus_migrate(store);
+            /* a failure shows when the log is written */
+            g_mkdir_with_parents(dir, 0700);
+            libbalsa_journal_compact(store->journal, pus_dump, store);
+        }
+        g_hash_table_insert(uid_stores, store->account, store);
+
+        g_free(name);
+        g_free(dir);
+    }
+    ++store->refs;
+    g_mutex_unlock(&uid_stores_lock);
+
+    return store;
+}
+
+gboolean
+libbalsa_pop3_uid_store_contains(LibBalsaPop3UidStore *store,
+                                 const gchar *uid)
+{
+    gboolean result;
+
+    g_return_val_if_fail(store != NULL, FALSE);
+
+    if (uid == NULL)
+        return FALSE;
+
+    g_mutex_lock(&store->lock);
+    result = g_hash_table_contains(store->uids, uid);
+    g_mutex_unlock(&store->lock);
+
+    return result;
+}
+
+/* libbalsa_pop3_uid_store_add() records the UID of a message which
+   has been retrieved and stored. */
+void
+libbalsa_pop3_uid_store_add(LibBalsaPop3UidStore *store,
+                            const gchar *uid)
+{
+    g_return_if_fail(store != NULL);
+
+    if (!pus_valid(uid))
+        return;
+
+    g_mutex_lock(&store->lock);
+    if (g_hash_table_add(store->uids, g_strdup(uid)))
+        libbalsa_journal_printf(store->journal, "+%s\n", uid);
+    g_mutex_unlock(&store->lock);
+}
+
+/* libbalsa_pop3_uid_store_expire() forgets the UIDs which are not
+   keys of present, i.e. whose messages have been removed from the
+   server; only these are written. */
+void
+libbalsa_pop3_uid_store_expire(LibBalsaPop3UidStore *store,
+                               GHashTable *present)
+{
+    GHashTableIter iter;
+    gpointer key;
+
+    g_return_if_fail(store != NULL && present != NULL);
+
+    g_mutex_lock(&store->lock);
+    g_hash_table_iter_init(&iter, store->uids);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (!g_hash_table_contains(present, key)) {
+            libbalsa_journal_printf(store->journal, "-%s\n",
+                                    (const gchar *) key);
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+    pus_maybe_compact(store);
+    g_mutex_unlock(&store->lock);
+}
+
+/* libbalsa_pop3_uid_store_close() releases the store; when the last
+   user releases it, the log is synced to disk and the store is
+   freed. Returns FALSE if any UID could not be written. */
+gboolean
+libbalsa_pop3_uid_store_close(LibBalsaPop3UidStore *store,
+                              GError **error)
+{
+    GError *sync_error = NULL;
+    gboolean result;
+
+    g_return_val_if_fail(store != NULL, FALSE);
+
+    g_mutex_lock(&uid_stores_lock);
+    g_mutex_lock(&store->lock);
+    result = libbalsa_journal_sync(store->journal, &sync_error);
+    if (!result) {
+        g_set_error(error, sync_error->domain, sync_error->code,
+                    _("Saving the POP3 message UID list failed: %s"),
+                    sync_error->message);
+        g_error_free(sync_error);
+    }
+    g_mutex_unlock(&store->lock);
+
+    if (--store->refs == 0) {
+        g_hash_table_remove(uid_stores, store->account);
+        pus_free(store);
+    }
+    g_mutex_unlock(&uid_stores_lock);
+
+    return result;
+}
@@ -0,0 +1,41 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2016 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef __LIBBALSA_POP3_UID_STORE_H__
+#define __LIBBALSA_POP3_UID_STORE_H__
+
+#include <glib.h>
+
+/* The POP3 UID store remembers, for each account ("user@host"), the
+ * UIDs of the messages which have already been retrieved from a
+ * server where they are left. */
+
+typedef struct _LibBalsaPop3UidStore LibBalsaPop3UidStore;
+
+LibBalsaPop3UidStore *libbalsa_pop3_uid_store_open(const gchar *account);
+gboolean libbalsa_pop3_uid_store_contains(LibBalsaPop3UidStore *store,
+                                          const gchar *uid);
+void libbalsa_pop3_uid_store_add(LibBalsaPop3UidStore *store,
+                                 const gchar *uid);
+void libbalsa_pop3_uid_store_expire(LibBalsaPop3UidStore *store,
+                                    GHashTable *present);
+gboolean libbalsa_pop3_uid_store_close(LibBalsaPop3UidStore *store,
+                                       GError **error);
+
+#endif                          /* __LIBBALSA_POP3_UID_STORE_H__ */
@@ -42,6 +42,7 @@
 #include "net-client-smtp.h"
 #include "gmime-filter-header.h"
 #include "smtp-server.h"
+#include "outbox-index.h"
 #include "identity.h"
 
 #include "libbalsa-progress.h"
@@ -62,6 +63,7 @@ struct _MessageQueueItem {
     LibBalsaMessage *orig;
     GMimeStream *stream;
     NetClientSmtpMessage *smtp_msg;
+    gboolean binary;            /* BINARYMIME if the server accepts it */
 };
 
 struct _SendMessageInfo {
@@ -77,6 +79,13 @@ struct _SendMessageInfo {
     gint last_report;
     guint msg_count;
     guint curr_msg;
+    GMutex lock;                /* protects next_item and the progress counters */
+    GList *next_item;           /* next MessageQueueItem to send */
+    GThread *connect_thread;    /* connects session while the messages are prepared */
+    gboolean reused;            /* session is an idle one kept from an earlier flush */
+    gboolean connected;
+    GError *connect_error;
+    gboolean all_present;       /* no message was skipped unseen */
 };
 
 
@@ -96,6 +105,7 @@ static gboolean send_mail_auto = FALSE;
 static guint send_mail_time = 0U;
 static guint send_mail_timer_id = 0U;
 static gint retrigger_send = 0;		/* # of messages added to outbox while the smtp server was locked, access via g_atomic_* */
+static GHashTable *outbox_msgnos = NULL;	/* Message-ID -> msgno of the outbox messages seen, protected by send_messages_lock */
 
 static ProgressDialog send_progress_dialog;
 
@@ -184,6 +194,8 @@ send_message_info_new(LibBalsaSmtpServer   *smtp_server,
     smi->finder = finder;
     smi->smtp_server = g_object_ref(smtp_server);
     smi->progress_id = g_strdup_printf(_("SMTP server %s"), libbalsa_smtp_server_get_name(smtp_server));
+    g_mutex_init(&smi->lock);
+    smi->all_present = TRUE;
     return smi;
 }
 
@@ -204,6 +216,8 @@ send_message_info_destroy(SendMessageInfo *smi)
     	g_free(smi->progress_id);
     }
     g_object_unref(smi->smtp_server);
+    g_clear_error(&smi->connect_error);
+    g_mutex_clear(&smi->lock);
     g_free(smi);
 }
 
@@ -450,6 +464,10 @@ lbs_message_queue_real(LibBalsaMessage    *message,
                 /* Temporarily modify message by changing its mime_msg: */
                 libbalsa_message_set_mime_message(message, mime_msgs[i]);
                 rc = libbalsa_message_copy(message, outbox, error);
+                if (rc) {
+                    libbalsa_outbox_index_enqueue(g_mime_message_get_message_id(mime_msgs[i]),
+                                                  libbalsa_smtp_server_get_name(smtp_server));
+                }
             }
             g_object_unref(mime_msgs[i]);
         }
@@ -459,6 +477,10 @@ lbs_message_queue_real(LibBalsaMessage    *message,
         g_object_unref(mime_msg);
     } else {
         rc = libbalsa_message_copy(message, outbox, error);
+        if (rc) {
+            libbalsa_outbox_index_enqueue(g_mime_message_get_message_id(mime_msg),
+                                          libbalsa_smtp_server_get_name(smtp_server));
+        }
     }
 
     return rc ? LIBBALSA_MESSAGE_CREATE_OK : LIBBALSA_MESSAGE_QUEUE_ERROR;
@@ -587,6 +609,7 @@ send_message_data_cb(gchar   *buffer,
         gdouble fraction;
         gint ipercent;
 
+        g_mutex_lock(&smi->lock);
     	smi->total_sent += read_res;
     	fraction = (gdouble) smi->total_sent / (gdouble) smi->total_size;
     	g_debug("%s: s=%lu t=%lu %g", __func__, (unsigned long) smi->total_sent, (unsigned long) smi->total_size, fraction);
@@ -599,6 +622,7 @@ send_message_data_cb(gchar   *buffer,
     			_("Message %u of %u"), smi->curr_msg, smi->msg_count);
     		smi->last_report = ipercent;
         }
+        g_mutex_unlock(&smi->lock);
     }
     return read_res;
 }
@@ -659,6 +683,37 @@ lbs_process_queue(LibBalsaMailbox      *outbox,
 }
 
 
+/* check if the message data contains any 8-bit characters, or even binary data, i.e. NUL characters, bare CRs or lines longer
+ * than 998 characters (RFC 5322, Sect. 2.1.1), so the server can be told to expect them */
+static NetClientSmtpBody
+lbs_stream_body_type(GMimeStream *stream)
+{
+    GByteArray *data;
+    NetClientSmtpBody body = NET_CLIENT_SMTP_BODY_7BIT;
+    guint line_len = 0U;
+    guint n;
+
+    data = g_mime_stream_mem_get_byte_array(GMIME_STREAM_MEM(stream));
+    for (n = 0U; n < data->len; n++) {
+        guint8 c = data->data[n];
+
+        if ((c == '\0') ||
+            ((c == '\r') && ((n + 1U == data->len) || (data->data[n + 1U] != '\n')))) {
+            return NET_CLIENT_SMTP_BODY_BINARYMIME;
+        }
+        if (c == '\n') {
+            line_len = 0U;
+        } else if ((c != '\r') && (++line_len > 998U)) {
+            return NET_CLIENT_SMTP_BODY_BINARYMIME;
+        }
+        if ((c & 0x80U) != 0U) {
+            body = NET_CLIENT_SMTP_BODY_8BITMIME;
+        }
+    }
+    return body;
+}
+
+
 static void
 lbs_process_queue_msg(guint 		   msgno,
 					  SendMessageInfo *send_message_info)
@@ -669,15 +724,44 @@ lbs_process_queue_msg(guint 		   msgno,
 	LibBalsaMsgCreateResult created;
         const gchar *dsn_header;
 
-	/* Skip this message if it either FLAGGED or DELETED: */
-	if (!libbalsa_mailbox_msgno_has_flags(send_message_info->outbox, msgno, 0,
-		(LIBBALSA_MESSAGE_FLAG_FLAGGED | LIBBALSA_MESSAGE_FLAG_DELETED))) {
+        const gchar *message_id;
+        gboolean skip;
+        LibBalsaOutboxState state;
+
+	/* Skip this message if it either FLAGGED or DELETED, unless it is flagged because sending it was interrupted: */
+	skip = !libbalsa_mailbox_msgno_has_flags(send_message_info->outbox, msgno, 0,
+		(LIBBALSA_MESSAGE_FLAG_FLAGGED | LIBBALSA_MESSAGE_FLAG_DELETED));
+	if (skip && !libbalsa_outbox_index_has_interrupted()) {
+		send_message_info->all_present = FALSE;
 		return;
 	}
 
 	msg = libbalsa_mailbox_get_message(send_message_info->outbox, msgno);
 	if (!msg) {
 		/* error? */
+		send_message_info->all_present = FALSE;
+		return;
+	}
+
+	/* the outbox index tells if the message is due for this server without loading it */
+	message_id = libbalsa_message_get_message_id(msg);
+	state = libbalsa_outbox_index_check(message_id,
+		libbalsa_smtp_server_get_name(send_message_info->smtp_server));
+	if (message_id != NULL) {
+		g_hash_table_replace(outbox_msgnos, g_strdup(message_id), GUINT_TO_POINTER(msgno));
+	}
+	if (skip && (state == LIBBALSA_OUTBOX_INTERRUPTED)) {
+		if (libbalsa_mailbox_msgno_has_flags(send_message_info->outbox, msgno, 0, LIBBALSA_MESSAGE_FLAG_DELETED)) {
+			g_debug("%s: resend message %s after interruption", __func__, message_id);
+			libbalsa_message_change_flags(msg, 0, LIBBALSA_MESSAGE_FLAG_FLAGGED);
+			skip = FALSE;
+		} else {
+			/* it was sent, but the crash came before it was removed */
+			libbalsa_outbox_index_done(message_id);
+		}
+	}
+	if (skip || (state == LIBBALSA_OUTBOX_DEFERRED)) {
+		g_object_unref(msg);
 		return;
 	}
 
@@ -687,6 +771,10 @@ lbs_process_queue_msg(guint 		   msgno,
 	if (!smtp_server_name) {
 		smtp_server_name = libbalsa_smtp_server_get_name(NULL);
 	}
+	if ((state == LIBBALSA_OUTBOX_UNKNOWN) && (message_id != NULL)) {
+		/* found by a scan of the outbox; index it, so the next flushes find it without one */
+		libbalsa_outbox_index_enqueue(message_id, smtp_server_name);
+	}
 	if (strcmp(smtp_server_name, libbalsa_smtp_server_get_name(send_message_info->smtp_server)) != 0) {
 		libbalsa_message_body_unref(msg);
 		g_object_unref(msg);
@@ -703,14 +791,19 @@ lbs_process_queue_msg(guint 		   msgno,
 		msg_queue_item_destroy(new_message);
 	} else {
                 gboolean request_dsn;
+                NetClientSmtpBody body;
                 LibBalsaMessageHeaders *headers;
                 InternetAddressList *from;
 		const InternetAddress* ia;
 		const gchar* mailbox;
 
 		libbalsa_message_change_flags(msg, LIBBALSA_MESSAGE_FLAG_FLAGGED, 0);
+		libbalsa_outbox_index_sending(message_id, smtp_server_name);
 		send_message_info->items = g_list_prepend(send_message_info->items, new_message);
 		new_message->smtp_msg = net_client_smtp_msg_new(send_message_data_cb, new_message);
+		body = lbs_stream_body_type(new_message->stream);
+		new_message->binary = (body == NET_CLIENT_SMTP_BODY_BINARYMIME);
+		net_client_smtp_msg_set_body(new_message->smtp_msg, body);
 		request_dsn = libbalsa_message_get_request_dsn(msg);
 		if (request_dsn) {
                         const gchar *message_id = libbalsa_message_get_message_id(msg);
@@ -791,6 +884,117 @@ lbs_process_queue_init_session(LibBalsaServer* server)
 }
 
 
+/* Thread function connecting the SMTP session, so the network round trips of the greeting, STARTTLS and authentication overlap with
+ * preparing the queued messages.  balsa_send_message_real() joins the thread before it sends anything. */
+static gpointer
+lbs_connect_session(SendMessageInfo *info)
+{
+    gchar *greeting = NULL;
+
+    /* check if a re-used session is still alive, and replace it by a new one if not */
+    if (info->reused) {
+        info->connected = net_client_smtp_reset(info->session, NULL);
+        if (!info->connected) {
+            NetClientSmtp *session;
+
+            g_debug("%s: idle session is stale, reconnect", __func__);
+            session = lbs_process_queue_init_session(LIBBALSA_SERVER(info->smtp_server));
+            g_object_unref(info->session);
+            info->session = session;
+            if (session == NULL) {
+                /* the stale session must not be connected again; fail transiently so the messages are retried */
+                g_set_error(&info->connect_error, NET_CLIENT_ERROR_QUARK, NET_CLIENT_ERROR_CONNECTION_LOST,
+                            _("The idle connection to %s was lost and a new one could not be set up"),
+                            libbalsa_server_get_host(LIBBALSA_SERVER(info->smtp_server)));
+            }
+        }
+    }
+
+    if (!info->connected && (info->session != NULL)) {
+        info->connected = net_client_smtp_connect(info->session, &greeting, &info->connect_error);
+        g_debug("%s: connect = %d: '%s'", __func__, info->connected, greeting);
+        g_free(greeting);
+    }
+
+    return NULL;
+}
+
+
+/* start connecting as soon as there is anything to send for this server */
+static inline void
+lbs_process_queue_connect(SendMessageInfo *send_message_info)
+{
+	if ((send_message_info->items != NULL) && (send_message_info->connect_thread == NULL)) {
+		send_message_info->connect_thread =
+			g_thread_new("lbs_connect_session", (GThreadFunc) lbs_connect_session, send_message_info);
+	}
+}
+
+
+/* get the message msgno from the outbox, and remember its msgno for the next flushes */
+static LibBalsaMessage *
+lbs_outbox_get_message(LibBalsaMailbox *outbox, guint msgno)
+{
+	LibBalsaMessage *msg;
+
+	msg = libbalsa_mailbox_get_message(outbox, msgno);
+	if ((msg != NULL) && (libbalsa_message_get_message_id(msg) != NULL)) {
+		g_hash_table_replace(outbox_msgnos, g_strdup(libbalsa_message_get_message_id(msg)), GUINT_TO_POINTER(msgno));
+	}
+	return msg;
+}
+
+
+/* queue the messages which the outbox index reports as due for this server, without looking at the others */
+static void
+lbs_process_queue_due(SendMessageInfo *send_message_info)
+{
+	LibBalsaMailbox *outbox = send_message_info->outbox;
+	GPtrArray *due;
+	guint unscanned;
+	gboolean lost = FALSE;
+	guint n;
+
+	due = libbalsa_outbox_index_due(libbalsa_smtp_server_get_name(send_message_info->smtp_server));
+	unscanned = libbalsa_mailbox_total_messages(outbox);
+	for (n = 0U; n < due->len; n++) {
+		const gchar *message_id = g_ptr_array_index(due, n);
+		LibBalsaMessage *msg = NULL;
+		guint msgno;
+
+		/* try the msgno seen by an earlier flush first; otherwise search from the end, as new messages are appended, and
+		 * expunging moves the others down */
+		msgno = GPOINTER_TO_UINT(g_hash_table_lookup(outbox_msgnos, message_id));
+		if ((msgno > 0U) && (msgno <= libbalsa_mailbox_total_messages(outbox))) {
+			msg = lbs_outbox_get_message(outbox, msgno);
+			if ((msg != NULL) && (g_strcmp0(libbalsa_message_get_message_id(msg), message_id) != 0)) {
+				g_clear_object(&msg);
+			}
+		}
+		while ((msg == NULL) && (unscanned > 0U)) {
+			msgno = unscanned--;
+			msg = lbs_outbox_get_message(outbox, msgno);
+			if (msg == NULL) {
+				lost = TRUE;
+			} else if (g_strcmp0(libbalsa_message_get_message_id(msg), message_id) != 0) {
+				g_clear_object(&msg);
+			}
+		}
+
+		if (msg != NULL) {
+			/* holding the message lets lbs_process_queue_msg() get it without parsing it again */
+			lbs_process_queue_msg(msgno, send_message_info);
+			g_object_unref(msg);
+			lbs_process_queue_connect(send_message_info);
+		} else if (!lost) {
+			/* removed from the outbox by other means */
+			libbalsa_outbox_index_done(message_id);
+		}
+	}
+	g_ptr_array_unref(due);
+}
+
+
 /* libbalsa_process_queue:
    treats given mailbox as a set of messages to send. Loads them up and
    launches sending thread/routine.
@@ -811,16 +1015,32 @@ lbs_process_queue_real(LibBalsaSmtpServer *smtp_server, SendQueueInfo *send_info
     if (libbalsa_mailbox_open(send_info->outbox, NULL)) {
     	NetClientSmtp *session;
 
-    	/* create the SMTP session */
-    	session = lbs_process_queue_init_session(LIBBALSA_SERVER(smtp_server));
+    	NetClientSmtp *idle_session;
+
+    	/* re-use an idle session if possible, or create a new one */
+    	idle_session = libbalsa_smtp_server_take_session(smtp_server);
+    	session = (idle_session != NULL) ? idle_session : lbs_process_queue_init_session(LIBBALSA_SERVER(smtp_server));
     	if (session != NULL) {
         	SendMessageInfo *send_message_info;
         	guint msgno;
 
     		send_message_info = send_message_info_new(smtp_server, send_info->outbox, send_info->finder, session);
+    		send_message_info->reused = (idle_session != NULL);
 
-    		for (msgno = libbalsa_mailbox_total_messages(send_info->outbox); msgno > 0U; msgno--) {
-    			lbs_process_queue_msg(msgno, send_message_info);
+    		if (outbox_msgnos == NULL) {
+    			outbox_msgnos = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    		}
+    		if (libbalsa_outbox_index_is_complete()) {
+    			lbs_process_queue_due(send_message_info);
+    		} else {
+    			/* the index may lack some messages: look at all of them, which indexes them, and forget the entries of
+    			 * messages which are not in the outbox any more */
+    			g_hash_table_remove_all(outbox_msgnos);
+    			for (msgno = libbalsa_mailbox_total_messages(send_info->outbox); msgno > 0U; msgno--) {
+    				lbs_process_queue_msg(msgno, send_message_info);
+    				lbs_process_queue_connect(send_message_info);
+    			}
+    			libbalsa_outbox_index_prune(outbox_msgnos, send_message_info->all_present);
     		}
 
     		/* launch the thread for sending the messages only if we collected any */
@@ -956,6 +1176,11 @@ balsa_send_message_success(MessageQueueItem *mqi,
 		/* If copy failed, mark the message again as flagged - otherwise it will get
 		 * resent again. And again, and again... */
 		libbalsa_message_change_flags(mqi->orig, remove ? LIBBALSA_MESSAGE_FLAG_DELETED : LIBBALSA_MESSAGE_FLAG_FLAGGED, 0);
+		if (remove) {
+			libbalsa_outbox_index_done(libbalsa_message_get_message_id(mqi->orig));
+		} else {
+			libbalsa_outbox_index_failed(libbalsa_message_get_message_id(mqi->orig));
+		}
 	}
 }
 
@@ -974,12 +1199,14 @@ balsa_send_message_error(MessageQueueItem *mqi,
 			 * - neither flagged nor deleted, so it can be resent later
 			 *   without changing flags. */
 			libbalsa_message_change_flags(mqi->orig, 0, LIBBALSA_MESSAGE_FLAG_FLAGGED | LIBBALSA_MESSAGE_FLAG_DELETED);
+			libbalsa_outbox_index_retry(libbalsa_message_get_message_id(mqi->orig));
 		} else {
 			/* Mark it as:
 			 * - flagged, so it will not be sent again until the error is fixed
 			 *   and the user manually clears the flag;
 			 * - undeleted, in case it was already deleted. */
 			libbalsa_message_change_flags(mqi->orig, LIBBALSA_MESSAGE_FLAG_FLAGGED, LIBBALSA_MESSAGE_FLAG_DELETED);
+			libbalsa_outbox_index_failed(libbalsa_message_get_message_id(mqi->orig));
 		}
 	}
 	libbalsa_information(LIBBALSA_INFORMATION_ERROR, _("Sending message failed: %s\nMessage left in your outbox."),
@@ -1006,96 +1233,200 @@ balsa_send_message_syslog(const gchar            *smtp_server,
 	}
 }
 
+/* Send queued messages through the passed, connected session until none is left.  Several sessions may run this in parallel, each
+ * one in its own thread.  After a failed message the session is reset; if that fails, the session is given up and the remaining
+ * messages are left to the other sessions. */
+static gboolean
+balsa_send_message_items(SendMessageInfo *info,
+                         NetClientSmtp   *session)
+{
+    gboolean result = TRUE;
+
+    for (;;) {
+        MessageQueueItem *mqi;
+        gboolean send_res;
+        gchar *server_reply = NULL;
+        GError *error = NULL;
+        LibBalsaMailbox *mailbox;
+
+        g_mutex_lock(&info->lock);
+        if (info->next_item == NULL) {
+            g_mutex_unlock(&info->lock);
+            break;
+        }
+        mqi = (MessageQueueItem *) info->next_item->data;
+        info->next_item = info->next_item->next;
+        info->curr_msg++;
+        g_debug("%s: %u/%u mqi = %p", __func__, info->msg_count, info->curr_msg, mqi);
+        g_mutex_unlock(&info->lock);
+
+        mailbox = mqi->orig != NULL ? libbalsa_message_get_mailbox(mqi->orig) : NULL;
+
+        /* a server without binary MIME may still pass the message on, so do not refuse to send it */
+        if (mqi->binary && !net_client_smtp_can_binarymime(session)) {
+            net_client_smtp_msg_set_body(mqi->smtp_msg, NET_CLIENT_SMTP_BODY_8BITMIME);
+        }
+
+        /* send the message */
+        send_res = net_client_smtp_send_msg(session, mqi->smtp_msg, &server_reply, &error);
+        balsa_send_message_syslog(net_client_get_host(NET_CLIENT(session)), mqi, send_res, server_reply, error);
+        g_free(server_reply);
+
+        g_mutex_lock(&send_messages_lock);
+        if (mailbox != NULL) {
+            libbalsa_message_change_flags(mqi->orig, 0, LIBBALSA_MESSAGE_FLAG_FLAGGED);
+        } else {
+            g_debug("mqi: %p mqi->orig: %p mailbox: %p",
+                      mqi, mqi->orig, mailbox);
+        }
+
+        if (send_res) {
+            /* sending message successful */
+			balsa_send_message_success(mqi, info);
+        } else {
+            /* sending message failed */
+			balsa_send_message_error(mqi, error);
+            g_clear_error(&error);
+            result = FALSE;
+        }
+
+        /* free data */
+        g_mutex_unlock(&send_messages_lock);
+
+        /* leave the mail transaction of the failed message */
+        if (!send_res && !net_client_smtp_reset(session, NULL)) {
+            break;
+        }
+    }
+
+    return result;
+}
+
+/* Mark the messages as neither flagged nor deleted, so they can be resent later without changing flags, and schedule the next
+ * attempt. */
+static void
+lbs_requeue_items(GList *items)
+{
+    GList *this_msg;
+
+    for (this_msg = items; this_msg != NULL; this_msg = this_msg->next) {
+        MessageQueueItem *mqi = (MessageQueueItem *) this_msg->data;
+        LibBalsaMailbox *mailbox;
+
+        mailbox = mqi->orig != NULL ?
+            libbalsa_message_get_mailbox(mqi->orig) : NULL;
+
+        if (mailbox != NULL) {
+            libbalsa_message_change_flags(mqi->orig,
+                                          0,
+                                          LIBBALSA_MESSAGE_FLAG_FLAGGED |
+                                          LIBBALSA_MESSAGE_FLAG_DELETED);
+            libbalsa_outbox_index_retry(libbalsa_message_get_message_id(mqi->orig));
+        }
+    }
+}
+
+/* Thread function for an additional session.  If it cannot connect, the messages are left to the other sessions.  Returns NULL if
+ * sending any message failed. */
+static gpointer
+balsa_send_message_worker(SendMessageInfo *info)
+{
+    NetClientSmtp *session;
+    gboolean result = TRUE;
+
+    session = lbs_process_queue_init_session(LIBBALSA_SERVER(info->smtp_server));
+    if (session != NULL) {
+        GError *error = NULL;
+
+        if (net_client_smtp_connect(session, NULL, &error)) {
+            result = balsa_send_message_items(info, session);
+        } else {
+            g_debug("%s: additional session to %s failed: %s", __func__,
+                    net_client_get_host(NET_CLIENT(session)), error->message);
+            g_error_free(error);
+        }
+        g_object_unref(session);
+    }
+
+    return result ? info : NULL;
+}
+
 static gpointer
 balsa_send_message_real(SendMessageInfo *info)
 {
     gboolean result;
-    GError *error = NULL;
-    gchar *greeting = NULL;
+    GError *error;
 
     g_debug("%s: starting", __func__);
 
-    /* connect the SMTP server */
+    /* wait until the SMTP server is connected */
     if (!info->no_dialog) {
 		libbalsa_progress_dialog_update(&send_progress_dialog, info->progress_id, FALSE, INFINITY,
-			_("Connecting %s…"), net_client_get_host(NET_CLIENT(info->session)));
+			_("Connecting %s…"), libbalsa_server_get_host(LIBBALSA_SERVER(info->smtp_server)));
     }
-    result = net_client_smtp_connect(info->session, &greeting, &error);
-    g_debug("%s: connect = %d [%p]: '%s'", __func__, result, info->items, greeting);
-    g_free(greeting);
+    g_thread_join(info->connect_thread);
+    info->connect_thread = NULL;
+    result = info->connected;
+    error = info->connect_error;
+    info->connect_error = NULL;
+    g_debug("%s: connect = %d [%p]", __func__, result, info->items);
     if (result) {
-        GList *this_msg;
+        guint n_sessions;
+        GPtrArray *workers;
+        guint n;
 
         if (!info->no_dialog) {
     		libbalsa_progress_dialog_update(&send_progress_dialog, info->progress_id, FALSE, 0.0,
     			_("Connected to %s"), net_client_get_host(NET_CLIENT(info->session)));
         }
 
-        for (this_msg = info->items; this_msg != NULL; this_msg = this_msg->next) {
-            MessageQueueItem *mqi = (MessageQueueItem *) this_msg->data;
-            gboolean send_res;
-            gchar *server_reply = NULL;
-            LibBalsaMailbox *mailbox;
-
-            mailbox = mqi->orig != NULL ? libbalsa_message_get_mailbox(mqi->orig) : NULL;
-
-            info->curr_msg++;
-            g_debug("%s: %u/%u mqi = %p", __func__, info->msg_count, info->curr_msg, mqi);
-            /* send the message */
-            send_res = net_client_smtp_send_msg(info->session, mqi->smtp_msg, &server_reply, &error);
-            balsa_send_message_syslog(net_client_get_host(NET_CLIENT(info->session)), mqi, send_res, server_reply, error);
-            g_free(server_reply);
+        /* start additional sessions if the server allows it and there is enough to do */
+        info->next_item = info->items;
+        n_sessions = MIN(libbalsa_smtp_server_get_max_sessions(info->smtp_server), info->msg_count);
+        workers = g_ptr_array_new();
+        for (n = 1U; n < n_sessions; n++) {
+            g_ptr_array_add(workers, g_thread_new("balsa_send_worker", (GThreadFunc) balsa_send_message_worker, info));
+        }
 
-            g_mutex_lock(&send_messages_lock);
-            if (mailbox != NULL) {
-                libbalsa_message_change_flags(mqi->orig, 0, LIBBALSA_MESSAGE_FLAG_FLAGGED);
-            } else {
-                g_debug("mqi: %p mqi->orig: %p mailbox: %p",
-                          mqi, mqi->orig, mailbox);
-            }
+        result = balsa_send_message_items(info, info->session);
 
-            if (send_res) {
-                /* sending message successful */
-				balsa_send_message_success(mqi, info);
-            } else {
-                /* sending message failed */
-				balsa_send_message_error(mqi, error);
-                g_clear_error(&error);
+        for (n = 0U; n < workers->len; n++) {
+            if (g_thread_join(g_ptr_array_index(workers, n)) == NULL) {
                 result = FALSE;
             }
+        }
+        g_ptr_array_free(workers, TRUE);
 
-            /* free data */
+        /* all sessions were given up: try the messages left again later */
+        if (info->next_item != NULL) {
+            g_mutex_lock(&send_messages_lock);
+            lbs_requeue_items(info->next_item);
             g_mutex_unlock(&send_messages_lock);
+            result = FALSE;
         }
     } else {
         if (ERROR_IS_TRANSIENT(error) || (error->code == NET_CLIENT_ERROR_SMTP_AUTHFAIL)) {
+            lbs_requeue_items(info->items);
+        	if (error->code == NET_CLIENT_ERROR_SMTP_AUTHFAIL) {
+        		/* authentication failed: clear password */
+        		libbalsa_server_set_password(LIBBALSA_SERVER(info->smtp_server), NULL, FALSE);
+        	}
+        } else {
             GList *this_msg;
 
-            /* Mark all messages as neither flagged nor deleted, so they can be resent later
-             * without changing flags. */
+            /* the messages remain flagged */
             for (this_msg = info->items; this_msg != NULL; this_msg = this_msg->next) {
                 MessageQueueItem *mqi = (MessageQueueItem *) this_msg->data;
-                LibBalsaMailbox *mailbox;
-
-                mailbox = mqi->orig != NULL ?
-                    libbalsa_message_get_mailbox(mqi->orig) : NULL;
 
-                if (mailbox != NULL) {
-                    libbalsa_message_change_flags(mqi->orig,
-                                                  0,
-                                                  LIBBALSA_MESSAGE_FLAG_FLAGGED |
-                                                  LIBBALSA_MESSAGE_FLAG_DELETED);
+                if (mqi->orig != NULL) {
+                    libbalsa_outbox_index_failed(libbalsa_message_get_message_id(mqi->orig));
                 }
             }
-        	if (error->code == NET_CLIENT_ERROR_SMTP_AUTHFAIL) {
-        		/* authentication failed: clear password */
-        		libbalsa_server_set_password(LIBBALSA_SERVER(info->smtp_server), NULL, FALSE);
-        	}
         }
         libbalsa_information(LIBBALSA_INFORMATION_ERROR,
                              _("Connecting SMTP server %s (%s) failed: %s"),
                              libbalsa_smtp_server_get_name(info->smtp_server),
-                             net_client_get_host(NET_CLIENT(info->session)),
+                             libbalsa_server_get_host(LIBBALSA_SERVER(info->smtp_server)),
                              error->message);
         g_error_free(error);
     }
@@ -1103,8 +1434,12 @@ balsa_send_message_real(SendMessageInfo *info)
     /* close outbox in an idle callback, as it might affect the display */
     g_idle_add((GSourceFunc) balsa_send_message_real_idle_cb, g_object_ref(info->outbox));
 
-    /* finalise the SMTP session (which may be slow) */
-    g_object_unref(info->session);
+    /* keep the SMTP session for the next flush if all went well, or finalise it (which may be slow) */
+    if (info->connected && result) {
+        libbalsa_smtp_server_keep_session(info->smtp_server, info->session);
+    } else if (info->session != NULL) {
+        g_object_unref(info->session);
+    }
     info->session = NULL;
 
     /* clean up */
@@ -1683,16 +2018,11 @@ libbalsa_fill_msg_queue_item_from_queu(LibBalsaMessage  *message,
         g_mime_stream_filter_add(GMIME_STREAM_FILTER(filter_stream), filter);
         g_object_unref(filter);
 
-        /* add CRLF */
+        /* add CRLF; dot-stuffing, if required, is done by the SMTP client */
         filter = g_mime_filter_unix2dos_new(FALSE);
         g_mime_stream_filter_add(GMIME_STREAM_FILTER(filter_stream), filter);
         g_object_unref(filter);
 
-        /* encode dot */
-        filter = g_mime_filter_smtp_data_new();
-        g_mime_stream_filter_add(GMIME_STREAM_FILTER(filter_stream), filter);
-        g_object_unref(filter);
-
         /* write to a new stream */
         mqi->stream = g_mime_stream_mem_new();
         g_mime_stream_write_to_stream(filter_stream, mqi->stream);
@@ -35,12 +35,23 @@
 #  include "macosx-helpers.h"
 #endif
 
+/* upper limit for parallel sessions to the same server */
+#define SMTP_SERVER_MAX_SESSIONS 8
+/* upper limit for keeping an idle session open, in seconds */
+#define SMTP_SERVER_MAX_IDLE 600
+
 struct _LibBalsaSmtpServer {
     LibBalsaServer server;
 
     gchar *name;
     guint big_message; /* size of partial messages; in kB; 0 disables splitting */
+    guint max_sessions; /* number of parallel sessions when sending the outbox */
+    guint idle_timeout; /* seconds to keep an idle session open; 0 disables */
     gint lock_state;	/* 0 means unlocked; access via atomic operations */
+
+    GMutex idle_lock;   /* protects idle_session and idle_id */
+    NetClientSmtp *idle_session;
+    guint idle_id;
 };
 
 /* Class boilerplate */
@@ -58,6 +69,11 @@ libbalsa_smtp_server_finalize(GObject * object)
 
     smtp_server = LIBBALSA_SMTP_SERVER(object);
 
+    /* a pending idle timeout holds a reference, so there is none */
+    if (smtp_server->idle_session != NULL) {
+        g_object_unref(smtp_server->idle_session);
+    }
+    g_mutex_clear(&smtp_server->idle_lock);
     g_free(smtp_server->name);
 
     G_OBJECT_CLASS(libbalsa_smtp_server_parent_class)->finalize(object);
@@ -77,6 +93,9 @@ static void
 libbalsa_smtp_server_init(LibBalsaSmtpServer * smtp_server)
 {
     libbalsa_server_set_protocol(LIBBALSA_SERVER(smtp_server), "smtp");
+    smtp_server->max_sessions = 1U;
+    smtp_server->idle_timeout = 60U;
+    g_mutex_init(&smtp_server->idle_lock);
 }
 
 /* Public methods */
@@ -114,6 +133,10 @@ libbalsa_smtp_server_new_from_config(const gchar * name)
     libbalsa_server_load_config(LIBBALSA_SERVER(smtp_server));
 
     smtp_server->big_message = libbalsa_conf_get_int("BigMessage=0");
+    smtp_server->max_sessions =
+        CLAMP(libbalsa_conf_get_int("MaxSessions=1"), 1, SMTP_SERVER_MAX_SESSIONS);
+    smtp_server->idle_timeout =
+        CLAMP(libbalsa_conf_get_int("IdleTimeout=60"), 0, SMTP_SERVER_MAX_IDLE);
 
     return smtp_server;
 }
@@ -124,6 +147,8 @@ libbalsa_smtp_server_save_config(LibBalsaSmtpServer * smtp_server)
     libbalsa_server_save_config(LIBBALSA_SERVER(smtp_server));
 
     libbalsa_conf_set_int("BigMessage", smtp_server->big_message);
+    libbalsa_conf_set_int("MaxSessions", smtp_server->max_sessions);
+    libbalsa_conf_set_int("IdleTimeout", smtp_server->idle_timeout);
 }
 
 void
@@ -147,6 +172,105 @@ libbalsa_smtp_server_get_big_message(LibBalsaSmtpServer * smtp_server)
     return smtp_server->big_message * 1024;
 }
 
+guint
+libbalsa_smtp_server_get_max_sessions(LibBalsaSmtpServer * smtp_server)
+{
+    return smtp_server->max_sessions;
+}
+
+/* Idle sessions are closed in a thread, as QUIT may block on a dead connection */
+static gpointer
+smtp_server_close_session(NetClientSmtp *session)
+{
+    g_object_unref(session);
+    return NULL;
+}
+
+static void
+smtp_server_drop_session(NetClientSmtp *session)
+{
+    if (session != NULL) {
+        g_thread_unref(g_thread_new("smtp_server_close_session",
+                                    (GThreadFunc) smtp_server_close_session, session));
+    }
+}
+
+static gboolean
+smtp_server_idle_expired(LibBalsaSmtpServer * smtp_server)
+{
+    NetClientSmtp *session;
+
+    g_mutex_lock(&smtp_server->idle_lock);
+    session = smtp_server->idle_session;
+    smtp_server->idle_session = NULL;
+    smtp_server->idle_id = 0U;
+    g_mutex_unlock(&smtp_server->idle_lock);
+    smtp_server_drop_session(session);
+
+    return FALSE;
+}
+
+/**
+ * libbalsa_smtp_server_keep_session:
+ * @smtp_server: the server
+ * @session: (transfer full): a connected session to @smtp_server
+ *
+ * Keep the session open for re-use by libbalsa_smtp_server_take_session()
+ * until the idle timeout of the server expires.  The session is closed
+ * immediately if the idle timeout is 0.
+ */
+void
+libbalsa_smtp_server_keep_session(LibBalsaSmtpServer * smtp_server,
+                                  NetClientSmtp * session)
+{
+    NetClientSmtp *old_session;
+
+    if (smtp_server->idle_timeout == 0U) {
+        smtp_server_drop_session(session);
+        return;
+    }
+
+    g_mutex_lock(&smtp_server->idle_lock);
+    old_session = smtp_server->idle_session;
+    smtp_server->idle_session = session;
+    if (smtp_server->idle_id != 0U) {
+        g_source_remove(smtp_server->idle_id);
+    }
+    smtp_server->idle_id =
+        g_timeout_add_seconds_full(G_PRIORITY_DEFAULT,
+                                   smtp_server->idle_timeout,
+                                   (GSourceFunc) smtp_server_idle_expired,
+                                   g_object_ref(smtp_server),
+                                   g_object_unref);
+    g_mutex_unlock(&smtp_server->idle_lock);
+    smtp_server_drop_session(old_session);
+}
+
+/**
+ * libbalsa_smtp_server_take_session:
+ * @smtp_server: the server
+ *
+ * Return value: (transfer full): the idle session kept by
+ * libbalsa_smtp_server_keep_session(), or NULL.  The caller must check
+ * that the session is still alive before using it.
+ */
+NetClientSmtp *
+libbalsa_smtp_server_take_session(LibBalsaSmtpServer * smtp_server)
+{
+    NetClientSmtp *session;
+
+    g_mutex_lock(&smtp_server->idle_lock);
+    session = smtp_server->idle_session;
+    smtp_server->idle_session = NULL;
+    if (smtp_server->idle_id != 0U) {
+        g_source_remove(smtp_server->idle_id);
+        smtp_server->idle_id = 0U;
+    }
+    g_mutex_unlock(&smtp_server->idle_lock);
+
+    return session;
+}
+
 static gint
 smtp_server_compare(gconstpointer a, gconstpointer b)
 {
@@ -208,6 +332,8 @@ struct smtp_server_dialog_info {
     LibBalsaServerCfg *notebook;
     GtkWidget *split_button;
     GtkWidget *big_message;
+    GtkWidget *max_sessions;
+    GtkWidget *idle_timeout;
 };
 
 /* GDestroyNotify for smtp_server_dialog_info. */
@@ -258,6 +384,12 @@ smtp_server_response(GtkDialog * dialog, gint response,
         } else {
         	sdi->smtp_server->big_message = 0U;
         }
+        sdi->smtp_server->max_sessions =
+            gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(sdi->max_sessions));
+        sdi->smtp_server->idle_timeout =
+            gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(sdi->idle_timeout));
+        /* the server settings may have changed: do not re-use an idle session */
+        smtp_server_drop_session(libbalsa_smtp_server_take_session(sdi->smtp_server));
         break;
     default:
         break;
@@ -365,6 +497,27 @@ libbalsa_smtp_server_dialog(LibBalsaSmtpServer * smtp_server,
     g_signal_connect(sdi->split_button, "toggled", G_CALLBACK(smtp_server_changed), sdi);
     g_signal_connect(sdi->big_message, "changed", G_CALLBACK(smtp_server_changed), sdi);
 
+    /* parallel sessions for sending many messages */
+    label = gtk_label_new_with_mnemonic(_("Parallel _connections"));
+    gtk_widget_set_halign(label, GTK_ALIGN_START);
+    sdi->max_sessions = gtk_spin_button_new_with_range(1, SMTP_SERVER_MAX_SESSIONS, 1);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(sdi->max_sessions), smtp_server->max_sessions);
+    gtk_label_set_mnemonic_widget(GTK_LABEL(label), sdi->max_sessions);
+    libbalsa_server_cfg_add_row(sdi->notebook, FALSE, label, sdi->max_sessions);
+    g_signal_connect(sdi->max_sessions, "changed", G_CALLBACK(smtp_server_changed), sdi);
+
+    /* keep the session open for sending more messages */
+    label = gtk_label_new_with_mnemonic(_("Keep idle connection _open for"));
+    gtk_widget_set_halign(label, GTK_ALIGN_START);
+    hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
+    sdi->idle_timeout = gtk_spin_button_new_with_range(0, SMTP_SERVER_MAX_IDLE, 10);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(sdi->idle_timeout), smtp_server->idle_timeout);
+    gtk_label_set_mnemonic_widget(GTK_LABEL(label), sdi->idle_timeout);
+    gtk_box_pack_start(GTK_BOX(hbox), sdi->idle_timeout, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(hbox), gtk_label_new(_("seconds")), FALSE, FALSE, 0);
+    libbalsa_server_cfg_add_row(sdi->notebook, FALSE, label, hbox);
+    g_signal_connect(sdi->idle_timeout, "changed", G_CALLBACK(smtp_server_changed), sdi);
+
     smtp_server_changed(NULL, sdi);
 
     gtk_widget_show_all(dialog);
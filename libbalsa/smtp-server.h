@@ -22,6 +22,7 @@
 
 #include <gtk/gtk.h>
 #include "server.h"
+#include "net-client-smtp.h"
 
 #define LIBBALSA_TYPE_SMTP_SERVER (libbalsa_smtp_server_get_type())
 
@@ -41,6 +42,8 @@ const gchar *libbalsa_smtp_server_get_name(LibBalsaSmtpServer *
                                            smtp_server);
 guint libbalsa_smtp_server_get_big_message(LibBalsaSmtpServer *
                                            smtp_server);
+guint libbalsa_smtp_server_get_max_sessions(LibBalsaSmtpServer *
+                                            smtp_server);
 void libbalsa_smtp_server_add_to_list(LibBalsaSmtpServer * smtp_server,
                                       GSList ** server_list);
 
@@ -51,6 +54,11 @@ void libbalsa_smtp_server_dialog(LibBalsaSmtpServer * smtp_server,
                                  GtkWindow * parent,
                                  LibBalsaSmtpServerUpdate update);
 
+void libbalsa_smtp_server_keep_session(LibBalsaSmtpServer * smtp_server,
+                                       NetClientSmtp * session);
+NetClientSmtp *libbalsa_smtp_server_take_session(LibBalsaSmtpServer *
+                                                 smtp_server);
+
 gboolean libbalsa_smtp_server_trylock(LibBalsaSmtpServer *smtp_server);
 void libbalsa_smtp_server_unlock(LibBalsaSmtpServer *smtp_server);
 
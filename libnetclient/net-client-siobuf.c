@@ -19,12 +19,17 @@
 #include "net-client-siobuf.h"
 
 
+/* size of the read buffer, i.e. the maximum number of bytes requested from the remote server in one read operation */
+#define SIOBUF_BLOCK_SIZE				65536U
+
+
 /*lint -esym(754,_NetClientSioBuf::parent)	required field, not referenced directly */
 struct _NetClientSioBuf {
     NetClient parent;
 
-	GString *buffer;		/**< hold a line read from the remote server, including the terminating CRLF */
-	gchar *read_ptr;		/**< point to the next char which shall be read in buffer's GString::str. */
+	gchar *buffer;			/**< block buffer holding raw data read from the remote server */
+	gsize read_pos;			/**< offset of the next char which shall be read from buffer */
+	gsize fill_pos;			/**< number of valid bytes in buffer */
 	GString *writebuf;		/**< buffer for buffered write functions */
 };
 
@@ -35,6 +40,7 @@ G_DEFINE_TYPE(NetClientSioBuf, net_client_siobuf, NET_CLIENT_TYPE)
 
 static void net_client_siobuf_finalise(GObject *object);
 static gboolean net_client_siobuf_fill(NetClientSioBuf *client, GError **error);
+static inline void net_client_siobuf_keep_last(NetClientSioBuf *client, gchar last_char);
 
 
 NetClientSioBuf *
@@ -50,8 +56,9 @@ net_client_siobuf_new(const gchar *host, guint16 port)
 			g_object_unref(client);
 			client = NULL;
 		} else {
-			client->buffer = g_string_sized_new(1024U);
-			client->read_ptr = NULL;
+			client->buffer = g_malloc(SIOBUF_BLOCK_SIZE);
+			client->read_pos = 0U;
+			client->fill_pos = 0U;
 			client->writebuf = g_string_sized_new(1024U);
 		}
 	}
@@ -63,7 +70,7 @@ net_client_siobuf_new(const gchar *host, guint16 port)
 gint
 net_client_siobuf_read(NetClientSioBuf *client, void *buffer, gsize count, GError **error)
 {
-	gboolean fill_res;
+	gboolean read_res;
 	gchar *dest;
 	gsize left;
 
@@ -71,25 +78,32 @@ net_client_siobuf_read(NetClientSioBuf *client, void *buffer, gsize count, GErro
 
 	dest = (gchar *) buffer;	/*lint !e9079	sane pointer conversion (MISRA C:2012 Rule 11.5) */
 	left = count;
-	fill_res = net_client_siobuf_fill(client, error);
-	while (fill_res && (left > 0U)) {
-		gsize avail;
+	read_res = TRUE;
+	while (read_res && (left > 0U)) {
 		gsize chunk;
 
-		/*lint -e{737,946,947,9029}		allowed exception according to MISRA C:2012 Rules 18.2, 18.3 */
-		avail = client->buffer->len - (client->read_ptr - client->buffer->str);
-		if (avail > left) {
-			chunk = left;
+		if (client->read_pos < client->fill_pos) {
+			/* consume buffered data first */
+			chunk = client->fill_pos - client->read_pos;
+			if (chunk > left) {
+				chunk = left;
+			}
+			memcpy(dest, &client->buffer[client->read_pos], chunk);
+			client->read_pos += chunk;
+		} else if (left >= SIOBUF_BLOCK_SIZE) {
+			/* large literal: read directly into the destination buffer, bypassing the internal one */
+			read_res = net_client_read_buffer(NET_CLIENT(client), dest, left, &chunk, error);
+			if (read_res) {
+				net_client_siobuf_keep_last(client, dest[chunk - 1U]);
+			}
 		} else {
-			chunk = avail;
+			read_res = net_client_siobuf_fill(client, error);
+			chunk = 0U;
 		}
 
-		memcpy(dest, client->read_ptr, chunk);
-		dest += chunk;
-		client->read_ptr += chunk;
-		left -= chunk;
-		if (left > 0U) {
-			fill_res = net_client_siobuf_fill(client, error);
+		if (read_res) {
+			dest += chunk;
+			left -= chunk;
 		}
 	}
 
@@ -97,6 +111,39 @@ net_client_siobuf_read(NetClientSioBuf *client, void *buffer, gsize count, GErro
 }
 
 
+gboolean
+net_client_siobuf_read_to_sink(NetClientSioBuf *client, gsize count, NetClientSioBufSink sink, gpointer user_data, GError **error)
+{
+	gboolean read_res;
+	gboolean sink_res;
+	gsize left;
+
+	g_return_val_if_fail(NET_IS_CLIENT_SIOBUF(client) && (sink != NULL), FALSE);
+
+	left = count;
+	read_res = TRUE;
+	sink_res = TRUE;
+	while (read_res && (left > 0U)) {
+		read_res = net_client_siobuf_fill(client, error);
+		if (read_res) {
+			gsize chunk;
+
+			chunk = client->fill_pos - client->read_pos;
+			if (chunk > left) {
+				chunk = left;
+			}
+			if (sink_res) {
+				sink_res = sink(&client->buffer[client->read_pos], chunk, user_data);
+			}
+			client->read_pos += chunk;
+			left -= chunk;
+		}
+	}
+
+	return read_res;
+}
+
+
 gint
 net_client_siobuf_getc(NetClientSioBuf *client, GError **error)
 {
@@ -105,7 +152,8 @@ net_client_siobuf_getc(NetClientSioBuf *client, GError **error)
 	g_return_val_if_fail(NET_IS_CLIENT_SIOBUF(client), -1);
 
 	if (net_client_siobuf_fill(client, error)) {
-		retval = (gint) *client->read_ptr++;
+		retval = (gint) (guchar) client->buffer[client->read_pos];
+		client->read_pos++;
 	} else {
 		retval = -1;
 	}
@@ -120,9 +168,8 @@ net_client_siobuf_ungetc(NetClientSioBuf *client)
 
 	g_return_val_if_fail(NET_IS_CLIENT_SIOBUF(client), -1);
 
-	/*lint -e{946}		allowed exception according to MISRA C:2012 Rules 18.2 and 18.3 */
-	if ((client->buffer->len != 0U) && (client->read_ptr > client->buffer->str)) {
-		client->read_ptr--;
+	if (client->read_pos > 0U) {
+		client->read_pos--;
 		retval = 0;
 	} else {
 		retval = -1;
@@ -131,6 +178,33 @@ net_client_siobuf_ungetc(NetClientSioBuf *client)
 }
 
 
+const gchar *
+net_client_siobuf_peek(NetClientSioBuf *client, gsize *count, GError **error)
+{
+	const gchar *result;
+
+	g_return_val_if_fail(NET_IS_CLIENT_SIOBUF(client) && (count != NULL), NULL);
+
+	if (net_client_siobuf_fill(client, error)) {
+		*count = client->fill_pos - client->read_pos;
+		result = &client->buffer[client->read_pos];
+	} else {
+		*count = 0U;
+		result = NULL;
+	}
+	return result;
+}
+
+
+void
+net_client_siobuf_skip(NetClientSioBuf *client, gsize count)
+{
+	g_return_if_fail(NET_IS_CLIENT_SIOBUF(client) && (count <= (client->fill_pos - client->read_pos)));
+
+	client->read_pos += count;
+}
+
+
 gchar *
 net_client_siobuf_gets(NetClientSioBuf *client, gchar *buffer, gsize buflen, GError **error)
 {
@@ -139,19 +213,33 @@ net_client_siobuf_gets(NetClientSioBuf *client, gchar *buffer, gsize buflen, GEr
 	g_return_val_if_fail(NET_IS_CLIENT_SIOBUF(client) && (buffer != NULL) && (buflen > 0U), NULL);
 
 	if (net_client_siobuf_fill(client, error)) {
-		gsize avail;
-		gsize chunk;
-
-		/*lint -e{737,946,947,9029}		allowed exception according to MISRA C:2012 Rules 18.2 and 18.3 */
-		avail = client->buffer->len - (client->read_ptr - client->buffer->str);
-		if (avail > (buflen - 1U)) {
-			chunk = buflen - 1U;
-		} else {
-			chunk = avail;
+		gboolean fill_res = TRUE;
+		gboolean eol = FALSE;
+		gsize len = 0U;
+
+		while (fill_res && !eol && (len < (buflen - 1U))) {
+			const gchar *start = &client->buffer[client->read_pos];
+			const gchar *lf;
+			gsize chunk;
+
+			chunk = client->fill_pos - client->read_pos;
+			if (chunk > (buflen - 1U - len)) {
+				chunk = buflen - 1U - len;
+			}
+			lf = memchr(start, '\n', chunk);
+			if (lf != NULL) {
+				/*lint -e{946,947,9029}		allowed exception according to MISRA C:2012 Rules 18.2 and 18.3 */
+				chunk = (gsize) (lf - start) + 1U;
+				eol = TRUE;
+			}
+			memcpy(&buffer[len], start, chunk);
+			client->read_pos += chunk;
+			len += chunk;
+			if (!eol && (len < (buflen - 1U))) {
+				fill_res = net_client_siobuf_fill(client, error);
+			}
 		}
-		memcpy(buffer, client->read_ptr, chunk);
-		client->read_ptr += chunk;
-		buffer[chunk] = '\0';
+		buffer[len] = '\0';
 		result = buffer;
 	} else {
 		result = NULL;
@@ -164,47 +252,82 @@ net_client_siobuf_gets(NetClientSioBuf *client, gchar *buffer, gsize buflen, GEr
 gchar *
 net_client_siobuf_get_line(NetClientSioBuf *client, GError **error)
 {
-	gchar *result;
+	GString *line;
+	gboolean fill_res;
+	gboolean eol = FALSE;
 
 	g_return_val_if_fail(NET_IS_CLIENT_SIOBUF(client), NULL);
 
-	if (net_client_siobuf_fill(client, error)) {
-		gsize avail;
+	line = g_string_new(NULL);
+	fill_res = net_client_siobuf_fill(client, error);
+	while (fill_res && !eol) {
+		const gchar *start = &client->buffer[client->read_pos];
+		const gchar *lf;
+		gsize chunk;
 
-		/*lint -e{737,946,947,9029}		allowed exception according to MISRA C:2012 Rules 18.2 and 18.3 */
-		avail = client->buffer->len - (client->read_ptr - client->buffer->str);
-		if (avail > 2U) {
-			result = g_strndup(client->read_ptr, avail - 2U);
-		} else {
-			result = g_strdup("");
+		chunk = client->fill_pos - client->read_pos;
+		lf = memchr(start, '\n', chunk);
+		if (lf != NULL) {
+			/*lint -e{946,947,9029}		allowed exception according to MISRA C:2012 Rules 18.2 and 18.3 */
+			chunk = (gsize) (lf - start) + 1U;
+			eol = TRUE;
+		}
+		(void) g_string_append_len(line, start, (gssize) chunk);
+		client->read_pos += chunk;
+		if (!eol) {
+			fill_res = net_client_siobuf_fill(client, error);
 		}
-		client->buffer->len = 0U;
-	} else {
-		result = NULL;
 	}
 
-	return result;
+	if (fill_res) {
+		/* strip the terminating LF or CRLF */
+		(void) g_string_truncate(line, line->len - 1U);
+		if ((line->len > 0U) && (line->str[line->len - 1U] == '\r')) {
+			(void) g_string_truncate(line, line->len - 1U);
+		}
+	}
+
+	return g_string_free(line, !fill_res);
 }
 
 
 gint
 net_client_siobuf_discard_line(NetClientSioBuf *client, GError **error)
 {
-	gint result;
+	gboolean fill_res;
+	gint result = -1;
 
 	g_return_val_if_fail(NET_IS_CLIENT_SIOBUF(client), -1);
 
-	if (net_client_siobuf_fill(client, error)) {
-		client->buffer->len = 0U;
-		result = (gint) '\n';
-	} else {
-		result = -1;
+	fill_res = net_client_siobuf_fill(client, error);
+	while (fill_res && (result == -1)) {
+		const gchar *start = &client->buffer[client->read_pos];
+		const gchar *lf;
+
+		lf = memchr(start, '\n', client->fill_pos - client->read_pos);
+		if (lf != NULL) {
+			/*lint -e{946,947,9029}		allowed exception according to MISRA C:2012 Rules 18.2 and 18.3 */
+			client->read_pos += (gsize) (lf - start) + 1U;
+			result = (gint) '\n';
+		} else {
+			client->read_pos = client->fill_pos;
+			fill_res = net_client_siobuf_fill(client, error);
+		}
 	}
 
 	return result;
 }
 
 
+gboolean
+net_client_siobuf_can_read(NetClientSioBuf *client)
+{
+	g_return_val_if_fail(NET_IS_CLIENT_SIOBUF(client), FALSE);
+
+	return (client->read_pos < client->fill_pos) || net_client_can_read(NET_CLIENT(client));
+}
+
+
 void
 net_client_siobuf_write(NetClientSioBuf *client, const void *buffer, gsize count)
 {
@@ -270,15 +393,21 @@ net_client_siobuf_fill(NetClientSioBuf *client, GError **error)
 {
 	gboolean result;
 
-	if ((client->buffer->len == 0U) || (client->read_ptr == NULL) || (*client->read_ptr == '\0')) {
-		gchar *read_buf;
+	if (client->read_pos >= client->fill_pos) {
+		gsize offset;
+		gsize bytes_read;
 
-		result = net_client_read_line(NET_CLIENT(client), &read_buf, error);
+		/* keep the last character so net_client_siobuf_ungetc() also works right after refilling the buffer */
+		if (client->fill_pos > 0U) {
+			client->buffer[0] = client->buffer[client->fill_pos - 1U];
+			offset = 1U;
+		} else {
+			offset = 0U;
+		}
+		result = net_client_read_buffer(NET_CLIENT(client), &client->buffer[offset], SIOBUF_BLOCK_SIZE - offset, &bytes_read, error);
 		if (result) {
-			(void) g_string_assign(client->buffer, read_buf);
-			(void) g_string_append(client->buffer, "\r\n");
-			client->read_ptr = client->buffer->str;
-			g_free(read_buf);
+			client->read_pos = offset;
+			client->fill_pos = offset + bytes_read;
 		}
 	} else {
 		result = TRUE;
@@ -288,13 +417,22 @@ net_client_siobuf_fill(NetClientSioBuf *client, GError **error)
 }
 
 
+static inline void
+net_client_siobuf_keep_last(NetClientSioBuf *client, gchar last_char)
+{
+	client->buffer[0] = last_char;
+	client->read_pos = 1U;
+	client->fill_pos = 1U;
+}
+
+
 static void
 net_client_siobuf_finalise(GObject *object)
 {
 	const NetClientSioBuf *client = NET_CLIENT_SIOBUF(object);
 	const GObjectClass *parent_class = G_OBJECT_CLASS(net_client_siobuf_parent_class);
 
-	(void) g_string_free(client->buffer, TRUE);
+	g_free(client->buffer);
 	(void) g_string_free(client->writebuf, TRUE);
 	(*parent_class->finalize)(object);
 }
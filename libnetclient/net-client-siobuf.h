@@ -47,11 +47,39 @@ NetClientSioBuf *net_client_siobuf_new(const gchar *host, guint16 port);
  * @return the number of bytes actually read, or -1 if nothing could be read
  *
  * Read a number of bytes, including the CRLF line terminations if applicable, from the remote server.  Note that the error location
- * may be filled on a short read (i. e. when the number of bytes read is smaller than the requested count).
+ * may be filled on a short read (i. e. when the number of bytes read is smaller than the requested count).  The data may contain
+ * NUL characters.  Large amounts of data (e. g. IMAP literals) are read directly into the passed buffer.
  */
 gint net_client_siobuf_read(NetClientSioBuf *client, void *buffer, gsize count, GError **error);
 
 
+/** @brief Sink for data read from a SIOBUF network client object
+ *
+ * @param buffer data read from the remote server
+ * @param count number of bytes in buffer
+ * @param user_data user data passed to net_client_siobuf_read_to_sink()
+ * @return TRUE to continue, FALSE to discard the remaining data
+ */
+typedef gboolean (*NetClientSioBufSink)(const gchar *buffer, gsize count, gpointer user_data);
+
+
+/** @brief Pass a number of bytes from a SIOBUF network client object to a sink
+ *
+ * @param client SIOBUF network client object
+ * @param count number of bytes which shall be read
+ * @param sink sink function
+ * @param user_data additional data passed to the sink function
+ * @param error filled with error information on error
+ * @return TRUE if all requested bytes have been read, FALSE on error
+ *
+ * Read exactly count bytes from the remote server and pass them, in chunks of at most the internal buffer size, to the sink
+ * function.  The data is passed directly from the internal buffer, i.e. it is never collected in memory.  If the sink returns
+ * FALSE, the remaining data is still read, but discarded.
+ */
+gboolean net_client_siobuf_read_to_sink(NetClientSioBuf *client, gsize count, NetClientSioBufSink sink, gpointer user_data,
+										GError **error);
+
+
 /** @brief Read a character from a SIOBUF network client object
  *
  * @param client SIOBUF network client object
@@ -69,11 +97,34 @@ gint net_client_siobuf_getc(NetClientSioBuf *client, GError **error);
  * @return 0 on success, or ä1 on error
  *
  * Put back the last character read from the remote server.  The function fails if no data is available or if the start of the
- * internal buffer has been reached.
+ * internal buffer has been reached.  It is always possible to put back one character.
  */
 gint net_client_siobuf_ungetc(NetClientSioBuf *client);
 
 
+/** @brief Access the buffered data of a SIOBUF network client object
+ *
+ * @param client SIOBUF network client object
+ * @param count filled with the number of bytes available
+ * @param error filled with error information on error
+ * @return a pointer to the next unread byte in the internal buffer, or NULL on error
+ *
+ * Return the data which is available in the internal buffer without consuming it, reading more data from the remote server if
+ * the buffer is empty.  The returned pointer is valid until the next read operation on the client.  Call
+ * net_client_siobuf_skip() to consume the data.  This allows parsers to scan the input a span at a time instead of character
+ * by character.
+ */
+const gchar *net_client_siobuf_peek(NetClientSioBuf *client, gsize *count, GError **error);
+
+
+/** @brief Consume buffered data of a SIOBUF network client object
+ *
+ * @param client SIOBUF network client object
+ * @param count number of bytes to consume, at most the count returned by the preceding net_client_siobuf_peek()
+ */
+void net_client_siobuf_skip(NetClientSioBuf *client, gsize count);
+
+
 /** @brief Read a buffer from a SIOBUF network client object
  *
  * @param client SIOBUF network client object
@@ -94,9 +145,8 @@ gchar *net_client_siobuf_gets(NetClientSioBuf *client, gchar *buffer, gsize bufl
  * @param error filled with error information on error
  * @return a line of data, excluding the terminating CRLF on success, or NULL on error
  *
- * Return a newly allocated buffer, containing data from the remote server, but excluding the terminating CRLF sequence.  If the
- * read buffer contains only 1 or 2 characters (i. e. the terminating CRLF or only LF), the function returns an empty string.  The
- * internal read buffer is empty after calling this function.
+ * Return a newly allocated buffer, containing the remainder of the current line from the remote server, but excluding the
+ * terminating CRLF or LF sequence.  If only the line termination is pending, the function returns an empty string.
  *
  * @note The caller must free the returned buffer when it is not needed any more.
  */
@@ -110,11 +160,20 @@ gchar *net_client_siobuf_get_line(NetClientSioBuf *client, GError **error)
  * @param error filled with error information on error
  * @return '\n' on success, or -1 on error
  *
- * Discard all pending data in the read buffer.  If the read buffer is empty, the function reads the next line and discards it.
+ * Discard the remainder of the current line, including the terminating LF.  If the read buffer is empty, the function reads the
+ * next line and discards it.
  */
 gint net_client_siobuf_discard_line(NetClientSioBuf *client, GError **error);
 
 
+/** @brief Check if data is available
+ *
+ * @param client SIOBUF network client object
+ * @return TRUE if data is available in the internal read buffer or can be read from the remote server without blocking
+ */
+gboolean net_client_siobuf_can_read(NetClientSioBuf *client);
+
+
 /** @brief Write data to the SIOBUF output buffer
  *
  * @param client SIOBUF network client object
@@ -154,8 +213,8 @@ gboolean net_client_siobuf_flush(NetClientSioBuf *client, GError **error);
 /** @file
  *
  * This module implements a glue layer client class for Balsa's imap implementation.  In addition to the base class, it implements
- * an internal input line buffer which provides reading single characters and lines, reading an exact amount of bytes, and buffered
- * write operations.
+ * an internal, binary-safe input block buffer which provides reading single characters and lines, reading an exact amount of
+ * bytes, and buffered write operations.
  */
 
 #endif /* NET_CLIENT_SIOBUF_H_ */
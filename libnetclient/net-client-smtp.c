@@ -25,6 +25,10 @@ struct _NetClientSmtp {
 	NetClientCryptMode crypt_mode;
 	guint auth_allowed[2];			/** 0: encrypted, 1: unencrypted */
 	gboolean can_dsn;
+	gboolean can_pipelining;		/** RFC 2920 PIPELINING */
+	gboolean can_chunking;			/** RFC 3030 CHUNKING */
+	gboolean can_8bitmime;			/** RFC 6152 8BITMIME */
+	gboolean can_binarymime;		/** RFC 3030 BINARYMIME */
 	gboolean data_state;
 };
 
@@ -35,6 +39,7 @@ struct _NetClientSmtpMessage {
 	gchar *dsn_envid;
 	gboolean dsn_ret_full;
 	gboolean have_dsn_rcpt;
+	NetClientSmtpBody body;
 	NetClientSmtpSendCb data_callback;
 	gpointer user_data;
 };
@@ -50,6 +55,7 @@ typedef struct {
  * 12288 octets as safe maximum length for SASL authentication. */
 #define MAX_SMTP_LINE_LEN			12288U
 #define SMTP_DATA_BUF_SIZE			8192U
+#define SMTP_BDAT_CHUNK_SIZE		(256U * 1024U)
 
 
 /*lint -esym(528,net_client_smtp_get_instance_private)		auto-generated function, not referenced */
@@ -71,6 +77,10 @@ static gboolean net_client_smtp_auth_gssapi(NetClientSmtp *client, const gchar *
 static gboolean net_client_smtp_read_reply(NetClientSmtp *client, gint expect_code, gchar **last_reply, GError **error);
 static gboolean net_client_smtp_eval_rescode(gint res_code, const gchar *reply, GError **error);
 static gchar *net_client_smtp_dsn_to_string(const NetClientSmtp *client, NetClientSmtpDsnMode dsn_mode);
+static GPtrArray *net_client_smtp_envelope(const NetClientSmtp *client, const NetClientSmtpMessage *message);
+static gboolean net_client_smtp_pipeline(NetClientSmtp *client, const GPtrArray *commands, GError **error);
+static gboolean net_client_smtp_send_data(NetClientSmtp *client, const NetClientSmtpMessage *message, GError **error);
+static gboolean net_client_smtp_send_bdat(NetClientSmtp *client, const NetClientSmtpMessage *message, GError **error);
 static void smtp_rcpt_free(smtp_rcpt_t *rcpt);
 
 
@@ -196,73 +206,75 @@ net_client_smtp_can_dsn(NetClientSmtp *client)
 }
 
 
+gboolean
+net_client_smtp_can_binarymime(NetClientSmtp *client)
+{
+	return NET_IS_CLIENT_SMTP(client) ? (client->can_chunking && client->can_binarymime) : FALSE;
+}
+
+
+gboolean
+net_client_smtp_reset(NetClientSmtp *client, GError **error)
+{
+	gboolean result;
+
+	/* paranoia checks */
+	g_return_val_if_fail(NET_IS_CLIENT_SMTP(client), FALSE);
+
+	/* the server would take RSET as part of an interrupted message */
+	if (client->data_state) {
+		g_set_error(error, NET_CLIENT_SMTP_ERROR_QUARK, (gint) NET_CLIENT_ERROR_SMTP_PROTOCOL,
+			_("cannot reset the session while sending message data"));
+		result = FALSE;
+	} else {
+		(void) net_client_set_timeout(NET_CLIENT(client), 60U);
+		result = net_client_smtp_execute(client, "RSET", NULL, error);
+	}
+	return result;
+}
+
+
 gboolean
 net_client_smtp_send_msg(NetClientSmtp *client, const NetClientSmtpMessage *message, gchar **server_stat, GError **error)
 {
 	NetClient *netclient;
 	gboolean result;
-	const GList *rcpt;
+	GPtrArray *envelope;
 
 	/* paranoia checks */
 	g_return_val_if_fail(NET_IS_CLIENT_SMTP(client) && (message != NULL) && (message->sender != NULL) &&
 		(message->recipients != NULL) && (message->data_callback != NULL), FALSE);
 
-	/* set the RFC 5321 sender and recipient(s) */
+	/* binary MIME content can only be transmitted using BDAT */
+	if ((message->body == NET_CLIENT_SMTP_BODY_BINARYMIME) && (!client->can_chunking || !client->can_binarymime)) {
+		g_set_error(error, NET_CLIENT_SMTP_ERROR_QUARK, (gint) NET_CLIENT_ERROR_SMTP_PERMANENT,
+			_("remote server does not support binary MIME"));
+		return FALSE;
+	}
+
+	/* set the RFC 5321 sender and recipient(s) - in one go if the server supports pipelining */
 	netclient = NET_CLIENT(client);		/* convenience pointer */
 	(void) net_client_set_timeout(netclient, 5U * 60U);	/* RFC 5321, Sect. 4.5.3.2.2., 4.5.3.2.3.: 5 minutes timeout */
-	if (client->can_dsn && message->have_dsn_rcpt) {
-		if (message->dsn_envid != NULL) {
-			result = net_client_smtp_execute(client, "MAIL FROM:<%s> RET=%s ENVID=%s", NULL, error, message->sender,
-											 (message->dsn_ret_full) ? "FULL" : "HDRS", message->dsn_envid);
-		} else {
-			result = net_client_smtp_execute(client, "MAIL FROM:<%s> RET=%s", NULL, error, message->sender,
-											 (message->dsn_ret_full) ? "FULL" : "HDRS");
-		}
+	envelope = net_client_smtp_envelope(client, message);
+	if (client->can_pipelining) {
+		result = net_client_smtp_pipeline(client, envelope, error);
 	} else {
-		result = net_client_smtp_execute(client, "MAIL FROM:<%s>", NULL, error, message->sender);
-	}
-	rcpt = message->recipients;
-	while (result && (rcpt != NULL)) {
-		const smtp_rcpt_t *this_rcpt = (const smtp_rcpt_t *) rcpt->data;	/*lint !e9079 !e9087 (MISRA C:2012 Rules 11.3, 11.5) */
-		gchar *dsn_opts;
+		guint n;
 
-		/* create the RFC 3461 DSN string */
-		dsn_opts = net_client_smtp_dsn_to_string(client, this_rcpt->dsn_mode);
-		result = net_client_smtp_execute(client, "RCPT TO:<%s>%s", NULL, error, this_rcpt->rfc5321_addr, dsn_opts);
-		g_free(dsn_opts);
-		rcpt = rcpt->next;
-	}
-
-	/* initialise sending the message data */
-	if (result) {
-		(void) net_client_set_timeout(netclient, 2U * 60U);	/* RFC 5321, Sect. 4.5.3.2.4.: 2 minutes timeout */
-		result = net_client_smtp_execute(client, "DATA", NULL, error);
+		result = TRUE;
+		for (n = 0U; result && (n < envelope->len); n++) {
+			result = net_client_smtp_execute(client, "%s", NULL, error, g_ptr_array_index(envelope, n));
+		}
 	}
+	g_ptr_array_unref(envelope);
 
-	/* call the data callback until all data has been transmitted or an error occurs */
+	/* send the message data, preferably in RFC 3030 chunks which do not need dot-stuffing */
 	if (result) {
-		gchar buffer[SMTP_DATA_BUF_SIZE];
-		gssize count;
-		gchar last_char = '\0';
-
-		(void) net_client_set_timeout(netclient, 3U * 60U);	/* RFC 5321, Sect. 4.5.3.2.5.: 3 minutes timeout */
-		client->data_state = TRUE;
-		do {
-			count = message->data_callback(buffer, SMTP_DATA_BUF_SIZE, message->user_data, error);
-			if (count < 0) {
-				result = FALSE;
-			} else if (count > 0) {
-				result = net_client_write_buffer(netclient, buffer, (gsize) count, error);
-				last_char = buffer[count - 1];
-			} else {
-				/* write termination */
-				if (last_char == '\n') {
-					result = net_client_write_buffer(netclient, ".\r\n", 3U, error);
-				} else {
-					result = net_client_write_buffer(netclient, "\r\n.\r\n", 5U, error);
-				}
-			}
-		} while (result && (count > 0));
+		if (client->can_chunking) {
+			result = net_client_smtp_send_bdat(client, message, error);
+		} else {
+			result = net_client_smtp_send_data(client, message, error);
+		}
 	}
 
 	if (result) {
@@ -289,6 +301,17 @@ net_client_smtp_msg_new(NetClientSmtpSendCb data_callback, gpointer user_data)
 }
 
 
+gboolean
+net_client_smtp_msg_set_body(NetClientSmtpMessage *smtp_msg, NetClientSmtpBody body)
+{
+	g_return_val_if_fail((smtp_msg != NULL) && (body >= NET_CLIENT_SMTP_BODY_7BIT) && (body <= NET_CLIENT_SMTP_BODY_BINARYMIME),
+		FALSE);
+
+	smtp_msg->body = body;
+	return TRUE;
+}
+
+
 gboolean
 net_client_smtp_msg_set_dsn_opts(NetClientSmtpMessage *smtp_msg, const gchar *envid, gboolean ret_full)
 {
@@ -582,6 +605,10 @@ net_client_smtp_ehlo(NetClientSmtp *client, guint *auth_supported, gboolean *can
 	/* clear all capability flags */
 	*auth_supported = 0U;
 	client->can_dsn = FALSE;
+	client->can_pipelining = FALSE;
+	client->can_chunking = FALSE;
+	client->can_8bitmime = FALSE;
+	client->can_binarymime = FALSE;
 	*can_starttls = FALSE;
 
 	/* evaluate the response */
@@ -602,6 +629,14 @@ net_client_smtp_ehlo(NetClientSmtp *client, guint *auth_supported, gboolean *can
 			} else {
 				if (strcmp(&endptr[1], "DSN") == 0) {
 					client->can_dsn = TRUE;
+				} else if (strcmp(&endptr[1], "PIPELINING") == 0) {
+					client->can_pipelining = TRUE;
+				} else if (strcmp(&endptr[1], "CHUNKING") == 0) {
+					client->can_chunking = TRUE;
+				} else if (strcmp(&endptr[1], "8BITMIME") == 0) {
+					client->can_8bitmime = TRUE;
+				} else if (strcmp(&endptr[1], "BINARYMIME") == 0) {
+					client->can_binarymime = TRUE;
 				} else if (strcmp(&endptr[1], "STARTTLS") == 0) {
 					*can_starttls = TRUE;
 				} else if ((strncmp(&endptr[1], "AUTH ", 5U) == 0) || (strncmp(&endptr[1], "AUTH=", 5U) == 0)) {
@@ -644,15 +679,18 @@ net_client_smtp_ehlo(NetClientSmtp *client, guint *auth_supported, gboolean *can
 }
 
 
-/* Note: according to RFC 5321, sect. 4.2, \em any reply may be multiline.  If supplied, last_reply is never NULL on success */
+/* Note: according to RFC 5321, sect. 4.2, \em any reply may be multiline.  If supplied, last_reply is never NULL on success.  An
+ * error reply is read completely, so the next reply can be read when pipelining. */
 static gboolean
 net_client_smtp_read_reply(NetClientSmtp *client, gint expect_code, gchar **last_reply, GError **error)
 {
 	gint rescode;
 	gboolean done;
 	gboolean result;
+	gboolean reply_ok;
 
 	done = FALSE;
+	reply_ok = TRUE;
 	rescode = expect_code;
 	do {
 		gchar *reply;
@@ -665,17 +703,19 @@ net_client_smtp_read_reply(NetClientSmtp *client, gint expect_code, gchar **last
 			this_rescode = strtol(reply, &endptr, 10);
 			if (rescode == -1) {
 				rescode = this_rescode;
-				result = net_client_smtp_eval_rescode(rescode, reply, error);
+				reply_ok = net_client_smtp_eval_rescode(rescode, reply, error);
 			} else if (rescode != this_rescode) {
-				g_set_error(error, NET_CLIENT_SMTP_ERROR_QUARK, (gint) NET_CLIENT_ERROR_SMTP_PROTOCOL,
-					_("bad server reply: %s"), reply);
+				if (reply_ok) {
+					g_set_error(error, NET_CLIENT_SMTP_ERROR_QUARK, (gint) NET_CLIENT_ERROR_SMTP_PROTOCOL,
+						_("bad server reply: %s"), reply);
+				}
 				result = FALSE;
 			} else {
 				/* nothing to do (see MISRA C:2012, Rule 15.7) */
 			}
 			if (reply[3] == ' ') {
 				done = TRUE;
-				if (last_reply != NULL) {
+				if ((last_reply != NULL) && reply_ok) {
 					*last_reply = g_strdup(&reply[4]);
 				}
 			}
@@ -684,7 +724,7 @@ net_client_smtp_read_reply(NetClientSmtp *client, gint expect_code, gchar **last
 		}
 	} while (result && !done);
 
-	return result;
+	return result && reply_ok;
 }
 
 
@@ -762,6 +802,193 @@ net_client_smtp_dsn_to_string(const NetClientSmtp *client, NetClientSmtpDsnMode
 }
 
 
+/* Note: the MAIL FROM command is the first item, followed by a RCPT TO command for each recipient */
+static GPtrArray *
+net_client_smtp_envelope(const NetClientSmtp *client, const NetClientSmtpMessage *message)
+{
+	GPtrArray *result;
+	GString *mail_from;
+	const GList *rcpt;
+
+	result = g_ptr_array_new_with_free_func(g_free);
+	mail_from = g_string_new(NULL);
+	g_string_printf(mail_from, "MAIL FROM:<%s>", message->sender);
+	/* RFC 6152, RFC 3030: declare the body type if it is not 7-bit and the server supports it */
+	if (message->body == NET_CLIENT_SMTP_BODY_BINARYMIME) {
+		mail_from = g_string_append(mail_from, " BODY=BINARYMIME");
+	} else if ((message->body == NET_CLIENT_SMTP_BODY_8BITMIME) && client->can_8bitmime) {
+		mail_from = g_string_append(mail_from, " BODY=8BITMIME");
+	} else {
+		/* nothing to do (see MISRA C:2012, Rule 15.7) */
+	}
+	if (client->can_dsn && message->have_dsn_rcpt) {
+		g_string_append_printf(mail_from, " RET=%s", (message->dsn_ret_full) ? "FULL" : "HDRS");
+		if (message->dsn_envid != NULL) {
+			g_string_append_printf(mail_from, " ENVID=%s", message->dsn_envid);
+		}
+	}
+	g_ptr_array_add(result, g_string_free(mail_from, FALSE));
+	for (rcpt = message->recipients; rcpt != NULL; rcpt = rcpt->next) {
+		const smtp_rcpt_t *this_rcpt = (const smtp_rcpt_t *) rcpt->data;	/*lint !e9079 !e9087 (MISRA C:2012 Rules 11.3, 11.5) */
+		gchar *dsn_opts;
+
+		/* create the RFC 3461 DSN string */
+		dsn_opts = net_client_smtp_dsn_to_string(client, this_rcpt->dsn_mode);
+		g_ptr_array_add(result, g_strdup_printf("RCPT TO:<%s>%s", this_rcpt->rfc5321_addr, dsn_opts));
+		g_free(dsn_opts);
+	}
+
+	return result;
+}
+
+
+/* RFC 2920: send all commands in one write, and evaluate the replies afterwards.  All replies are read, but only the first error
+ * is reported. */
+static gboolean
+net_client_smtp_pipeline(NetClientSmtp *client, const GPtrArray *commands, GError **error)
+{
+	GString *buffer;
+	gboolean result;
+	gboolean io_ok;
+	guint n;
+
+	buffer = g_string_new(NULL);
+	result = TRUE;
+	for (n = 0U; result && (n < commands->len); n++) {
+		const gchar *command = (const gchar *) g_ptr_array_index(commands, n);	/*lint !e9079 (MISRA C:2012 Rule 11.5) */
+
+		if (strlen(command) > (MAX_SMTP_LINE_LEN - 2U)) {
+			g_set_error(error, NET_CLIENT_ERROR_QUARK, (gint) NET_CLIENT_ERROR_LINE_TOO_LONG, _("line too long"));
+			result = FALSE;
+		} else {
+			buffer = g_string_append(buffer, command);
+			buffer = g_string_append(buffer, "\r\n");
+		}
+	}
+	if (result) {
+		result = net_client_write_buffer(NET_CLIENT(client), buffer->str, buffer->len, error);
+	}
+	(void) g_string_free(buffer, TRUE);
+
+	io_ok = result;
+	for (n = 0U; io_ok && (n < commands->len); n++) {
+		GError *this_error = NULL;
+
+		if (!net_client_smtp_read_reply(client, -1, NULL, &this_error)) {
+			/* stop on i/o errors, as no more replies will arrive */
+			if ((this_error == NULL) || (this_error->domain != NET_CLIENT_SMTP_ERROR_QUARK)) {
+				io_ok = FALSE;
+			}
+			if (result) {
+				g_propagate_error(error, this_error);
+				result = FALSE;
+			} else {
+				g_clear_error(&this_error);
+			}
+		}
+	}
+
+	return result;
+}
+
+
+/* RFC 5321, Sect. 4.1.1.4: send the message data after a DATA command, with leading dots being doubled (Sect. 4.5.2) */
+static gboolean
+net_client_smtp_send_data(NetClientSmtp *client, const NetClientSmtpMessage *message, GError **error)
+{
+	NetClient *netclient = NET_CLIENT(client);
+	gboolean result;
+
+	(void) net_client_set_timeout(netclient, 2U * 60U);	/* RFC 5321, Sect. 4.5.3.2.4.: 2 minutes timeout */
+	result = net_client_smtp_execute(client, "DATA", NULL, error);
+
+	/* call the data callback until all data has been transmitted or an error occurs */
+	if (result) {
+		gchar buffer[SMTP_DATA_BUF_SIZE];
+		gchar stuffed[2U * SMTP_DATA_BUF_SIZE];
+		gssize count;
+		gboolean at_bol = TRUE;
+
+		(void) net_client_set_timeout(netclient, 3U * 60U);	/* RFC 5321, Sect. 4.5.3.2.5.: 3 minutes timeout */
+		client->data_state = TRUE;
+		do {
+			count = message->data_callback(buffer, SMTP_DATA_BUF_SIZE, message->user_data, error);
+			if (count < 0) {
+				result = FALSE;
+			} else if (count > 0) {
+				gsize stuffed_len = 0U;
+				gssize n;
+
+				for (n = 0; n < count; n++) {
+					if (at_bol && (buffer[n] == '.')) {
+						stuffed[stuffed_len++] = '.';
+					}
+					stuffed[stuffed_len++] = buffer[n];
+					at_bol = (buffer[n] == '\n');
+				}
+				result = net_client_write_buffer(netclient, stuffed, stuffed_len, error);
+			} else {
+				/* write termination */
+				if (at_bol) {
+					result = net_client_write_buffer(netclient, ".\r\n", 3U, error);
+				} else {
+					result = net_client_write_buffer(netclient, "\r\n.\r\n", 5U, error);
+				}
+			}
+		} while (result && (count > 0));
+	}
+
+	return result;
+}
+
+
+/* RFC 3030: send the message data in BDAT chunks.  The callback is called until a chunk is full, so the final chunk can be marked
+ * as LAST.  The reply to the last chunk is the final reply for the message, and is read by the caller. */
+static gboolean
+net_client_smtp_send_bdat(NetClientSmtp *client, const NetClientSmtpMessage *message, GError **error)
+{
+	NetClient *netclient = NET_CLIENT(client);
+	gchar *buffer;
+	gboolean result;
+	gboolean last_chunk;
+
+	buffer = g_malloc(SMTP_BDAT_CHUNK_SIZE);
+	(void) net_client_set_timeout(netclient, 3U * 60U);	/* RFC 5321, Sect. 4.5.3.2.5.: 3 minutes timeout */
+	client->data_state = TRUE;
+	result = TRUE;
+	last_chunk = FALSE;
+	while (result && !last_chunk) {
+		gsize fill = 0U;
+
+		while (result && !last_chunk && (fill < SMTP_BDAT_CHUNK_SIZE)) {
+			gssize count;
+
+			count = message->data_callback(&buffer[fill], SMTP_BDAT_CHUNK_SIZE - fill, message->user_data, error);
+			if (count < 0) {
+				result = FALSE;
+			} else if (count == 0) {
+				last_chunk = TRUE;
+			} else {
+				fill += (gsize) count;
+			}
+		}
+
+		if (result) {
+			result = net_client_write_line(netclient, "BDAT %lu%s", error, (unsigned long) fill, last_chunk ? " LAST" : "");
+		}
+		if (result && (fill > 0U)) {
+			result = net_client_write_buffer(netclient, buffer, fill, error);
+		}
+		if (result && !last_chunk) {
+			result = net_client_smtp_read_reply(client, -1, NULL, error);
+		}
+	}
+	g_free(buffer);
+
+	return result;
+}
+
+
 static void
 smtp_rcpt_free(smtp_rcpt_t *rcpt)
 {
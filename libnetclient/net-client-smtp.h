@@ -31,6 +31,7 @@ G_DECLARE_FINAL_TYPE(NetClientSmtp, net_client_smtp, NET, CLIENT_SMTP, NetClient
 
 typedef struct _NetClientSmtpMessage NetClientSmtpMessage;
 typedef enum _NetClientSmtpDsnMode NetClientSmtpDsnMode;
+typedef enum _NetClientSmtpBody NetClientSmtpBody;
 
 
 /** @brief SMTP-specific error codes */
@@ -82,6 +83,18 @@ enum _NetClientSmtpDsnMode {
 };
 
 
+/** @brief Message body type
+ *
+ * The body type of a message is announced in the ESMTP MAIL command if the server supports it.
+ */
+enum _NetClientSmtpBody {
+	NET_CLIENT_SMTP_BODY_7BIT = 0,			/**< 7-bit content (default). */
+	NET_CLIENT_SMTP_BODY_8BITMIME,			/**< 8-bit content with CRLF line endings (<a href="https://tools.ietf.org/html/rfc6152">RFC
+											 * 6152</a>). */
+	NET_CLIENT_SMTP_BODY_BINARYMIME			/**< Binary content (<a href="https://tools.ietf.org/html/rfc3030">RFC 3030</a>). */
+};
+
+
 /** @brief SMTP Message Transmission Callback Function
  *
  * The user-provided callback function to send a message to the remote SMTP server:
@@ -94,7 +107,11 @@ enum _NetClientSmtpDsnMode {
  *
  * @note The callback function is responsible for properly formatting the message body according to
  *       <a href="https://tools.ietf.org/html/rfc5321">RFC 5321</a>, <a href="https://tools.ietf.org/html/rfc5322">RFC 5322</a> and
- *       further relevant standards, e.g. by using <a href="http://spruce.sourceforge.net/gmime/">GMime</a>.
+ *       further relevant standards, e.g. by using <a href="http://spruce.sourceforge.net/gmime/">GMime</a>.  The data must @em not
+ *       be dot-stuffed, as this is done by the SMTP client if required.
+ * @note API change: earlier versions of the SMTP client sent the data unchanged after DATA, and expected the callback to double
+ *       leading dots (<a href="https://tools.ietf.org/html/rfc5321">RFC 5321</a>, Sect. 4.5.2).  Callers which still do so now
+ *       send each leading dot twice.
  */
 typedef gssize (*NetClientSmtpSendCb)(gchar *buffer, gsize count, gpointer user_data, GError **error);
 
@@ -157,6 +174,31 @@ gboolean net_client_smtp_connect(NetClientSmtp *client, gchar **greeting, GError
 gboolean net_client_smtp_can_dsn(NetClientSmtp *client);
 
 
+/** @brief Check if the SMTP network client supports binary MIME
+ *
+ * @param client connected SMTP network client object
+ * @return TRUE if binary MIME is supported, FALSE if not
+ *
+ * Return if the connected SMTP server announced support for both CHUNKING and BINARYMIME according to
+ * <a href="https://tools.ietf.org/html/rfc3030">RFC 3030</a>, i.e. if a message with body type @ref NET_CLIENT_SMTP_BODY_BINARYMIME
+ * can be sent.
+ */
+gboolean net_client_smtp_can_binarymime(NetClientSmtp *client);
+
+
+/** @brief Reset a SMTP session
+ *
+ * @param client connected SMTP network client object
+ * @param error filled with error information if the connection fails
+ * @return TRUE on success or FALSE if the session is not usable any more
+ *
+ * Send the RSET command to abort any pending mail transaction, e.g. before re-using an idle session, or after sending a message
+ * failed.  A failure indicates that the server has closed the connection, or that the transmission of the message data was
+ * interrupted, and that a new session must be established.
+ */
+gboolean net_client_smtp_reset(NetClientSmtp *client, GError **error);
+
+
 /** @brief Send a message to a SMTP network client
  *
  * @param client connected SMTP network client object
@@ -165,7 +207,11 @@ gboolean net_client_smtp_can_dsn(NetClientSmtp *client);
  * @param error filled with error information if the connection fails
  * @return TRUE on success or FALSE if sending the message failed
  *
- * Send the passed SMTP message to the connected SMTP server.
+ * Send the passed SMTP message to the connected SMTP server.  If the server supports CHUNKING
+ * (<a href="https://tools.ietf.org/html/rfc3030">RFC 3030</a>), the message data is sent in BDAT chunks, otherwise by using DATA.
+ * Sending a message with body type @ref NET_CLIENT_SMTP_BODY_BINARYMIME fails if the server does not support CHUNKING and
+ * BINARYMIME.  After a failure, the session may still be inside the mail transaction; call net_client_smtp_reset() before sending
+ * another message through it.
  */
 gboolean net_client_smtp_send_msg(NetClientSmtp *client, const NetClientSmtpMessage *message, gchar **server_stat, GError **error);
 
@@ -209,6 +255,18 @@ gboolean net_client_smtp_msg_set_sender(NetClientSmtpMessage *smtp_msg, const gc
 gboolean net_client_smtp_msg_set_dsn_opts(NetClientSmtpMessage *smtp_msg, const gchar *envid, gboolean ret_full);
 
 
+/** @brief Set the body type of a SMTP message
+ *
+ * @param smtp_msg SMTP message returned by net_client_smtp_msg_new()
+ * @param body body type of the message data
+ * @return TRUE on success or FALSE on error
+ *
+ * Set the body type of the message.  The default is @ref NET_CLIENT_SMTP_BODY_7BIT.  An 8-bit body type is announced only if the
+ * server supports it.
+ */
+gboolean net_client_smtp_msg_set_body(NetClientSmtpMessage *smtp_msg, NetClientSmtpBody body);
+
+
 /** @brief Add a recipient to a SMTP message
  *
  * @param smtp_msg SMTP message returned by net_client_smtp_msg_new()
@@ -245,6 +303,9 @@ void net_client_smtp_msg_free(NetClientSmtpMessage *smtp_msg);
  *   - GSSAPI according to <a href="https://tools.ietf.org/html/rfc4752">RFC 4752</a> (if configured with gssapi support)
  * - STARTTLS encryption according to <a href="https://tools.ietf.org/html/rfc3207">RFC 3207</a>
  * - Delivery Status Notifications (DSNs) according to <a href="https://tools.ietf.org/html/rfc3461">RFC 3461</a>
+ * - Command pipelining according to <a href="https://tools.ietf.org/html/rfc2920">RFC 2920</a>
+ * - Chunking and binary MIME according to <a href="https://tools.ietf.org/html/rfc3030">RFC 3030</a>
+ * - 8-bit MIME transport according to <a href="https://tools.ietf.org/html/rfc6152">RFC 6152</a>
  */
 
 
@@ -298,6 +298,38 @@ net_client_read_line(NetClient *client, gchar **recv_line, GError **error)
 }
 
 
+gboolean
+net_client_read_buffer(NetClient *client, gchar *buffer, gsize count, gsize *bytes_read, GError **error)
+{
+	/*lint -e{9079}		(MISRA C:2012 Rule 11.5) intended use of this function */
+	const NetClientPrivate *priv = net_client_get_instance_private(client);
+	gboolean result = FALSE;
+
+	g_return_val_if_fail(NET_IS_CLIENT(client) && (buffer != NULL) && (count > 0U), FALSE);
+
+	if (priv->istream == NULL) {
+		g_set_error(error, NET_CLIENT_ERROR_QUARK, (gint) NET_CLIENT_ERROR_NOT_CONNECTED, _("network client is not connected"));
+	} else {
+		gssize read_res;
+
+		read_res = g_input_stream_read(G_INPUT_STREAM(priv->istream), buffer, count, NULL, error);
+		if (read_res > 0) {
+			g_debug("R '%.*s'", (int) read_res, buffer);
+			result = TRUE;
+			if (bytes_read != NULL) {
+				*bytes_read = (gsize) read_res;
+			}
+		} else if (read_res == 0) {
+			g_set_error(error, NET_CLIENT_ERROR_QUARK, (gint) NET_CLIENT_ERROR_CONNECTION_LOST, _("connection lost"));
+		} else {
+			/* error has been set by g_input_stream_read() */
+		}
+	}
+
+	return result;
+}
+
+
 gboolean
 net_client_write_buffer(NetClient *client, const gchar *buffer, gsize count, GError **error)
 {
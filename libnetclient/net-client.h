@@ -206,6 +206,22 @@ gboolean net_client_start_compression(NetClient *client, GError **error);
 gboolean net_client_read_line(NetClient *client, gchar **recv_line, GError **error);
 
 
+/** @brief Read data from a network client
+ *
+ * @param client network client
+ * @param buffer destination buffer
+ * @param count size of the destination buffer
+ * @param bytes_read filled with the number of bytes actually read, may be NULL
+ * @param error filled with error information on error
+ * @return TRUE is the read operation was successful, FALSE on error
+ *
+ * Read up to count bytes from the remote server into the passed buffer.  The function blocks until at least one byte is available,
+ * but returns the data which is already available instead of waiting for the buffer to be filled completely.  Unlike
+ * net_client_read_line(), the data is not interpreted in any way, i.e. it may contain NUL characters and line terminations.
+ */
+gboolean net_client_read_buffer(NetClient *client, gchar *buffer, gsize count, gsize *bytes_read, GError **error);
+
+
 /** @brief Write data to a network client
  *
  * @param client network client
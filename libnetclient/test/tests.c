@@ -15,6 +15,7 @@
 #include <sys/types.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sput.h>
 #include "net-client.h"
@@ -30,6 +31,9 @@
 static void test_basic(void);
 static void test_basic_crypt(void);
 static void test_smtp(void);
+static void test_smtp_pipelining(void);
+static void test_smtp_concurrent_clients(void);
+static void test_smtp_chunking(void);
 static void test_pop3(void);
 static void test_siobuf(void);
 static void test_utils(void);
@@ -58,6 +62,15 @@ main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv)
 	sput_enter_suite("test SMTP");
 	sput_run_test(test_smtp);
 
+	sput_enter_suite("test SMTP pipelining");
+	sput_run_test(test_smtp_pipelining);
+
+	sput_enter_suite("test SMTP concurrent client sessions");
+	sput_run_test(test_smtp_concurrent_clients);
+
+	sput_enter_suite("test SMTP chunking and dot-stuffing");
+	sput_run_test(test_smtp_chunking);
+
 	sput_enter_suite("test POP3");
 	sput_run_test(test_pop3);
 
@@ -80,6 +93,8 @@ test_basic(void)
 	GError *error = NULL;
 	gboolean op_res;
 	gchar *read_res;
+	gchar raw_buf[16];
+	gsize bytes_read;
 	struct pollfd fds[1];
 
 	sput_fail_unless(net_client_new(NULL, 65000, 42) == NULL, "missing host");
@@ -168,6 +183,16 @@ test_basic(void)
 	g_free(read_res);
 	sput_fail_unless(net_client_can_read(basic) == FALSE, "no data");
 
+	sput_fail_unless(net_client_read_buffer(NULL, raw_buf, sizeof(raw_buf), NULL, NULL) == FALSE, "read buffer w/o client");
+	sput_fail_unless(net_client_read_buffer(basic, NULL, sizeof(raw_buf), NULL, NULL) == FALSE, "read buffer w/o buffer");
+	sput_fail_unless(net_client_read_buffer(basic, raw_buf, 0U, NULL, NULL) == FALSE, "read buffer w/o count");
+	sput_fail_unless(net_client_write_buffer(basic, "a\000b\r\n", 5U, NULL) == TRUE, "write binary data");
+	op_res = net_client_read_buffer(basic, raw_buf, sizeof(raw_buf), &bytes_read, NULL);
+	sput_fail_unless(op_res && (bytes_read == 5U) && (memcmp(raw_buf, "a\000b\r\n", 5U) == 0), "read buffer ok");
+	op_res = net_client_read_buffer(basic, raw_buf, sizeof(raw_buf), NULL, &error);
+	sput_fail_unless((op_res == FALSE) && (error->code == G_IO_ERROR_TIMED_OUT), "read buffer timeout");
+	g_clear_error(&error);
+
 	sput_fail_unless(net_client_start_compression(NULL, NULL) == FALSE, "start compression w/o client");
 	op_res = net_client_execute(basic, &read_res, "COMPRESS", NULL);
 	sput_fail_unless((op_res == TRUE) && (strcmp("COMPRESS", read_res) == 0), "execute 'COMPRESS' ok");
@@ -566,6 +591,516 @@ test_smtp(void)
 	net_client_smtp_msg_free(msg);
 }
 
+typedef struct {
+	GSocketListener *listener;
+	guint sessions;					/* number of connections to accept */
+	gboolean chunking;				/* announce CHUNKING */
+	gboolean binarymime;			/* announce BINARYMIME */
+	guint envelope_reads;
+	guint messages;					/* messages received */
+	/* the following items are recorded for single sessions only, and only if data is not NULL */
+	GString *data;					/* data of the last message, dot-stuffing removed */
+	GArray *chunks;					/* sizes of the BDAT chunks of the last message */
+	gboolean last_chunk;			/* the last BDAT chunk was marked LAST */
+	gboolean body_binarymime;		/* MAIL FROM of the last message declared BODY=BINARYMIME */
+} smtp_standin_t;
+
+typedef struct {
+	smtp_standin_t *standin;
+	GSocketConnection *conn;
+} smtp_standin_session_t;
+
+
+/* one session of the minimal SMTP server announcing PIPELINING and, optionally, CHUNKING and BINARYMIME; counts the reads which
+ * contain envelope commands */
+static gpointer
+smtp_standin_session(gpointer user_data)
+{
+	smtp_standin_session_t *session = (smtp_standin_session_t *) user_data;
+	smtp_standin_t *standin = session->standin;
+	GSocketConnection *conn = session->conn;
+	GInputStream *in;
+	GOutputStream *out;
+	GString *pending;
+	gboolean done;
+	gboolean in_data;
+	gsize bdat_left;
+	gboolean in_bdat;
+	gboolean bdat_last;
+
+	g_free(session);
+	in = g_io_stream_get_input_stream(G_IO_STREAM(conn));
+	out = g_io_stream_get_output_stream(G_IO_STREAM(conn));
+	pending = g_string_new(NULL);
+	g_output_stream_write_all(out, "220 stand-in ready\r\n", 20U, NULL, NULL, NULL);
+	done = FALSE;
+	in_data = FALSE;
+	in_bdat = FALSE;
+	bdat_left = 0U;
+	bdat_last = FALSE;
+	while (!done) {
+		gchar buffer[4096];
+		gssize count;
+		gchar *eol;
+
+		count = g_input_stream_read(in, buffer, sizeof(buffer), NULL, NULL);
+		if (count <= 0) {
+			break;
+		}
+		pending = g_string_append_len(pending, buffer, count);
+		if ((strstr(pending->str, "MAIL FROM:") != NULL) || (strstr(pending->str, "RCPT TO:") != NULL)) {
+			g_atomic_int_inc(&standin->envelope_reads);
+		}
+		while (in_bdat || ((eol = strstr(pending->str, "\r\n")) != NULL)) {
+			gchar *line;
+			const gchar *reply = NULL;
+
+			/* consume the raw data of a BDAT chunk */
+			if (in_bdat) {
+				gsize take = MIN(bdat_left, pending->len);
+
+				if (standin->data != NULL) {
+					standin->data = g_string_append_len(standin->data, pending->str, take);
+				}
+				pending = g_string_erase(pending, 0, take);
+				bdat_left -= take;
+				if (bdat_left > 0U) {
+					break;				/* wait for more data */
+				}
+				in_bdat = FALSE;
+				if (bdat_last) {
+					g_atomic_int_inc(&standin->messages);
+					reply = "250 queued\r\n";
+				} else {
+					reply = "250 chunk received\r\n";
+				}
+				g_output_stream_write_all(out, reply, strlen(reply), NULL, NULL, NULL);
+				continue;
+			}
+
+			line = g_strndup(pending->str, eol - pending->str);
+			pending = g_string_erase(pending, 0, (eol - pending->str) + 2);
+			if (in_data) {
+				if (strcmp(line, ".") == 0) {
+					g_atomic_int_inc(&standin->messages);
+					reply = "250 queued\r\n";
+					in_data = FALSE;
+				} else if (standin->data != NULL) {
+					standin->data = g_string_append(standin->data, (line[0] == '.') ? &line[1] : line);
+					standin->data = g_string_append(standin->data, "\r\n");
+				} else {
+					/* nothing to do (see MISRA C:2012, Rule 15.7) */
+				}
+			} else if (strncmp(line, "EHLO ", 5U) == 0) {
+				GString *ehlo;
+
+				ehlo = g_string_new("250-stand-in\r\n250-PIPELINING\r\n");
+				if (standin->chunking) {
+					ehlo = g_string_append(ehlo, "250-CHUNKING\r\n");
+				}
+				if (standin->binarymime) {
+					ehlo = g_string_append(ehlo, "250-BINARYMIME\r\n");
+				}
+				ehlo = g_string_append(ehlo, "250 DSN\r\n");
+				g_output_stream_write_all(out, ehlo->str, ehlo->len, NULL, NULL, NULL);
+				(void) g_string_free(ehlo, TRUE);
+			} else if (strncmp(line, "RCPT TO:<bad", 12U) == 0) {
+				reply = "550 no such user\r\n";
+			} else if (strncmp(line, "MAIL FROM:", 10U) == 0) {
+				if (standin->data != NULL) {
+					standin->data = g_string_truncate(standin->data, 0U);
+					g_array_set_size(standin->chunks, 0U);
+					standin->last_chunk = FALSE;
+					standin->body_binarymime = (strstr(line, " BODY=BINARYMIME") != NULL);
+				}
+				reply = "250 ok\r\n";
+			} else if (strncmp(line, "RCPT TO:", 8U) == 0) {
+				reply = "250 ok\r\n";
+			} else if (strcmp(line, "DATA") == 0) {
+				reply = "354 go ahead\r\n";
+				in_data = TRUE;
+			} else if (standin->chunking && (strncmp(line, "BDAT ", 5U) == 0)) {
+				gchar *endptr;
+				guint size;
+
+				size = (guint) strtoul(&line[5], &endptr, 10);
+				bdat_left = size;
+				bdat_last = (strcmp(endptr, " LAST") == 0);
+				in_bdat = TRUE;
+				if (standin->data != NULL) {
+					g_array_append_val(standin->chunks, size);
+					standin->last_chunk = bdat_last;
+				}
+			} else if (strcmp(line, "RSET") == 0) {
+				reply = "250 reset\r\n";
+			} else if (strcmp(line, "QUIT") == 0) {
+				reply = "221 bye\r\n";
+				done = TRUE;
+			} else {
+				reply = "500 unknown command\r\n";
+			}
+			if (reply != NULL) {
+				g_output_stream_write_all(out, reply, strlen(reply), NULL, NULL, NULL);
+			}
+			g_free(line);
+		}
+	}
+	g_string_free(pending, TRUE);
+	g_object_unref(conn);
+	return NULL;
+}
+
+
+/* accept the requested number of connections, and run a session thread for each of them */
+static gpointer
+smtp_standin_thread(gpointer user_data)
+{
+	smtp_standin_t *standin = (smtp_standin_t *) user_data;
+	GPtrArray *threads;
+	guint n;
+
+	threads = g_ptr_array_new();
+	for (n = 0U; n < standin->sessions; n++) {
+		GSocketConnection *conn;
+		smtp_standin_session_t *session;
+
+		conn = g_socket_listener_accept(standin->listener, NULL, NULL, NULL);
+		if (conn == NULL) {
+			break;
+		}
+		session = g_new(smtp_standin_session_t, 1U);
+		session->standin = standin;
+		session->conn = conn;
+		g_ptr_array_add(threads, g_thread_new("smtp stand-in session", smtp_standin_session, session));
+	}
+	for (n = 0U; n < threads->len; n++) {
+		(void) g_thread_join((GThread *) g_ptr_array_index(threads, n));
+	}
+	(void) g_ptr_array_free(threads, TRUE);
+	return NULL;
+}
+
+
+/* start the stand-in server on port 65030 for the passed number of sessions; if record is TRUE, the data and the BDAT chunks of the
+ * last message are recorded */
+static GThread *
+standin_start(smtp_standin_t *standin, guint sessions, gboolean chunking, gboolean record)
+{
+	standin->listener = g_socket_listener_new();
+	standin->sessions = sessions;
+	standin->chunking = chunking;
+	standin->binarymime = FALSE;
+	standin->envelope_reads = 0U;
+	standin->messages = 0U;
+	if (record) {
+		standin->data = g_string_new(NULL);
+		standin->chunks = g_array_new(FALSE, FALSE, sizeof(guint));
+	} else {
+		standin->data = NULL;
+		standin->chunks = NULL;
+	}
+	sput_fail_unless(g_socket_listener_add_inet_port(standin->listener, 65030, NULL, NULL) == TRUE, "stand-in server: port 65030");
+	return g_thread_new("smtp stand-in", smtp_standin_thread, standin);
+}
+
+
+/* wait until the stand-in server has finished all sessions, and clean up */
+static void
+standin_stop(smtp_standin_t *standin, GThread *server)
+{
+	(void) g_thread_join(server);
+	g_object_unref(standin->listener);
+	if (standin->data != NULL) {
+		(void) g_string_free(standin->data, TRUE);
+		(void) g_array_free(standin->chunks, TRUE);
+	}
+}
+
+
+static void
+test_smtp_pipelining(void)
+{
+	smtp_standin_t standin;
+	msg_data_t msg_buf;
+	NetClientSmtpMessage *msg;
+	NetClientSmtpMessage *good_msg;
+	NetClientSmtp *smtp;
+	GThread *server;
+	GError *error = NULL;
+	gboolean op_res;
+	guint n;
+
+	server = standin_start(&standin, 1U, FALSE, FALSE);
+
+	msg_buf.msg_text = msg_buf.read_ptr = MSG_TEXT;
+	msg_buf.sim_error = FALSE;
+	msg = net_client_smtp_msg_new(msg_data_cb, &msg_buf);
+	(void) net_client_smtp_msg_set_sender(msg, "me@here.com");
+	for (n = 0U; n < 40U; n++) {
+		gchar *rcpt;
+
+		rcpt = g_strdup_printf("rcpt%u@there.com", n);
+		(void) net_client_smtp_msg_add_recipient(msg, rcpt, NET_CLIENT_SMTP_DSN_NEVER);
+		g_free(rcpt);
+	}
+
+	sput_fail_unless((smtp = net_client_smtp_new("localhost", 65030, NET_CLIENT_CRYPT_NONE)) != NULL, "localhost:65030");
+	sput_fail_unless(net_client_smtp_connect(smtp, NULL, NULL) == TRUE, "connect: success");
+	sput_fail_unless(net_client_smtp_send_msg(smtp, msg, NULL, NULL) == TRUE, "send msg, 40 recipients: success");
+	sput_fail_unless(standin.envelope_reads == 1U, "envelope sent in one write");
+
+	// a rejected recipient in the middle of the pipeline
+	(void) net_client_smtp_msg_add_recipient(msg, "bad@there.com", NET_CLIENT_SMTP_DSN_NEVER);
+	(void) net_client_smtp_msg_add_recipient(msg, "last@there.com", NET_CLIENT_SMTP_DSN_NEVER);
+	msg_buf.read_ptr = msg_buf.msg_text;
+	op_res = net_client_smtp_send_msg(smtp, msg, NULL, &error);
+	sput_fail_unless((op_res == FALSE) && (error != NULL) && (error->code == NET_CLIENT_ERROR_SMTP_PERMANENT),
+		"send msg: recipient rejected");
+	g_clear_error(&error);
+	sput_fail_unless(standin.envelope_reads == 2U, "envelope sent in one write");
+	sput_fail_unless(net_client_smtp_reset(NULL, NULL) == FALSE, "reset, NULL client");
+	sput_fail_unless(net_client_smtp_reset(smtp, NULL) == TRUE, "reset after rejected recipient");
+
+	// the session is usable again after the reset
+	good_msg = net_client_smtp_msg_new(msg_data_cb, &msg_buf);
+	(void) net_client_smtp_msg_set_sender(good_msg, "me@here.com");
+	(void) net_client_smtp_msg_add_recipient(good_msg, "you@there.com", NET_CLIENT_SMTP_DSN_NEVER);
+	msg_buf.read_ptr = msg_buf.msg_text;
+	sput_fail_unless(net_client_smtp_send_msg(smtp, good_msg, NULL, NULL) == TRUE, "send msg after reset: success");
+	sput_fail_unless(standin.messages == 2U, "msg after reset: received");
+
+	// no reset while the server expects message data
+	msg_buf.read_ptr = msg_buf.msg_text;
+	msg_buf.sim_error = TRUE;
+	sput_fail_unless(net_client_smtp_send_msg(smtp, good_msg, NULL, NULL) == FALSE, "send msg, data error: fails");
+	sput_fail_unless(net_client_smtp_reset(smtp, NULL) == FALSE, "reset after interrupted data: fails");
+	g_object_unref(smtp);
+	net_client_smtp_msg_free(good_msg);
+
+	smtp = net_client_smtp_new("localhost", 65030, NET_CLIENT_CRYPT_NONE);
+	sput_fail_unless(net_client_smtp_reset(smtp, NULL) == FALSE, "reset, not connected");
+	g_object_unref(smtp);
+
+	standin_stop(&standin, server);
+	net_client_smtp_msg_free(msg);
+}
+
+
+#define CONCURRENT_MESSAGES		25U
+#define CONCURRENT_MAX_SESSIONS	8U
+
+
+/* message data callback for the concurrent sessions, without logging */
+static gssize
+bulk_data_cb(gchar *buffer, gsize count, gpointer user_data, G_GNUC_UNUSED GError **error)
+{
+	const gchar **read_ptr = (const gchar **) user_data;
+	gsize msg_len;
+
+	msg_len = MIN(strlen(*read_ptr), count);
+	memcpy(buffer, *read_ptr, msg_len);
+	*read_ptr = &(*read_ptr)[msg_len];
+	return (gssize) msg_len;
+}
+
+
+/* one client of the concurrent sessions test: connect, send CONCURRENT_MESSAGES messages, and count the successful ones */
+static gpointer
+smtp_concurrent_client(gpointer user_data)
+{
+	guint *sent = (guint *) user_data;
+	const gchar *read_ptr;
+	NetClientSmtpMessage *msg;
+	NetClientSmtp *smtp;
+
+	msg = net_client_smtp_msg_new(bulk_data_cb, &read_ptr);
+	(void) net_client_smtp_msg_set_sender(msg, "me@here.com");
+	(void) net_client_smtp_msg_add_recipient(msg, "you@there.com", NET_CLIENT_SMTP_DSN_NEVER);
+	smtp = net_client_smtp_new("localhost", 65030, NET_CLIENT_CRYPT_NONE);
+	if (net_client_smtp_connect(smtp, NULL, NULL)) {
+		guint n;
+
+		for (n = 0U; n < CONCURRENT_MESSAGES; n++) {
+			read_ptr = MSG_TEXT;
+			if (net_client_smtp_send_msg(smtp, msg, NULL, NULL)) {
+				(*sent)++;
+			}
+		}
+	}
+	g_object_unref(smtp);
+	net_client_smtp_msg_free(msg);
+	return NULL;
+}
+
+
+/* send CONCURRENT_MESSAGES messages through each of 1, 2, 4 and 8 concurrent client sessions to the same server */
+static void
+test_smtp_concurrent_clients(void)
+{
+	static const guint n_sessions[] = { 1U, 2U, 4U, CONCURRENT_MAX_SESSIONS };
+	guint k;
+
+	for (k = 0U; k < G_N_ELEMENTS(n_sessions); k++) {
+		smtp_standin_t standin;
+		GThread *server;
+		GThread *clients[CONCURRENT_MAX_SESSIONS];
+		guint sent[CONCURRENT_MAX_SESSIONS];
+		guint total;
+		guint n;
+
+		server = standin_start(&standin, n_sessions[k], FALSE, FALSE);
+		for (n = 0U; n < n_sessions[k]; n++) {
+			sent[n] = 0U;
+			clients[n] = g_thread_new("smtp client", smtp_concurrent_client, &sent[n]);
+		}
+		total = 0U;
+		for (n = 0U; n < n_sessions[k]; n++) {
+			(void) g_thread_join(clients[n]);
+			total += sent[n];
+		}
+		standin_stop(&standin, server);
+
+		sput_fail_unless(total == (n_sessions[k] * CONCURRENT_MESSAGES), "concurrent sessions: all messages sent");
+		sput_fail_unless(standin.messages == total, "concurrent sessions: all messages received");
+	}
+}
+
+
+/* check the BDAT chunk sizes recorded by the stand-in server, the last one being marked LAST */
+static gboolean
+check_chunks(const smtp_standin_t *standin, const gsize *sizes, guint n_sizes)
+{
+	gboolean result;
+	guint n;
+
+	result = (standin->chunks->len == n_sizes) && standin->last_chunk;
+	for (n = 0U; result && (n < n_sizes); n++) {
+		result = (g_array_index(standin->chunks, guint, n) == sizes[n]);
+	}
+	return result;
+}
+
+
+/* create a message of size bytes, consisting of CRLF-terminated lines of 64 bytes */
+static gchar *
+create_large_msg(gsize size)
+{
+	gchar *msg;
+	gsize n;
+
+	msg = g_malloc(size + 1U);
+	for (n = 0U; n < size; n++) {
+		if ((n % 64U) == 62U) {
+			msg[n] = '\r';
+		} else if ((n % 64U) == 63U) {
+			msg[n] = '\n';
+		} else {
+			msg[n] = 'a' + (gchar) ((n / 64U) % 26U);
+		}
+	}
+	msg[size] = '\0';
+	return msg;
+}
+
+
+#define DOT_MSG_TEXT									\
+	"Subject: dot-stuffing\r\n"						\
+	"\r\n"												\
+	".\r\n"											\
+	"..two dots\r\n"									\
+	".one dot\r\n"										\
+	"no dot.\r\n"										\
+	".\r\n"
+
+
+static void
+test_smtp_chunking(void)
+{
+	static const gsize large_chunks[] = { 256U * 1024U, 256U * 1024U, 88U * 1024U };
+	static const gsize exact_chunks[] = { 256U * 1024U, 256U * 1024U, 0U };
+	smtp_standin_t standin;
+	msg_data_t msg_buf;
+	NetClientSmtpMessage *msg;
+	NetClientSmtp *smtp;
+	GThread *server;
+	GError *error = NULL;
+	gboolean op_res;
+	gsize size;
+
+	server = standin_start(&standin, 3U, TRUE, TRUE);
+
+	msg_buf.msg_text = msg_buf.read_ptr = MSG_TEXT;
+	msg_buf.sim_error = FALSE;
+	msg = net_client_smtp_msg_new(msg_data_cb, &msg_buf);
+	(void) net_client_smtp_msg_set_sender(msg, "me@here.com");
+	(void) net_client_smtp_msg_add_recipient(msg, "you@there.com", NET_CLIENT_SMTP_DSN_NEVER);
+
+	// CHUNKING without BINARYMIME
+	sput_fail_unless((smtp = net_client_smtp_new("localhost", 65030, NET_CLIENT_CRYPT_NONE)) != NULL, "localhost:65030");
+	sput_fail_unless(net_client_smtp_connect(smtp, NULL, NULL) == TRUE, "connect: success");
+	sput_fail_unless(net_client_smtp_can_binarymime(NULL) == FALSE, "NULL client: no binarymime");
+	sput_fail_unless(net_client_smtp_can_binarymime(smtp) == FALSE, "chunking only: no binarymime");
+	sput_fail_unless(net_client_smtp_send_msg(smtp, msg, NULL, NULL) == TRUE, "send small msg: success");
+	size = strlen(MSG_TEXT);
+	sput_fail_unless(check_chunks(&standin, &size, 1U), "small msg: one chunk, LAST");
+	sput_fail_unless(strcmp(standin.data->str, MSG_TEXT) == 0, "small msg: data ok");
+
+	msg_buf.msg_text = msg_buf.read_ptr = create_large_msg(600U * 1024U);
+	sput_fail_unless(net_client_smtp_send_msg(smtp, msg, NULL, NULL) == TRUE, "send 600 KiB msg: success");
+	sput_fail_unless(check_chunks(&standin, large_chunks, G_N_ELEMENTS(large_chunks)), "600 KiB msg: chunks 256k, 256k, 88k LAST");
+	sput_fail_unless(strcmp(standin.data->str, msg_buf.msg_text) == 0, "600 KiB msg: data ok");
+	g_free(msg_buf.msg_text);
+
+	msg_buf.msg_text = msg_buf.read_ptr = create_large_msg(512U * 1024U);
+	sput_fail_unless(net_client_smtp_send_msg(smtp, msg, NULL, NULL) == TRUE, "send 512 KiB msg: success");
+	sput_fail_unless(check_chunks(&standin, exact_chunks, G_N_ELEMENTS(exact_chunks)), "512 KiB msg: chunks 256k, 256k, 0 LAST");
+	sput_fail_unless(strcmp(standin.data->str, msg_buf.msg_text) == 0, "512 KiB msg: data ok");
+	g_free(msg_buf.msg_text);
+
+	// BINARYMIME is refused if not announced, without sending anything
+	msg_buf.msg_text = msg_buf.read_ptr = MSG_TEXT;
+	sput_fail_unless(net_client_smtp_msg_set_body(msg, NET_CLIENT_SMTP_BODY_BINARYMIME) == TRUE, "set body binarymime");
+	op_res = net_client_smtp_send_msg(smtp, msg, NULL, &error);
+	sput_fail_unless((op_res == FALSE) && (error != NULL) && (error->code == NET_CLIENT_ERROR_SMTP_PERMANENT),
+		"send binarymime msg: not supported");
+	g_clear_error(&error);
+	sput_fail_unless(standin.messages == 3U, "binarymime msg: nothing sent");
+	sput_fail_unless(net_client_smtp_reset(smtp, NULL) == TRUE, "session still usable");
+	g_object_unref(smtp);
+
+	// CHUNKING and BINARYMIME
+	standin.binarymime = TRUE;
+	sput_fail_unless((smtp = net_client_smtp_new("localhost", 65030, NET_CLIENT_CRYPT_NONE)) != NULL, "localhost:65030");
+	sput_fail_unless(net_client_smtp_connect(smtp, NULL, NULL) == TRUE, "connect: success");
+	sput_fail_unless(net_client_smtp_can_binarymime(smtp) == TRUE, "chunking and binarymime: can binarymime");
+	sput_fail_unless(net_client_smtp_send_msg(smtp, msg, NULL, NULL) == TRUE, "send binarymime msg: success");
+	sput_fail_unless(standin.body_binarymime, "binarymime msg: BODY=BINARYMIME");
+	sput_fail_unless(check_chunks(&standin, &size, 1U), "binarymime msg: one chunk, LAST");
+	g_object_unref(smtp);
+
+	// no CHUNKING: DATA with dot-stuffing, and no BINARYMIME
+	standin.chunking = FALSE;
+	standin.binarymime = FALSE;
+	sput_fail_unless((smtp = net_client_smtp_new("localhost", 65030, NET_CLIENT_CRYPT_NONE)) != NULL, "localhost:65030");
+	sput_fail_unless(net_client_smtp_connect(smtp, NULL, NULL) == TRUE, "connect: success");
+	msg_buf.read_ptr = msg_buf.msg_text;
+	op_res = net_client_smtp_send_msg(smtp, msg, NULL, &error);
+	sput_fail_unless((op_res == FALSE) && (error != NULL) && (error->code == NET_CLIENT_ERROR_SMTP_PERMANENT),
+		"send binarymime msg w/o chunking: not supported");
+	g_clear_error(&error);
+	sput_fail_unless(net_client_smtp_msg_set_body(msg, NET_CLIENT_SMTP_BODY_7BIT) == TRUE, "set body 7bit");
+	msg_buf.msg_text = msg_buf.read_ptr = DOT_MSG_TEXT;
+	sput_fail_unless(net_client_smtp_send_msg(smtp, msg, NULL, NULL) == TRUE, "send msg w/ leading dots: success");
+	sput_fail_unless(standin.chunks->len == 0U, "msg w/ leading dots: no BDAT");
+	sput_fail_unless(strcmp(standin.data->str, DOT_MSG_TEXT) == 0, "msg w/ leading dots: data ok");
+	sput_fail_unless(standin.messages == 5U, "all messages received");
+	g_object_unref(smtp);
+
+	standin_stop(&standin, server);
+	net_client_smtp_msg_free(msg);
+}
+
+
 static gboolean
 msg_cb(const gchar *buffer, gssize count, gsize lines, const NetClientPopMessageInfo *info, gpointer user_data, GError **error)
 {
@@ -787,6 +1322,14 @@ test_pop3(void)
 }
 
 
+static gboolean
+siobuf_sink(const gchar *buffer, gsize count, gpointer user_data)
+{
+	(void) g_string_append_len((GString *) user_data, buffer, (gssize) count);
+	return TRUE;
+}
+
+
 static void
 test_siobuf(void)
 {
@@ -796,6 +1339,9 @@ test_siobuf(void)
 	gint read_res;
 	gboolean op_res;
 	gchar *recv_data;
+	GString *sink_data;
+	const gchar *peek_data;
+	gsize peek_len;
 
 	sput_fail_unless(net_client_siobuf_new(NULL, 65000) == NULL, "missing host");
 	sput_fail_unless((siobuf = net_client_siobuf_new("localhost", 65000)) != NULL, "localhost; port 65000");
@@ -876,6 +1422,47 @@ test_siobuf(void)
 	sput_fail_unless(net_client_siobuf_discard_line(siobuf, NULL) == -1, "discard line w/o data");
 	sput_fail_unless(net_client_siobuf_get_line(siobuf, NULL) == NULL, "get line w/o data");
 
+	sput_fail_unless(net_client_siobuf_can_read(NULL) == FALSE, "can read w/o client");
+	sput_fail_unless(net_client_siobuf_can_read(siobuf) == FALSE, "can read w/o data");
+	sput_fail_unless(net_client_write_buffer(NET_CLIENT(siobuf), "ab\000\377cd\r\n\000", 9U, NULL) == TRUE, "write binary data");
+	sput_fail_unless(net_client_siobuf_getc(siobuf, NULL) == 'a', "getc ok");
+	sput_fail_unless(net_client_siobuf_can_read(siobuf) == TRUE, "can read buffered data");
+	sput_fail_unless(net_client_siobuf_getc(siobuf, NULL) == 'b', "getc ok");
+	sput_fail_unless(net_client_siobuf_getc(siobuf, NULL) == 0x00, "getc NUL ok");
+	sput_fail_unless(net_client_siobuf_getc(siobuf, NULL) == 0xff, "getc 0xff ok");
+	memset(buffer, 0x55, sizeof(buffer));
+	sput_fail_unless((net_client_siobuf_read(siobuf, buffer, 5U, NULL) == 5) && (memcmp(buffer, "cd\r\n\000", 5U) == 0),
+		"binary read ok");
+
+	sput_fail_unless(net_client_siobuf_peek(NULL, &peek_len, NULL) == NULL, "peek w/o client");
+	sput_fail_unless(net_client_siobuf_peek(siobuf, NULL, NULL) == NULL, "peek w/o count");
+	sput_fail_unless(net_client_write_buffer(NET_CLIENT(siobuf), "span\r\n", 6U, NULL) == TRUE, "write data");
+	peek_data = net_client_siobuf_peek(siobuf, &peek_len, NULL);
+	sput_fail_unless((peek_data != NULL) && (peek_len == 6U) && (memcmp(peek_data, "span\r\n", 6U) == 0), "peek ok");
+	net_client_siobuf_skip(NULL, 2U);
+	net_client_siobuf_skip(siobuf, 7U);
+	net_client_siobuf_skip(siobuf, 2U);
+	sput_fail_unless(net_client_siobuf_getc(siobuf, NULL) == 'a', "getc after skip ok");
+	peek_data = net_client_siobuf_peek(siobuf, &peek_len, NULL);
+	sput_fail_unless((peek_data != NULL) && (peek_len == 3U) && (memcmp(peek_data, "n\r\n", 3U) == 0), "peek ok");
+	net_client_siobuf_skip(siobuf, 3U);
+
+	sink_data = g_string_new(NULL);
+	sput_fail_unless(net_client_siobuf_read_to_sink(NULL, 4U, siobuf_sink, sink_data, NULL) == FALSE, "read to sink w/o client");
+	sput_fail_unless(net_client_siobuf_read_to_sink(siobuf, 4U, NULL, sink_data, NULL) == FALSE, "read to sink w/o sink");
+	sput_fail_unless(net_client_write_buffer(NET_CLIENT(siobuf), "0123456789\r\nabc\r\n", 17U, NULL) == TRUE, "write data");
+	sput_fail_unless(net_client_siobuf_getc(siobuf, NULL) == '0', "getc ok");
+	op_res = net_client_siobuf_read_to_sink(siobuf, 9U, siobuf_sink, sink_data, NULL);
+	sput_fail_unless(op_res && (strcmp(sink_data->str, "123456789") == 0), "read to sink ok");
+	recv_data = net_client_siobuf_get_line(siobuf, NULL);
+	sput_fail_unless(strcmp(recv_data, "") == 0, "get line after read to sink ok");
+	g_free(recv_data);
+	op_res = net_client_siobuf_read_to_sink(siobuf, 10U, siobuf_sink, sink_data, &error);
+	sput_fail_unless((op_res == FALSE) && (strcmp(sink_data->str, "123456789abc\r\n") == 0) &&
+		(error->code == G_IO_ERROR_TIMED_OUT), "short read to sink");
+	g_clear_error(&error);
+	(void) g_string_free(sink_data, TRUE);
+
 	g_object_unref(siobuf);
 }
 
@@ -420,7 +420,9 @@ balsa_app_init(void)
     balsa_app.local_scan_depth = 1;
     balsa_app.check_imap = 1;
     balsa_app.check_imap_inbox = 0;
+    balsa_app.check_mail_workers = 4;
     balsa_app.imap_scan_depth = 1;
+    balsa_app.imap_cache_size = 512;
 
     /* gpgme stuff */
     balsa_app.has_openpgp = FALSE;
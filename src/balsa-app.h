@@ -145,6 +145,9 @@ extern struct BalsaApplication {
     guint local_scan_depth;
     guint imap_scan_depth;
 
+    /* size limit of the IMAP message cache, in MB */
+    guint imap_cache_size;
+
     BalsaWindow *main_window;
     BalsaMBList *mblist;
     GtkTreeStore *mblist_tree_store;
@@ -188,6 +191,7 @@ extern struct BalsaApplication {
     gint check_imap_inbox;
     gint quiet_background_check;
     gint msg_size_limit; /* for POP mailboxes; in kB */
+    gint check_mail_workers; /* mailboxes checked at once */
 
     /* GUI settings (note: window sizes are tracked by the geometry-manager) */
     gint mblist_width;
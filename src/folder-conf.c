@@ -61,7 +61,7 @@ struct _FolderDialogData {
     LibBalsaServer *server;
     GtkWidget *subscribed, *list_inbox, *prefix;
     GtkWidget *connection_limit, *enable_persistent,
-        *use_idle, *has_bugs, *use_status;
+        *use_idle, *has_bugs, *use_status, *mirror_bodies;
 };
 
 /* FIXME: identity_name will leak on cancelled folder edition */
@@ -233,6 +233,8 @@ folder_conf_clicked_ok(FolderDialogData * folder_data)
         (imap, ISBUG_FETCH, gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(folder_data->has_bugs)));
     libbalsa_imap_server_set_use_status
         (imap, gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(folder_data->use_status)));
+    libbalsa_imap_server_set_mirror_bodies
+        (imap, gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(folder_data->mirror_bodies)));
 
     if (mbnode == NULL) {
     	folder_data->common_data.mbnode = mbnode =
@@ -525,6 +527,8 @@ folder_conf_imap_node(BalsaMailboxNode *mn)
     	libbalsa_imap_server_has_bug(LIBBALSA_IMAP_SERVER(folder_data->server), ISBUG_FETCH), NULL, NULL);
     folder_data->use_status = libbalsa_server_cfg_add_check(folder_data->server_cfg, FALSE, _("Use STATUS for mailbox checking"),
     	libbalsa_imap_server_get_use_status(LIBBALSA_IMAP_SERVER(folder_data->server)), NULL, NULL);
+    folder_data->mirror_bodies = libbalsa_server_cfg_add_check(folder_data->server_cfg, FALSE, _("_Mirror messages for offline use"),
+    	libbalsa_imap_server_get_mirror_bodies(LIBBALSA_IMAP_SERVER(folder_data->server)), NULL, NULL);
 
     gtk_widget_show_all(GTK_WIDGET(folder_data->common_data.dialog));
 
@@ -118,7 +118,9 @@ static void bw_idle_replace(BalsaWindow * window, BalsaIndex * bindex);
 static gboolean bw_idle_cb(BalsaWindow * window);
 
 
-static void bw_check_mailbox_list(struct check_messages_thread_info *info, GList * list);
+static void bw_mailbox_check(LibBalsaMailbox * mailbox,
+                             struct check_messages_thread_info *info);
+static void bw_check_cancel(void);
 static gboolean bw_add_mbox_to_checklist(GtkTreeModel * model,
                                          GtkTreePath * path,
                                          GtkTreeIter * iter,
@@ -281,6 +283,8 @@ bw_network_changed_cb(GNetworkMonitor * monitor,
     if (priv->network_available != available) {
         priv->network_available = available;
         print_network_status(available);
+        if (!available)
+            bw_check_cancel();
     }
 
     if (priv->network_changed_source_id == 0) {
@@ -3167,6 +3171,8 @@ balsa_window_dispose(GObject * object)
         priv->network_changed_source_id = 0;
     }
 
+    bw_check_cancel();
+
     if (priv->network_changed_handler_id != 0) {
         GNetworkMonitor *monitor = g_network_monitor_get_default();
         g_signal_handler_disconnect(monitor, priv->network_changed_handler_id);
@@ -3281,66 +3287,115 @@ bw_check_mailbox_progress_cb(LibBalsaMailbox* mailbox, gint action, gdouble frac
 	g_free(progress_id);
 }
 
-static void
-bw_check_mailbox(LibBalsaMailbox *mailbox)
-{
-	libbalsa_mailbox_check(mailbox);
-	g_thread_exit(NULL);
-}
-
+/* The mail check scheduler: a queue of mailboxes, checked by up to
+ * balsa_app.check_mail_workers threads. A POP3 server is asked by one
+ * thread at a time, as it locks the maildrop; an IMAP server by no
+ * more threads than its connection limit, less one which is left for
+ * the foreground. */
 typedef struct {
-	LibBalsaMailbox *mailbox;
-	GThread *thread;
-	gulong notify;
-} bw_pop_mbox_t;
+	GMutex lock;
+	GCond cond;
+	GQueue pending;			/* mailboxes not yet checked */
+	GHashTable *active;		/* LibBalsaServer -> number of running checks */
+	guint n_mailboxes;		/* IMAP and local mailboxes, for the progress */
+	guint n_done;
+	struct check_messages_thread_info *info;
+} bw_check_sched_t;
+
+/* note: access with g_atomic_* functions */
+static gint check_mail_cancelled;
+
+static guint
+bw_check_server_limit(LibBalsaMailbox *mailbox, LibBalsaServer **server)
+{
+	if (!LIBBALSA_IS_MAILBOX_REMOTE(mailbox)) {
+		*server = NULL;
+		return G_MAXUINT;
+	}
 
-static void
-bw_check_mailbox_done(bw_pop_mbox_t *bw_pop_mbox)
-{
-	if (bw_pop_mbox->thread != NULL) {
-		g_thread_join(bw_pop_mbox->thread);
-		g_debug("joined thread %p", bw_pop_mbox->thread);
+	*server = LIBBALSA_MAILBOX_REMOTE_GET_SERVER(mailbox);
+	if (LIBBALSA_IS_IMAP_SERVER(*server)) {
+		return MAX(libbalsa_imap_server_get_max_connections(LIBBALSA_IMAP_SERVER(*server)) - 1, 1);
 	}
-	if (bw_pop_mbox->notify > 0U) {
-		g_signal_handler_disconnect(bw_pop_mbox->mailbox, bw_pop_mbox->notify);
+	return 1U;
+}
+
+/* take the first pending mailbox whose server is not busy; called with
+ * the lock held */
+static LibBalsaMailbox *
+bw_check_sched_next(bw_check_sched_t *sched, LibBalsaServer **server)
+{
+	GList *p;
+
+	for (p = sched->pending.head; p != NULL; p = p->next) {
+		LibBalsaMailbox *mailbox = p->data;
+		guint limit;
+
+		limit = bw_check_server_limit(mailbox, server);
+		if (GPOINTER_TO_UINT(g_hash_table_lookup(sched->active, *server)) < limit) {
+			g_queue_delete_link(&sched->pending, p);
+			return mailbox;
+		}
 	}
-	g_object_unref(bw_pop_mbox->mailbox);
+
+	return NULL;
 }
 
 static void
-bw_check_mailbox_list(struct check_messages_thread_info *info, GList *mailbox_list)
+bw_check_sched_count(bw_check_sched_t *sched, LibBalsaServer *server, gint delta)
 {
-    GList *check_mbx = NULL;
+	guint count;
 
-    if (info->window != NULL) {
-        BalsaWindowPrivate *priv = balsa_window_get_instance_private(info->window);
+	count = GPOINTER_TO_UINT(g_hash_table_lookup(sched->active, server));
+	g_hash_table_insert(sched->active, server, GUINT_TO_POINTER(count + delta));
+}
 
-        if (!priv->network_available)
-            return;
-    }
+static gpointer
+bw_check_worker(bw_check_sched_t *sched)
+{
+	g_mutex_lock(&sched->lock);
+	while (!g_queue_is_empty(&sched->pending) && !g_atomic_int_get(&check_mail_cancelled)) {
+		LibBalsaMailbox *mailbox;
+		LibBalsaServer *server;
 
-    for ( ; mailbox_list; mailbox_list = mailbox_list->next) {
-        LibBalsaMailbox *mailbox = balsa_mailbox_node_get_mailbox(mailbox_list->data);
-        LibBalsaMailboxPOP3 *pop3 = LIBBALSA_MAILBOX_POP3(mailbox);
-        bw_pop_mbox_t *bw_pop_mbox;
+		mailbox = bw_check_sched_next(sched, &server);
+		if (mailbox == NULL) {
+			/* all remaining mailboxes wait for a busy server */
+			g_cond_wait(&sched->cond, &sched->lock);
+			continue;
+		}
+		bw_check_sched_count(sched, server, 1);
+		g_mutex_unlock(&sched->lock);
+
+		bw_mailbox_check(mailbox, sched->info);
+
+		g_mutex_lock(&sched->lock);
+		bw_check_sched_count(sched, server, -1);
+		if (!LIBBALSA_IS_MAILBOX_POP3(mailbox)) {
+			sched->n_done++;
+			if (sched->info->with_progress_dialog) {
+				libbalsa_progress_dialog_update(&progress_dialog, _("Mailboxes"), FALSE,
+					(gdouble) sched->n_done / (gdouble) sched->n_mailboxes,
+					_("%u of %u mailboxes checked"), sched->n_done, sched->n_mailboxes);
+			}
+		}
+		g_object_unref(mailbox);
+		g_cond_broadcast(&sched->cond);
+	}
+	g_mutex_unlock(&sched->lock);
 
-        bw_pop_mbox = g_malloc0(sizeof(bw_pop_mbox_t));
-        bw_pop_mbox->mailbox = g_object_ref(mailbox);
-        libbalsa_mailbox_pop3_set_inbox(mailbox, balsa_app.inbox);
-        libbalsa_mailbox_pop3_set_msg_size_limit(pop3, balsa_app.msg_size_limit * 1024);
-        if (info->with_progress_dialog) {
-        	bw_pop_mbox->notify =
-        		g_signal_connect(mailbox, "progress-notify", G_CALLBACK(bw_check_mailbox_progress_cb), mailbox);
-        }
-        bw_pop_mbox->thread = g_thread_new(NULL, (GThreadFunc) bw_check_mailbox, mailbox);
-        g_debug("launched thread %p for checking POP3 mailbox %s", bw_pop_mbox->thread, libbalsa_mailbox_get_name(mailbox));
-        check_mbx = g_list_prepend(check_mbx, bw_pop_mbox);
-    }
+	return NULL;
+}
 
-    /* join all threads, i.e. proceed only after all threads have finished, and disconnect progress notify handlers */
-    g_list_foreach(check_mbx, (GFunc) bw_check_mailbox_done, NULL);
-    g_debug("all POP3 mailbox threads done");
-    g_list_free_full(check_mbx, (GDestroyNotify) g_free);
+/* bw_check_cancel() drops the mailboxes which are still waiting to be
+ * checked; checks which have already started are completed. */
+static void
+bw_check_cancel(void)
+{
+	if (g_atomic_int_get(&checking_mail) != 1) {
+		g_debug("cancelling the mail check");
+		g_atomic_int_set(&check_mail_cancelled, 1);
+	}
 }
 
 /*Callback to check a mailbox in a balsa-mblist */
@@ -3415,6 +3470,8 @@ check_new_messages_real(BalsaWindow * window, gboolean background_check)
         return;
     }
 
+    g_atomic_int_set(&check_mail_cancelled, 0);
+
     if (window)
         bw_action_set_enabled(window, "get-new-mail", FALSE);
 
@@ -3499,19 +3556,37 @@ bw_mailbox_check(LibBalsaMailbox * mailbox, struct check_messages_thread_info *i
 {
     if (balsa_app.main_window == NULL)
         return;
-    if (libbalsa_mailbox_get_subscribe(mailbox) == LB_MAILBOX_SUBSCRIBE_NO)
-        return;
+
+    if (LIBBALSA_IS_MAILBOX_REMOTE(mailbox) && (info->window != NULL)) {
+        BalsaWindowPrivate *priv =
+            balsa_window_get_instance_private(info->window);
+
+        if (!priv->network_available)
+            return;
+    }
 
     g_debug("checking mailbox %s", libbalsa_mailbox_get_name(mailbox));
-    if (LIBBALSA_IS_MAILBOX_IMAP(mailbox)) {
-    	if (info->window != NULL) {
-            BalsaWindowPrivate *priv =
-                balsa_window_get_instance_private(info->window);
+    if (LIBBALSA_IS_MAILBOX_POP3(mailbox)) {
+        LibBalsaMailboxPOP3 *pop3 = LIBBALSA_MAILBOX_POP3(mailbox);
+        gulong notify = 0UL;
 
-            if (!priv->network_available)
-                return;
+        libbalsa_mailbox_pop3_set_inbox(mailbox, balsa_app.inbox);
+        libbalsa_mailbox_pop3_set_msg_size_limit(pop3, balsa_app.msg_size_limit * 1024);
+        if (info->with_progress_dialog) {
+            notify = g_signal_connect(mailbox, "progress-notify",
+                                      G_CALLBACK(bw_check_mailbox_progress_cb), mailbox);
         }
+        libbalsa_mailbox_check(mailbox);
+        if (notify > 0UL) {
+            g_signal_handler_disconnect(mailbox, notify);
+        }
+        return;
+    }
 
+    if (libbalsa_mailbox_get_subscribe(mailbox) == LB_MAILBOX_SUBSCRIBE_NO)
+        return;
+
+    if (LIBBALSA_IS_MAILBOX_IMAP(mailbox)) {
     	if (info->with_progress_dialog) {
     		libbalsa_progress_dialog_update(&progress_dialog, _("Mailboxes"), FALSE, INFINITY,
     			_("IMAP mailbox: %s"), libbalsa_mailbox_get_url(mailbox));
@@ -3545,20 +3620,59 @@ bw_check_messages_thread(struct check_messages_thread_info *info)
      *  and that the calling procedure will check for an existing lock
      *  and set checking_mail to true before calling.
      */
-    bw_check_mailbox_list(info, balsa_app.inbox_input);
+    bw_check_sched_t sched;
+    GList *p;
+    GSList *l;
+    GPtrArray *workers;
+    guint n_workers;
+    guint n;
+
+    g_mutex_init(&sched.lock);
+    g_cond_init(&sched.cond);
+    g_queue_init(&sched.pending);
+    sched.active = g_hash_table_new(NULL, NULL);
+    sched.n_done = 0U;
+    sched.info = info;
+
+    /* POP3 mailboxes first, as they usually take longest */
+    for (p = balsa_app.inbox_input; p != NULL; p = p->next) {
+        g_queue_push_tail(&sched.pending,
+                          g_object_ref(balsa_mailbox_node_get_mailbox(p->data)));
+    }
+    sched.n_mailboxes = g_slist_length(info->list);
+    for (l = info->list; l != NULL; l = l->next) {
+        g_queue_push_tail(&sched.pending, l->data);
+    }
+    g_slist_free(info->list);
 
-    if (info->list!= NULL) {
-        GSList *list = info->list;
+    if (info->with_progress_dialog && (sched.n_mailboxes > 0U)) {
+    	libbalsa_progress_dialog_ensure(&progress_dialog, _("Checking Mail…"), GTK_WINDOW(info->window), _("Mailboxes"));
+    }
 
-    	if (info->with_progress_dialog) {
-    		libbalsa_progress_dialog_ensure(&progress_dialog, _("Checking Mail…"), GTK_WINDOW(info->window), _("Mailboxes"));
-    	}
-    	g_slist_foreach(list, (GFunc) bw_mailbox_check, info);
-    	g_slist_free_full(list, g_object_unref);
-    	if (info->with_progress_dialog) {
-    		libbalsa_progress_dialog_update(&progress_dialog, _("Mailboxes"), TRUE, 1.0, NULL);
-    	}
+    /* check the mailboxes in parallel, and wait for all checks */
+    n_workers = MIN((guint) MAX(balsa_app.check_mail_workers, 1), g_queue_get_length(&sched.pending));
+    workers = g_ptr_array_new();
+    for (n = 0U; n < n_workers; n++) {
+        g_ptr_array_add(workers,
+                        g_thread_new("bw_check_worker", (GThreadFunc) bw_check_worker, &sched));
+    }
+    for (n = 0U; n < workers->len; n++) {
+        g_thread_join(g_ptr_array_index(workers, n));
+    }
+    g_ptr_array_free(workers, TRUE);
+    g_debug("all mailbox checks done");
+
+    if (info->with_progress_dialog && (sched.n_mailboxes > 0U)) {
+    	libbalsa_progress_dialog_update(&progress_dialog, _("Mailboxes"), TRUE, 1.0, NULL);
+    }
+
+    /* mailboxes left by a cancelled check */
+    while (!g_queue_is_empty(&sched.pending)) {
+        g_object_unref(g_queue_pop_head(&sched.pending));
     }
+    g_hash_table_destroy(sched.active);
+    g_cond_clear(&sched.cond);
+    g_mutex_clear(&sched.lock);
 
 	if (info->with_activity_bar) {
 		balsa_window_decrease_activity(info->window, _("Checking Mail…"));
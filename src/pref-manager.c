@@ -85,6 +85,7 @@ typedef struct _PropertyUI {
     GtkWidget *msg_size_limit;
     GtkWidget *check_imap;
     GtkWidget *check_imap_inbox;
+    GtkWidget *check_mail_workers;
     GtkWidget *notify_new_mail_dialog;
     GtkWidget *notify_new_mail_sound;
     GtkWidget *notify_new_mail_icon;
@@ -460,6 +461,9 @@ apply_prefs(GtkDialog * pbox)
     balsa_app.check_imap_inbox =
         gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON
                                      (pui->check_imap_inbox));
+    balsa_app.check_mail_workers =
+        gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON
+                                         (pui->check_mail_workers));
     balsa_app.notify_new_mail_dialog =
         gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON
                                      (pui->notify_new_mail_dialog));
@@ -707,6 +711,8 @@ set_prefs(void)
                                  balsa_app.quiet_background_check);
     gtk_spin_button_set_value(GTK_SPIN_BUTTON(pui->msg_size_limit),
                               ((float) balsa_app.msg_size_limit) / 1024);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(pui->check_mail_workers),
+                              (float) balsa_app.check_mail_workers);
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(pui->check_imap),
                                  balsa_app.check_imap);
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(pui->check_imap_inbox),
@@ -2130,6 +2136,20 @@ pm_grid_add_checking_group(GtkWidget * grid_widget)
         gtk_check_button_new_with_mnemonic(_("Check Inbox _only"));
     pm_grid_attach(grid, pui->check_imap_inbox, 2, row, 2, 1);
 
+    label = gtk_label_new_with_mnemonic(_("Check _up to"));
+    gtk_widget_set_halign(label, GTK_ALIGN_START);
+    pm_grid_attach(grid, label, 1, ++row, 1, 1);
+
+    spinbutton_adj = gtk_adjustment_new(4, 1, 16, 1, 4, 0);
+    pui->check_mail_workers = gtk_spin_button_new(spinbutton_adj, 1, 0);
+    gtk_label_set_mnemonic_widget(GTK_LABEL(label), pui->check_mail_workers);
+    gtk_widget_set_hexpand(pui->check_mail_workers, TRUE);
+    pm_grid_attach(grid, pui->check_mail_workers, 2, row, 1, 1);
+
+    label = gtk_label_new(_("mailboxes at once"));
+    gtk_widget_set_halign(label, GTK_ALIGN_START);
+    pm_grid_attach(grid, label, 3, row, 1, 1);
+
     hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, COL_SPACING);
 
     label = gtk_label_new(_("When mail arrives:"));
@@ -3382,6 +3402,8 @@ open_preferences_manager(GtkWidget * widget, gpointer data)
 
     g_signal_connect(pui->check_imap_inbox, "toggled",
                      G_CALLBACK(properties_modified_cb), property_box);
+    g_signal_connect(pui->check_mail_workers, "changed",
+                     G_CALLBACK(properties_modified_cb), property_box);
 
     g_signal_connect(pui->notify_new_mail_dialog, "toggled",
                      G_CALLBACK(properties_modified_cb), property_box);
@@ -993,6 +993,9 @@ config_global_load(void)
     balsa_app.check_imap_inbox=d_get_gint("CheckIMAPInbox", 0);
     balsa_app.quiet_background_check=d_get_gint("QuietBackgroundCheck", 0);
     balsa_app.msg_size_limit=d_get_gint("POPMsgSizeLimit", 20000);
+    balsa_app.check_mail_workers = d_get_gint("Workers", 4);
+    if (balsa_app.check_mail_workers < 1)
+	balsa_app.check_mail_workers = 4;
     libbalsa_conf_pop_group();
 
     /* folder scanning */
@@ -1001,6 +1004,13 @@ config_global_load(void)
     balsa_app.imap_scan_depth = d_get_gint("ImapScanDepth", 1);
     libbalsa_conf_pop_group();
 
+    /* message cache */
+    libbalsa_conf_push_group("MessageCache");
+    balsa_app.imap_cache_size = d_get_gint("ImapCacheSize", 512);
+    libbalsa_imap_set_cache_size((off_t) balsa_app.imap_cache_size
+                                 * 1024 * 1024);
+    libbalsa_conf_pop_group();
+
     /* how to react if a message with MDN request is displayed */
     libbalsa_conf_push_group("MDNReply");
     balsa_app.mdn_reply_clean = libbalsa_conf_get_int("Clean=1");
@@ -1443,6 +1453,7 @@ config_save(void)
     libbalsa_conf_set_int("QuietBackgroundCheck",
 			 balsa_app.quiet_background_check);
     libbalsa_conf_set_int("POPMsgSizeLimit", balsa_app.msg_size_limit);
+    libbalsa_conf_set_int("Workers", balsa_app.check_mail_workers);
 
     libbalsa_conf_pop_group();
 
@@ -1452,6 +1463,11 @@ config_save(void)
     libbalsa_conf_set_int("ImapScanDepth", balsa_app.imap_scan_depth);
     libbalsa_conf_pop_group();
 
+    /* message cache */
+    libbalsa_conf_push_group("MessageCache");
+    libbalsa_conf_set_int("ImapCacheSize", balsa_app.imap_cache_size);
+    libbalsa_conf_pop_group();
+
     /* how to react if a message with MDN request is displayed */
     libbalsa_conf_push_group("MDNReply");
     libbalsa_conf_set_int("Clean", balsa_app.mdn_reply_clean);